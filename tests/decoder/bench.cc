@@ -0,0 +1,89 @@
+//
+// Decoding benchmark. Loads each file from memory several times and reports
+// the best time and throughput, e.g. to compare lossless JPEG decoder changes.
+//
+// Usage: bench [-n iterations] [-t threads] file...
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#define TINY_DNG_LOADER_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#include "tiny_dng_loader.h"
+
+int main(int argc, char** argv) {
+  int iterations = 20;
+  int num_threads = 1;
+  std::vector<std::string> filenames;
+  for (int i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) {
+      iterations = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc)) {
+      num_threads = atoi(argv[++i]);
+    } else {
+      filenames.push_back(argv[i]);
+    }
+  }
+  if (filenames.empty() || (iterations < 1)) {
+    fprintf(stderr, "Usage: %s [-n iterations] [-t threads] file...\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Scratch memory is reused across iterations, so that allocation is not
+  // measured.
+  tinydng::ThreadPool pool(num_threads);
+  tinydng::DecoderContext context;
+  tinydng::LoadOptions options;
+  options.thread_pool = &pool;
+  options.decoder_context = &context;
+
+  for (size_t i = 0; i < filenames.size(); i++) {
+    std::ifstream ifs(filenames[i].c_str(), std::ios::binary);
+    std::vector<char> mem((std::istreambuf_iterator<char>(ifs)),
+                          std::istreambuf_iterator<char>());
+    if (mem.empty()) {
+      fprintf(stderr, "Failed to read %s\n", filenames[i].c_str());
+      return EXIT_FAILURE;
+    }
+
+    double best = 0.0;
+    size_t num_pixels = 0;
+    for (int k = 0; k < iterations; k++) {
+      std::string warn, err;
+      std::vector<tinydng::FieldInfo> custom_fields;
+      std::vector<tinydng::DNGImage> images;
+      const std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      const bool ret =
+          tinydng::LoadDNGFromMemory(&mem[0], mem.size(), options,
+                                     custom_fields, &images, &warn, &err);
+      const double ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+      if (!ret) {
+        fprintf(stderr, "Failed to load %s: %s\n", filenames[i].c_str(),
+                err.c_str());
+        return EXIT_FAILURE;
+      }
+      if ((k == 0) || (ms < best)) {
+        best = ms;
+      }
+      num_pixels = 0;
+      for (size_t n = 0; n < images.size(); n++) {
+        num_pixels += size_t(images[n].width) * size_t(images[n].height);
+      }
+    }
+
+    printf("%s: %.3f ms, %.1f MPixels/s\n", filenames[i].c_str(), best,
+           (best > 0.0) ? double(num_pixels) / (best * 1000.0) : 0.0);
+  }
+
+  return EXIT_SUCCESS;
+}
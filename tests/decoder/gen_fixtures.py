@@ -0,0 +1,846 @@
+#!/usr/bin/env python3
+#
+# Generates the TIFF/DNG fixtures of the decoder test into `data/`.
+#
+# Every fixture is encoded here from known sample values, and the samples are
+# written to `<name>.raw` in the layout of `DNGImage::data`(sample byte order
+# of the file). Fixtures without a `.raw` file must be rejected, or are compared
+# with another way of loading them.
+# `<name>.le.raw` holds the samples unpacked to 16 bits or in little endian.
+#
+# Usage: python3 gen_fixtures.py [output_dir]
+#
+import os
+import struct
+import sys
+import zlib
+
+OUT = sys.argv[1] if len(sys.argv) > 1 else os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), 'data')
+
+BYTE, ASCII, SHORT, LONG, LONG8 = 1, 2, 3, 4, 16
+TYPE_FORMAT = {BYTE: 'B', ASCII: 'B', SHORT: 'H', LONG: 'I', LONG8: 'Q'}
+
+
+def write_tiff_ifds(name, ifds, be=False, big=False):
+    """Writes IFDs linked in the order of `ifds`.
+
+    ifds: list of (tags, payloads). tags: list of (tag, type, values). values
+    'OFFSETS' and 'COUNTS' are replaced with the offsets and sizes of
+    `payloads`.
+    """
+    e = '>' if be else '<'
+    buf = bytearray(b'MM' if be else b'II')
+    if big:
+        buf += struct.pack(e + 'HHHQ', 43, 8, 0, 0)
+    else:
+        buf += struct.pack(e + 'HI', 42, 0)
+
+    # Position of the offset which links to the next IFD.
+    link = 8 if big else 4
+    for tags, payloads in ifds:
+        offsets = []
+        for p in payloads:
+            if len(buf) % 2:
+                buf.append(0)
+            offsets.append(len(buf))
+            buf += p
+
+        entries = []
+        for tag, typ, vals in sorted(tags, key=lambda t: t[0]):
+            if vals == 'OFFSETS':
+                vals = offsets
+            elif vals == 'COUNTS':
+                vals = [len(p) for p in payloads]
+            raw = b''.join(struct.pack(e + TYPE_FORMAT[typ], v) for v in vals)
+            inline = 8 if big else 4
+            if len(raw) > inline:
+                if len(buf) % 2:
+                    buf.append(0)
+                pos = len(buf)
+                buf += raw
+                raw = struct.pack(e + ('Q' if big else 'I'), pos)
+            entries.append((tag, typ, len(vals), raw.ljust(inline, b'\0')))
+
+        if len(buf) % 2:
+            buf.append(0)
+        ifd = len(buf)
+        if big:
+            struct.pack_into(e + 'Q', buf, link, ifd)
+            buf += struct.pack(e + 'Q', len(entries))
+            for tag, typ, count, raw in entries:
+                buf += struct.pack(e + 'HHQ', tag, typ, count) + raw
+            link = len(buf)
+            buf += struct.pack(e + 'Q', 0)
+        else:
+            struct.pack_into(e + 'I', buf, link, ifd)
+            buf += struct.pack(e + 'H', len(entries))
+            for tag, typ, count, raw in entries:
+                buf += struct.pack(e + 'HHI', tag, typ, count) + raw
+            link = len(buf)
+            buf += struct.pack(e + 'I', 0)
+
+    write_file(name + '.tif', buf)
+
+
+def write_tiff(name, tags, payloads, be=False, big=False):
+    """Writes a single IFD file."""
+    write_tiff_ifds(name, [(tags, payloads)], be, big)
+
+
+def write_file(filename, data):
+    with open(os.path.join(OUT, filename), 'wb') as f:
+        f.write(data)
+
+
+def write_expected(name, data):
+    write_file(name + '.raw', data)
+
+
+def pack(vals, bits, be=False):
+    e = '>' if be else '<'
+    fmt = {8: 'B', 16: 'H', 32: 'I', 64: 'Q'}[bits]
+    return struct.pack(e + str(len(vals)) + fmt, *vals)
+
+
+def base_tags(w, h, spp, bits, compression, photometric=32803):
+    return [(254, LONG, [0]), (256, LONG, [w]), (257, LONG, [h]),
+            (258, SHORT, [bits] * spp), (259, SHORT, [compression]),
+            (262, SHORT, [photometric]), (277, SHORT, [spp]),
+            (50706, BYTE, [1, 4, 0, 0])]
+
+
+def strip_tags(w, h, spp, bits, compression, rps, photometric=32803):
+    return base_tags(w, h, spp, bits, compression, photometric) + [
+        (278, LONG, [rps]), (273, LONG, 'OFFSETS'), (279, LONG, 'COUNTS')]
+
+
+def tile_tags(w, h, spp, bits, compression, tw, th, photometric=32803):
+    return base_tags(w, h, spp, bits, compression, photometric) + [
+        (322, LONG, [tw]), (323, LONG, [th]),
+        (324, LONG, 'OFFSETS'), (325, LONG, 'COUNTS')]
+
+
+def gen_image(w, h, spp, bits, seed):
+    """Deterministic gradient with noise."""
+    state = seed * 2654435761 + 1
+    vals = []
+    mask = (1 << bits) - 1
+    for y in range(h):
+        for x in range(w):
+            for c in range(spp):
+                state = (state * 1103515245 + 12345) & 0x7FFFFFFF
+                v = x * 37 + y * 91 + c * 1000 + (state >> 16) % 41
+                vals.append(v & mask)
+    return vals
+
+
+def tiles_of(vals, w, h, spp, tw, th):
+    """Splits samples into tiles in TileOffsets order. Edges are zero padded."""
+    tiles = []
+    for ty in range(0, h, th):
+        for tx in range(0, w, tw):
+            t = []
+            for y in range(ty, ty + th):
+                for x in range(tx, tx + tw):
+                    for c in range(spp):
+                        t.append(vals[(y * w + x) * spp + c]
+                                 if (y < h and x < w) else 0)
+            tiles.append(t)
+    return tiles
+
+
+def huffman_lengths(counts):
+    """Code lengths(at most 16 bits) of a Huffman code for symbol counts."""
+    # A dummy symbol takes the all-ones code, which JPEG does not allow.
+    nodes = [(n, [s]) for s, n in sorted(counts.items()) if n > 0]
+    nodes.append((1, [None]))
+    lengths = dict((s, 0) for _, syms in nodes for s in syms)
+    while len(nodes) > 1:
+        nodes.sort(key=lambda node: node[0])
+        (n0, s0), (n1, s1) = nodes[0], nodes[1]
+        for s in s0 + s1:
+            lengths[s] += 1
+        nodes = nodes[2:] + [(n0 + n1, s0 + s1)]
+    del lengths[None]
+    assert max(lengths.values()) <= 16
+    return lengths
+
+
+class LJ92Stats(object):
+    def __init__(self):
+        self.max_code_length = 0
+        self.stuffed_bytes = 0  # 0xFF bytes followed by a stuffed 0x00.
+        self.ssss16 = 0  # Differences of 32768(SSSS = 16).
+
+
+def lj92_encode(vals, w, h, comps, bits, predictor=1, num_tables=1,
+                code_lengths=None, stats=None):
+    """Lossless JPEG. Component `c` uses Huffman table `c % num_tables`.
+
+    code_lengths: code length of each SSSS(0..16), used for all tables. By
+    default each table is a Huffman code of the differences it codes.
+    """
+    stats = stats if stats is not None else LJ92Stats()
+    row = w * comps
+
+    def predict(i, x, y):
+        if y == 0:
+            return vals[i - comps] if x else 1 << (bits - 1)
+        if x == 0:
+            return vals[i - row]
+        a, b, c = vals[i - comps], vals[i - row], vals[i - row - comps]
+        return {1: a, 2: b, 3: c, 4: a + b - c, 5: a + ((b - c) >> 1),
+                6: b + ((a - c) >> 1), 7: (a + b) >> 1}[predictor]
+
+    diffs = []
+    for y in range(h):
+        for x in range(w):
+            for c in range(comps):
+                i = y * row + x * comps + c
+                # Differences are modulo 2^16. -32768 is coded as SSSS 16.
+                d = ((vals[i] - predict(i, x, y) + 32768) & 0xFFFF) - 32768
+                diffs.append((c % num_tables, d))
+
+    tables = []
+    for t in range(num_tables):
+        lengths = code_lengths
+        if lengths is None:
+            counts = {}
+            for table, d in diffs:
+                if table == t:
+                    k = abs(d).bit_length()
+                    counts[k] = counts.get(k, 0) + 1
+            lengths = huffman_lengths(counts)
+        # Canonical codes in the order of (length, symbol).
+        syms = sorted(lengths, key=lambda s: (lengths[s], s))
+        codes, code, prev = {}, 0, 0
+        for s in syms:
+            code <<= lengths[s] - prev
+            prev = lengths[s]
+            codes[s] = (code, prev)
+            code += 1
+        tables.append((syms, codes))
+
+    out = bytearray(b'\xff\xd8')
+    for t, (syms, codes) in enumerate(tables):
+        num_codes = [0] * 16
+        for s in syms:
+            num_codes[codes[s][1] - 1] += 1
+        dht = bytes([t] + num_codes + syms)
+        out += b'\xff\xc4' + struct.pack('>H', 2 + len(dht)) + dht
+    sof = struct.pack('>BHHB', bits, h, w, comps) + b''.join(
+        bytes([c + 1, 0x11, 0]) for c in range(comps))
+    out += b'\xff\xc3' + struct.pack('>H', 2 + len(sof)) + sof
+    sos = bytes([comps]) + b''.join(
+        bytes([c + 1, (c % num_tables) << 4]) for c in range(comps))
+    sos += bytes([predictor, 0, 0])
+    out += b'\xff\xda' + struct.pack('>H', 2 + len(sos)) + sos
+
+    bits_out = []
+    for t, d in diffs:
+        k = abs(d).bit_length()
+        code, length = tables[t][1][k]
+        stats.max_code_length = max(stats.max_code_length, length)
+        bits_out += [(code >> b) & 1 for b in range(length - 1, -1, -1)]
+        if k == 16:
+            stats.ssss16 += 1
+        elif k:
+            v = d if d > 0 else d + (1 << k) - 1
+            bits_out += [(v >> b) & 1 for b in range(k - 1, -1, -1)]
+    bits_out += [1] * (-len(bits_out) % 8)
+    for i in range(0, len(bits_out), 8):
+        byte = int(''.join(str(b) for b in bits_out[i:i + 8]), 2)
+        out.append(byte)
+        if byte == 0xFF:
+            out.append(0)
+            stats.stuffed_bytes += 1
+    out += b'\xff\xd9'
+    return bytes(out)
+
+
+class LZWStats(object):
+    def __init__(self):
+        self.kwkwk = 0  # Codes which refer to the entry being defined.
+        self.resets = 0  # Clear codes after the table is full.
+        self.max_width = 9
+
+
+def lzw_encode(data, stats=None):
+    """TIFF LZW(MSB first). Code width grows one code early as in libtiff."""
+    stats = stats if stats is not None else LZWStats()
+    out = bytearray()
+    acc = [0, 0]
+
+    def put(code, width):
+        acc[0] = (acc[0] << width) | code
+        acc[1] += width
+        while acc[1] >= 8:
+            acc[1] -= 8
+            out.append((acc[0] >> acc[1]) & 0xFF)
+        acc[0] &= (1 << acc[1]) - 1
+
+    table = dict((bytes([i]), i) for i in range(256))
+    next_code = 258
+    width = 9
+    last_added = None
+    put(256, width)
+    w = b''
+    for byte in data:
+        wc = w + bytes([byte])
+        if wc in table:
+            w = wc
+            continue
+        if table[w] == last_added:
+            stats.kwkwk += 1
+        put(table[w], width)
+        table[wc] = next_code
+        last_added = next_code
+        next_code += 1
+        if next_code in (512, 1024, 2048):
+            width += 1
+            stats.max_width = max(stats.max_width, width)
+        if next_code == 4094:
+            put(256, width)
+            stats.resets += 1
+            table = dict((bytes([i]), i) for i in range(256))
+            next_code = 258
+            width = 9
+            last_added = None
+        w = bytes([byte])
+    if w:
+        if table[w] == last_added:
+            stats.kwkwk += 1
+        put(table[w], width)
+        if next_code + 1 in (512, 1024, 2048):
+            width += 1
+    put(257, width)
+    if acc[1]:
+        out.append((acc[0] << (8 - acc[1])) & 0xFF)
+    return bytes(out)
+
+
+def gen_basic():
+    # Uncompressed strips. The last strip is partial.
+    w, h, rps = 40, 20, 8
+    vals = gen_image(w, h, 1, 16, 10)
+    strips = [pack(vals[y * w:(y + rps) * w], 16) for y in range(0, h, rps)]
+    write_tiff('strips_u16', strip_tags(w, h, 1, 16, 1, rps), strips)
+    write_expected('strips_u16', pack(vals, 16))
+
+    # Lossless JPEG in a single strip. A JPEG row holds an image row as 2
+    # components.
+    w, h = 32, 16
+    vals = gen_image(w, h, 1, 12, 11)
+    jpeg = lj92_encode(vals, w // 2, h, 2, 12)
+    write_tiff('lj92_strip', strip_tags(w, h, 1, 16, 7, h), [jpeg])
+    write_expected('lj92_strip', pack(vals, 16))
+
+    # A DHT segment too short for its 16 code counts.
+    dht = jpeg.index(b'\xff\xc4')
+    length = struct.unpack_from('>H', jpeg, dht + 2)[0]
+    jpeg = (jpeg[:dht + 2] + struct.pack('>H', 10) + jpeg[dht + 4:dht + 12] +
+            jpeg[dht + 2 + length:])
+    write_tiff('lj92_short_dht', strip_tags(w, h, 1, 16, 7, h), [jpeg])
+
+    write_file('empty.tif', b'')
+
+
+def gen_truncated():
+    with open(os.path.join(OUT, 'strips_u16.tif'), 'rb') as f:
+        data = f.read()
+    # Shorter than the TIFF header.
+    write_file('truncated_header.tif', data[:6])
+    # IFD0 ends after 3 entries.
+    ifd = struct.unpack_from('<I', data, 4)[0]
+    write_file('truncated_ifd.tif', data[:ifd + 2 + 12 * 3])
+
+
+def gen_multi_ifd():
+    # Main image, a reduced RGB preview(NewSubFileType 1) and a second full
+    # resolution image.
+    ifds = []
+    for i, (w, h, spp, bits, subfile_type) in enumerate(
+            ((40, 20, 1, 16, 0), (20, 10, 3, 8, 1), (24, 12, 1, 16, 0))):
+        vals = gen_image(w, h, spp, bits, 20 + i)
+        tags = strip_tags(w, h, spp, bits, 1, h, 2 if spp == 3 else 32803)
+        tags[0] = (254, LONG, [subfile_type])
+        ifds.append((tags, [pack(vals, bits)]))
+        write_expected('multi_ifd' + ('_%d' % i if i else ''), pack(vals, bits))
+    write_tiff_ifds('multi_ifd', ifds)
+
+
+def gen_lj92_tiles():
+    # 3 x 3 tiles. Tiles at the right/bottom edges are partial.
+    w, h, tw, th = 72, 40, 32, 16
+    vals = gen_image(w, h, 1, 12, 30)
+    tiles = [lj92_encode(t, tw // 2, th, 2, 12)
+             for t in tiles_of(vals, w, h, 1, tw, th)]
+    write_tiff('lj92_tiles', tile_tags(w, h, 1, 16, 7, tw, th), tiles)
+    write_expected('lj92_tiles', pack(vals, 16))
+
+
+def gen_zip():
+    # 3 x 3 tiles. Tiles at the right/bottom edges are partial.
+    w, h, tw, th = 72, 40, 32, 16
+    vals = gen_image(w, h, 1, 16, 31)
+    tiles = [zlib.compress(pack(t, 16))
+             for t in tiles_of(vals, w, h, 1, tw, th)]
+    write_tiff('zip_tiles', tile_tags(w, h, 1, 16, 8, tw, th), tiles)
+    write_expected('zip_tiles', pack(vals, 16))
+
+    # A single strip.
+    w, h = 40, 20
+    vals = gen_image(w, h, 3, 16, 32)
+    write_tiff('zip_strip', strip_tags(w, h, 3, 16, 8, h, 34892),
+               [zlib.compress(pack(vals, 16))])
+    write_expected('zip_strip', pack(vals, 16))
+
+    # Dimensions whose byte size(2^41) overflows 32 bits and exceeds the limit
+    # of the loader.
+    w, h = 1 << 20, 1 << 20
+    write_tiff('zip_too_large', strip_tags(w, h, 1, 16, 8, h),
+               [zlib.compress(b'\0' * 64)])
+
+
+def gen_lj92_codes():
+    w, h = 64, 32
+
+    # Noise gives many 0xFF bytes, which are followed by a stuffed 0x00.
+    state = 7
+    vals = []
+    for i in range(w * h):
+        state = (state * 1103515245 + 12345) & 0x7FFFFFFF
+        vals.append((state >> 8) & 0x3FFF)
+    stats = LJ92Stats()
+    jpeg = lj92_encode(vals, w // 2, h, 2, 14, stats=stats)
+    assert stats.stuffed_bytes >= 8
+    write_tiff('lj92_stuffing', strip_tags(w, h, 1, 16, 7, h), [jpeg])
+    write_expected('lj92_stuffing', pack(vals, 16))
+
+    # Codes up to 16 bits, longer than the lookup table of the decoder.
+    lengths = dict((k, k + 1) for k in range(14))
+    lengths.update({14: 16, 15: 16, 16: 16})
+    stats = LJ92Stats()
+    jpeg = lj92_encode(vals, w // 2, h, 2, 14, code_lengths=lengths,
+                       stats=stats)
+    assert stats.max_code_length == 16
+    write_tiff('lj92_long_codes', strip_tags(w, h, 1, 16, 7, h), [jpeg])
+    write_expected('lj92_long_codes', pack(vals, 16))
+
+    # 16-bit samples which step up by 32768 at every other pixel. The
+    # difference is coded as SSSS 16 without additional bits.
+    # The first sample is not 0, which would differ by -32768 from the initial
+    # prediction(32768).
+    vals = [(y * 7 + (x % 2) * 3 + x // 4 + 1 +
+             (32768 if (x // 2) % 2 else 0))
+            for y in range(h) for x in range(w)]
+    stats = LJ92Stats()
+    jpeg = lj92_encode(vals, w // 2, h, 2, 16, stats=stats)
+    assert stats.ssss16 >= 16
+    write_tiff('lj92_ssss16', strip_tags(w, h, 1, 16, 7, h), [jpeg])
+    write_expected('lj92_ssss16', pack(vals, 16))
+
+
+def gen_lj92_predictors():
+    # Each predictor with 1 to 4 components, which use a Huffman table each.
+    # Tiles at the right/bottom edges are partial.
+    h, th, bits = 20, 8, 14
+    for predictor in range(1, 8):
+        for comps in range(1, 5):
+            name = 'lj92_p%d_c%d' % (predictor, comps)
+            tw = 6 * comps
+            w = tw * 2 + comps
+            vals = gen_image(w, h, 1, bits, predictor * 10 + comps)
+            tiles = [lj92_encode(t, tw // comps, th, comps, bits, predictor,
+                                 num_tables=comps)
+                     for t in tiles_of(vals, w, h, 1, tw, th)]
+            write_tiff(name, tile_tags(w, h, 1, 16, 7, tw, th), tiles)
+            write_expected(name, pack(vals, 16))
+
+
+def gen_lj92_tile_rows():
+    # JPEG rows which are not tile rows. Samples of a tile are coded in
+    # raster order, so that a JPEG row holds several tile rows or a part.
+    w, h, tw, th = 72, 40, 32, 16
+    for name, lj_width, comps, lj_height in (
+            ('lj92_tile_rows_c2', tw, 2, th // 2),
+            ('lj92_tile_rows_c4', tw // 2, 4, th // 2),
+            ('lj92_tile_rows_short', tw // 4, 2, th // 2)):
+        vals = gen_image(w, h, 1, 12, len(name) + comps)
+        n = lj_width * comps * lj_height
+        tiles = [lj92_encode(t[:n], lj_width, lj_height, comps, 12)
+                 for t in tiles_of(vals, w, h, 1, tw, th)]
+        write_tiff(name, tile_tags(w, h, 1, 16, 7, tw, th), tiles)
+        # Samples which the JPEG frame does not cover are zero.
+        for y in range(h):
+            for x in range(w):
+                if (y % th) * tw + (x % tw) >= n:
+                    vals[y * w + x] = 0
+        write_expected(name, pack(vals, 16))
+
+
+def gen_tile_table():
+    w, h, tw, th = 40, 24, 16, 16
+    vals = gen_image(w, h, 1, 16, 1)
+    tiles = [zlib.compress(pack(t, 16))
+             for t in tiles_of(vals, w, h, 1, tw, th)]
+    common = base_tags(w, h, 1, 16, 8) + [(322, LONG, [tw]), (323, LONG, [th])]
+
+    # ZIP tiles with partial edge tiles. Each tile is inflated from its exact
+    # byte count.
+    write_tiff('tile_zip', common + [
+        (324, LONG, 'OFFSETS'), (325, LONG, 'COUNTS')], tiles)
+    write_expected('tile_zip', pack(vals, 16))
+
+    # SHORT TileByteCounts.
+    write_tiff('tile_zip_short_counts', common + [
+        (324, LONG, 'OFFSETS'), (325, SHORT, 'COUNTS')], tiles)
+    write_expected('tile_zip_short_counts', pack(vals, 16))
+
+    # Broken tile tables.
+    counts = [len(t) for t in tiles]
+    write_tiff('tile_count_mismatch', common + [
+        (324, LONG, 'OFFSETS'), (325, LONG, counts[:5])], tiles)
+    write_tiff('tile_missing', common + [
+        (324, LONG, 'OFFSETS'), (325, LONG, 'COUNTS')], tiles[:5])
+    write_tiff('tile_out_of_range', common + [
+        (324, LONG, 'OFFSETS'), (325, LONG, counts[:5] + [0x10000])], tiles)
+
+    # Lossless JPEG image stored as a single tile(TileOffsets is inline).
+    w, h = 32, 8
+    vals = gen_image(w, h, 1, 12, 2)
+    write_tiff('tile_lj_single', tile_tags(w, h, 1, 16, 7, w, h),
+               [lj92_encode(vals, w // 2, h, 2, 12)])
+    write_expected('tile_lj_single', pack(vals, 16))
+
+
+def gen_lzw_strips():
+    # 8-bit LZW strips.
+    w, h, rps = 40, 24, 8
+    vals = gen_image(w, h, 1, 8, 40)
+    strips = [lzw_encode(bytes(vals[y * w:(y + rps) * w]))
+              for y in range(0, h, rps)]
+    write_tiff('lzw_strips', strip_tags(w, h, 1, 8, 5, rps, 1), strips)
+    write_expected('lzw_strips', bytes(vals))
+
+
+def gen_source_strips():
+    # Uncompressed strips spanning several blocks of the source reader, so
+    # that loading the metadata does not fetch the whole file.
+    w, h, rps = 300, 240, 16
+    vals = gen_image(w, h, 1, 16, 16)
+    strips = [pack(vals[y * w:(y + rps) * w], 16) for y in range(0, h, rps)]
+    write_tiff('source_strips', strip_tags(w, h, 1, 16, 1, rps), strips)
+
+
+def gen_bigtiff():
+    # Uncompressed strips. StripOffsets/StripByteCounts are LONG8 arrays.
+    w, h, rps = 40, 24, 8
+    vals = gen_image(w, h, 1, 16, 3)
+    for be in (False, True):
+        name = 'bigtiff_strips_' + ('be' if be else 'le')
+        strips = [pack(vals[y * w:(y + rps) * w], 16, be)
+                  for y in range(0, h, rps)]
+        tags = base_tags(w, h, 1, 16, 1) + [
+            (278, LONG, [rps]),
+            (273, LONG8, 'OFFSETS'), (279, LONG8, 'COUNTS')]
+        write_tiff(name, tags, strips, be=be, big=True)
+        write_expected(name, pack(vals, 16, be))
+
+    # A single strip. The LONG8 offset is stored inline in the entry.
+    name = 'bigtiff_inline_offset'
+    tags = base_tags(w, h, 1, 16, 1) + [
+        (278, LONG, [h]), (273, LONG8, 'OFFSETS'), (279, LONG, 'COUNTS')]
+    write_tiff(name, tags, [pack(vals, 16)], big=True)
+    write_expected(name, pack(vals, 16))
+
+    # ZIP tiles with a LONG8 tile table.
+    tw, th = 16, 16
+    for be in (False, True):
+        name = 'bigtiff_zip_tiles_' + ('be' if be else 'le')
+        tiles = [zlib.compress(pack(t, 16, be))
+                 for t in tiles_of(vals, w, h, 1, tw, th)]
+        tags = base_tags(w, h, 1, 16, 8) + [
+            (322, LONG, [tw]), (323, LONG, [th]),
+            (324, LONG8, 'OFFSETS'), (325, LONG8, 'COUNTS')]
+        write_tiff(name, tags, tiles, be=be, big=True)
+        write_expected(name, pack(vals, 16, be))
+
+    # Offset bytesize of the header must be 8.
+    name = 'bigtiff_bad_header'
+    tags = base_tags(w, h, 1, 16, 1) + [
+        (278, LONG, [h]), (273, LONG8, 'OFFSETS'), (279, LONG, 'COUNTS')]
+    write_tiff(name, tags, [pack(vals, 16)], big=True)
+    path = os.path.join(OUT, name + '.tif')
+    with open(path, 'r+b') as f:
+        f.seek(4)
+        f.write(struct.pack('<H', 4))
+
+
+def gen_output_buffer():
+    # A JPEG frame with more samples than the image.
+    w, h = 32, 16
+    vals = gen_image(w, h + 2, 1, 12, 50)
+    write_tiff('lj92_frame_too_large', strip_tags(w, h, 1, 16, 7, h),
+               [lj92_encode(vals, w // 2, h + 2, 2, 12)])
+
+    # 24-bit samples, whose size is not a power of two.
+    w, h = 30, 10
+    vals = gen_image(w, h, 1, 24, 51)
+    data = b''.join(struct.pack('<I', v)[:3] for v in vals)
+    write_tiff('strips_u24', strip_tags(w, h, 1, 24, 1, h, 1), [data])
+    write_expected('strips_u24', data)
+
+
+def gen_lzw():
+    def write_lzw(name, w, h, rps, vals, expect):
+        stats = LZWStats()
+        strips = [lzw_encode(bytes(vals[y * w:(y + rps) * w]), stats)
+                  for y in range(0, h, rps)]
+        assert expect(stats), name
+        tags = base_tags(w, h, 1, 8, 5, photometric=1) + [
+            (278, LONG, [rps]), (273, LONG, 'OFFSETS'), (279, LONG, 'COUNTS')]
+        write_tiff(name, tags, strips)
+        write_expected(name, bytes(vals))
+
+    # Runs of one value emit codes of the entry being defined(KwKwK).
+    w, h = 64, 16
+    vals = [(y // 4) * 16 for y in range(h) for x in range(w)]
+    write_lzw('lzw_kwkwk', w, h, 8, vals, lambda s: s.kwkwk > 8)
+
+    # Long enough for 10, 11 and 12-bit codes, without a reset.
+    w, h = 128, 32
+    vals = gen_image(w, h, 1, 8, 4)
+    write_lzw('lzw_code_widths', w, h, h, vals,
+              lambda s: s.max_width == 12 and s.resets == 0)
+
+    # The table fills up and is reset several times within a strip.
+    w, h = 128, 96
+    state = 5
+    vals = []
+    for i in range(w * h):
+        state = (state * 1103515245 + 12345) & 0x7FFFFFFF
+        vals.append((state >> 16) & 0xFF)
+    write_lzw('lzw_reset', w, h, 48, vals, lambda s: s.resets >= 2)
+
+
+def horizontal_diff(vals, w, rows, spp, bits):
+    """Predictor 2: each sample minus the sample to its left(mod 2^bits)."""
+    out = list(vals)
+    mask = (1 << bits) - 1
+    for y in range(rows):
+        for x in range(1, w):
+            for c in range(spp):
+                i = (y * w + x) * spp + c
+                out[i] = (vals[i] - vals[i - spp]) & mask
+    return out
+
+
+def gen_predictor():
+    # LZW strips. The last strip is partial.
+    w, h, rps = 30, 20, 8
+    for bits, spp in ((16, 1), (16, 3), (32, 1), (32, 2)):
+        vals = gen_image(w, h, spp, bits, bits + spp)
+        if bits == 32:
+            # Use the high bytes so that carries cross byte boundaries.
+            vals = [(v * 2654435761) & 0xFFFFFFFF for v in vals]
+        for be in (False, True):
+            name = 'pred2_lzw%d_s%d_%s' % (bits, spp, 'be' if be else 'le')
+            strips = []
+            for y in range(0, h, rps):
+                rows = min(rps, h - y)
+                part = vals[y * w * spp:(y + rows) * w * spp]
+                strips.append(lzw_encode(
+                    pack(horizontal_diff(part, w, rows, spp, bits), bits, be)))
+            tags = base_tags(w, h, spp, bits, 5, photometric=1) + [
+                (317, SHORT, [2]), (278, LONG, [rps]),
+                (273, LONG, 'OFFSETS'), (279, LONG, 'COUNTS')]
+            write_tiff(name, tags, strips, be=be)
+            write_expected(name, pack(vals, bits, be))
+
+    # ZIP tiles.
+    w, h, tw, th, spp = 40, 24, 16, 16, 3
+    vals = gen_image(w, h, spp, 16, 6)
+    for be in (False, True):
+        name = 'pred2_zip16_s3_%s' % ('be' if be else 'le')
+        tiles = [zlib.compress(
+            pack(horizontal_diff(t, tw, th, spp, 16), 16, be))
+            for t in tiles_of(vals, w, h, spp, tw, th)]
+        tags = base_tags(w, h, spp, 16, 8, photometric=34892) + [
+            (317, SHORT, [2]), (322, LONG, [tw]), (323, LONG, [th]),
+            (324, LONG, 'OFFSETS'), (325, LONG, 'COUNTS')]
+        write_tiff(name, tags, tiles, be=be)
+        write_expected(name, pack(vals, 16, be))
+
+
+def float_bytes(v, size):
+    """Big endian bytes of `v` as a 16/24/32/64-bit float."""
+    if size == 2:
+        return struct.pack('>e', v)
+    if size == 4:
+        return struct.pack('>f', v)
+    if size == 8:
+        return struct.pack('>d', v)
+    # 24-bit float: sign, 7-bit exponent(bias 63) and 16-bit mantissa.
+    f = struct.unpack('>I', struct.pack('>f', v))[0]
+    sign = (f >> 31) << 23
+    if (f & 0x7FFFFFFF) == 0:
+        return struct.pack('>I', sign)[1:]
+    exponent = ((f >> 23) & 0xFF) - 127 + 63
+    return struct.pack('>I', sign | (exponent << 16) | ((f >> 7) & 0xFFFF))[1:]
+
+
+def floating_point_diff(samples, w, rows, spp, size):
+    """Predictor 3: bytes of a row are split into planes(most significant
+    first), then byte-wise differenced."""
+    out = bytearray()
+    n = w * spp
+    for y in range(rows):
+        row = samples[y * n:(y + 1) * n]
+        planes = bytearray(n * size)
+        for i, sample in enumerate(row):
+            for b in range(size):
+                planes[b * n + i] = sample[b]
+        for k in range(len(planes) - 1, spp - 1, -1):
+            planes[k] = (planes[k] - planes[k - spp]) & 0xFF
+        out += planes
+    return bytes(out)
+
+
+def gen_floating_point_predictor():
+    w, h = 30, 20
+    for bits, spp, compression in ((16, 1, 5), (24, 1, 8), (32, 3, 5),
+                                   (32, 1, 8), (64, 1, 5)):
+        size = bits // 8
+        vals = [(x * 0.37 + y * 1.5 + c) * (-1 if (x + c) % 7 == 0 else 1)
+                for y in range(h) for x in range(w) for c in range(spp)]
+        samples = [float_bytes(v, size) for v in vals]
+        for be in (False, True):
+            name = 'pred3_%s%d_s%d_%s' % ('lzw' if compression == 5 else 'zip',
+                                          bits, spp, 'be' if be else 'le')
+            tags = base_tags(w, h, spp, bits, compression, photometric=1) + [
+                (317, SHORT, [3]), (339, SHORT, [3] * spp)]
+            if compression == 5:
+                # LZW strips. The last strip is partial.
+                rps = 8
+                payloads = []
+                for y in range(0, h, rps):
+                    rows = min(rps, h - y)
+                    payloads.append(lzw_encode(floating_point_diff(
+                        samples[y * w * spp:(y + rows) * w * spp], w, rows,
+                        spp, size)))
+                tags += [(278, LONG, [rps]),
+                         (273, LONG, 'OFFSETS'), (279, LONG, 'COUNTS')]
+            else:
+                # ZIP tiles.
+                tw, th = 16, 16
+                pad = b'\0' * size
+                payloads = []
+                for ty in range(0, h, th):
+                    for tx in range(0, w, tw):
+                        t = [samples[(y * w + x) * spp + c]
+                             if (y < h and x < w) else pad
+                             for y in range(ty, ty + th)
+                             for x in range(tx, tx + tw) for c in range(spp)]
+                        payloads.append(zlib.compress(
+                            floating_point_diff(t, tw, th, spp, size)))
+                tags += [(322, LONG, [tw]), (323, LONG, [th]),
+                         (324, LONG, 'OFFSETS'), (325, LONG, 'COUNTS')]
+            write_tiff(name, tags, payloads, be=be)
+            # Samples are decoded in the byte order of the file.
+            write_expected(name, b''.join(
+                sample if be else sample[::-1] for sample in samples))
+
+
+def pack_bits(vals, w, bits, lsb_first=False):
+    """Packs rows of `w` samples. Each row starts at a byte boundary."""
+    out = bytearray()
+    for y in range(len(vals) // w):
+        acc, n = 0, 0
+        for v in vals[y * w:(y + 1) * w]:
+            if lsb_first:
+                acc |= v << n
+            else:
+                acc = (acc << bits) | v
+            n += bits
+            while n >= 8:
+                n -= 8
+                if lsb_first:
+                    out.append(acc & 0xFF)
+                    acc >>= 8
+                else:
+                    out.append((acc >> n) & 0xFF)
+                    acc &= (1 << n) - 1
+        if n:
+            out.append(acc & 0xFF if lsb_first else (acc << (8 - n)) & 0xFF)
+    return bytes(out)
+
+
+def gen_packed():
+    # Odd widths, so that rows end in the middle of a byte. The last strip is
+    # partial. The bit stream does not depend on the byte order of the file.
+    h, rps = 11, 4
+    for bits, w, be, lsb_first in ((10, 37, False, False),
+                                   (12, 33, True, False),
+                                   (14, 31, False, False),
+                                   (12, 35, False, True)):
+        name = 'packed%d_w%d_%s%s' % (bits, w, 'be' if be else 'le',
+                                      '_lsb' if lsb_first else '')
+        vals = gen_image(w, h, 1, bits, bits + w)
+        strips = [pack_bits(vals[y * w:(y + rps) * w], w, bits, lsb_first)
+                  for y in range(0, h, rps)]
+        write_tiff(name, strip_tags(w, h, 1, bits, 1, rps), strips, be=be)
+        write_file(name + '.le.raw', pack(vals, 16))
+
+
+def gen_byte_order():
+    w, h, rps = 30, 20, 8
+    for bits, compression in ((16, 1), (32, 1), (64, 1), (16, 5), (16, 8)):
+        vals = [(v * 0x9E3779B97F4A7C15) & ((1 << bits) - 1)
+                for v in gen_image(w, h, 1, 16, bits + compression)]
+        for be in (False, True):
+            name = 'order_%s%d_%s' % (
+                {1: 'raw', 5: 'lzw', 8: 'zip'}[compression], bits,
+                'be' if be else 'le')
+            if compression == 8:
+                # ZIP tiles.
+                tw, th = 16, 16
+                payloads = [zlib.compress(pack(t, bits, be))
+                            for t in tiles_of(vals, w, h, 1, tw, th)]
+                tags = tile_tags(w, h, 1, bits, compression, tw, th, 1)
+            else:
+                payloads = [pack(vals[y * w:(y + rps) * w], bits, be)
+                            for y in range(0, h, rps)]
+                if compression == 5:
+                    payloads = [lzw_encode(p) for p in payloads]
+                tags = strip_tags(w, h, 1, bits, compression, rps, 1)
+            write_tiff(name, tags, payloads, be=be)
+            write_expected(name, pack(vals, bits, be))
+            write_file(name + '.le.raw', pack(vals, bits))
+
+
+def main():
+    os.makedirs(OUT, exist_ok=True)
+    gen_basic()
+    gen_truncated()
+    gen_multi_ifd()
+    gen_lj92_tiles()
+    gen_zip()
+    gen_lj92_codes()
+    gen_lj92_predictors()
+    gen_lj92_tile_rows()
+    gen_tile_table()
+    gen_lzw_strips()
+    gen_source_strips()
+    gen_bigtiff()
+    gen_output_buffer()
+    gen_lzw()
+    gen_predictor()
+    gen_floating_point_predictor()
+    gen_packed()
+    gen_byte_order()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,1365 @@
+//
+// Decoder tests. Loads the fixtures in `data/`(generated by gen_fixtures.py)
+// and compares the decoded samples with `<name>.raw`, or checks that broken
+// files are rejected with the expected error. Functional tests exercise the
+// loading APIs with the same fixtures.
+//
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define TINY_DNG_LOADER_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#include "tiny_dng_loader.h"
+
+#define TINY_DNG_WRITER_IMPLEMENTATION
+#include "tiny_dng_writer.h"
+
+struct TestCase {
+  const char* name;
+  // NULL = the file must be decoded to `<name>.raw`. Otherwise the image must
+  // be rejected with an error containing this string.
+  const char* error;
+};
+
+static const TestCase kTestCases[] = {
+    {"strips_u16", NULL},
+    {"lj92_strip", NULL},
+    {"lj92_short_dht", "JPEG"},
+    {"multi_ifd", NULL},
+
+    // Lossless JPEG tiles.
+    {"lj92_tiles", NULL},
+
+    // ZIP.
+    {"zip_tiles", NULL},
+    {"zip_strip", NULL},
+    {"zip_too_large", "too large"},
+
+    // Lossless JPEG Huffman codes.
+    {"lj92_stuffing", NULL},
+    {"lj92_long_codes", NULL},
+    {"lj92_ssss16", NULL},
+
+    // Lossless JPEG tiles whose JPEG rows are not tile rows.
+    {"lj92_tile_rows_c2", NULL},
+    {"lj92_tile_rows_c4", NULL},
+    {"lj92_tile_rows_short", NULL},
+
+    // Tile table(TileOffsets/TileByteCounts).
+    {"tile_zip", NULL},
+    {"tile_zip_short_counts", NULL},
+    {"tile_lj_single", NULL},
+    {"tile_count_mismatch", "does not match"},
+    {"tile_missing", "tiles are required"},
+    {"tile_out_of_range", "out of file range"},
+    {"lzw_strips", NULL},
+
+    // BigTIFF.
+    {"bigtiff_strips_le", NULL},
+    {"bigtiff_strips_be", NULL},
+    {"bigtiff_inline_offset", NULL},
+    {"bigtiff_zip_tiles_le", NULL},
+    {"bigtiff_zip_tiles_be", NULL},
+    {"bigtiff_bad_header", "Invalid BigTIFF header"},
+
+    // Frames and samples checked against the destination.
+    {"lj92_frame_too_large", "does not fit"},
+    {"strips_u24", NULL},
+
+    // LZW.
+    {"lzw_kwkwk", NULL},
+    {"lzw_code_widths", NULL},
+    {"lzw_reset", NULL},
+
+    // Horizontal predictor(Predictor=2) of 16/32-bit samples.
+    {"pred2_lzw16_s1_le", NULL},
+    {"pred2_lzw16_s1_be", NULL},
+    {"pred2_lzw16_s3_le", NULL},
+    {"pred2_lzw16_s3_be", NULL},
+    {"pred2_lzw32_s1_le", NULL},
+    {"pred2_lzw32_s1_be", NULL},
+    {"pred2_lzw32_s2_le", NULL},
+    {"pred2_lzw32_s2_be", NULL},
+    {"pred2_zip16_s3_le", NULL},
+    {"pred2_zip16_s3_be", NULL},
+
+    // Floating point predictor(Predictor=3).
+    {"pred3_lzw16_s1_le", NULL},
+    {"pred3_lzw16_s1_be", NULL},
+    {"pred3_zip24_s1_le", NULL},
+    {"pred3_zip24_s1_be", NULL},
+    {"pred3_lzw32_s3_le", NULL},
+    {"pred3_lzw32_s3_be", NULL},
+    {"pred3_zip32_s1_le", NULL},
+    {"pred3_zip32_s1_be", NULL},
+    {"pred3_lzw64_s1_le", NULL},
+    {"pred3_lzw64_s1_be", NULL},
+
+    // 16/32/64-bit samples in the byte order of the file.
+    {"order_raw16_le", NULL},
+    {"order_raw16_be", NULL},
+    {"order_raw32_le", NULL},
+    {"order_raw32_be", NULL},
+    {"order_raw64_le", NULL},
+    {"order_raw64_be", NULL},
+    {"order_lzw16_le", NULL},
+    {"order_lzw16_be", NULL},
+    {"order_zip16_le", NULL},
+    {"order_zip16_be", NULL},
+};
+
+static bool ReadFile(const std::string& filename,
+                     std::vector<unsigned char>* data) {
+  std::ifstream ifs(filename.c_str(), std::ios::binary);
+  if (!ifs) {
+    return false;
+  }
+  data->assign(std::istreambuf_iterator<char>(ifs),
+               std::istreambuf_iterator<char>());
+  return true;
+}
+
+static bool Fail(const std::string& msg) {
+  std::cout << "  " << msg << "\n";
+  return false;
+}
+
+// Compares decoded bytes with the expected bytes.
+static bool CheckData(const std::string& what, const unsigned char* data,
+                      size_t size, const std::vector<unsigned char>& expected) {
+  if (size != expected.size()) {
+    std::cout << "  " << what << ": size mismatch: " << size
+              << " bytes(expected " << expected.size() << ")\n";
+    return false;
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    if (data[i] != expected[i]) {
+      std::cout << "  " << what << ": data mismatch at byte " << i << "\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool CheckData(const std::string& what,
+                      const std::vector<unsigned char>& data,
+                      const std::vector<unsigned char>& expected) {
+  return CheckData(what, data.empty() ? NULL : &data[0], data.size(),
+                   expected);
+}
+
+static bool CheckExpected(const std::string& dir, const std::string& name,
+                          const std::vector<unsigned char>& data) {
+  std::vector<unsigned char> expected;
+  if (!ReadFile(dir + "/" + name + ".raw", &expected)) {
+    return Fail(name + ": expected output not found");
+  }
+  return CheckData(name, data, expected);
+}
+
+static bool Load(const std::string& filename,
+                 std::vector<tinydng::DNGImage>* images, std::string* err) {
+  std::string warn;
+  std::vector<tinydng::FieldInfo> custom_fields;
+  return tinydng::LoadDNG(filename.c_str(), custom_fields, images, &warn, err);
+}
+
+static bool Load(const std::string& filename,
+                 const tinydng::LoadOptions& options,
+                 std::vector<tinydng::DNGImage>* images, std::string* err) {
+  std::string warn;
+  std::vector<tinydng::FieldInfo> custom_fields;
+  return tinydng::LoadDNG(filename.c_str(), options, custom_fields, images,
+                          &warn, err);
+}
+
+// Loads `<name>.tif` and checks the first image against `<name>.raw`.
+static bool LoadAndCheck(const std::string& dir, const std::string& name) {
+  std::string err;
+  std::vector<tinydng::DNGImage> images;
+  if (!Load(dir + "/" + name + ".tif", &images, &err) || images.empty()) {
+    return Fail(name + ": failed to load: " + err);
+  }
+  return CheckExpected(dir, name, images[0].data);
+}
+
+static bool RunTest(const std::string& dir, const TestCase& test) {
+  if (!test.error) {
+    return LoadAndCheck(dir, test.name);
+  }
+
+  std::string err;
+  std::vector<tinydng::DNGImage> images;
+  bool ret = false;
+  try {
+    ret = Load(dir + "/" + test.name + ".tif", &images, &err);
+  } catch (const std::runtime_error& e) {
+    // TINY_DNG_ASSERT throws on some broken data.
+    err = e.what();
+  }
+
+  // An IFD which fails to parse ends the IFD list, so the load itself may
+  // succeed without images.
+  if (ret && !images.empty()) {
+    return Fail("loaded an image which must be rejected");
+  }
+  if (err.find(test.error) == std::string::npos) {
+    return Fail("unexpected error: " + err);
+  }
+  return true;
+}
+
+// Copies the rectangle of a full decode with byte aligned samples.
+static std::vector<unsigned char> Crop(const tinydng::DNGImage& image, int x,
+                                       int y, int w, int h) {
+  const size_t pixel_bytes =
+      size_t(image.samples_per_pixel * image.bits_per_sample / 8);
+  const size_t row_bytes = size_t(image.width) * pixel_bytes;
+  std::vector<unsigned char> out;
+  for (int row = y; row < y + h; row++) {
+    const unsigned char* p =
+        &image.data[size_t(row) * row_bytes + size_t(x) * pixel_bytes];
+    out.insert(out.end(), p, p + size_t(w) * pixel_bytes);
+  }
+  return out;
+}
+
+static bool IsBigEndianHost() {
+  const unsigned int one = 1;
+  unsigned char c;
+  memcpy(&c, &one, 1);
+  return c == 0;
+}
+
+// Reads `<name>.le.raw`, whose samples are little endian, in host byte order.
+static bool ReadExpectedHostOrder(const std::string& dir,
+                                  const std::string& name, size_t sample_bytes,
+                                  std::vector<unsigned char>* data) {
+  if (!ReadFile(dir + "/" + name + ".le.raw", data)) {
+    return false;
+  }
+  if (IsBigEndianHost()) {
+    for (size_t i = 0; i + sample_bytes <= data->size(); i += sample_bytes) {
+      std::reverse(data->begin() + i, data->begin() + i + sample_bytes);
+    }
+  }
+  return true;
+}
+
+//
+// LoadDNG on a memory mapped file and LoadDNGFromMemory decode the same
+// images. Empty and missing files are rejected.
+//
+static bool TestMappedFile(const std::string& dir) {
+  const char* names[] = {"strips_u16", "lj92_strip"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const std::string filename = dir + "/" + names[i] + ".tif";
+    std::string err;
+    std::vector<tinydng::DNGImage> mapped;
+    if (!Load(filename, &mapped, &err) || mapped.size() != 1) {
+      return Fail(filename + ": failed to load: " + err);
+    }
+
+    std::vector<unsigned char> mem;
+    if (!ReadFile(filename, &mem)) {
+      return Fail(filename + ": cannot read");
+    }
+    std::string warn;
+    std::vector<tinydng::DNGImage> images;
+    std::vector<tinydng::FieldInfo> custom_fields;
+    if (!tinydng::LoadDNGFromMemory(reinterpret_cast<const char*>(&mem[0]),
+                                    mem.size(), custom_fields, &images, &warn,
+                                    &err) ||
+        images.size() != 1) {
+      return Fail(filename + ": failed to load from memory: " + err);
+    }
+    if (!CheckData(filename, mapped[0].data, images[0].data) ||
+        !CheckExpected(dir, names[i], mapped[0].data)) {
+      return false;
+    }
+  }
+
+  const char* broken[] = {"empty.tif", "missing.tif"};
+  for (size_t i = 0; i < sizeof(broken) / sizeof(broken[0]); i++) {
+    std::string err;
+    std::vector<tinydng::DNGImage> images;
+    if (Load(dir + "/" + broken[i], &images, &err) || err.empty()) {
+      return Fail(std::string(broken[i]) + ": must be rejected with an error");
+    }
+  }
+
+  return true;
+}
+
+//
+// File type sniffing reads only a prefix, and handles files and memory which
+// end anywhere in the header or IFD0.
+//
+static bool TestSniff(const std::string& dir) {
+  const std::string filename = dir + "/strips_u16.tif";
+  std::string msg;
+  tinydng::DNGFileInfo info;
+  if (!tinydng::SniffDNG(filename.c_str(), &info, &msg) || !info.is_tiff ||
+      info.is_bigtiff || info.big_endian || !info.has_dng_version ||
+      (info.dng_version[0] != 1) || (info.dng_version[1] != 4)) {
+    return Fail("strips_u16.tif: not sniffed as DNG 1.4: " + msg);
+  }
+  if (!tinydng::IsDNG(filename.c_str(), &msg)) {
+    return Fail("strips_u16.tif: IsDNG failed: " + msg);
+  }
+
+  // Every prefix of the file.
+  std::vector<unsigned char> mem;
+  if (!ReadFile(filename, &mem)) {
+    return Fail("cannot read " + filename);
+  }
+  for (size_t size = 0; size <= mem.size(); size++) {
+    tinydng::DNGFileInfo prefix;
+    if (!tinydng::SniffDNGFromMemory(reinterpret_cast<const char*>(&mem[0]),
+                                     size, &prefix, &msg)) {
+      return Fail("SniffDNGFromMemory failed");
+    }
+    if (prefix.is_tiff != (size >= 8)) {
+      return Fail("unexpected is_tiff of a prefix");
+    }
+    if (size == mem.size() && !prefix.has_dng_version) {
+      return Fail("DNGVersion not found in the whole file");
+    }
+  }
+
+  // Files shorter than the header or IFD0.
+  tinydng::DNGFileInfo truncated;
+  if (!tinydng::SniffDNG((dir + "/truncated_header.tif").c_str(), &truncated,
+                         &msg) ||
+      truncated.is_tiff) {
+    return Fail("truncated_header.tif: sniffed as TIFF");
+  }
+  if (tinydng::IsDNG((dir + "/truncated_header.tif").c_str(), &msg)) {
+    return Fail("truncated_header.tif: IsDNG returned true");
+  }
+  truncated = tinydng::DNGFileInfo();
+  if (!tinydng::SniffDNG((dir + "/truncated_ifd.tif").c_str(), &truncated,
+                         &msg) ||
+      !truncated.is_tiff || truncated.has_dng_version) {
+    return Fail("truncated_ifd.tif: unexpected file info");
+  }
+
+  if (tinydng::SniffDNG((dir + "/missing.tif").c_str(), &truncated, &msg)) {
+    return Fail("missing.tif: SniffDNG succeeded");
+  }
+
+  return true;
+}
+
+//
+// Metadata-only loading returns the same images as a full load, without
+// pixels.
+//
+static bool TestMetadataOnly(const std::string& dir) {
+  const char* names[] = {"strips_u16", "lj92_strip"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const std::string filename = dir + "/" + names[i] + ".tif";
+    std::string warn, err;
+    std::vector<tinydng::FieldInfo> custom_fields;
+    std::vector<tinydng::DNGImage> full, info;
+    if (!Load(filename, &full, &err) ||
+        !tinydng::LoadDNGInfo(filename.c_str(), custom_fields, &info, &warn,
+                              &err)) {
+      return Fail(filename + ": failed to load: " + err);
+    }
+    if (info.size() != full.size()) {
+      return Fail(filename + ": image count mismatch");
+    }
+    for (size_t k = 0; k < info.size(); k++) {
+      if ((info[k].width != full[k].width) ||
+          (info[k].height != full[k].height) ||
+          (info[k].samples_per_pixel != full[k].samples_per_pixel) ||
+          (info[k].bits_per_sample != full[k].bits_per_sample)) {
+        return Fail(filename + ": metadata mismatch");
+      }
+      if (!info[k].data.empty()) {
+        return Fail(filename + ": pixels decoded in metadata-only mode");
+      }
+      if ((info[k].data_offset == 0) || (info[k].data_byte_count == 0)) {
+        return Fail(filename + ": data location not filled");
+      }
+    }
+
+    std::vector<unsigned char> mem;
+    if (!ReadFile(filename, &mem)) {
+      return Fail("cannot read " + filename);
+    }
+    tinydng::LoadOptions options;
+    options.metadata_only = true;
+    std::vector<tinydng::DNGImage> images;
+    if (!tinydng::LoadDNGFromMemory(reinterpret_cast<const char*>(&mem[0]),
+                                    mem.size(), options, custom_fields,
+                                    &images, &warn, &err) ||
+        (images.size() != full.size()) || !images[0].data.empty()) {
+      return Fail(filename + ": metadata-only load from memory failed");
+    }
+  }
+  return true;
+}
+
+static bool SelectThirdImage(const tinydng::DNGImage& image, size_t index,
+                             void* user_data) {
+  (void)image;
+  (void)user_data;
+  return index == 2;
+}
+
+//
+// Only the selected images are decoded. Other images have metadata only.
+//
+static bool TestImageSelection(const std::string& dir) {
+  const std::string filename = dir + "/multi_ifd.tif";
+  const char* expected[] = {"multi_ifd", "multi_ifd_1", "multi_ifd_2"};
+
+  struct Selection {
+    tinydng::ImageSelection selection;
+    int decoded;  // Index of the decoded image. -1 = all.
+  };
+  const Selection selections[] = {
+      {tinydng::IMAGE_SELECTION_ALL, -1},
+      {tinydng::IMAGE_SELECTION_INDEX, 1},
+      {tinydng::IMAGE_SELECTION_NEW_SUBFILE_TYPE, 1},
+      {tinydng::IMAGE_SELECTION_LARGEST, 0},
+      {tinydng::IMAGE_SELECTION_PREDICATE, 2}};
+
+  for (size_t i = 0; i < sizeof(selections) / sizeof(selections[0]); i++) {
+    tinydng::LoadOptions options;
+    options.image_selection = selections[i].selection;
+    options.select_index = 1;
+    options.select_new_subfile_type = 1;
+    options.select_predicate = SelectThirdImage;
+
+    std::string err;
+    std::vector<tinydng::DNGImage> images;
+    if (!Load(filename, options, &images, &err) || (images.size() != 3)) {
+      return Fail("multi_ifd.tif: failed to load: " + err);
+    }
+    for (int k = 0; k < 3; k++) {
+      if ((selections[i].decoded < 0) || (selections[i].decoded == k)) {
+        if (!CheckExpected(dir, expected[k], images[size_t(k)].data)) {
+          return false;
+        }
+      } else if (!images[size_t(k)].data.empty()) {
+        return Fail("multi_ifd.tif: an image which is not selected is decoded");
+      }
+    }
+  }
+  return true;
+}
+
+//
+// parallel_for calls the function exactly once for each index, also when it
+// is nested.
+//
+static bool TestThreadPool(const std::string& dir) {
+  (void)dir;
+  tinydng::ThreadPool pool(4);
+  if (pool.num_threads() != 4) {
+    return Fail("unexpected number of threads");
+  }
+
+  const size_t sizes[] = {0, 1, 7, 1000};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    std::vector<int> counts(sizes[i], 0);
+    pool.parallel_for(sizes[i], [&counts](size_t begin, size_t end) {
+      for (size_t k = begin; k < end; k++) {
+        counts[k]++;
+      }
+    });
+    for (size_t k = 0; k < counts.size(); k++) {
+      if (counts[k] != 1) {
+        return Fail("parallel_for: an index is not called exactly once");
+      }
+    }
+  }
+
+  std::atomic<size_t> total(0);
+  pool.parallel_for(8, [&pool, &total](size_t begin, size_t end) {
+    for (size_t k = begin; k < end; k++) {
+      pool.parallel_for(100, [&total](size_t b, size_t e) { total += e - b; });
+    }
+  });
+  if (total != 800) {
+    return Fail("nested parallel_for: unexpected number of calls");
+  }
+
+  return true;
+}
+
+//
+// Decoding with a single thread and with multiple threads gives the same
+// pixels.
+//
+static bool TestParallelDecode(const std::string& dir) {
+  tinydng::ThreadPool serial(1);
+  tinydng::ThreadPool parallel(4);
+  const char* names[] = {"lj92_strip", "lj92_tiles", "zip_tiles", "zip_strip",
+                         "strips_u16", "multi_ifd"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const std::string filename = dir + "/" + names[i] + ".tif";
+    std::vector<tinydng::DNGImage> images[2];
+    for (int k = 0; k < 2; k++) {
+      tinydng::LoadOptions options;
+      options.thread_pool = k ? &parallel : &serial;
+      std::string err;
+      if (!Load(filename, options, &images[k], &err)) {
+        return Fail(filename + ": failed to load: " + err);
+      }
+    }
+    if (images[0].size() != images[1].size()) {
+      return Fail(filename + ": image count mismatch");
+    }
+    for (size_t k = 0; k < images[0].size(); k++) {
+      if (!CheckData(filename, images[1][k].data, images[0][k].data)) {
+        return false;
+      }
+    }
+    if (!CheckExpected(dir, names[i], images[1][0].data)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//
+// A decoder context reaches a steady state where repeated loads allocate no
+// scratch memory.
+//
+static bool TestDecoderContext(const std::string& dir) {
+  // A single thread, so that loads check out the same scratch memory.
+  tinydng::DecoderContext context;
+  tinydng::ThreadPool pool(1);
+  tinydng::LoadOptions options;
+  options.decoder_context = &context;
+  options.thread_pool = &pool;
+
+  const char* names[] = {"lj92_strip", "lj92_tiles", "zip_tiles"};
+  for (int pass = 0; pass < 3; pass++) {
+    context.reset_stats();
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      std::string err;
+      std::vector<tinydng::DNGImage> images;
+      if (!Load(dir + "/" + names[i] + ".tif", options, &images, &err) ||
+          images.empty()) {
+        return Fail(std::string(names[i]) + ": failed to load: " + err);
+      }
+      if (!CheckExpected(dir, names[i], images[0].data)) {
+        return false;
+      }
+    }
+    const tinydng::DecoderContext::Stats stats = context.stats();
+    if (stats.num_acquires == 0) {
+      return Fail("scratch memory of the context is not used");
+    }
+    if ((pass > 0) && (stats.num_allocations != 0)) {
+      return Fail("repeated loads allocate scratch memory");
+    }
+  }
+  return true;
+}
+
+//
+// Lossless JPEG of each predictor and component count.
+//
+static bool TestLJ92Predictors(const std::string& dir) {
+  for (int predictor = 1; predictor <= 7; predictor++) {
+    for (int comps = 1; comps <= 4; comps++) {
+      char name[32];
+      snprintf(name, sizeof(name), "lj92_p%d_c%d", predictor, comps);
+      if (!LoadAndCheck(dir, name)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+//
+// DecodeRegion gives the rectangle of a full decode, and rejects empty and
+// out of range rectangles.
+//
+static bool TestDecodeRegion(const std::string& dir) {
+  const char* names[] = {"lj92_tiles", "zip_tiles", "strips_u16",
+                         "lzw_strips"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const std::string filename = dir + "/" + names[i] + ".tif";
+    std::string err;
+    std::vector<tinydng::DNGImage> images;
+    if (!Load(filename, &images, &err) || images.empty()) {
+      return Fail(filename + ": failed to load: " + err);
+    }
+    const tinydng::DNGImage& image = images[0];
+    const int w = image.width;
+    const int h = image.height;
+
+    std::vector<unsigned char> mem;
+    if (!ReadFile(filename, &mem)) {
+      return Fail("cannot read " + filename);
+    }
+
+    // Whole image, rectangles crossing tile/strip edges(tiles are 32x16 and
+    // strips are 8 rows), a pixel at the bottom right and a column.
+    const int rects[][4] = {{0, 0, w, h},            {29, 13, 10, 6},
+                            {30, 6, w - 30, h - 6},  {w - 1, h - 1, 1, 1},
+                            {5, 3, 1, h - 3}};
+    for (size_t k = 0; k < sizeof(rects) / sizeof(rects[0]); k++) {
+      const int* r = rects[k];
+      std::vector<unsigned char> out, out_mem;
+      if (!tinydng::DecodeRegion(filename.c_str(), image, r[0], r[1], r[2],
+                                 r[3], &out, &err) ||
+          !tinydng::DecodeRegionFromMemory(
+              reinterpret_cast<const char*>(&mem[0]), mem.size(), image, r[0],
+              r[1], r[2], r[3], &out_mem, &err)) {
+        return Fail(filename + ": DecodeRegion failed: " + err);
+      }
+      const std::vector<unsigned char> expected =
+          Crop(image, r[0], r[1], r[2], r[3]);
+      if (!CheckData(filename, out, expected) ||
+          !CheckData(filename, out_mem, expected)) {
+        return false;
+      }
+    }
+
+    const int rejected[][4] = {{0, 0, 0, 1},     {0, 0, 1, 0},
+                               {-1, 0, 2, 2},    {0, -1, 2, 2},
+                               {w - 1, 0, 2, 1}, {0, h - 1, 1, 2}};
+    for (size_t k = 0; k < sizeof(rejected) / sizeof(rejected[0]); k++) {
+      const int* r = rejected[k];
+      std::vector<unsigned char> out;
+      err.clear();
+      if (tinydng::DecodeRegion(filename.c_str(), image, r[0], r[1], r[2],
+                                r[3], &out, &err) ||
+          err.empty()) {
+        return Fail(filename + ": an invalid rectangle is accepted");
+      }
+    }
+  }
+  return true;
+}
+
+//
+// TiledImageReader tiles match the full decode. Tiles are cached and the
+// least recently used tile is evicted when the cache exceeds its budget.
+//
+static bool TestTiledImageReader(const std::string& dir) {
+  const std::string filename = dir + "/lj92_tiles.tif";
+  std::string warn, err;
+  std::vector<tinydng::DNGImage> images;
+  if (!Load(filename, &images, &err)) {
+    return Fail(filename + ": failed to load: " + err);
+  }
+
+  // Two full tiles(32x16 16-bit samples).
+  tinydng::TiledImageReader::Options options;
+  options.cache_budget = 2 * 32 * 16 * 2;
+  tinydng::TiledImageReader reader;
+  if (!reader.open(filename.c_str(), options, &warn, &err)) {
+    return Fail(filename + ": failed to open: " + err);
+  }
+  int tw = 0, th = 0, across = 0, down = 0;
+  if (!reader.tile_layout(0, &tw, &th, &across, &down) || (tw != 32) ||
+      (th != 16) || (across != 3) || (down != 3)) {
+    return Fail("unexpected tile layout");
+  }
+
+  // (2, 0) is a partial tile. It evicts (1, 0), then (1, 0) evicts (2, 0).
+  const int order[][2] = {{0, 0}, {1, 0}, {0, 0}, {2, 0}, {0, 0}, {1, 0}};
+  for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+    std::shared_ptr<const tinydng::TiledImageReader::Tile> tile =
+        reader.tile(0, order[i][0], order[i][1], &err);
+    if (!tile) {
+      return Fail("failed to read a tile: " + err);
+    }
+    if ((tile->x != order[i][0] * tw) || (tile->y != order[i][1] * th) ||
+        !CheckData("tile", tile->data,
+                   Crop(images[0], tile->x, tile->y, tile->width,
+                        tile->height))) {
+      return false;
+    }
+  }
+  const tinydng::TiledImageReader::Stats stats = reader.stats();
+  if ((stats.hits != 2) || (stats.misses != 4) || (stats.evictions != 2) ||
+      (stats.cached_tiles != 2)) {
+    return Fail("unexpected cache statistics");
+  }
+
+  // Every tile, and a region through the cache.
+  for (int ty = 0; ty < down; ty++) {
+    for (int tx = 0; tx < across; tx++) {
+      std::shared_ptr<const tinydng::TiledImageReader::Tile> tile =
+          reader.tile(0, tx, ty, &err);
+      if (!tile || !CheckData("tile", tile->data,
+                              Crop(images[0], tile->x, tile->y, tile->width,
+                                   tile->height))) {
+        return Fail("tile mismatch: " + err);
+      }
+    }
+  }
+  std::vector<unsigned char> region;
+  if (!reader.read_region(0, 20, 10, 40, 25, &region, &err) ||
+      !CheckData("region", region, Crop(images[0], 20, 10, 40, 25))) {
+    return Fail("read_region failed: " + err);
+  }
+
+  // Images which are not tiled are split into virtual tiles of full width.
+  // LZW strips are decoded as a whole, so virtual tiles are whole strips.
+  const char* strips[] = {"strips_u16", "lzw_strips"};
+  const int tile_heights[] = {5, 8};
+  for (size_t i = 0; i < 2; i++) {
+    const std::string name = dir + "/" + strips[i] + ".tif";
+    images.clear();
+    if (!Load(name, &images, &err)) {
+      return Fail(name + ": failed to load: " + err);
+    }
+    tinydng::TiledImageReader::Options strip_options;
+    strip_options.virtual_tile_size = 5;
+    tinydng::TiledImageReader strip_reader;
+    if (!strip_reader.open(name.c_str(), strip_options, &warn, &err) ||
+        !strip_reader.tile_layout(0, &tw, &th, &across, &down)) {
+      return Fail(name + ": failed to open: " + err);
+    }
+    if ((tw != images[0].width) || (th != tile_heights[i]) || (across != 1) ||
+        (down != (images[0].height + th - 1) / th)) {
+      return Fail(name + ": unexpected virtual tile layout");
+    }
+    for (int ty = 0; ty < down; ty++) {
+      std::shared_ptr<const tinydng::TiledImageReader::Tile> tile =
+          strip_reader.tile(0, 0, ty, &err);
+      if (!tile || !CheckData(name, tile->data,
+                              Crop(images[0], tile->x, tile->y, tile->width,
+                                   tile->height))) {
+        return Fail(name + ": virtual tile mismatch: " + err);
+      }
+    }
+  }
+
+  return true;
+}
+
+//
+// Tiles decoded concurrently from one file match the full decode.
+//
+static bool TestConcurrentTiles(const std::string& dir) {
+  tinydng::ThreadPool pool(4);
+  const char* names[] = {"lj92_tiles", "zip_tiles"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const std::string filename = dir + "/" + names[i] + ".tif";
+    std::string warn, err;
+    std::vector<tinydng::DNGImage> images;
+    if (!Load(filename, &images, &err)) {
+      return Fail(filename + ": failed to load: " + err);
+    }
+
+    // No cache, so that each call decodes.
+    tinydng::TiledImageReader::Options options;
+    options.cache_budget = 0;
+    options.thread_pool = &pool;
+    tinydng::TiledImageReader reader;
+    if (!reader.open(filename.c_str(), options, &warn, &err)) {
+      return Fail(filename + ": failed to open: " + err);
+    }
+
+    const tinydng::DNGImage& image = images[0];
+    std::atomic<int> failures(0);
+    pool.parallel_for(9 * 8, [&](size_t begin, size_t end) {
+      for (size_t k = begin; k < end; k++) {
+        std::string tile_err;
+        std::shared_ptr<const tinydng::TiledImageReader::Tile> tile =
+            reader.tile(0, int(k % 3), int(k / 3 % 3), &tile_err);
+        if (!tile || (tile->data != Crop(image, tile->x, tile->y, tile->width,
+                                         tile->height))) {
+          failures++;
+        }
+      }
+    });
+    if (failures != 0) {
+      return Fail(filename + ": concurrently decoded tiles mismatch");
+    }
+  }
+  return true;
+}
+
+//
+// ByteSource over a memory, which may pretend to be shorter and fails reads
+// after a number of bytes. Reads past the end are recorded.
+//
+class TestByteSource : public tinydng::ByteSource {
+ public:
+  TestByteSource(const std::vector<unsigned char>& mem, size_t size)
+      : mem_(mem),
+        size_(size),
+        fail_after_(size_t(-1)),
+        read_bytes_(0),
+        read_past_end_(false) {}
+
+  uint64_t size() const { return size_; }
+
+  bool read_at(uint64_t offset, size_t len, unsigned char* dst) {
+    if ((offset > size_) || (len > size_ - offset)) {
+      read_past_end_ = true;
+      return false;
+    }
+    read_bytes_ += len;
+    if (read_bytes_ > fail_after_) {
+      return false;
+    }
+    memcpy(dst, &mem_[size_t(offset)], len);
+    return true;
+  }
+
+  void fail_after(size_t bytes) { fail_after_ = bytes; }
+  size_t read_bytes() const { return read_bytes_; }
+  bool read_past_end() const { return read_past_end_; }
+
+ private:
+  const std::vector<unsigned char>& mem_;
+  size_t size_;
+  size_t fail_after_;
+  std::atomic<size_t> read_bytes_;
+  bool read_past_end_;
+};
+
+static bool LoadFromSource(tinydng::ByteSource* source, bool metadata_only,
+                           std::vector<tinydng::DNGImage>* images,
+                           std::string* err) {
+  tinydng::LoadOptions options;
+  options.metadata_only = metadata_only;
+  std::string warn;
+  std::vector<tinydng::FieldInfo> custom_fields;
+  return tinydng::LoadDNGFromSource(source, options, custom_fields, images,
+                                    &warn, err);
+}
+
+//
+// Loading through a ByteSource gives the same images as LoadDNG. Sources which
+// are truncated or fail reads are handled without reading past the end.
+//
+static bool TestByteSourceLoad(const std::string& dir) {
+  // Non-tiled lossless JPEG and ZIP are not supported by region decoding.
+  const char* names[] = {"source_strips", "strips_u16", "lj92_tiles",
+                         "zip_tiles",     "lzw_strips", "multi_ifd",
+                         "lj92_strip"};
+  const size_t num_region_tests = 6;
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const std::string filename = dir + "/" + names[i] + ".tif";
+    std::string err;
+    std::vector<tinydng::DNGImage> expected;
+    std::vector<unsigned char> mem;
+    if (!Load(filename, &expected, &err) || !ReadFile(filename, &mem)) {
+      return Fail(filename + ": failed to load: " + err);
+    }
+
+    TestByteSource source(mem, mem.size());
+    std::vector<tinydng::DNGImage> images;
+    if (!LoadFromSource(&source, false, &images, &err) ||
+        (images.size() != expected.size())) {
+      return Fail(filename + ": failed to load from a source: " + err);
+    }
+    for (size_t k = 0; k < images.size(); k++) {
+      if (!CheckData(filename, images[k].data, expected[k].data)) {
+        return false;
+      }
+    }
+
+    // Metadata only.
+    TestByteSource info_source(mem, mem.size());
+    images.clear();
+    if (!LoadFromSource(&info_source, true, &images, &err) ||
+        (images.size() != expected.size())) {
+      return Fail(filename + ": failed to load metadata: " + err);
+    }
+    for (size_t k = 0; k < images.size(); k++) {
+      if (!images[k].data.empty() || (images[k].width != expected[k].width) ||
+          (images[k].height != expected[k].height)) {
+        return Fail(filename + ": unexpected metadata-only image");
+      }
+    }
+
+    // A rectangle.
+    std::vector<unsigned char> region;
+    TestByteSource region_source(mem, mem.size());
+    if ((i < num_region_tests) &&
+        (!tinydng::DecodeRegionFromSource(&region_source,
+                                          tinydng::LoadOptions(), expected[0],
+                                          3, 2, 20, 12, &region, &err) ||
+         !CheckData(filename, region, Crop(expected[0], 3, 2, 20, 12)))) {
+      return Fail(filename + ": DecodeRegionFromSource failed: " + err);
+    }
+
+    // Data which ends early loads as from memory of the same size.
+    for (size_t cut = 1; cut <= 3; cut++) {
+      const size_t size = mem.size() - cut * mem.size() / 4;
+      TestByteSource short_source(mem, size);
+      std::vector<tinydng::DNGImage> from_source, from_memory;
+      std::string source_err, memory_err, warn;
+      std::vector<tinydng::FieldInfo> custom_fields;
+      const bool source_ret =
+          LoadFromSource(&short_source, false, &from_source, &source_err);
+      const bool memory_ret = tinydng::LoadDNGFromMemory(
+          reinterpret_cast<const char*>(&mem[0]), size, tinydng::LoadOptions(),
+          custom_fields, &from_memory, &warn, &memory_err);
+      if ((source_ret != memory_ret) ||
+          (from_source.size() != from_memory.size())) {
+        return Fail(filename + ": truncated source and memory differ");
+      }
+      for (size_t k = 0; k < from_source.size(); k++) {
+        if (!CheckData(filename, from_source[k].data, from_memory[k].data)) {
+          return false;
+        }
+      }
+      if (short_source.read_past_end()) {
+        return Fail(filename + ": read past the end of the source");
+      }
+    }
+    if (source.read_past_end() || info_source.read_past_end() ||
+        region_source.read_past_end()) {
+      return Fail(filename + ": read past the end of the source");
+    }
+  }
+
+  // `source_strips` spans several blocks of the source reader: loading the
+  // metadata does not fetch the pixel data, and a read which fails after it
+  // is reported.
+  const std::string filename = dir + "/source_strips.tif";
+  std::vector<unsigned char> mem;
+  if (!ReadFile(filename, &mem)) {
+    return Fail(filename + ": not found");
+  }
+  TestByteSource info_source(mem, mem.size());
+  std::vector<tinydng::DNGImage> images;
+  std::string err;
+  if (!LoadFromSource(&info_source, true, &images, &err) ||
+      (info_source.read_bytes() >= mem.size())) {
+    return Fail(filename + ": metadata-only load fetched the whole file");
+  }
+  TestByteSource failing(mem, mem.size());
+  failing.fail_after(info_source.read_bytes());
+  images.clear();
+  err.clear();
+  if (LoadFromSource(&failing, false, &images, &err) || err.empty()) {
+    return Fail(filename + ": a failed read is not reported");
+  }
+  if (failing.read_past_end()) {
+    return Fail(filename + ": read past the end of the source");
+  }
+  return true;
+}
+
+struct ImageBufferTest {
+  size_t offset;  // Bytes from an aligned address.
+  size_t padding;  // Bytes appended to each row.
+  std::vector<unsigned char> memory;
+};
+
+static bool SupplyImageBuffer(const tinydng::DNGImage& image, size_t index,
+                              size_t byte_size, tinydng::ImageBuffer* buffer,
+                              void* user_data) {
+  (void)index;
+  (void)byte_size;
+  ImageBufferTest* test = static_cast<ImageBufferTest*>(user_data);
+  const size_t row_bytes = size_t(image.width) *
+                           size_t(image.samples_per_pixel) *
+                           size_t(image.bits_per_sample) / 8;
+  buffer->row_stride = test->padding ? row_bytes + test->padding : 0;
+  test->memory.assign(
+      test->offset + (row_bytes + test->padding) * size_t(image.height), 0xCD);
+  buffer->data = &test->memory[test->offset];
+  return true;
+}
+
+// Loads `filename` into a caller-provided buffer and compares the rows with
+// `expected`. Padding bytes must be untouched.
+static bool CheckImageBuffer(const std::string& filename, size_t offset,
+                             size_t padding,
+                             const std::vector<unsigned char>& expected) {
+  ImageBufferTest test;
+  test.offset = offset;
+  test.padding = padding;
+  tinydng::LoadOptions options;
+  options.image_buffer_callback = SupplyImageBuffer;
+  options.image_buffer_user_data = &test;
+
+  std::string err;
+  std::vector<tinydng::DNGImage> images;
+  if (!Load(filename, options, &images, &err) || images.empty()) {
+    return Fail(filename + ": failed to load into a buffer: " + err);
+  }
+  const tinydng::DNGImage& image = images[0];
+  if (!image.data.empty() || (image.external_data != &test.memory[offset])) {
+    return Fail(filename + ": pixels are not decoded into the buffer");
+  }
+
+  const size_t row_bytes = expected.size() / size_t(image.height);
+  for (int y = 0; y < image.height; y++) {
+    const unsigned char* row =
+        &test.memory[offset + size_t(y) * (row_bytes + padding)];
+    if (!CheckData(filename, row, row_bytes,
+                   std::vector<unsigned char>(
+                       expected.begin() + std::ptrdiff_t(size_t(y) * row_bytes),
+                       expected.begin() +
+                           std::ptrdiff_t(size_t(y + 1) * row_bytes)))) {
+      return false;
+    }
+    for (size_t k = 0; k < padding; k++) {
+      if (row[row_bytes + k] != 0xCD) {
+        return Fail(filename + ": row padding is overwritten");
+      }
+    }
+  }
+  return true;
+}
+
+//
+// Pixels are decoded into caller-provided buffers with padded rows, and into
+// buffers of 24-bit samples at any address.
+//
+static bool TestImageBuffer(const std::string& dir) {
+  const char* names[] = {"strips_u16", "lj92_strip", "lj92_tiles",
+                         "zip_tiles",  "zip_strip",  "lzw_strips"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const std::string filename = dir + "/" + names[i] + ".tif";
+    std::vector<unsigned char> expected;
+    if (!ReadFile(dir + "/" + names[i] + ".raw", &expected)) {
+      return Fail(filename + ": expected output not found");
+    }
+    if (!CheckImageBuffer(filename, 0, 0, expected) ||
+        !CheckImageBuffer(filename, 0, 6, expected)) {
+      return false;
+    }
+  }
+
+  std::vector<unsigned char> expected;
+  if (!ReadFile(dir + "/strips_u24.raw", &expected)) {
+    return Fail("strips_u24: expected output not found");
+  }
+  return CheckImageBuffer(dir + "/strips_u24.tif", 1, 0, expected) &&
+         CheckImageBuffer(dir + "/strips_u24.tif", 1, 3, expected);
+}
+
+//
+// A lossless JPEG DNG written by tiny_dng_writer, which stores two image rows
+// in a JPEG row, loads to the written pixels.
+//
+static bool TestWriterLJ92(const std::string& dir) {
+  (void)dir;
+  const unsigned int w = 64, h = 32;
+  std::vector<unsigned short> pixels(w * h);
+  for (size_t i = 0; i < pixels.size(); i++) {
+    pixels[i] = static_cast<unsigned short>((i * 37 + (i / w) * 11) & 0xFFF);
+  }
+
+  tinydngwriter::DNGImage dng;
+  dng.SetBigEndian(false);
+  dng.SetSubfileType(false, false, false);
+  dng.SetImageWidth(w);
+  dng.SetImageLength(h);
+  dng.SetRowsPerStrip(h);
+  dng.SetSamplesPerPixel(1);
+  const unsigned short bps = 16;
+  dng.SetBitsPerSample(1, &bps);
+  dng.SetPlanarConfig(tinydngwriter::PLANARCONFIG_CONTIG);
+  dng.SetCompression(tinydngwriter::COMPRESSION_NEW_JPEG);
+  dng.SetPhotometric(tinydngwriter::PHOTOMETRIC_CFA);
+  if (!dng.SetImageDataJpeg(&pixels[0], w, h, 12)) {
+    return Fail("failed to encode lossless JPEG");
+  }
+
+  const std::string filename = "writer_lj92.dng";
+  tinydngwriter::DNGWriter writer(false);
+  writer.AddImage(&dng);
+  std::string err;
+  if (!writer.WriteToFile(filename.c_str(), &err)) {
+    return Fail("failed to write " + filename + ": " + err);
+  }
+
+  std::vector<unsigned char> expected(pixels.size() * 2);
+  for (size_t i = 0; i < pixels.size(); i++) {
+    memcpy(&expected[i * 2], &pixels[i], 2);
+  }
+
+  std::vector<tinydng::DNGImage> images;
+  const bool ok = Load(filename, &images, &err) && !images.empty() &&
+                  CheckData(filename, images[0].data, expected) &&
+                  CheckImageBuffer(filename, 0, 4, expected);
+  std::remove(filename.c_str());
+  if (!ok) {
+    return Fail(filename + ": failed to load: " + err);
+  }
+  return true;
+}
+
+//
+// A decoder context allocating from an arena keeps working after the arena is
+// reset between files.
+//
+static bool TestArena(const std::string& dir) {
+  tinydng::ArenaAllocator arena(4096);
+  tinydng::DecoderContext context(&arena);
+  tinydng::LoadOptions options;
+  options.allocator = &arena;
+  options.decoder_context = &context;
+
+  const char* names[] = {"lj92_tiles", "zip_tiles", "lj92_tiles",
+                         "lj92_strip"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    context.reset_stats();
+    std::string err;
+    std::vector<tinydng::DNGImage> images;
+    if (!Load(dir + "/" + names[i] + ".tif", options, &images, &err) ||
+        images.empty()) {
+      return Fail(std::string(names[i]) + ": failed to load: " + err);
+    }
+    if (!CheckExpected(dir, names[i], images[0].data)) {
+      return false;
+    }
+    if ((arena.stats().used_bytes == 0) ||
+        (context.stats().num_allocations == 0)) {
+      return Fail("scratch memory is not allocated from the arena");
+    }
+    arena.reset();
+  }
+  return true;
+}
+
+struct BatchResults {
+  std::vector<tinydng::DNGBatchResult> results;
+  size_t num_calls;
+};
+
+static bool CollectBatchResult(tinydng::DNGBatchResult* result,
+                               void* user_data) {
+  BatchResults* batch = static_cast<BatchResults*>(user_data);
+  batch->results[result->index] = *result;
+  batch->num_calls++;
+  return true;
+}
+
+//
+// A batch of good and broken files gives the same result for each file as
+// LoadDNG.
+//
+static bool TestBatch(const std::string& dir) {
+  const char* names[] = {"strips_u16", "lj92_tiles",  "tile_missing",
+                         "zip_tiles",  "missing",     "lj92_strip",
+                         "empty",      "lzw_strips",  "multi_ifd",
+                         "zip_strip",  "zip_too_large"};
+  const size_t num_files = sizeof(names) / sizeof(names[0]);
+  std::vector<std::string> filenames;
+  for (size_t i = 0; i < num_files; i++) {
+    filenames.push_back(dir + "/" + names[i] + ".tif");
+  }
+
+  // With enough threads for a decoder per file, with a single decoder, and
+  // with a memory limit smaller than the files.
+  const int num_threads[] = {4, 2, 1};
+  const size_t limits[] = {0, 0, 1024};
+  for (size_t t = 0; t < 3; t++) {
+    tinydng::ThreadPool pool(num_threads[t]);
+    tinydng::LoadOptions options;
+    options.thread_pool = &pool;
+
+    BatchResults batch;
+    batch.results.resize(num_files);
+    batch.num_calls = 0;
+    std::string err;
+    std::vector<tinydng::FieldInfo> custom_fields;
+    if (!tinydng::LoadDNGBatch(filenames, options, custom_fields, limits[t],
+                               CollectBatchResult, &batch, &err) ||
+        (batch.num_calls != num_files)) {
+      return Fail("LoadDNGBatch failed: " + err);
+    }
+
+    for (size_t i = 0; i < num_files; i++) {
+      const tinydng::DNGBatchResult& result = batch.results[i];
+      std::string load_err;
+      std::vector<tinydng::DNGImage> images;
+      const bool ret = Load(filenames[i], &images, &load_err);
+      if ((result.index != i) || (result.filename != filenames[i]) ||
+          (result.ok != ret) || (result.err.empty() != load_err.empty()) ||
+          (result.images.size() != images.size())) {
+        return Fail(filenames[i] + ": batch result differs from LoadDNG");
+      }
+      for (size_t k = 0; k < images.size(); k++) {
+        if (!CheckData(filenames[i], result.images[k].data, images[k].data)) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+//
+// Packed 10/12/14-bit samples are unpacked to 16 bits or floats.
+//
+static bool TestUnpackSamples(const std::string& dir) {
+  const char* names[] = {"packed10_w37_le", "packed12_w33_be",
+                         "packed14_w31_le", "packed12_w35_le_lsb"};
+  const int bits[] = {10, 12, 14, 12};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const std::string filename = dir + "/" + names[i] + ".tif";
+    std::vector<unsigned char> expected;
+    if (!ReadExpectedHostOrder(dir, names[i], 2, &expected)) {
+      return Fail(filename + ": expected output not found");
+    }
+
+    tinydng::LoadOptions options;
+    options.unpack_samples = tinydng::SAMPLE_UNPACKING_UINT16;
+    if (strstr(names[i], "_lsb")) {
+      options.packed_bit_order = tinydng::BIT_ORDER_LSB_FIRST;
+    }
+    std::string err;
+    std::vector<tinydng::DNGImage> images;
+    if (!Load(filename, options, &images, &err) || images.empty()) {
+      return Fail(filename + ": failed to load: " + err);
+    }
+    if ((images[0].bits_per_sample != 16) ||
+        (images[0].bits_per_sample_original != bits[i]) ||
+        !CheckData(filename, images[0].data, expected)) {
+      return Fail(filename + ": unexpected 16-bit samples");
+    }
+
+    options.unpack_samples = tinydng::SAMPLE_UNPACKING_FLOAT;
+    images.clear();
+    if (!Load(filename, options, &images, &err) || images.empty()) {
+      return Fail(filename + ": failed to load: " + err);
+    }
+    if ((images[0].bits_per_sample != 32) ||
+        (images[0].sample_format != tinydng::SAMPLEFORMAT_IEEEFP) ||
+        (images[0].data.size() != expected.size() * 2)) {
+      return Fail(filename + ": unexpected float samples");
+    }
+    for (size_t k = 0; k < expected.size() / 2; k++) {
+      unsigned short value;
+      float f;
+      memcpy(&value, &expected[k * 2], 2);
+      memcpy(&f, &images[0].data[k * 4], 4);
+      if (f != float(value)) {
+        return Fail(filename + ": float sample mismatch");
+      }
+    }
+  }
+  return true;
+}
+
+//
+// 16/32/64-bit samples are delivered in host byte order, also by region
+// decoding and TiledImageReader.
+//
+static bool TestHostByteOrder(const std::string& dir) {
+  const char* names[] = {"order_raw16_le", "order_raw16_be", "order_raw32_le",
+                         "order_raw32_be", "order_raw64_le", "order_raw64_be",
+                         "order_lzw16_le", "order_lzw16_be", "order_zip16_le",
+                         "order_zip16_be"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    const std::string filename = dir + "/" + names[i] + ".tif";
+    tinydng::LoadOptions options;
+    options.host_byte_order = true;
+    std::string warn, err;
+    std::vector<tinydng::DNGImage> images;
+    if (!Load(filename, options, &images, &err) || images.empty()) {
+      return Fail(filename + ": failed to load: " + err);
+    }
+    const tinydng::DNGImage& image = images[0];
+    std::vector<unsigned char> expected;
+    if (!ReadExpectedHostOrder(dir, names[i],
+                               size_t(image.bits_per_sample / 8), &expected)) {
+      return Fail(filename + ": expected output not found");
+    }
+    if (!CheckData(filename, image.data, expected)) {
+      return false;
+    }
+
+    std::vector<unsigned char> region;
+    if (!tinydng::DecodeRegion(filename.c_str(), options, image, 7, 5, 20, 13,
+                               &region, &err) ||
+        !CheckData(filename, region, Crop(image, 7, 5, 20, 13))) {
+      return Fail(filename + ": region is not in host byte order: " + err);
+    }
+
+    tinydng::TiledImageReader::Options reader_options;
+    reader_options.host_byte_order = true;
+    tinydng::TiledImageReader reader;
+    if (!reader.open(filename.c_str(), reader_options, &warn, &err) ||
+        !reader.read_region(0, 7, 5, 20, 13, &region, &err) ||
+        !CheckData(filename, region, Crop(image, 7, 5, 20, 13))) {
+      return Fail(filename + ": tiles are not in host byte order: " + err);
+    }
+  }
+  return true;
+}
+
+typedef bool (*TestFunction)(const std::string& dir);
+
+struct FunctionTest {
+  const char* name;
+  TestFunction func;
+};
+
+static const FunctionTest kFunctionTests[] = {
+    {"mapped_file", TestMappedFile},
+    {"sniff", TestSniff},
+    {"metadata_only", TestMetadataOnly},
+    {"image_selection", TestImageSelection},
+    {"thread_pool", TestThreadPool},
+    {"parallel_decode", TestParallelDecode},
+    {"decoder_context", TestDecoderContext},
+    {"lj92_predictors", TestLJ92Predictors},
+    {"decode_region", TestDecodeRegion},
+    {"tiled_image_reader", TestTiledImageReader},
+    {"concurrent_tiles", TestConcurrentTiles},
+    {"byte_source", TestByteSourceLoad},
+    {"image_buffer", TestImageBuffer},
+    {"writer_lj92", TestWriterLJ92},
+    {"arena", TestArena},
+    {"batch", TestBatch},
+    {"unpack_samples", TestUnpackSamples},
+    {"host_byte_order", TestHostByteOrder},
+};
+
+int main(int argc, char** argv) {
+  std::string dir = "data";
+  if (argc > 1) {
+    dir = argv[1];
+  }
+
+  const size_t num_cases = sizeof(kTestCases) / sizeof(kTestCases[0]);
+  const size_t num_functions =
+      sizeof(kFunctionTests) / sizeof(kFunctionTests[0]);
+  size_t num_failed = 0;
+  for (size_t i = 0; i < num_cases; i++) {
+    const bool ok = RunTest(dir, kTestCases[i]);
+    std::cout << (ok ? "PASS " : "FAIL ") << kTestCases[i].name << "\n";
+    if (!ok) {
+      num_failed++;
+    }
+  }
+  for (size_t i = 0; i < num_functions; i++) {
+    const bool ok = kFunctionTests[i].func(dir);
+    std::cout << (ok ? "PASS " : "FAIL ") << kFunctionTests[i].name << "\n";
+    if (!ok) {
+      num_failed++;
+    }
+  }
+
+  const size_t num_tests = num_cases + num_functions;
+  std::cout << (num_tests - num_failed) << "/" << num_tests << " passed\n";
+
+  return (num_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -32,6 +32,9 @@ THE SOFTWARE.
 // https://www.adobe.com/content/dam/Adobe/en/products/photoshop/pdfs/dng_spec_1.4.0.0.pdf
 // }
 
+#include <cstddef>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -184,8 +187,8 @@ struct DNGImage {
 
   int tile_width;
   int tile_length;
-  unsigned int tile_offset;
-  unsigned int tile_byte_count;  // (compressed) size
+  uint64_t tile_offset;      // Offset to the first tile.
+  uint64_t tile_byte_count;  // (compressed) size of the first tile.
 
   int pad0;
   double analog_balance[3];
@@ -213,7 +216,9 @@ struct DNGImage {
   int width;
   int height;
   int compression;
-  unsigned int offset;
+  uint64_t offset;
+  unsigned int new_subfile_type;  // tag 254. 0 = main image, bit 0 set =
+                                  // reduced-resolution(preview) image.
   short orientation;
   short _pad0;
   int strip_byte_count;
@@ -226,8 +231,14 @@ struct DNGImage {
 
   // For an image with multiple strips.
   int strips_per_image;
-  std::vector<unsigned int> strip_byte_counts;
-  std::vector<unsigned int> strip_offsets;
+  std::vector<uint64_t> strip_byte_counts;
+  std::vector<uint64_t> strip_offsets;
+
+  // For a tiled image. One entry per tile in TileOffsets order(left to right,
+  // top to bottom, then plane by plane when planar_configuration == 2).
+  // Offsets and byte counts are validated against the file size.
+  std::vector<uint64_t> tile_offsets;
+  std::vector<uint64_t> tile_byte_counts;  // (compressed) size
 
   // CR2(Canon RAW) specific
   unsigned short cr2_slices[3];
@@ -241,13 +252,341 @@ struct DNGImage {
   std::vector<GainMap> opcodelist2_gainmap;
   std::vector<GainMap> opcodelist3_gainmap;
 
+  // Location of the stored(possibly compressed) image data in the file.
+  // `data_offset` points to the first strip/tile and `data_byte_count` is the
+  // total byte count of all strips/tiles(0 if unknown).
+  // Filled for both decoding and metadata-only loading.
+  uint64_t data_offset;
+  uint64_t data_byte_count;
+
   std::vector<unsigned char>
       data;  // Decoded pixel data(len = spp * width * height * bps / 8)
+             // Empty when loaded with `LoadOptions::metadata_only`.
+
+  // Decoded pixel data in the buffer supplied by
+  // `LoadOptions::image_buffer_callback`. `data` is empty in this case.
+  // NULL when pixels are stored to `data`.
+  unsigned char* external_data;
+
+  // Bytes between the start of rows of decoded pixels(in `data` or
+  // `external_data`). 0 when rows are not byte aligned.
+  size_t row_stride;
 
   // Custom fields
   std::vector<FieldData> custom_fields;
 };
 
+///
+/// Worker thread pool which can be shared among load calls.
+///
+/// Create it once and pass it through `LoadOptions::thread_pool` to avoid
+/// spawning threads for each load. Strips, tiles and images(IFDs) are
+/// scheduled onto the pool. Each worker has its own task queue and steals
+/// tasks from other workers when its queue becomes empty.
+///
+/// Tasks run serially on the calling thread when TinyDNG is compiled without
+/// `TINY_DNG_LOADER_USE_THREAD`.
+///
+class ThreadPool {
+ public:
+  ///
+  /// `num_threads` is the max number of threads used for a `parallel_for`,
+  /// including the calling thread. 0 = std::thread::hardware_concurrency().
+  ///
+  explicit ThreadPool(int num_threads = 0);
+  ~ThreadPool();
+
+  ///
+  /// Returns the max number of threads used for a `parallel_for`.
+  ///
+  int num_threads() const;
+
+  ///
+  /// Calls `func(begin, end)` for disjoint ranges which cover [0, n) and
+  /// returns after all calls finished. The calling thread also executes
+  /// tasks while waiting, thus `parallel_for` can be nested.
+  ///
+  void parallel_for(size_t n,
+                    const std::function<void(size_t begin, size_t end)>& func);
+
+  ///
+  /// Process-global pool. Used when `LoadOptions::thread_pool` is NULL.
+  ///
+  static ThreadPool* GetDefault();
+
+ private:
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
+
+  struct Impl;
+  Impl* impl_;
+};
+
+///
+/// Memory allocator for loader-internal memory(decoder scratch such as tile
+/// buffers and Huffman tables/row caches of lossless JPEG decoder, blocks
+/// fetched from a `ByteSource`, and bookkeeping of decoding tasks).
+///
+/// `DNGImage` members are standard containers and are not allocated with it.
+/// Returned memory must be aligned for any fundamental type. Must be
+/// thread-safe when a load decodes with multiple threads.
+///
+class Allocator {
+ public:
+  virtual ~Allocator() {}
+  virtual void* allocate(size_t size) = 0;
+  virtual void deallocate(void* ptr, size_t size) = 0;
+
+  ///
+  /// Changes when memory allocated before is reclaimed without `deallocate`
+  /// (e.g. `ArenaAllocator::reset`). A `DecoderContext` then drops its cached
+  /// scratch memory without touching it.
+  ///
+  virtual uint64_t generation() const { return 0; }
+};
+
+///
+/// Monotonic arena. Memory is carved from large blocks and `deallocate` does
+/// nothing. Create one per worker and call `reset` between files, so that
+/// short-lived allocations of a load reuse the same blocks instead of
+/// fragmenting the system allocator. Thread-safe.
+///
+/// A `DecoderContext` created with the arena notices `reset`/`release` and
+/// drops its cached scratch memory, thus it keeps working across files but
+/// allocates scratch again after each reset.
+///
+class ArenaAllocator : public Allocator {
+ public:
+  struct Stats {
+    size_t used_bytes;      // Bytes allocated since the last `reset`.
+    size_t reserved_bytes;  // Bytes of all blocks.
+    size_t num_blocks;
+  };
+
+  ///
+  /// `block_size` is the size of a block allocated from the system. Larger
+  /// requests get a block of their own.
+  ///
+  explicit ArenaAllocator(size_t block_size = 1024 * 1024);
+  ~ArenaAllocator();
+
+  void* allocate(size_t size);
+  void deallocate(void* ptr, size_t size);
+  uint64_t generation() const;
+
+  ///
+  /// Makes all blocks available again. Memory allocated before must no longer
+  /// be used. Do not call while a load with this arena is in progress.
+  ///
+  void reset();
+
+  ///
+  /// Frees all blocks.
+  /// Do not call while a load with this arena is in progress.
+  ///
+  void release();
+
+  Stats stats() const;
+
+ private:
+  ArenaAllocator(const ArenaAllocator&);
+  ArenaAllocator& operator=(const ArenaAllocator&);
+
+  struct Impl;
+  Impl* impl_;
+};
+
+struct DecoderContextAccess;
+
+///
+/// Reusable decoder scratch memory(tile buffers, Huffman tables and row
+/// caches of lossless JPEG decoder).
+///
+/// Create it once and pass it through `LoadOptions::decoder_context` so that
+/// repeated loads reach a steady state with no heap allocation for decoder
+/// scratch. Scratch memory is checked out per task, thus a context can be
+/// used by multiple threads and concurrent load calls.
+///
+class DecoderContext {
+ public:
+  struct Stats {
+    uint64_t num_allocations;  // # of heap allocations for scratch memory.
+    uint64_t allocated_bytes;  // Total bytes of these allocations.
+    uint64_t num_acquires;     // # of scratch checkouts(tasks).
+  };
+
+  DecoderContext();
+
+  ///
+  /// Scratch memory is allocated with `allocator`(NULL = system allocator),
+  /// which must outlive the context. Cached scratch memory is dropped when
+  /// the allocator reclaims its memory(`Allocator::generation` changes, e.g.
+  /// `ArenaAllocator::reset`). Do not reset the allocator while a load with
+  /// this context is in progress.
+  ///
+  explicit DecoderContext(Allocator* allocator);
+  ~DecoderContext();
+
+  ///
+  /// Returns allocation statistics.
+  /// Do not call while a load with this context is in progress.
+  ///
+  Stats stats() const;
+
+  ///
+  /// Clears statistics.
+  /// Do not call while a load with this context is in progress.
+  ///
+  void reset_stats();
+
+  ///
+  /// Frees all cached scratch memory.
+  /// Do not call while a load with this context is in progress.
+  ///
+  void release();
+
+ private:
+  DecoderContext(const DecoderContext&);
+  DecoderContext& operator=(const DecoderContext&);
+
+  friend struct DecoderContextAccess;
+
+  struct Impl;
+  Impl* impl_;
+};
+
+typedef enum {
+  IMAGE_SELECTION_ALL = 0,           // Decode all images(default).
+  IMAGE_SELECTION_INDEX,             // Decode `select_index`'th image.
+  IMAGE_SELECTION_NEW_SUBFILE_TYPE,  // Decode images whose NewSubFileType
+                                     // equals to `select_new_subfile_type`.
+  IMAGE_SELECTION_LARGEST,           // Decode the image with the largest
+                                     // width * height.
+  IMAGE_SELECTION_SEMANTIC_NAME,     // Decode images whose SemanticName equals
+                                     // to `select_semantic_name`.
+  IMAGE_SELECTION_PREDICATE          // Decode images for which
+                                     // `select_predicate` returns true.
+} ImageSelection;
+
+///
+/// User predicate for `IMAGE_SELECTION_PREDICATE`.
+/// `image` has metadata only(as in `LoadOptions::metadata_only`) when the
+/// predicate is called. Return true to decode `index`'th image.
+///
+typedef bool (*ImageSelectionPredicate)(const DNGImage& image, size_t index,
+                                        void* user_data);
+
+///
+/// Destination of decoded pixels supplied by `ImageBufferCallback`.
+///
+struct ImageBuffer {
+  unsigned char* data;  // NULL = decode to `DNGImage::data`.
+  size_t row_stride;    // Bytes between the start of rows. 0 = packed rows.
+};
+
+///
+/// User callback which supplies the destination of decoded pixels of
+/// `index`'th image. Called before the pixels are decoded, when `image` has
+/// the layout of decoded pixels(`width`, `height`, `samples_per_pixel` and
+/// `bits_per_sample`). `byte_size` is the size of packed pixels.
+///
+/// `buffer->data` must have `byte_size` bytes(`row_stride * height` bytes
+/// when `row_stride` > 0) and be aligned to the sample size. `row_stride`
+/// must be a multiple of the sample size and requires byte aligned rows.
+/// Pixels which are not stored in the file(e.g. truncated data) are left
+/// unwritten. Images are decoded concurrently, thus the callback may be called
+/// from multiple threads at the same time. Return false to abort loading.
+///
+typedef bool (*ImageBufferCallback)(const DNGImage& image, size_t index,
+                                    size_t byte_size, ImageBuffer* buffer,
+                                    void* user_data);
+
+///
+/// Output of bit-packed samples(`LoadOptions::unpack_samples`).
+///
+typedef enum {
+  SAMPLE_UNPACKING_NONE = 0,  // Keep packed bits(default).
+  SAMPLE_UNPACKING_UINT16,    // Unpack to uint16_t(`bits_per_sample` = 16).
+  SAMPLE_UNPACKING_FLOAT      // Unpack to float(`bits_per_sample` = 32 and
+                              // `sample_format` = SAMPLEFORMAT_IEEEFP).
+} SampleUnpacking;
+
+///
+/// Bit order of bit-packed samples.
+///
+typedef enum {
+  BIT_ORDER_MSB_FIRST = 0,  // A sample starts at the most significant bit of
+                            // a byte(TIFF. default).
+  BIT_ORDER_LSB_FIRST       // A sample starts at the least significant bit.
+} BitOrder;
+
+///
+/// Options for loading DNG.
+///
+struct LoadOptions {
+  // Parse IFDs only and do not decode any pixel data.
+  // `DNGImage::data` will be empty, but image dimensions, color information
+  // and `DNGImage::data_offset`/`DNGImage::data_byte_count` are filled.
+  bool metadata_only;
+
+  // Select images to decode. Images not selected are still returned, but
+  // with metadata only. Ignored when `metadata_only` is true.
+  ImageSelection image_selection;
+  size_t select_index;
+  unsigned int select_new_subfile_type;
+  std::string select_semantic_name;
+  ImageSelectionPredicate select_predicate;
+  void* select_predicate_user_data;
+
+  // Thread pool used for decoding. NULL = use `ThreadPool::GetDefault()`.
+  ThreadPool* thread_pool;
+
+  // Scratch memory used for decoding. NULL = use a temporary context which is
+  // freed at the end of the load call.
+  DecoderContext* decoder_context;
+
+  // Allocator for loader-internal memory of the load call. NULL = system
+  // allocator. Memory of `decoder_context` is allocated with the allocator of
+  // the context.
+  Allocator* allocator;
+
+  // Supplies the destination of decoded pixels for each image(e.g. aligned
+  // or shared memory), to decode into it without an intermediate copy.
+  // NULL = decode to `DNGImage::data`. Used by the `LoadDNG*` functions.
+  ImageBufferCallback image_buffer_callback;
+  void* image_buffer_user_data;
+
+  // Unpack uncompressed samples whose bits per sample is not a multiple of 8
+  // (e.g. 10/12/14-bit raw data) while loading. Values are not scaled.
+  // `bits_per_sample_original` keeps the packed size. Not applied by
+  // `DecodeRegion*` and `TiledImageReader`, which reject packed samples.
+  SampleUnpacking unpack_samples;
+  BitOrder packed_bit_order;
+
+  // Deliver 16/32/64-bit samples of uncompressed, LZW and ZIP images in host
+  // byte order instead of the byte order of the file. Samples are swapped
+  // while they are copied or decoded, not in a separate pass. Lossless JPEG
+  // and unpacked samples are always in host byte order. Used by the
+  // `LoadDNG*` and `DecodeRegion*` functions.
+  bool host_byte_order;
+
+  LoadOptions()
+      : metadata_only(false),
+        image_selection(IMAGE_SELECTION_ALL),
+        select_index(0),
+        select_new_subfile_type(0),
+        select_predicate(NULL),
+        select_predicate_user_data(NULL),
+        thread_pool(NULL),
+        decoder_context(NULL),
+        allocator(NULL),
+        image_buffer_callback(NULL),
+        image_buffer_user_data(NULL),
+        unpack_samples(SAMPLE_UNPACKING_NONE),
+        packed_bit_order(BIT_ORDER_MSB_FIRST),
+        host_byte_order(false) {}
+};
+
 ///
 /// Loads DNG image and store it to `images`
 ///
@@ -271,25 +610,432 @@ bool LoadDNG(const char* filename, std::vector<FieldInfo>& custom_fields,
              std::vector<DNGImage>* images, std::string* warn,
              std::string* err);
 
+///
+/// A variant of `LoadDNG` with loading options.
+///
+bool LoadDNG(const char* filename, const LoadOptions& options,
+             std::vector<FieldInfo>& custom_fields,
+             std::vector<DNGImage>* images, std::string* warn,
+             std::string* err);
+
+///
+/// Loads metadata of DNG images(no pixel decoding).
+/// Equivalent to `LoadDNG` with `LoadOptions::metadata_only` = true.
+///
+bool LoadDNGInfo(const char* filename, std::vector<FieldInfo>& custom_fields,
+                 std::vector<DNGImage>* images, std::string* warn,
+                 std::string* err);
+
 ///
 /// Check if a file is DNG(TIFF) or not.
 /// Extra message will be stored `msg`.
 ///
+/// Only reads the TIFF header(not the whole file).
+///
 bool IsDNG(const char* filename, std::string* msg);
 
+///
+/// File type information obtained by sniffing the TIFF header and IFD0.
+///
+struct DNGFileInfo {
+  std::string filename;
+
+  bool is_tiff;          // Valid TIFF(magic 42) or BigTIFF(magic 43) header.
+  bool is_bigtiff;       // BigTIFF(magic 43).
+  bool big_endian;       // "MM" byte order.
+  bool has_dng_version;  // IFD0 contains DNGVersion tag(50706).
+  unsigned char dng_version[4];  // e.g. {1, 4, 0, 0}. Valid when
+                                 // `has_dng_version` is true.
+
+  DNGFileInfo()
+      : is_tiff(false),
+        is_bigtiff(false),
+        big_endian(false),
+        has_dng_version(false) {
+    dng_version[0] = dng_version[1] = dng_version[2] = dng_version[3] = 0;
+  }
+};
+
+///
+/// Sniff the file type of `filename`.
+///
+/// Reads at most a small prefix of the file plus the entries of IFD0, so the
+/// cost does not depend on the file size.
+///
+/// @param[in] filename Filename.
+/// @param[out] info File type information.
+/// @param[out] msg Extra message(optional).
+///
+/// @return true when the file could be read(`info` is filled even if the file
+/// is not a TIFF). false when the file cannot be opened.
+///
+bool SniffDNG(const char* filename, DNGFileInfo* info, std::string* msg);
+
+///
+/// A variant of `SniffDNG` which sniffs the data in memory.
+///
+bool SniffDNGFromMemory(const char* mem, size_t size, DNGFileInfo* info,
+                        std::string* msg);
+
+///
+/// Classify many files with bounded I/O per file.
+/// `infos` has the same length and order as `filenames`. Files which cannot be
+/// opened are reported as non-TIFF.
+///
+void SniffDNGFiles(const std::vector<std::string>& filenames,
+                   std::vector<DNGFileInfo>* infos);
+
+///
+/// Scan the directory `dirname`(non recursive) and classify the regular files
+/// in it with `SniffDNG`.
+///
+/// @param[in] dirname Directory name.
+/// @param[in] dng_only Report only files containing DNGVersion tag. When
+/// false, all TIFF(and BigTIFF) files are reported.
+/// @param[out] infos Classified files(sorted by filename).
+/// @param[out] err Error message.
+///
+/// @return false when the directory cannot be opened.
+///
+bool ScanDNGDirectory(const char* dirname, bool dng_only,
+                      std::vector<DNGFileInfo>* infos, std::string* err);
+
 ///
 /// A variant of `LoadDNG` which loads DNG image from memory.
-/// Up to 2GB DNG data.
 ///
-bool LoadDNGFromMemory(const char* mem, unsigned int size,
+bool LoadDNGFromMemory(const char* mem, size_t size,
                        std::vector<FieldInfo>& custom_fields,
                        std::vector<DNGImage>* images, std::string* warn,
                        std::string* err);
 
+///
+/// A variant of `LoadDNGFromMemory` with loading options.
+///
+bool LoadDNGFromMemory(const char* mem, size_t size,
+                       const LoadOptions& options,
+                       std::vector<FieldInfo>& custom_fields,
+                       std::vector<DNGImage>* images, std::string* warn,
+                       std::string* err);
+
+///
+/// A variant of `LoadDNGInfo` which loads DNG metadata from memory.
+///
+bool LoadDNGInfoFromMemory(const char* mem, size_t size,
+                           std::vector<FieldInfo>& custom_fields,
+                           std::vector<DNGImage>* images, std::string* warn,
+                           std::string* err);
+
 ///
 /// A variant of `IsDNG` which checks if a data is DNG image.
 ///
-bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg);
+bool IsDNGFromMemory(const char* mem, size_t size, std::string* msg);
+
+///
+/// Random access byte source for `LoadDNGFromSource` and
+/// `DecodeRegionFromSource`.
+///
+/// Implement it to read DNG data from e.g. an object storage without fetching
+/// the whole file. `read_at` may be called from multiple threads concurrently
+/// when TinyDNG is compiled with `TINY_DNG_LOADER_USE_THREAD`.
+///
+class ByteSource {
+ public:
+  virtual ~ByteSource() {}
+
+  ///
+  /// Returns the total size of the data in bytes.
+  ///
+  virtual uint64_t size() const = 0;
+
+  ///
+  /// Reads `len` bytes at `offset` into `dst`.
+  /// Returns false when the range cannot be read entirely.
+  ///
+  virtual bool read_at(uint64_t offset, size_t len, unsigned char* dst) = 0;
+};
+
+///
+/// `ByteSource` over a memory. `mem` must be alive while the source is used.
+///
+class MemoryByteSource : public ByteSource {
+ public:
+  MemoryByteSource(const void* mem, size_t size);
+
+  uint64_t size() const;
+  bool read_at(uint64_t offset, size_t len, unsigned char* dst);
+
+ private:
+  const unsigned char* mem_;
+  size_t size_;
+};
+
+///
+/// `ByteSource` over a local file. Each `read_at` is a positional read(no
+/// memory mapping, no read ahead).
+///
+class FileByteSource : public ByteSource {
+ public:
+  FileByteSource();
+  ~FileByteSource();
+
+  ///
+  /// Opens `filename`. Returns false and store message into `err` when failed.
+  ///
+  bool open(const char* filename, std::string* err);
+
+  void close();
+
+  uint64_t size() const;
+  bool read_at(uint64_t offset, size_t len, unsigned char* dst);
+
+ private:
+  FileByteSource(const FileByteSource&);
+  FileByteSource& operator=(const FileByteSource&);
+
+  struct Impl;
+  Impl* impl_;
+};
+
+///
+/// A variant of `LoadDNG` which reads DNG data through `source`.
+///
+/// The TIFF header and IFDs are read in small blocks, and then only the byte
+/// ranges of the strips/tiles of the images to decode are fetched(ranges close
+/// to each other are merged into one `read_at` call). With
+/// `LoadOptions::metadata_only`, no pixel data is fetched.
+///
+bool LoadDNGFromSource(ByteSource* source, const LoadOptions& options,
+                       std::vector<FieldInfo>& custom_fields,
+                       std::vector<DNGImage>* images, std::string* warn,
+                       std::string* err);
+
+///
+/// Result of a file loaded by `LoadDNGBatch`.
+///
+struct DNGBatchResult {
+  size_t index;  // Index of the file in `filenames`.
+  std::string filename;
+  bool ok;  // Return value of the load.
+  std::vector<DNGImage> images;
+  std::string warn;
+  std::string err;
+
+  DNGBatchResult() : index(0), ok(false) {}
+};
+
+///
+/// User callback which receives a loaded file. `result` can be modified(e.g.
+/// move out `images`). Return false to stop loading the remaining files.
+///
+typedef bool (*DNGBatchCallback)(DNGBatchResult* result, void* user_data);
+
+///
+/// Loads many files concurrently and delivers each file to `callback` in
+/// completion order.
+///
+/// A reader thread reads files ahead while they are decoded by decoder threads
+/// of the batch(one file per thread). Decoders plus the workers which decode
+/// strips/tiles of a file in parallel use the thread count of
+/// `LoadOptions::thread_pool`: one decoder per thread when there are enough
+/// files, and the remaining threads decode strips/tiles otherwise. The workers
+/// of `LoadOptions::thread_pool` itself are used only when a single decoder
+/// runs.
+///
+/// `max_in_flight_bytes` bounds the memory of files read ahead or being
+/// decoded plus decoded pixels not yet delivered(0 = no limit). A file larger
+/// than the limit is decoded alone from a memory mapping instead of being read
+/// ahead.
+///
+/// Calls of `callback` are serialized. A file which fails to load is reported
+/// with `DNGBatchResult::ok` false and does not stop the batch. Runs serially
+/// when compiled without `TINY_DNG_LOADER_USE_THREAD`.
+///
+/// @return false when `callback` stopped the batch or arguments are invalid.
+///
+bool LoadDNGBatch(const std::vector<std::string>& filenames,
+                  const LoadOptions& options,
+                  std::vector<FieldInfo>& custom_fields,
+                  size_t max_in_flight_bytes, DNGBatchCallback callback,
+                  void* user_data, std::string* err);
+
+///
+/// Decodes the rectangle [`x`, `x` + `w`) x [`y`, `y` + `h`) of `image`.
+///
+/// `image` is one of the images obtained from the same file with `LoadDNGInfo`
+/// (or `LoadDNG`). Only the tiles or strips which intersect the rectangle are
+/// decoded, so the cost is proportional to the region rather than the whole
+/// image.
+///
+/// Supported images: tiled lossless JPEG, tiled ZIP, uncompressed(tiled or
+/// strips) and LZW strips.
+///
+/// @param[in] filename DNG filename.
+/// @param[in] image Image to decode.
+/// @param[in] x Left of the rectangle.
+/// @param[in] y Top of the rectangle.
+/// @param[in] w Width of the rectangle.
+/// @param[in] h Height of the rectangle.
+/// @param[out] out Decoded pixels(`w` * `h` pixels). The sample layout and
+/// bits per sample are same as `DNGImage::data` of a full decode.
+/// @param[out] err Error message.
+///
+/// @return true upon success.
+///
+bool DecodeRegion(const char* filename, const DNGImage& image, int x, int y,
+                  int w, int h, std::vector<unsigned char>* out,
+                  std::string* err);
+
+///
+/// A variant of `DecodeRegion` with loading options(`thread_pool`,
+/// `decoder_context`, `allocator` and `host_byte_order` are used).
+///
+bool DecodeRegion(const char* filename, const LoadOptions& options,
+                  const DNGImage& image, int x, int y, int w, int h,
+                  std::vector<unsigned char>* out, std::string* err);
+
+///
+/// A variant of `DecodeRegion` which decodes DNG data in memory.
+///
+bool DecodeRegionFromMemory(const char* mem, size_t size,
+                            const DNGImage& image, int x, int y, int w, int h,
+                            std::vector<unsigned char>* out, std::string* err);
+
+///
+/// A variant of `DecodeRegionFromMemory` with loading options.
+///
+bool DecodeRegionFromMemory(const char* mem, size_t size,
+                            const LoadOptions& options, const DNGImage& image,
+                            int x, int y, int w, int h,
+                            std::vector<unsigned char>* out, std::string* err);
+
+///
+/// A variant of `DecodeRegion` which reads DNG data through `source`. Only the
+/// tiles or strips intersecting the rectangle are fetched.
+///
+bool DecodeRegionFromSource(ByteSource* source, const LoadOptions& options,
+                            const DNGImage& image, int x, int y, int w, int h,
+                            std::vector<unsigned char>* out, std::string* err);
+
+///
+/// Decodes tiles of a (possibly larger than RAM) TIFF/DNG file on demand.
+///
+/// The file is kept open(memory mapped when possible) and decoded tiles are
+/// stored in a LRU cache bounded by `Options::cache_budget` bytes, so viewers
+/// and tilers can pan across an image of any size with constant memory.
+/// Images which are not tiled are split into virtual tiles of full image width
+/// and `Options::virtual_tile_size` rows(rounded up to whole strips for LZW
+/// strips, which are decoded as a whole). Supported images are same as
+/// `DecodeRegion`.
+///
+/// `tile`, `read_region`, `set_cache_budget` and `stats` can be called from
+/// multiple threads concurrently when TinyDNG is compiled with
+/// `TINY_DNG_LOADER_USE_THREAD`.
+///
+class TiledImageReader {
+ public:
+  struct Options {
+    size_t cache_budget;    // Max bytes of decoded tiles kept in the cache.
+    int virtual_tile_size;  // Tile height for images which are not tiled.
+
+    // Thread pool used for decoding a tile. NULL = use
+    // `ThreadPool::GetDefault()`.
+    ThreadPool* thread_pool;
+
+    // Scratch memory used for decoding. NULL = use a context owned by the
+    // reader.
+    DecoderContext* decoder_context;
+
+    // Deliver 16/32/64-bit samples in host byte order(see
+    // `LoadOptions::host_byte_order`).
+    bool host_byte_order;
+
+    Options()
+        : cache_budget(size_t(256) * 1024 * 1024),
+          virtual_tile_size(256),
+          thread_pool(NULL),
+          decoder_context(NULL),
+          host_byte_order(false) {}
+  };
+
+  ///
+  /// Decoded tile. Pixels are stored in the same sample layout as
+  /// `DNGImage::data`. A tile stays valid while referenced, even after it is
+  /// evicted from the cache.
+  ///
+  struct Tile {
+    int x;  // Position of the tile in the image.
+    int y;
+    int width;  // Tiles at the right/bottom edge are clipped to the image.
+    int height;
+    int samples_per_pixel;
+    int bits_per_sample;
+    std::vector<unsigned char> data;
+  };
+
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t cached_tiles;
+    size_t cached_bytes;
+  };
+
+  TiledImageReader();
+  ~TiledImageReader();
+
+  ///
+  /// Opens `filename` and parses its metadata. No pixel data is decoded.
+  ///
+  bool open(const char* filename, const Options& options, std::string* warn,
+            std::string* err);
+
+  ///
+  /// Closes the file and frees all cached tiles.
+  ///
+  void close();
+
+  ///
+  /// Metadata of the images in the file(as in `LoadDNGInfo`).
+  ///
+  const std::vector<DNGImage>& images() const;
+
+  ///
+  /// Returns the tile grid of `image_index`'th image.
+  ///
+  bool tile_layout(size_t image_index, int* tile_width, int* tile_height,
+                   int* tiles_across, int* tiles_down) const;
+
+  ///
+  /// Returns (`tx`, `ty`)'th tile of `image_index`'th image. The tile is
+  /// decoded when it is not in the cache.
+  ///
+  /// @return NULL upon failure and store error message into `err`.
+  ///
+  std::shared_ptr<const Tile> tile(size_t image_index, int tx, int ty,
+                                   std::string* err);
+
+  ///
+  /// Copies the rectangle [`x`, `x` + `w`) x [`y`, `y` + `h`) of
+  /// `image_index`'th image to `out` through the tile cache.
+  ///
+  bool read_region(size_t image_index, int x, int y, int w, int h,
+                   std::vector<unsigned char>* out, std::string* err);
+
+  ///
+  /// Changes the byte budget of the cache. Tiles are evicted immediately when
+  /// the cache exceeds the new budget.
+  ///
+  void set_cache_budget(size_t bytes);
+
+  Stats stats() const;
+
+ private:
+  TiledImageReader(const TiledImageReader&);
+  TiledImageReader& operator=(const TiledImageReader&);
+
+  struct Impl;
+  Impl* impl_;
+};
 
 }  // namespace tinydng
 
@@ -307,11 +1053,16 @@ bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg);
 
 #include <cmath>
 #include <cstdlib>
+#include <cerrno>
 #include <cstring>
 #include <iterator>
+#include <algorithm>
+#include <list>
 #include <map>
 #include <sstream>
 #include <limits>
+#include <new>
+#include <type_traits>
 
 #if defined(TINY_DNG_LOADER_NO_STDIO)
 #else
@@ -320,6 +1071,31 @@ bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg);
 #include <iostream>
 #endif
 
+#if !defined(_WIN32)
+#include <dirent.h>
+#endif
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if !defined(TINY_DNG_LOADER_NO_MMAP) && !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+#if !defined(TINY_DNG_LOADER_NO_SIMD) &&                      \
+    (defined(__SSE2__) || defined(_M_X64) ||                  \
+     (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)))
+#define TINY_DNG_LOADER_SSE2
+#include <emmintrin.h>
+#if defined(__SSSE3__) || defined(__AVX__)
+#define TINY_DNG_LOADER_SSSE3
+#include <tmmintrin.h>
+#endif
+#endif
+
 // #include <iostream> // dbg
 
 #ifdef TINY_DNG_LOADER_PROFILING
@@ -331,6 +1107,11 @@ bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg);
 
 #ifdef TINY_DNG_LOADER_USE_THREAD
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
 #include <thread>
 #endif
 
@@ -479,6 +1260,60 @@ namespace tinydng {
 #pragma warning(disable : 4244)
 #endif
 
+// STL allocator which allocates with a `tinydng::Allocator`(NULL = system
+// allocator). Containers for loader-internal memory use it.
+template <typename T>
+struct StlAllocator {
+  typedef T value_type;
+
+  // The allocator follows the memory on container assignment and swap.
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  Allocator* allocator;
+
+  StlAllocator(Allocator* a = NULL) : allocator(a) {}
+  template <typename U>
+  StlAllocator(const StlAllocator<U>& rhs) : allocator(rhs.allocator) {}
+
+  T* allocate(size_t n) {
+    void* p = allocator ? allocator->allocate(n * sizeof(T))
+                        : malloc(n * sizeof(T));
+    if (!p && (n > 0)) {
+      TINY_DNG_ABORT("Failed to allocate memory.");
+    }
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t n) {
+    if (allocator) {
+      allocator->deallocate(p, n * sizeof(T));
+    } else {
+      free(p);
+    }
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const StlAllocator<T>& a, const StlAllocator<U>& b) {
+  return a.allocator == b.allocator;
+}
+
+template <typename T, typename U>
+bool operator!=(const StlAllocator<T>& a, const StlAllocator<U>& b) {
+  return a.allocator != b.allocator;
+}
+
+// std::vector whose memory is allocated with a `tinydng::Allocator`.
+template <typename T>
+using AllocVector = std::vector<T, StlAllocator<T> >;
+
+// Decoder object and its reusable storage are defined outside of the
+// anonymous namespace, since `DecoderContext` holds the storage.
+struct _ljp;
+struct _lj92_storage;
+
 namespace {
 // Begin liblj92, Lossless JPEG decode/encoder ------------------------------
 //
@@ -531,10 +1366,25 @@ int lj92_open(lj92* lj,                          // Return handle here
 /* Release a decoder object */
 void lj92_close(lj92 lj);
 
+/* Reusable memory for decoder objects(defined below) */
+typedef struct _lj92_storage lj92_storage;
+
+/* Same as lj92_open, but decoder object, Huffman tables and row cache are
+ * placed in `storage` and reused across calls. lj92_close does not free
+ * them. `storage` must outlive the handle and must not be shared among
+ * handles which are open at the same time.
+ */
+int lj92_open_with_storage(lj92* lj, lj92_storage* storage,
+                           const uint8_t* data, int datalen, int* width,
+                           int* height, int* bitdepth);
+
 /*
  * Decode previously opened lossless JPEG (1992) into a 2D tile of memory
  * Starting at target, write writeLength 16bit values, then skip 16bit
  * skipLength value before writing again
+ * Each row(width * components values) is written once. Values of a row beyond
+ * writeLength are decoded but not written, which clips a tile overhanging the
+ * target. Decoding stops after writeRows rows(negative: all rows).
  * If linearize is not NULL, use table at linearize to convert data values from
  * output value to target value
  * Data is only correct if LJ92_ERROR_NONE is returned
@@ -543,7 +1393,8 @@ int lj92_decode(
     lj92 lj, uint16_t* target, int writeLength,
     int skipLength,  // The image is written to target as a tile
     uint16_t* linearize,
-    int linearizeLength);  // If not null, linearize the data using this table
+    int linearizeLength,  // If not null, linearize the data using this table
+    int writeRows = -1);
 
 #if 0
 /*
@@ -567,6 +1418,41 @@ typedef uint32_t u32;
 
 #define LJ92_MAX_COMPONENTS (16)
 
+// Width(in bits) of the lookup table which decodes a Huffman code together
+// with its difference bits.
+#define LJ92_FAST_BITS (11)
+
+// Inlining of the entropy decoder into the decoding loop is required to keep
+// its state in registers.
+#if defined(_MSC_VER)
+#define LJ92_INLINE __forceinline
+#elif defined(__GNUC__)
+#define LJ92_INLINE inline __attribute__((always_inline))
+#else
+#define LJ92_INLINE inline
+#endif
+
+#if defined(_MSC_VER)
+#define LJ92_NOINLINE __declspec(noinline)
+#elif defined(__GNUC__)
+#define LJ92_NOINLINE __attribute__((noinline))
+#else
+#define LJ92_NOINLINE
+#endif
+
+}  // namespace
+
+// Entry of the fast lookup table.
+//   bits == 0 : code is longer than the table width. Use `hufflut`.
+//   extra == 0: `diff` is the decoded difference and `bits` are consumed.
+//   otherwise : `bits` of the code are consumed and `extra`(= ssss) bits of
+//               the difference follow.
+typedef struct _lj92_fastcode {
+  int16_t diff;
+  uint8_t bits;
+  uint8_t extra;
+} lj92_fastcode;
+
 typedef struct _ljp {
   u8* data;
   u8* dataend;
@@ -579,6 +1465,7 @@ typedef struct _ljp {
   int components;  // Components(Nf)
   int writelen;    // Write rows this long
   int skiplen;     // Skip this many values after each row
+  int writerows;   // Decode this many rows
   u16* linearize;  // Linearization table
   int linlen;
   int sssshist[16];
@@ -597,20 +1484,73 @@ typedef struct _ljp {
   // Huffman table for each components
   u16* hufflut[LJ92_MAX_COMPONENTS];
   int huffbits[LJ92_MAX_COMPONENTS];
+  lj92_fastcode* fastlut[LJ92_MAX_COMPONENTS];
   int num_huff_idx;
 #endif
   // Parse state
-  int cnt;
-  u32 b;
+  int cnt;     // # of valid bits in `b`
+  uint64_t b;  // Bit buffer. Valid bits are stored in LSB side.
   u16* image;
   u16* rowcache;
   u16* outrow[2];
+
+  lj92_storage* storage;  // NULL = memory is owned by the decoder object.
 } ljp;
 
+struct _lj92_storage {
+  ljp handle;
+  tinydng::AllocVector<u16> hufflut[LJ92_MAX_COMPONENTS];
+  tinydng::AllocVector<lj92_fastcode> fastlut[LJ92_MAX_COMPONENTS];
+  tinydng::AllocVector<u16> rowcache;
+
+  // DHT segment and table width the lookup tables were built from. Tiles of
+  // a DNG file usually share the same Huffman tables, so rebuilding can be
+  // skipped.
+  tinydng::AllocVector<u8> huffspec[LJ92_MAX_COMPONENTS];
+  int huffbits[LJ92_MAX_COMPONENTS];
+
+  // Statistics of heap allocations made for the storage.
+  uint64_t num_allocations;
+  uint64_t allocated_bytes;
+
+  explicit _lj92_storage(tinydng::Allocator* allocator = NULL)
+      : rowcache(allocator), num_allocations(0), allocated_bytes(0) {
+    memset(&handle, 0, sizeof(ljp));
+    memset(huffbits, 0, sizeof(huffbits));
+    for (int i = 0; i < LJ92_MAX_COMPONENTS; i++) {
+      hufflut[i] = tinydng::AllocVector<u16>(allocator);
+      fastlut[i] = tinydng::AllocVector<lj92_fastcode>(allocator);
+      huffspec[i] = tinydng::AllocVector<u8>(allocator);
+    }
+  }
+};
+
+namespace {
+
+// Returns zero-cleared memory of `n` elements. Memory of `storage` is
+// reused when available, otherwise allocated with calloc.
+template <typename T>
+static T* lj92_alloc(ljp* self, tinydng::AllocVector<T>* storage_buf,
+                     size_t n) {
+  if (self->storage == NULL) {
+    return (T*)calloc(n, sizeof(T));
+  }
+
+  if (storage_buf->capacity() < n) {
+    storage_buf->clear();
+    storage_buf->shrink_to_fit();
+    storage_buf->reserve(n);
+    self->storage->num_allocations++;
+    self->storage->allocated_bytes += n * sizeof(T);
+  }
+  storage_buf->assign(n, T());
+  return storage_buf->data();
+}
+
 static int find(ljp* self) {
   int ix = self->ix;
   u8* data = self->data;
-  while (data[ix] != 0xFF && ix < (self->datalen - 1)) {
+  while (ix < (self->datalen - 1) && data[ix] != 0xFF) {
     ix += 1;
   }
   ix += 2;
@@ -631,10 +1571,16 @@ static int parseHuff(ljp* self) {
   u8* huffhead =
       &self->data
            [self->ix];  // xstruct.unpack('>HB16B',self.data[self.ix:self.ix+19])
-  u8* bits = &huffhead[2];
-  bits[0] = 0;  // Because table starts from 1
+  if ((self->ix + 2) > self->datalen) return ret;
   int hufflen = BEH(huffhead[0]);
   if ((self->ix + hufflen) >= self->datalen) return ret;
+  // Length(2 bytes), table class/id(1 byte) and 16 code counts.
+  if (hufflen < 19) return ret;
+  // Copy code counts so that the input data is never modified(it may be a
+  // read-only mapping of the file).
+  u8 bits[17];
+  memcpy(bits, &huffhead[2], 17);
+  bits[0] = 0;  // Because table starts from 1
 #ifdef SLOW_HUFF
   u8* huffval = calloc(hufflen - 19, sizeof(u8));
   if (huffval == NULL) return LJ92_ERROR_NO_MEMORY;
@@ -753,6 +1699,9 @@ static int parseHuff(ljp* self) {
   ret = LJ92_ERROR_NONE;
 #else
   /* Calculate huffman direct lut */
+  if (self->num_huff_idx >= LJ92_MAX_COMPONENTS) return LJ92_ERROR_CORRUPT;
+  const int huff_idx = self->num_huff_idx;
+
   // How many bits in the table - find highest entry
   u8* huffvals = &self->data[self->ix + 19];
   int maxbits = 16;
@@ -760,14 +1709,34 @@ static int parseHuff(ljp* self) {
     if (bits[maxbits]) break;
     maxbits--;
   }
-  self->huffbits[self->num_huff_idx] = maxbits;
-  TINY_DNG_DPRINTF("huffbuts[%d] = %d\n", self->num_huff_idx, maxbits);
+  if (maxbits == 0) return LJ92_ERROR_CORRUPT;  // No codes
+  self->huffbits[huff_idx] = maxbits;
+  TINY_DNG_DPRINTF("huffbuts[%d] = %d\n", huff_idx, maxbits);
+
+  // Reuse the tables when the storage holds ones built from the same DHT.
+  if (self->storage) {
+    tinydng::AllocVector<u8>& spec = self->storage->huffspec[huff_idx];
+    const u8* spec_begin = &huffhead[2];
+    const size_t spec_len = size_t(hufflen - 2);
+    if ((spec.size() == spec_len) &&
+        (self->storage->huffbits[huff_idx] == maxbits) &&
+        (memcmp(spec.data(), spec_begin, spec_len) == 0)) {
+      self->hufflut[huff_idx] = self->storage->hufflut[huff_idx].data();
+      self->fastlut[huff_idx] = self->storage->fastlut[huff_idx].data();
+      self->num_huff_idx++;
+      return LJ92_ERROR_NONE;
+    }
+    spec.clear();  // Invalidate until the tables are built.
+  }
 
   /* Now fill the lut */
-  u16* hufflut = (u16*)malloc((1 << maxbits) * sizeof(u16));
+  u16* hufflut =
+      lj92_alloc(self,
+                 self->storage ? &self->storage->hufflut[huff_idx] : NULL,
+                 size_t(1) << maxbits);
   // TINY_DNG_DPRINTF("maxbits = %d\n", maxbits);
   if (hufflut == NULL) return LJ92_ERROR_NO_MEMORY;
-  self->hufflut[self->num_huff_idx] = hufflut;
+  self->hufflut[huff_idx] = hufflut;
   int i = 0;
   int hv = 0;
   int rv = 0;
@@ -799,10 +1768,48 @@ static int parseHuff(ljp* self) {
     }
     hcode = huffvals[hv];
     hufflut[i] = hcode << 8 | bitsused;
-    TINY_DNG_DPRINTF("idx[%d] hufflut[%d] = %d(bitsused = %d, hcode = %d\n",self->num_huff_idx, i, hufflut[i], bitsused,hcode);
+    TINY_DNG_DPRINTF("idx[%d] hufflut[%d] = %d(bitsused = %d, hcode = %d\n",huff_idx, i, hufflut[i], bitsused,hcode);
     i++;
     rv++;
   }
+
+  // Build the fast lut. An entry decodes the code and, when they fit in the
+  // table width, the difference bits which follow it in one lookup.
+  const int fastbits = LJ92_FAST_BITS;
+  lj92_fastcode* fastlut =
+      lj92_alloc(self,
+                 self->storage ? &self->storage->fastlut[huff_idx] : NULL,
+                 size_t(1) << fastbits);
+  if (fastlut == NULL) return LJ92_ERROR_NO_MEMORY;
+  self->fastlut[huff_idx] = fastlut;
+  for (int k = 0; k < (1 << fastbits); k++) {
+    const u16 entry = (maxbits >= fastbits)
+                          ? hufflut[k << (maxbits - fastbits)]
+                          : hufflut[k >> (fastbits - maxbits)];
+    const int codelen = entry & 0xFF;
+    const int ssss = entry >> 8;
+    lj92_fastcode& fc = fastlut[k];
+    if ((codelen == 0) || (codelen > fastbits) || (ssss > 16)) {
+      fc.bits = 0;  // Decode with `hufflut`.
+    } else if (codelen + ssss <= fastbits) {
+      int diff = 0;
+      if (ssss > 0) {
+        diff = (k >> (fastbits - codelen - ssss)) & ((1 << ssss) - 1);
+        if (diff < (1 << (ssss - 1))) diff -= (1 << ssss) - 1;
+      }
+      fc.diff = int16_t(diff);
+      fc.bits = u8(codelen + ssss);
+      fc.extra = 0;
+    } else {
+      fc.bits = u8(codelen);
+      fc.extra = u8(ssss);
+    }
+  }
+
+  if (self->storage) {
+    self->storage->huffspec[huff_idx].assign(&huffhead[2], &huffhead[hufflen]);
+    self->storage->huffbits[huff_idx] = maxbits;
+  }
   ret = LJ92_ERROR_NONE;
 #endif
   self->num_huff_idx++;
@@ -894,6 +1901,120 @@ static int extend(ljp* self, int v, int t) {
 }
 #endif
 
+#ifndef SLOW_HUFF
+// Bit reader state of the entropy decoder. Decoding loops keep it in local
+// variables so that it stays in registers.
+struct lj92_bitreader {
+  uint64_t b;  // Bit buffer. Valid bits are stored in LSB side.
+  int cnt;     // # of valid bits in `b`
+  int ix;      // Read position in `data`
+};
+
+// Reads 8 bytes as a big endian value.
+LJ92_INLINE static uint64_t load_be64(const u8* p) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  uint64_t v;
+  memcpy(&v, p, sizeof(uint64_t));
+  return __builtin_bswap64(v);
+#else
+  return (uint64_t(p[0]) << 56) | (uint64_t(p[1]) << 48) |
+         (uint64_t(p[2]) << 40) | (uint64_t(p[3]) << 32) |
+         (uint64_t(p[4]) << 24) | (uint64_t(p[5]) << 16) |
+         (uint64_t(p[6]) << 8) | uint64_t(p[7]);
+#endif
+}
+
+// Fills the bit buffer up to 57 or more bits one byte at a time. Each 0xFF
+// byte is followed by a stuffed byte, which is skipped. Zeros are fed after
+// the end of data.
+LJ92_NOINLINE static void refill_bytes(const ljp* self, lj92_bitreader* br) {
+  uint64_t b = br->b;
+  int cnt = br->cnt;
+  int ix = br->ix;
+  while (cnt <= 56) {
+    uint64_t next = 0;
+    if (ix < self->datalen) {
+      next = self->data[ix++];
+      if (next == 0xFF) ix++;  // Skip stuffed byte
+    }
+    b = (b << 8) | next;
+    cnt += 8;
+  }
+  br->b = b;
+  br->cnt = cnt;
+  br->ix = ix;
+}
+
+// Same as refill_bytes, but takes the branch free path when next 8 bytes
+// contain no 0xFF.
+LJ92_INLINE static void refill(const ljp* self, lj92_bitreader* br) {
+  const int ix = br->ix;
+  if (ix + 8 <= self->datalen) {
+    const uint64_t v = load_be64(&self->data[ix]);
+    // Nonzero when any byte of `v` is 0xFF.
+    const uint64_t nv = ~v;
+    const uint64_t has_ff =
+        (nv - 0x0101010101010101ULL) & ~nv & 0x8080808080808080ULL;
+    if (!has_ff) {
+      // Take as many whole bytes as fit.
+      const int n = (63 - br->cnt) >> 3;
+      br->b = (br->b << (8 * n)) | (v >> (64 - 8 * n));
+      br->cnt += 8 * n;
+      br->ix = ix + n;
+      return;
+    }
+  }
+  refill_bytes(self, br);
+}
+
+// Decodes a difference value with Huffman table `component_idx`.
+LJ92_INLINE static int decodediff(const ljp* self, lj92_bitreader* br,
+                                  int component_idx, int* errcode) {
+  if (br->cnt < 32) {
+    // 32 bits are enough for a code(<= 16 bits) and its difference bits.
+    refill(self, br);
+  }
+
+  const uint64_t b = br->b;
+  int cnt = br->cnt;
+  const lj92_fastcode fc =
+      self->fastlut[component_idx][(b >> (cnt - LJ92_FAST_BITS)) &
+                                   ((1u << LJ92_FAST_BITS) - 1)];
+  int usedbits = fc.bits;
+  int t = fc.extra;
+  int diff = fc.diff;
+  if (usedbits == 0) {
+    // Code longer than the fast lut.
+    const int huffbits = self->huffbits[component_idx];
+    const u16 ssssused =
+        self->hufflut[component_idx][(b >> (cnt - huffbits)) &
+                                     ((1u << huffbits) - 1)];
+    usedbits = ssssused & 0xFF;
+    t = ssssused >> 8;
+    if ((usedbits == 0) || (t > 16)) {
+      if (errcode) {
+        (*errcode) = LJ92_ERROR_CORRUPT;
+      }
+      return 0;
+    }
+  }
+
+  if (t == 16) {
+    // SSSS 16 has no difference bits: the difference is 32768.
+    diff = 32768;
+    t = 0;
+  }
+
+  // Difference bits. `t` is zero when the lut already gave `diff`.
+  cnt -= usedbits + t;
+  const int v = int((b >> cnt) & ((1u << t) - 1));
+  diff += v - ((v < ((1 << t) >> 1)) ? ((1 << t) - 1) : 0);
+  br->cnt = cnt;
+  return diff;
+}
+#endif
+
 inline static int nextdiff(ljp* self, int component_idx, int Px, int *errcode) {
   (void)Px;
 #ifdef SLOW_HUFF
@@ -913,60 +2034,14 @@ inline static int nextdiff(ljp* self, int component_idx, int Px, int *errcode) {
   }
 
   //TINY_DNG_ASSERT(component_idx <= self->num_huff_idx, "Invalid huff index.");
-  u32 b = self->b;
-  int cnt = self->cnt;
-  int huffbits = self->huffbits[component_idx];
-  int ix = self->ix;
-  int next;
-  while (cnt < huffbits) {
-    next = *(u16*)&self->data[ix];
-    int one = next & 0xFF;
-    int two = next >> 8;
-    b = (b << 16) | (one << 8) | two;
-    cnt += 16;
-    ix += 2;
-    if (one == 0xFF) {
-      // TINY_DNG_DPRINTF("%x %x %x %x %d\n",one,two,b,b>>8,cnt);
-      b >>= 8;
-      cnt -= 8;
-    } else if (two == 0xFF)
-      ix++;
-  }
-  int index = b >> (cnt - huffbits);
-  // TINY_DNG_DPRINTF("component_idx = %d / %d, index = %d\n", component_idx,
-  // self->components, index);
-
-  u16 ssssused = self->hufflut[component_idx][index];
-  int usedbits = ssssused & 0xFF;
-  int t = ssssused >> 8;
-  self->sssshist[t]++;
-  cnt -= usedbits;
-  int keepbitsmask = (1 << cnt) - 1;
-  b &= keepbitsmask;
-  while (cnt < t) {
-    next = *(u16*)&self->data[ix];
-    int one = next & 0xFF;
-    int two = next >> 8;
-    b = (b << 16) | (one << 8) | two;
-    cnt += 16;
-    ix += 2;
-    if (one == 0xFF) {
-      b >>= 8;
-      cnt -= 8;
-    } else if (two == 0xFF)
-      ix++;
-  }
-  cnt -= t;
-  int diff = b >> cnt;
-  int vt = 1 << (t - 1);
-  if (diff < vt) {
-    vt = (-1 << t) + 1;
-    diff += vt;
-  }
-  keepbitsmask = (1 << cnt) - 1;
-  self->b = b & keepbitsmask;
-  self->cnt = cnt;
-  self->ix = ix;
+  lj92_bitreader br;
+  br.b = self->b;
+  br.cnt = self->cnt;
+  br.ix = self->ix;
+  int diff = decodediff(self, &br, component_idx, errcode);
+  self->b = br.b;
+  self->cnt = br.cnt;
+  self->ix = br.ix;
 // TINY_DNG_DPRINTF("%d %d\n",t,diff);
 // TINY_DNG_DPRINTF("%d %d %d %x %x %d\n",Px+diff,Px,diff,t,index,usedbits);
 #ifdef LJ92_DEBUG
@@ -975,148 +2050,148 @@ inline static int nextdiff(ljp* self, int component_idx, int Px, int *errcode) {
   return diff;
 }
 
-static int parsePred6(ljp* self) {
-  // TODO: Consider self->components
-  TINY_DNG_DPRINTF("parsePred6\n");
-  int ret = LJ92_ERROR_CORRUPT;
-  self->ix = self->scanstart;
-  // int compcount = self->data[self->ix+2];
-  self->ix += BEH(self->data[self->ix]);
-  self->cnt = 0;
-  self->b = 0;
-  int write = self->writelen;
-  // Now need to decode huffman coded values
-  int c = 0;
-  int pixels = self->y * self->x;
-  u16* out = self->image;
-  u16* temprow;
-  u16* thisrow = self->outrow[0];
-  u16* lastrow = self->outrow[1];
-
-  // First pixel predicted from base value
-  int diff;
-  int Px;
-  int col = 0;
-  int row = 0;
-  int left = 0;
-  int linear;
-  if (self->num_huff_idx <= self->components) {
-    // ok
-  } else {
-    //TINY_DNG_ASSERT(self->num_huff_idx <= self->components,
-    //                "Invalid number of huff indices.");
-    return LJ92_ERROR_CORRUPT;
+// Predicts a sample from its neighbours: `a` left, `b` above and `c` above
+// left.
+template <int PRED>
+LJ92_INLINE static int predict(int a, int b, int c) {
+  switch (PRED) {
+    case 1:
+      return a;
+    case 2:
+      return b;
+    case 3:
+      return c;
+    case 4:
+      return a + b - c;
+    case 5:
+      return a + ((b - c) >> 1);
+    case 6:
+      return b + ((a - c) >> 1);
+    case 7:
+      return (a + b) >> 1;
+    default:
+      return 0;  // No prediction... should not be used
   }
+}
+
+// Decodes a sample predicted from `Px` and stores it to the row cache and the
+// output(which may be the row cache itself).
+LJ92_INLINE static int decodesample(const ljp* self, lj92_bitreader* br,
+                                    int huff_idx, int Px, u16* cache,
+                                    u16* out) {
   int errcode = LJ92_ERROR_NONE;
-  // First pixel
-  diff = nextdiff(self, self->num_huff_idx - 1,
-                  0, &errcode);  // FIXME(syoyo): Is using (self->num_huff_idx-1) correct?
+  const int diff = decodediff(self, br, huff_idx, &errcode);
   if (errcode != LJ92_ERROR_NONE) {
     return errcode;
   }
 
-  Px = 1 << (self->bits - 1);
-  left = Px + diff;
-  left = (u16)(left % 65536);
-  if (self->linearize)
-    linear = self->linearize[left];
-  else
-    linear = left;
-  thisrow[col++] = left;
-  out[c++] = linear;
-  if (self->ix >= self->datalen) {
-    TINY_DNG_DPRINTF("ix = %d, datalen = %d\n", self->ix, self->datalen);
-    return ret;
+  const int left = Px + diff;
+  if ((left < 0) || (left >= 65536)) {
+    return LJ92_ERROR_CORRUPT;
   }
-  --write;
-  int rowcount = self->x - 1;
-  while (rowcount--) {
-    int _errcode = LJ92_ERROR_NONE;
-    diff = nextdiff(self, self->num_huff_idx - 1, 0, &_errcode);
-    if (_errcode != LJ92_ERROR_NONE) {
-      return _errcode;
-    }
-    Px = left;
-    left = Px + diff;
-    left = (u16)(left % 65536);
-    if (self->linearize)
-      linear = self->linearize[left];
-    else
-      linear = left;
-    thisrow[col++] = left;
-    out[c++] = linear;
-    // TINY_DNG_DPRINTF("%d %d %d %d
-    // %x\n",col-1,diff,left,thisrow[col-1],&thisrow[col-1]);
-    if (self->ix >= self->datalen) {
-      TINY_DNG_DPRINTF("a: self->ix = %d, datalen = %d\n", self->ix,
-                       self->datalen);
-      return ret;
-    }
-    if (--write == 0) {
-      out += self->skiplen;
-      write = self->writelen;
-    }
-  }
-  temprow = lastrow;
-  lastrow = thisrow;
-  thisrow = temprow;
-  row++;
-  // TINY_DNG_DPRINTF("%x %x\n",thisrow,lastrow);
-  while (c < pixels) {
-    col = 0;
-    int _errcode = LJ92_ERROR_NONE;
-    diff = nextdiff(self, self->num_huff_idx - 1, 0, &_errcode);
-    if (_errcode != LJ92_ERROR_NONE) {
-      return _errcode;
-    }
-    Px = lastrow[col];  // Use value above for first pixel in row
-    left = Px + diff;
-    left = (u16)(left % 65536);
-    if (self->linearize) {
-      if (left > self->linlen) return LJ92_ERROR_CORRUPT;
-      linear = self->linearize[left];
-    } else
-      linear = left;
-    thisrow[col++] = left;
-    // TINY_DNG_DPRINTF("%d %d %d %d\n",col,diff,left,lastrow[col]);
-    out[c++] = linear;
-    if (self->ix >= self->datalen) break;
-    rowcount = self->x - 1;
-    if (--write == 0) {
-      out += self->skiplen;
-      write = self->writelen;
-    }
-    while (rowcount--) {
-      int errcode_d2 = LJ92_ERROR_NONE;
-      diff = nextdiff(self, self->num_huff_idx - 1, 0, &errcode_d2);
-      if (errcode_d2 != LJ92_ERROR_NONE) {
-        return errcode_d2;
-      }
-
-      Px = lastrow[col] + ((left - lastrow[col - 1]) >> 1);
-      left = Px + diff;
-      left = (u16)(left % 65536);
-      // TINY_DNG_DPRINTF("%d %d %d %d %d
-      // %x\n",col,diff,left,lastrow[col],lastrow[col-1],&lastrow[col]);
+
+  (*cache) = u16(left);
+  (*out) = u16(left);
+  return LJ92_ERROR_NONE;
+}
+
+// Scan decoder specialized for the predictor and the number of
+// components(NCOMP == 0: use self->components). The first row and the
+// first column, which use fixed predictors, are peeled off the inner loop.
+//
+// NOTE: pixel data is stored in interleaved manner(RGBRGBRGB...)
+template <int PRED, int NCOMP>
+static int parseScanRows(ljp* self, lj92_bitreader* reader,
+                         const int* huff_idx) {
+  lj92_bitreader bits = *reader;  // Local copy, kept in registers
+  lj92_bitreader* br = &bits;
+  const int ncomp = (NCOMP > 0) ? NCOMP : self->components;
+  const int width = self->x;
+  const int rowlen = width * ncomp;
+  const int writelen = (self->writelen < rowlen) ? self->writelen : rowlen;
+  const int rows = ((self->writerows >= 0) && (self->writerows < self->y))
+                       ? self->writerows
+                       : self->y;
+  // Whole rows without linearization are decoded straight into the output.
+  // Otherwise rows are decoded into the row cache and copied.
+  const bool direct = (writelen == rowlen) && (self->linearize == NULL);
+  u16* out = self->image;
+  u16* thisrow = self->outrow[0];
+  u16* lastrow = self->outrow[1];
+  int ret;
+
+  for (int row = 0; row < rows; row++) {
+    u16* rowout = direct ? out : thisrow;
+
+    // First column: predicted from the base value or the value above.
+    for (int c = 0; c < ncomp; c++) {
+      const int Px = (row == 0) ? (1 << (self->bits - 1)) : lastrow[c];
+      ret = decodesample(self, br, huff_idx[c], Px, &thisrow[c], &rowout[c]);
+      if (ret != LJ92_ERROR_NONE) return ret;
+    }
+
+    if (row == 0) {
+      // First row: predicted from the left value.
+      for (int col = 1; col < width; col++) {
+        const int colx = col * ncomp;
+        for (int c = 0; c < ncomp; c++) {
+          ret = decodesample(self, br, huff_idx[c], thisrow[colx - ncomp + c],
+                             &thisrow[colx + c], &rowout[colx + c]);
+          if (ret != LJ92_ERROR_NONE) return ret;
+        }
+      }
+    } else {
+      for (int col = 1; col < width; col++) {
+        const int colx = col * ncomp;
+        for (int c = 0; c < ncomp; c++) {
+          const int Px =
+              predict<PRED>(thisrow[colx - ncomp + c], lastrow[colx + c],
+                            lastrow[colx - ncomp + c]);
+          ret = decodesample(self, br, huff_idx[c], Px, &thisrow[colx + c],
+                             &rowout[colx + c]);
+          if (ret != LJ92_ERROR_NONE) return ret;
+        }
+      }
+    }
+
+    if (!direct) {
       if (self->linearize) {
-        if (left > self->linlen) return LJ92_ERROR_CORRUPT;
-        linear = self->linearize[left];
-      } else
-        linear = left;
-      thisrow[col++] = left;
-      out[c++] = linear;
-      if (--write == 0) {
-        out += self->skiplen;
-        write = self->writelen;
-      }
-    }
-    temprow = lastrow;
+        for (int i = 0; i < writelen; i++) {
+          if (thisrow[i] > self->linlen) return LJ92_ERROR_CORRUPT;
+          out[i] = self->linearize[thisrow[i]];
+        }
+      } else {
+        memcpy(out, thisrow, sizeof(u16) * size_t(writelen));
+      }
+    }
+
+    // Swap pointers for input and working row buffer
+    u16* temprow = lastrow;
     lastrow = thisrow;
     thisrow = temprow;
-    if (self->ix >= self->datalen) break;
+
+    // Advance row of output buffer.
+    out += writelen + self->skiplen;
+  }
+
+  (*reader) = bits;
+  return LJ92_ERROR_NONE;
+}
+
+template <int PRED>
+static int parseScanPred(ljp* self, lj92_bitreader* br, const int* huff_idx) {
+  switch (self->components) {
+    case 1:
+      return parseScanRows<PRED, 1>(self, br, huff_idx);
+    case 2:
+      return parseScanRows<PRED, 2>(self, br, huff_idx);
+    case 3:
+      return parseScanRows<PRED, 3>(self, br, huff_idx);
+    case 4:
+      return parseScanRows<PRED, 4>(self, br, huff_idx);
+    default:
+      return parseScanRows<PRED, 0>(self, br, huff_idx);
   }
-  if (c >= pixels) ret = LJ92_ERROR_NONE;
-  return ret;
 }
 
 static int parseScan(ljp* self) {
@@ -1129,180 +2204,61 @@ static int parseScan(ljp* self) {
   TINY_DNG_DPRINTF("predicator %d\n", pred);
 
   if (pred < 0 || pred > 7) return ret;
+  if ((self->bits < 1) || (self->bits > 16)) return ret;
 
-  // Disable until parsePred6() consideres self->components.
-  // if (pred == 6) return parsePred6(self);  // Fast path
-
-  // TINY_DNG_DPRINTF("pref = %d\n", pred);
   self->ix += BEH(self->data[self->ix]);
   self->cnt = 0;
   self->b = 0;
-  // int write = self->writelen;
-  // Now need to decode huffman coded values
-  // int c = 0;
-  // int pixels = self->y * self->x * self->components;
-  u16* out = self->image;
-  u16* thisrow = self->outrow[0];
-  u16* lastrow = self->outrow[1];
+  if (self->num_huff_idx < 1) return ret;
 
-  // First pixel predicted from base value
-  int diff;
-  int Px = 0;
-  // int col = 0;
-  // int row = 0;
-  int left = 0;
-  // TINY_DNG_DPRINTF("w = %d, h = %d, components = %d, skiplen = %d\n",
-  // self->x,
-  // self->y,
-  //       self->components, self->skiplen);
-  for (int row = 0; row < self->y; row++) {
-    // TINY_DNG_DPRINTF("row = %d / %d\n", row, self->y);
-    // TINY_DNG_DPRINTF("thisrow %p, lastrow %p\n", thisrow, lastrow);
-    for (int col = 0; col < self->x; col++) {
-      int colx = col * self->components;
-
-      //
-      // NOTE: pixel data is stored in interleaved manner(RGBRGBRGB...)
-      //
-      for (int c = 0; c < self->components; c++) {
-        // TINY_DNG_DPRINTF("c = %d, col = %d, row = %d\n", c, col, row);
-        if ((col == 0) && (row == 0)) {
-          Px = 1 << (self->bits - 1);
-        } else if (row == 0) {
-          // Px = left;
-          if (col > 0) {
-            // ok
-          } else {
-            //TINY_DNG_ASSERT(col > 0, "Unexpected col.");
-            return LJ92_ERROR_CORRUPT;
-          }
-          Px = thisrow[(col - 1) * self->components + c];
-        } else if (col == 0) {
-          Px = lastrow[c];  // Use value above for first pixel in row
-        } else {
-          int prev_colx = (col - 1) * self->components;
-
-          // previous pixel
-          left = thisrow[prev_colx + c];
-
-          // TINY_DNG_DPRINTF("pred = %d\n", pred);
-          switch (pred) {
-            case 0:
-              Px = 0;
-              break;  // No prediction... should not be used
-            case 1:
-              Px = thisrow[prev_colx + c];
-              break;
-            case 2:
-              Px = lastrow[colx + c];
-              break;
-            case 3:
-              Px = lastrow[prev_colx + c];
-              break;
-            case 4:
-              Px = left + lastrow[colx + c] - lastrow[prev_colx + c];
-              break;
-            case 5:
-              Px = left + ((lastrow[colx + c] - lastrow[prev_colx + c]) >> 1);
-              break;
-            case 6:
-              Px = lastrow[colx + c] + ((left - lastrow[prev_colx + c]) >> 1);
-              break;
-            case 7:
-              Px = (left + lastrow[colx + c]) >> 1;
-              // printf("Px = %d, left = %d, lastrow[colx + c] = %d\n", Px,
-              // left, lastrow[colx + c]);
-              break;
-          }
-        }
-
-        int huff_idx = c;
-        if (c >= self->num_huff_idx) {
-          // Invalid huffman table index.
-          // Currently we assume # of huffman tables is 1.
-          TINY_DNG_ASSERT(self->num_huff_idx == 1,
-                          "Cannot handle >1 huffman tables.");
-          huff_idx = 0;  // Look up the first huffman table.
-        }
-
-        int errcode = LJ92_ERROR_NONE;
-        diff = nextdiff(self, huff_idx, Px, &errcode);
-        if (errcode != LJ92_ERROR_NONE) {
-          return errcode;
-        }
-
-        left = Px + diff;
-
-        if (left >= 0) {
-          // ok
-        } else {
-          //TINY_DNG_ASSERT(left >= 0, "left value must be positive.");
-          return LJ92_ERROR_CORRUPT;
-        }
-
-        if (left < 65536) {
-          // ok
-        } else {
-          //TINY_DNG_ASSERT(left < 65536,
-          //                "left value must be less than u16 max(65536).");
-          return LJ92_ERROR_CORRUPT;
-        }
-
-        left = (u16)(left % 65536);
-        // TINY_DNG_DPRINTF("row[%d] col[%d] c[%d] Px = %d, diff = %d, left =
-        // %d\n", row, col, c, Px, diff, left);
-        // Apple ProRAW gives -1 for `left`(=65535?), so uncommented negative
-        // left value check.
-        // TINY_DNG_ASSERT(left >= 0 && left < (1 << self->bits),
-        //                "Error huffman decoding.");
-        // TINY_DNG_DPRINTF("pix = %d\n", left);
-        // TINY_DNG_DPRINTF("%d %d %d\n",c,diff,left);
-        int linear;  // TODO: use u16?
-        if (self->linearize) {
-          if (left > self->linlen) return LJ92_ERROR_CORRUPT;
-          linear = self->linearize[u16(left)];
-        } else {
-          linear = left;
-        }
-
-        // TINY_DNG_DPRINTF("linear = %d\n", linear);
-        thisrow[colx + c] = left;
-        out[colx + c] = linear;
-      }  // c
-    }    // col
-
-    // Swap pointers for input and working row buffer
-    u16* temprow = lastrow;
-    lastrow = thisrow;
-    thisrow = temprow;
-
-    // Advance row of output buffer.
-    // NOTE: multiply
-    out += self->x * self->components + self->skiplen;
-    // TINY_DNG_DPRINTF("out = %p, %p, diff = %lld\n", out, self->image, out -
-    // self->image);
+  // Huffman table for each component.
+  int huff_idx[LJ92_MAX_COMPONENTS];
+  for (int c = 0; c < self->components; c++) {
+    huff_idx[c] = c;
+    if (c >= self->num_huff_idx) {
+      // Invalid huffman table index.
+      // Currently we assume # of huffman tables is 1.
+      TINY_DNG_ASSERT(self->num_huff_idx == 1,
+                      "Cannot handle >1 huffman tables.");
+      huff_idx[c] = 0;  // Look up the first huffman table.
+    }
+  }
 
-  }  // row
+  lj92_bitreader br;
+  br.b = 0;
+  br.cnt = 0;
+  br.ix = self->ix;
 
-  ret = LJ92_ERROR_NONE;
+  switch (pred) {
+    case 1:
+      ret = parseScanPred<1>(self, &br, huff_idx);
+      break;
+    case 2:
+      ret = parseScanPred<2>(self, &br, huff_idx);
+      break;
+    case 3:
+      ret = parseScanPred<3>(self, &br, huff_idx);
+      break;
+    case 4:
+      ret = parseScanPred<4>(self, &br, huff_idx);
+      break;
+    case 5:
+      ret = parseScanPred<5>(self, &br, huff_idx);
+      break;
+    case 6:
+      ret = parseScanPred<6>(self, &br, huff_idx);
+      break;
+    case 7:
+      ret = parseScanPred<7>(self, &br, huff_idx);
+      break;
+    default:
+      ret = parseScanRows<0, 0>(self, &br, huff_idx);
+      break;
+  }
 
-  // TINY_DNG_DPRINTF("out written = %d\n", int(out - self->image));
-
-  // if (++col == self->x) {
-  //	col = 0;
-  //	row++;
-  //}
-  // if (--write == 0) {
-  //	out += self->skiplen;
-  //	write = self->writelen;
-  //}
-  // if (self->ix >= self->datalen + 2) break;
-
-  // if (c >= pixels) ret = LJ92_ERROR_NONE;
-  /*for (int h=0;h<17;h++) {
-      TINY_DNG_DPRINTF("ssss:%d=%d
-  (%f)\n",h,self->sssshist[h],(float)self->sssshist[h]/(float)(pixels));
-  }*/
+  self->b = br.b;
+  self->cnt = br.cnt;
+  self->ix = br.ix;
   return ret;
 }
 
@@ -1346,6 +2302,15 @@ static int findSoI(ljp* self) {
 }
 
 static void free_memory(ljp* self) {
+  if (self->storage) {
+    // Memory is owned by the storage.
+    for (int i = 0; i < LJ92_MAX_COMPONENTS; i++) {
+      self->hufflut[i] = NULL;
+      self->fastlut[i] = NULL;
+    }
+    self->rowcache = NULL;
+    return;
+  }
 #ifdef SLOW_HUFF
   free(self->maxcode);
   self->maxcode = NULL;
@@ -1360,19 +2325,29 @@ static void free_memory(ljp* self) {
   free(self->huffcode);
   self->huffcode = NULL;
 #else
-  for (int i = 0; i < self->num_huff_idx; i++) {
+  for (int i = 0; i < LJ92_MAX_COMPONENTS; i++) {
     free(self->hufflut[i]);
     self->hufflut[i] = NULL;
+    free(self->fastlut[i]);
+    self->fastlut[i] = NULL;
   }
 #endif
   free(self->rowcache);
   self->rowcache = NULL;
 }
 
-int lj92_open(lj92* lj, const uint8_t* data, int datalen, int* width,
-              int* height, int* bitdepth) {
-  ljp* self = (ljp*)calloc(sizeof(ljp), 1);
-  if (self == NULL) return LJ92_ERROR_NO_MEMORY;
+int lj92_open_with_storage(lj92* lj, lj92_storage* storage,
+                           const uint8_t* data, int datalen, int* width,
+                           int* height, int* bitdepth) {
+  ljp* self = NULL;
+  if (storage) {
+    self = &storage->handle;
+    memset(self, 0, sizeof(ljp));
+    self->storage = storage;
+  } else {
+    self = (ljp*)calloc(sizeof(ljp), 1);
+    if (self == NULL) return LJ92_ERROR_NO_MEMORY;
+  }
 
   self->data = (u8*)data;
   self->dataend = self->data + datalen;
@@ -1382,7 +2357,9 @@ int lj92_open(lj92* lj, const uint8_t* data, int datalen, int* width,
   int ret = findSoI(self);
 
   if (ret == LJ92_ERROR_NONE) {
-    u16* rowcache = (u16*)calloc(self->x * self->components * 2, sizeof(u16));
+    u16* rowcache =
+        lj92_alloc(self, storage ? &storage->rowcache : NULL,
+                   size_t(self->x) * size_t(self->components) * 2);
     if (rowcache == NULL)
       ret = LJ92_ERROR_NO_MEMORY;
     else {
@@ -1395,7 +2372,7 @@ int lj92_open(lj92* lj, const uint8_t* data, int datalen, int* width,
   if (ret != LJ92_ERROR_NONE) {  // Failed, clean up
     *lj = NULL;
     free_memory(self);
-    free(self);
+    if (!storage) free(self);
   } else {
     *width = self->x;
     *height = self->y;
@@ -1405,14 +2382,22 @@ int lj92_open(lj92* lj, const uint8_t* data, int datalen, int* width,
   return ret;
 }
 
+int lj92_open(lj92* lj, const uint8_t* data, int datalen, int* width,
+              int* height, int* bitdepth) {
+  return lj92_open_with_storage(lj, NULL, data, datalen, width, height,
+                                bitdepth);
+}
+
 int lj92_decode(lj92 lj, uint16_t* target, int writeLength, int skipLength,
-                uint16_t* linearize, int linearizeLength) {
+                uint16_t* linearize, int linearizeLength, int writeRows) {
   int ret = LJ92_ERROR_NONE;
   ljp* self = lj;
   if (self == NULL) return LJ92_ERROR_BAD_HANDLE;
+  if ((writeLength < 0) || (skipLength < 0)) return LJ92_ERROR_CORRUPT;
   self->image = target;
   self->writelen = writeLength;
   self->skiplen = skipLength;
+  self->writerows = writeRows;
   self->linearize = linearize;
   self->linlen = linearizeLength;
   ret = parseScan(self);
@@ -1421,8 +2406,10 @@ int lj92_decode(lj92 lj, uint16_t* target, int writeLength, int skipLength,
 
 void lj92_close(lj92 lj) {
   ljp* self = lj;
-  if (self != NULL) free_memory(self);
-  free(self);
+  if (self == NULL) return;
+  const bool owned = (self->storage == NULL);
+  free_memory(self);
+  if (owned) free(self);
 }
 
 #if 0  // not used in tinydngloader at the moment.
@@ -2088,14 +3075,6 @@ static void cpy2(unsigned short* dst_val, const unsigned short* src_val) {
   dst[1] = src[1];
 }
 
-static void cpy2(short* dst_val, const short* src_val) {
-  unsigned char* dst = reinterpret_cast<unsigned char*>(dst_val);
-  const unsigned char* src = reinterpret_cast<const unsigned char*>(src_val);
-
-  dst[0] = src[0];
-  dst[1] = src[1];
-}
-
 static void cpy4(unsigned int* dst_val, const unsigned int* src_val) {
   unsigned char* dst = reinterpret_cast<unsigned char*>(dst_val);
   const unsigned char* src = reinterpret_cast<const unsigned char*>(src_val);
@@ -2106,16 +3085,6 @@ static void cpy4(unsigned int* dst_val, const unsigned int* src_val) {
   dst[3] = src[3];
 }
 
-static void cpy4(int* dst_val, const int* src_val) {
-  unsigned char* dst = reinterpret_cast<unsigned char*>(dst_val);
-  const unsigned char* src = reinterpret_cast<const unsigned char*>(src_val);
-
-  dst[0] = src[0];
-  dst[1] = src[1];
-  dst[2] = src[2];
-  dst[3] = src[3];
-}
-
 static void cpy8(uint64_t* dst_val, const uint64_t* src_val) {
   unsigned char* dst = reinterpret_cast<unsigned char*>(dst_val);
   const unsigned char* src = reinterpret_cast<const unsigned char*>(src_val);
@@ -2130,220 +3099,459 @@ static void cpy8(uint64_t* dst_val, const uint64_t* src_val) {
   dst[7] = src[7];
 }
 
-static void cpy8(int64_t* dst_val, const int64_t* src_val) {
-  unsigned char* dst = reinterpret_cast<unsigned char*>(dst_val);
-  const unsigned char* src = reinterpret_cast<const unsigned char*>(src_val);
-
-  dst[0] = src[0];
-  dst[1] = src[1];
-  dst[2] = src[2];
-  dst[3] = src[3];
-  dst[4] = src[4];
-  dst[5] = src[5];
-  dst[6] = src[6];
-  dst[7] = src[7];
-}
-
 
 ///
-/// Simple stream reader
+/// Keeps byte ranges fetched from a `ByteSource` so that `StreamReader` can
+/// hand out addresses of them.
 ///
-class StreamReader {
+/// Small reads(TIFF header, IFDs and tag values) fetch the enclosing
+/// `kBlockSize` aligned blocks. Larger ranges(strips and tiles) are fetched
+/// exactly. `prefetch` merges ranges closer than `kCoalesceGap` into one read.
+/// Fetched memory is kept until the cache is destroyed, thus returned
+/// addresses stay valid for its lifetime. Memory is allocated with
+/// `allocator`(NULL = system allocator).
+///
+class ByteSourceCache {
  public:
-  explicit StreamReader(const uint8_t* binary, const size_t length,
-                        const bool swap_endian)
-      : binary_(binary), length_(length), swap_endian_(swap_endian), idx_(0) {
-    (void)pad_;
-  }
-
-  bool seek_set(const uint64_t offset) const {
-    if (offset > length_) {
-      return false;
+  static const size_t kBlockSize = 64 * 1024;
+  static const uint64_t kCoalesceGap = 64 * 1024;
+
+  explicit ByteSourceCache(ByteSource* source, Allocator* allocator = NULL)
+      : source_(source),
+        size_(source->size()),
+        allocator_(allocator),
+        extents_(std::less<uint64_t>(), allocator),
+        storage_(allocator) {}
+
+  uint64_t size() const { return size_; }
+
+  // Returns the address of [offset, offset + len). NULL when the range is out
+  // of the source or `ByteSource::read_at` failed.
+  const uint8_t* map(const uint64_t offset, const size_t len) {
+    if ((offset > size_) || (len > size_ - offset)) {
+      return NULL;
     }
 
-    idx_ = offset;
-    return true;
-  }
+    // Whether the head of the range is already fetched.
+    bool head_cached = false;
+    {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+      std::lock_guard<std::mutex> lock(mutex_);
+#endif
+      const uint8_t* p = find(offset, len);
+      if (p) {
+        return p;
+      }
+      head_cached = (find(offset, 1) != NULL);
+    }
 
-  bool seek_from_currect(const int64_t offset) const {
-    if ((int64_t(idx_) + offset) < 0) {
-      return false;
+    uint64_t begin = offset;
+    uint64_t end = offset + len;
+    if (len < kBlockSize) {
+      if (!head_cached) {
+        begin = offset - (offset % kBlockSize);
+      }
+      end = (std::min)(size_, ((end + kBlockSize - 1) / kBlockSize) * kBlockSize);
     }
 
-    if (size_t((int64_t(idx_) + offset)) > length_) {
-      return false;
+    // Fetch without holding the lock so that decoders running in parallel
+    // can fetch their strips/tiles concurrently.
+    AllocVector<uint8_t> data(allocator_);
+    if (!fetch(begin, end, &data)) {
+      return NULL;
     }
 
-    idx_ = size_t(int64_t(idx_) + offset);
-    return true;
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+    std::lock_guard<std::mutex> lock(mutex_);
+#endif
+    return insert(begin, &data) + (offset - begin);
   }
 
-  size_t read(const size_t n, const uint64_t dst_len,
-              unsigned char* dst) const {
-    size_t len = n;
-    if ((idx_ + len) > length_) {
-      len = length_ - idx_;
+  // Copies [offset, offset + len) to `dst`. Ranges not in the cache are read
+  // from the source directly and are not kept.
+  bool read(const uint64_t offset, const size_t len, uint8_t* dst) {
+    if ((offset > size_) || (len > size_ - offset)) {
+      return false;
     }
 
-    if (len > 0) {
-      if (dst_len < len) {
-        // dst does not have enough space. return 0 for a while.
-        return 0;
+    if (len < kBlockSize) {
+      const uint8_t* p = map(offset, len);
+      if (!p) {
+        return false;
       }
-
-      memcpy(dst, &binary_[idx_], len);
-      idx_ += len;
-      return len;
-
-    } else {
-      return 0;
+      memcpy(dst, p, len);
+      return true;
     }
-  }
 
-  bool read1(unsigned char* ret) const {
-    if ((idx_ + 1) > length_) {
-      return false;
+    {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+      std::lock_guard<std::mutex> lock(mutex_);
+#endif
+      const uint8_t* p = find(offset, len);
+      if (p) {
+        memcpy(dst, p, len);
+        return true;
+      }
     }
 
-    const unsigned char val = binary_[idx_];
-
-    (*ret) = val;
-    idx_ += 1;
-
-    return true;
+    return source_->read_at(offset, len, dst);
   }
 
-  bool read_bool(bool* ret) const {
-    if ((idx_ + 1) > length_) {
-      return false;
-    }
-
-    const char val = static_cast<const char>(binary_[idx_]);
+  // Fetches `ranges`([begin, end) pairs) ahead of `map` calls.
+  bool prefetch(std::vector<std::pair<uint64_t, uint64_t> > ranges) {
+    std::sort(ranges.begin(), ranges.end());
 
-    (*ret) = bool(val);
-    idx_ += 1;
+    size_t k = 0;
+    while (k < ranges.size()) {
+      const uint64_t begin = ranges[k].first;
+      uint64_t end = ranges[k].second;
+      for (k++; k < ranges.size(); k++) {
+        if (ranges[k].first > end + kCoalesceGap) {
+          break;
+        }
+        end = (std::max)(end, ranges[k].second);
+      }
 
-    return true;
-  }
+      if ((begin >= end) || (end > size_)) {
+        return false;
+      }
 
-  bool read1(char* ret) const {
-    if ((idx_ + 1) > length_) {
-      return false;
+      {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+        std::lock_guard<std::mutex> lock(mutex_);
+#endif
+        if (find(begin, size_t(end - begin))) {
+          continue;
+        }
+      }
+
+      AllocVector<uint8_t> data(allocator_);
+      if (!fetch(begin, end, &data)) {
+        return false;
+      }
+
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+      std::lock_guard<std::mutex> lock(mutex_);
+#endif
+      insert(begin, &data);
+    }
+
+    return true;
+  }
+
+ private:
+  ByteSourceCache(const ByteSourceCache&);
+  ByteSourceCache& operator=(const ByteSourceCache&);
+
+  bool fetch(const uint64_t begin, const uint64_t end,
+             AllocVector<uint8_t>* data) const {
+    data->resize(size_t(end - begin));
+    return source_->read_at(begin, data->size(), data->data());
+  }
+
+  // Looks up the extent which starts at or before `offset`.
+  const uint8_t* find(const uint64_t offset, const size_t len) const {
+    ExtentMap::const_iterator it = extents_.upper_bound(offset);
+    if (it == extents_.begin()) {
+      return NULL;
+    }
+    --it;
+    if (offset + len > it->second.end) {
+      return NULL;
     }
+    return it->second.addr + (offset - it->first);
+  }
 
-    const char val = static_cast<const char>(binary_[idx_]);
+  const uint8_t* insert(const uint64_t begin, AllocVector<uint8_t>* data) {
+    storage_.push_back(AllocVector<uint8_t>(allocator_));
+    storage_.back().swap(*data);
 
-    (*ret) = val;
-    idx_ += 1;
+    Extent& e = extents_[begin];
+    const uint64_t end = begin + storage_.back().size();
+    // Keep the longer one when another thread fetched the same range. Memory
+    // of the other one is not freed since its address may be in use.
+    if (end > e.end) {
+      e.end = end;
+      e.addr = storage_.back().data();
+    }
+    return storage_.back().data();
+  }
 
+  struct Extent {
+    uint64_t end;
+    const uint8_t* addr;
+    Extent() : end(0), addr(NULL) {}
+  };
+
+  typedef std::map<uint64_t, Extent, std::less<uint64_t>,
+                   StlAllocator<std::pair<const uint64_t, Extent> > >
+      ExtentMap;
+  typedef std::list<AllocVector<uint8_t>, StlAllocator<AllocVector<uint8_t> > >
+      BlockList;
+
+  ByteSource* source_;
+  const uint64_t size_;
+  Allocator* allocator_;
+  ExtentMap extents_;  // Keyed by the begin offset.
+  BlockList storage_;
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::mutex mutex_;
+#endif
+};
+
+///
+/// Simple stream reader
+///
+/// Sequential reads(`read*`, `seek_set`) move the read position. Positional
+/// reads(`read_at`, `map_abs_addr`) do not, thus decoders use them to share
+/// one reader among threads.
+///
+/// The data is either a memory or a `ByteSourceCache`. In the latter case
+/// bytes are fetched from the source on first access.
+///
+class StreamReader {
+ public:
+  explicit StreamReader(const uint8_t* binary, const size_t length,
+                        const bool swap_endian)
+      : binary_(binary),
+        source_(NULL),
+        length_(length),
+        swap_endian_(swap_endian),
+        idx_(0) {
+    (void)pad_;
+  }
+
+  explicit StreamReader(ByteSourceCache* source, const bool swap_endian)
+      : binary_(NULL),
+        source_(source),
+        length_(size_t(source->size())),
+        swap_endian_(swap_endian),
+        idx_(0) {
+    (void)pad_;
+  }
+
+  bool seek_set(const uint64_t offset) const {
+    if (offset > length_) {
+      return false;
+    }
+
+    idx_ = offset;
     return true;
   }
 
-  bool read2(unsigned short* ret) const {
-    if ((idx_ + 2) > length_) {
+  bool seek_from_currect(const int64_t offset) const {
+    if ((int64_t(idx_) + offset) < 0) {
+      return false;
+    }
+
+    if (size_t((int64_t(idx_) + offset)) > length_) {
       return false;
     }
 
-    unsigned short val = 0;
-    cpy2(&val, reinterpret_cast<const unsigned short*>(&binary_[idx_]));
+    idx_ = size_t(int64_t(idx_) + offset);
+    return true;
+  }
 
-    if (swap_endian_) {
-      swap2(&val);
+  size_t read(const size_t n, const uint64_t dst_len,
+              unsigned char* dst) const {
+    size_t len = n;
+    if ((idx_ + len) > length_) {
+      len = length_ - idx_;
     }
 
-    (*ret) = val;
-    idx_ += 2;
+    if (len > 0) {
+      if (dst_len < len) {
+        // dst does not have enough space. return 0 for a while.
+        return 0;
+      }
+
+      const uint8_t* src = addr(idx_, len);
+      if (!src) {
+        return 0;
+      }
+
+      memcpy(dst, src, len);
+      idx_ += len;
+      return len;
+
+    } else {
+      return 0;
+    }
+  }
+
+  //
+  // Positional reads. They neither use nor modify the read position, thus
+  // one reader can be shared by multiple threads.
+  //
+
+  // Read `n` bytes at `offset` to `dst`. Fails when the range exceeds the
+  // data.
+  bool read_at(const uint64_t offset, const size_t n,
+               unsigned char* dst) const {
+    if ((offset > length_) || (n > length_ - offset)) {
+      return false;
+    }
 
+    if (n > 0) {
+      if (source_) {
+        return source_->read(offset, n, dst);
+      }
+      memcpy(dst, &binary_[offset], n);
+    }
     return true;
   }
 
-  bool read2(short* ret) const {
-    if ((idx_ + 2) > length_) {
+  // Read a value of type `T`(1, 2, 4 or 8 bytes) at `offset` with endian
+  // conversion.
+  template <typename T>
+  bool read_at(const uint64_t offset, T* ret) const {
+    if ((offset > length_) || (sizeof(T) > length_ - offset)) {
+      return false;
+    }
+
+    const uint8_t* src = addr(offset, sizeof(T));
+    if (!src) {
       return false;
     }
 
-    short val = 0;
-    cpy2(&val, reinterpret_cast<const short*>(&binary_[idx_]));
+    T val;
+    memcpy(&val, src, sizeof(T));
 
-    if (swap_endian_) {
-      swap2(reinterpret_cast<unsigned short*>(&val));
+    if (swap_endian_ && (sizeof(T) > 1)) {
+      unsigned char* p = reinterpret_cast<unsigned char*>(&val);
+      std::reverse(p, p + sizeof(T));
     }
 
     (*ret) = val;
-    idx_ += 2;
-
     return true;
   }
 
-  bool read4(unsigned int* ret) const {
-    if ((idx_ + 4) > length_) {
-      return false;
+  // Read SHORT or LONG value at `offset`.
+  bool read_uint_at(const uint64_t offset, const int type,
+                    uint64_t* ret) const {
+    if (type == TYPE_SHORT) {
+      unsigned short val;
+      if (!read_at(offset, &val)) {
+        return false;
+      }
+      (*ret) = val;
+      return true;
+    } else if (type == TYPE_LONG) {
+      unsigned int val;
+      if (!read_at(offset, &val)) {
+        return false;
+      }
+      (*ret) = val;
+      return true;
     }
+    return false;
+  }
 
-    unsigned int val = 0;
-    cpy4(&val, reinterpret_cast<const unsigned int*>(&binary_[idx_]));
+  bool read1(unsigned char* ret) const {
+    if ((idx_ + 1) > length_) {
+      return false;
+    }
 
-    if (swap_endian_) {
-      swap4(&val);
+    const uint8_t* src = addr(idx_, 1);
+    if (!src) {
+      return false;
     }
 
+    const unsigned char val = src[0];
+
     (*ret) = val;
-    idx_ += 4;
+    idx_ += 1;
 
     return true;
   }
 
-  bool read4(int* ret) const {
-    if ((idx_ + 4) > length_) {
+  bool read_bool(bool* ret) const {
+    if ((idx_ + 1) > length_) {
+      return false;
+    }
+
+    const uint8_t* src = addr(idx_, 1);
+    if (!src) {
       return false;
     }
 
-    int val = 0;
-    cpy4(&val, reinterpret_cast<const int*>(&binary_[idx_]));
+    const char val = static_cast<const char>(src[0]);
+
+    (*ret) = bool(val);
+    idx_ += 1;
+
+    return true;
+  }
+
+  bool read1(char* ret) const {
+    if ((idx_ + 1) > length_) {
+      return false;
+    }
 
-    if (swap_endian_) {
-      swap4(&val);
+    const uint8_t* src = addr(idx_, 1);
+    if (!src) {
+      return false;
     }
 
+    const char val = static_cast<const char>(src[0]);
+
     (*ret) = val;
-    idx_ += 4;
+    idx_ += 1;
 
     return true;
   }
 
-  bool read8(uint64_t* ret) const {
-    if ((idx_ + 8) > length_) {
+  bool read2(unsigned short* ret) const {
+    if (!read_at(idx_, ret)) {
       return false;
     }
 
-    uint64_t val = 0;
-    cpy8(&val, reinterpret_cast<const uint64_t*>(&binary_[idx_]));
+    idx_ += 2;
+    return true;
+  }
 
-    if (swap_endian_) {
-      swap8(&val);
+  bool read2(short* ret) const {
+    if (!read_at(idx_, ret)) {
+      return false;
     }
 
-    (*ret) = val;
-    idx_ += 8;
+    idx_ += 2;
+    return true;
+  }
+
+  bool read4(unsigned int* ret) const {
+    if (!read_at(idx_, ret)) {
+      return false;
+    }
 
+    idx_ += 4;
     return true;
   }
 
-  bool read8(int64_t* ret) const {
-    if ((idx_ + 8) > length_) {
+  bool read4(int* ret) const {
+    if (!read_at(idx_, ret)) {
       return false;
     }
 
-    int64_t val = 0;
-    cpy8(&val, reinterpret_cast<const int64_t*>(&binary_[idx_]));
+    idx_ += 4;
+    return true;
+  }
 
-    if (swap_endian_) {
-      swap8(&val);
+  bool read8(uint64_t* ret) const {
+    if (!read_at(idx_, ret)) {
+      return false;
     }
 
-    (*ret) = val;
     idx_ += 8;
+    return true;
+  }
 
+  bool read8(int64_t* ret) const {
+    if (!read_at(idx_, ret)) {
+      return false;
+    }
+
+    idx_ += 8;
     return true;
   }
 
@@ -2463,7 +3671,7 @@ class StreamReader {
   //
   // @return nullptr when failed to map address.
   //
-  const uint8_t* map_addr(size_t offset, const size_t length) {
+  const uint8_t* map_addr(size_t offset, const size_t length) const {
     if (length == 0) {
       return NULL;
     }
@@ -2476,7 +3684,7 @@ class StreamReader {
       return NULL;
     }
 
-    return &binary_[idx_ + offset];
+    return addr(idx_ + offset, length);
   }
 
   //
@@ -2492,7 +3700,7 @@ class StreamReader {
   //
   // @return nullptr when failed to map address.
   //
-  const uint8_t* map_abs_addr(size_t pos, const size_t length) {
+  const uint8_t* map_abs_addr(size_t pos, const size_t length) const {
     if (length == 0) {
       return NULL;
     }
@@ -2505,28 +3713,46 @@ class StreamReader {
       return NULL;
     }
 
-    return &binary_[pos];
+    return addr(pos, length);
   }
 
   size_t tell() const { return idx_; }
 
-  const uint8_t* data() const { return binary_; }
-
   bool swap_endian() const { return swap_endian_; }
 
   size_t size() const { return length_; }
 
+  // NULL when the data is a memory.
+  ByteSourceCache* source() const { return source_; }
+
  private:
+  // Address of [offset, offset + n). The range must be checked by the caller.
+  const uint8_t* addr(const uint64_t offset, const size_t n) const {
+    if (source_) {
+      return source_->map(offset, n);
+    }
+    return &binary_[offset];
+  }
+
   const uint8_t* binary_;
+  ByteSourceCache* source_;
   const size_t length_;
   bool swap_endian_;
   char pad_[7];
   mutable uint64_t idx_;
 };
 
-static bool GetTIFFTag(const StreamReader& sr, unsigned short* tag,
-                       unsigned short* type, unsigned int* len,
-                       unsigned int* saved_offt) {
+//
+// Read a TIFF IFD entry and move the read position to its value.
+//
+// Classic TIFF entry is 12 bytes: tag(2), type(2), count(4), value(4).
+// BigTIFF entry is 20 bytes: tag(2), type(2), count(8), value(8).
+// A value which does not fit in the value field is stored at the offset
+// written in the field.
+//
+static bool GetTIFFTag(const StreamReader& sr, const bool big_tiff,
+                       unsigned short* tag, unsigned short* type,
+                       unsigned int* len, size_t* saved_offt) {
   if (!sr.read2(tag)) {
     return false;
   }
@@ -2535,19 +3761,41 @@ static bool GetTIFFTag(const StreamReader& sr, unsigned short* tag,
     return false;
   }
 
-  if (!sr.read4(len)) {
-    return false;
+  if (big_tiff) {
+    uint64_t count = 0;
+    if (!sr.read8(&count)) {
+      return false;
+    }
+    if (count > uint64_t((std::numeric_limits<unsigned int>::max)())) {
+      return false;
+    }
+    (*len) = static_cast<unsigned int>(count);
+  } else {
+    if (!sr.read4(len)) {
+      return false;
+    }
   }
 
-  (*saved_offt) = static_cast<unsigned int>(sr.tell()) + 4;
+  const size_t field_size = big_tiff ? 8 : 4;
 
-  size_t typesize_table[] = {1, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4};
+  (*saved_offt) = sr.tell() + field_size;
 
-  if ((*len) * (typesize_table[(*type) < 14 ? (*type) : 0]) > 4) {
-    unsigned int base = 0;  // fixme
-    unsigned int offt = 0;
-    if (!sr.read4(&offt)) {
-      return false;
+  size_t typesize_table[] = {1, 1, 1, 2, 4, 8, 1, 1, 2, 4,
+                             8, 4, 8, 4, 1, 1, 8, 8, 8};
+
+  if ((*len) * (typesize_table[(*type) < 19 ? (*type) : 0]) > field_size) {
+    uint64_t base = 0;  // fixme
+    uint64_t offt = 0;
+    if (big_tiff) {
+      if (!sr.read8(&offt)) {
+        return false;
+      }
+    } else {
+      unsigned int offt32 = 0;
+      if (!sr.read4(&offt32)) {
+        return false;
+      }
+      offt = offt32;
     }
     if (!sr.seek_set(offt + base)) {
       return false;
@@ -2557,46 +3805,191 @@ static bool GetTIFFTag(const StreamReader& sr, unsigned short* tag,
   return true;
 }
 
-static void InitializeDNGImage(tinydng::DNGImage* image) {
-  image->version = 0;
+// Read an offset or a byte count(StripOffsets, SubIFDs, etc) of `type` at
+// the current position. SHORT, LONG8 and IFD8 are read as is and other types
+// are read as LONG.
+static bool ReadTIFFOffset(const StreamReader& sr, const unsigned short type,
+                           uint64_t* ret) {
+  if (type == TYPE_SHORT) {
+    unsigned short val;
+    if (!sr.read2(&val)) {
+      return false;
+    }
+    (*ret) = val;
+  } else if ((type == TYPE_LONG8) || (type == TYPE_IFD8)) {
+    if (!sr.read8(ret)) {
+      return false;
+    }
+  } else {
+    unsigned int val;
+    if (!sr.read4(&val)) {
+      return false;
+    }
+    (*ret) = val;
+  }
+  return true;
+}
 
-  image->color_matrix1[0][0] = 1.0;
-  image->color_matrix1[0][1] = 0.0;
-  image->color_matrix1[0][2] = 0.0;
-  image->color_matrix1[1][0] = 0.0;
-  image->color_matrix1[1][1] = 1.0;
-  image->color_matrix1[1][2] = 0.0;
-  image->color_matrix1[2][0] = 0.0;
-  image->color_matrix1[2][1] = 0.0;
-  image->color_matrix1[2][2] = 1.0;
+// Element type of StripOffsets/StripByteCounts array. Types other than SHORT,
+// LONG8 and IFD8 are read as LONG.
+static inline unsigned short ArrayTypeOf(const unsigned short type) {
+  if ((type == TYPE_SHORT) || (type == TYPE_LONG8) || (type == TYPE_IFD8)) {
+    return type;
+  }
+  return TYPE_LONG;
+}
 
-  image->color_matrix2[0][0] = 1.0;
-  image->color_matrix2[0][1] = 0.0;
-  image->color_matrix2[0][2] = 0.0;
-  image->color_matrix2[1][0] = 0.0;
-  image->color_matrix2[1][1] = 1.0;
-  image->color_matrix2[1][2] = 0.0;
-  image->color_matrix2[2][0] = 0.0;
-  image->color_matrix2[2][1] = 0.0;
-  image->color_matrix2[2][2] = 1.0;
+// Read `count` SHORT, LONG or LONG8(IFD8) values located at `offt`.
+// Does not modify the read position of `sr`.
+static bool ReadTIFFUIntArray(const StreamReader& sr, const size_t offt,
+                              const unsigned short type,
+                              const unsigned int count,
+                              std::vector<uint64_t>* values) {
+  values->clear();
 
-  image->forward_matrix1[0][0] = 1.0;
-  image->forward_matrix1[0][1] = 0.0;
-  image->forward_matrix1[0][2] = 0.0;
-  image->forward_matrix1[1][0] = 0.0;
-  image->forward_matrix1[1][1] = 1.0;
-  image->forward_matrix1[1][2] = 0.0;
-  image->forward_matrix1[2][0] = 0.0;
-  image->forward_matrix1[2][1] = 0.0;
-  image->forward_matrix1[2][2] = 1.0;
+  if (count == 0) {
+    return true;
+  }
 
-  image->forward_matrix2[0][0] = 1.0;
-  image->forward_matrix2[0][1] = 0.0;
-  image->forward_matrix2[0][2] = 0.0;
-  image->forward_matrix2[1][0] = 0.0;
-  image->forward_matrix2[1][1] = 1.0;
-  image->forward_matrix2[1][2] = 0.0;
-  image->forward_matrix2[2][0] = 0.0;
+  const bool is_long8 = (type == TYPE_LONG8) || (type == TYPE_IFD8);
+  const size_t type_size = (type == TYPE_SHORT) ? 2 : (is_long8 ? 8 : 4);
+  if (((type != TYPE_SHORT) && (type != TYPE_LONG) && !is_long8) ||
+      (offt >= sr.size()) ||
+      (size_t(count) > (sr.size() - offt) / type_size)) {
+    return false;
+  }
+
+  // Map the whole array at once so that a `ByteSource` is read with one
+  // request.
+  const uint8_t* src = sr.map_abs_addr(offt, size_t(count) * type_size);
+  if (!src) {
+    return false;
+  }
+
+  values->resize(count);
+  for (size_t k = 0; k < count; k++) {
+    if (type == TYPE_SHORT) {
+      unsigned short val;
+      memcpy(&val, src + k * 2, 2);
+      if (sr.swap_endian()) {
+        swap2(&val);
+      }
+      (*values)[k] = val;
+    } else if (is_long8) {
+      uint64_t val;
+      memcpy(&val, src + k * 8, 8);
+      if (sr.swap_endian()) {
+        swap8(&val);
+      }
+      (*values)[k] = val;
+    } else {
+      unsigned int val;
+      memcpy(&val, src + k * 4, 4);
+      if (sr.swap_endian()) {
+        swap4(&val);
+      }
+      (*values)[k] = val;
+    }
+  }
+
+  return true;
+}
+
+// Check that the tile table of `image` covers all tiles and that every tile
+// lies within the file.
+static bool ValidateTileTable(const StreamReader& sr,
+                              const tinydng::DNGImage& image,
+                              std::string* err) {
+  if (image.tile_offsets.size() != image.tile_byte_counts.size()) {
+    if (err) {
+      (*err) +=
+          "The number of TileOffsets and TileByteCounts does not match.\n";
+    }
+    return false;
+  }
+
+  if ((image.tile_width > 0) && (image.tile_length > 0) && (image.width > 0) &&
+      (image.height > 0)) {
+    const uint64_t tiles_across =
+        (uint64_t(image.width) + uint64_t(image.tile_width) - 1) /
+        uint64_t(image.tile_width);
+    const uint64_t tiles_down =
+        (uint64_t(image.height) + uint64_t(image.tile_length) - 1) /
+        uint64_t(image.tile_length);
+    uint64_t num_tiles = tiles_across * tiles_down;
+    if ((image.planar_configuration == 2) && (image.samples_per_pixel > 0)) {
+      num_tiles *= uint64_t(image.samples_per_pixel);
+    }
+
+    if (uint64_t(image.tile_offsets.size()) < num_tiles) {
+      if (err) {
+        std::stringstream ss;
+        ss << "TileOffsets has " << image.tile_offsets.size()
+           << " entries but " << num_tiles << " tiles are required.\n";
+        (*err) += ss.str();
+      }
+      return false;
+    }
+  }
+
+  const uint64_t file_size = uint64_t(sr.size());
+  for (size_t k = 0; k < image.tile_offsets.size(); k++) {
+    const uint64_t offt = image.tile_offsets[k];
+    const uint64_t count = image.tile_byte_counts[k];
+    if ((offt == 0) || (offt >= file_size) || (count > file_size - offt)) {
+      if (err) {
+        std::stringstream ss;
+        ss << "Tile " << k << " is out of file range(offset " << offt
+           << ", byte count " << count << ").\n";
+        (*err) += ss.str();
+      }
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void InitializeDNGImage(tinydng::DNGImage* image) {
+  image->version = 0;
+
+  image->color_matrix1[0][0] = 1.0;
+  image->color_matrix1[0][1] = 0.0;
+  image->color_matrix1[0][2] = 0.0;
+  image->color_matrix1[1][0] = 0.0;
+  image->color_matrix1[1][1] = 1.0;
+  image->color_matrix1[1][2] = 0.0;
+  image->color_matrix1[2][0] = 0.0;
+  image->color_matrix1[2][1] = 0.0;
+  image->color_matrix1[2][2] = 1.0;
+
+  image->color_matrix2[0][0] = 1.0;
+  image->color_matrix2[0][1] = 0.0;
+  image->color_matrix2[0][2] = 0.0;
+  image->color_matrix2[1][0] = 0.0;
+  image->color_matrix2[1][1] = 1.0;
+  image->color_matrix2[1][2] = 0.0;
+  image->color_matrix2[2][0] = 0.0;
+  image->color_matrix2[2][1] = 0.0;
+  image->color_matrix2[2][2] = 1.0;
+
+  image->forward_matrix1[0][0] = 1.0;
+  image->forward_matrix1[0][1] = 0.0;
+  image->forward_matrix1[0][2] = 0.0;
+  image->forward_matrix1[1][0] = 0.0;
+  image->forward_matrix1[1][1] = 1.0;
+  image->forward_matrix1[1][2] = 0.0;
+  image->forward_matrix1[2][0] = 0.0;
+  image->forward_matrix1[2][1] = 0.0;
+  image->forward_matrix1[2][2] = 1.0;
+
+  image->forward_matrix2[0][0] = 1.0;
+  image->forward_matrix2[0][1] = 0.0;
+  image->forward_matrix2[0][2] = 0.0;
+  image->forward_matrix2[1][0] = 0.0;
+  image->forward_matrix2[1][1] = 1.0;
+  image->forward_matrix2[1][2] = 0.0;
+  image->forward_matrix2[2][0] = 0.0;
   image->forward_matrix2[2][1] = 0.0;
   image->forward_matrix2[2][2] = 1.0;
 
@@ -2661,10 +4054,18 @@ static void InitializeDNGImage(tinydng::DNGImage* image) {
   image->cfa_layout = 1;
 
   image->offset = 0;
+  image->new_subfile_type = 0;
 
   image->tile_width = -1;
   image->tile_length = -1;
   image->tile_offset = 0;
+  image->tile_byte_count = 0;
+
+  image->data_offset = 0;
+  image->data_byte_count = 0;
+
+  image->external_data = NULL;
+  image->row_stride = 0;
 
   image->planar_configuration = 1;  // chunky
 
@@ -2696,14 +4097,18 @@ static void InitializeDNGImage(tinydng::DNGImage* image) {
 
 // Check if JPEG data is lossless JPEG or not(baseline JPEG)
 static bool IsLosslessJPEG(const uint8_t* header_addr, int data_len, int* width,
-                           int* height, int* bits, int* components) {
+                           int* height, int* bits, int* components,
+                           lj92_storage* storage = NULL) {
   TINY_DNG_DPRINTF("islossless jpeg\n");
   int lj_width = 0;
   int lj_height = 0;
   int lj_bits = 0;
   lj92 ljp;
-  int ret =
-      lj92_open(&ljp, header_addr, data_len, &lj_width, &lj_height, &lj_bits);
+  int ret = storage ? lj92_open_with_storage(&ljp, storage, header_addr,
+                                             data_len, &lj_width, &lj_height,
+                                             &lj_bits)
+                    : lj92_open(&ljp, header_addr, data_len, &lj_width,
+                                &lj_height, &lj_bits);
   if (ret == LJ92_ERROR_NONE) {
     // TINY_DNG_DPRINTF("w = %d, h = %d, bits = %d, components = %d\n",
     // lj_width,
@@ -2727,2253 +4132,5409 @@ static bool IsLosslessJPEG(const uint8_t* header_addr, int data_len, int* width,
   return (ret == LJ92_ERROR_NONE) ? true : false;
 }
 
-#ifdef TINY_DNG_LOADER_ENABLE_ZIP
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
 
-static bool DecompressZIP(unsigned char* dst,
-                          unsigned long* uncompressed_size /* inout */,
-                          const unsigned char* src, unsigned long src_size,
-                          std::string* err) {
-  std::vector<unsigned char> tmpBuf(*uncompressed_size);
+struct ThreadPool::Impl {
+  // A set of tasks created by one `parallel_for` call.
+  struct Job {
+    const std::function<void(size_t, size_t)>* func;
+    std::atomic<size_t> pending;  // # of tasks not yet finished.
+    std::mutex mutex;
+    std::condition_variable done;
+#if !defined(TINY_DNG_NO_EXCEPTION)
+    std::exception_ptr exception;  // The first exception thrown by a task.
+#endif
+  };
 
-#ifdef TINY_DNG_LOADER_USE_SYSTEM_ZLIB
-  int ret = uncompress(&tmpBuf.at(0), uncompressed_size, src, src_size);
-  if (Z_OK != ret) {
-    if (err) {
-      std::stringstream ss;
-      ss << "zlib uncompress failed. code = " << ret << "\n";
-      (*err) += ss.str();
-    }
-    return false;
+  struct Task {
+    Job* job;
+    size_t begin;
+    size_t end;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<Queue> > queues;  // One per worker.
+  std::atomic<size_t> num_queued;
+  std::atomic<size_t> next_queue;
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+  bool stop;
+
+  // Index of the worker running on the current thread. -1 for other threads.
+  static int& WorkerIndex() {
+    static thread_local int index = -1;
+    return index;
   }
-#else
-  int ret = mz_uncompress(&tmpBuf.at(0), uncompressed_size, src, src_size);
-  if (MZ_OK != ret) {
-    if (err) {
-      std::stringstream ss;
-      ss << "mz_uncompress failed. code = " << ret << "\n";
-      (*err) += ss.str();
+
+  static const Impl*& WorkerPool() {
+    static thread_local const Impl* pool = NULL;
+    return pool;
+  }
+
+  int CurrentWorker() const {
+    return (WorkerPool() == this) ? WorkerIndex() : -1;
+  }
+
+  void Push(size_t q, const Task& task) {
+    {
+      std::lock_guard<std::mutex> lock(queues[q]->mutex);
+      queues[q]->tasks.push_back(task);
     }
-    return false;
+    num_queued++;
   }
-#endif
 
-  memcpy(dst, tmpBuf.data(), (*uncompressed_size));
+  // Pop a task from the back of own queue(LIFO), otherwise steal one from the
+  // front of other workers' queues.
+  bool Pop(int self, Task* task) {
+    if (num_queued == 0) {
+      return false;
+    }
 
-  return true;
-}
+    const size_t n = queues.size();
+    if (self >= 0) {
+      Queue& q = *queues[size_t(self)];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        (*task) = q.tasks.back();
+        q.tasks.pop_back();
+        num_queued--;
+        return true;
+      }
+    }
 
-// Assume T = uint8 or uint16
-static bool UnpredictImageU8(std::vector<uint8_t>& dst,  // inout
-                             int predictor, const size_t width,
-                             const size_t rows, const size_t spp) {
-  if (predictor == 1) {
-    // no prediction shceme
-    return true;
-  } else if (predictor == 2) {
-    // horizontal diff
-    const size_t stride = size_t(width * spp);
-    for (size_t row = 0; row < rows; row++) {
-      for (size_t c = 0; c < spp; c++) {
-        unsigned int b = dst[row * stride + c];
-        for (size_t col = 1; col < width; col++) {
-          // value may overflow(wrap over), but its expected behavior.
-          b += dst[stride * row + spp * col + c];
-          dst[stride * row + spp * col + c] =
-              static_cast<unsigned char>(b & 0xFF);
-        }
+    const size_t start = (self >= 0) ? size_t(self) + 1 : next_queue++;
+    for (size_t i = 0; i < n; i++) {
+      Queue& q = *queues[(start + i) % n];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        (*task) = q.tasks.front();
+        q.tasks.pop_front();
+        num_queued--;
+        return true;
       }
     }
-    return true;
-  } else {
-    // TODO
+
     return false;
   }
-}
-
-static bool DecompressZIPedTile(const StreamReader& sr, unsigned char* dst_data,
-                                int dst_width, const DNGImage& image_info,
-                                std::string* err) {
-  unsigned int tiff_h = 0, tiff_w = 0;
-  int offset = 0;
-
-  (void)dst_data;
-  (void)dst_width;
 
-#ifdef TINY_DNG_LOADER_PROFILING
-  auto start_t = std::chrono::system_clock::now();
+  static void Run(const Task& task) {
+    Job* job = task.job;
+#if !defined(TINY_DNG_NO_EXCEPTION)
+    try {
+      (*job->func)(task.begin, task.end);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      if (!job->exception) {
+        job->exception = std::current_exception();
+      }
+    }
+#else
+    (*job->func)(task.begin, task.end);
 #endif
 
-  TINY_DNG_DPRINTF("tile_offset = %d\n", int(image_info.tile_offset));
+    // Decrement under the lock so that the waiting thread does not destroy
+    // `job` while it is still in use here.
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (--job->pending == 0) {
+      job->done.notify_all();
+    }
+  }
 
-  if ((image_info.tile_width > 0) && (image_info.tile_length > 0)) {
-    // Assume ZIP is stored in tiled format.
-    TINY_DNG_ASSERT(image_info.tile_width > 0, "Invalid tile width.");
-    TINY_DNG_ASSERT(image_info.tile_length > 0, "Invalid tile length.");
+  void WorkerLoop(int index) {
+    WorkerIndex() = index;
+    WorkerPool() = this;
 
-    // <-       image width(skip len)           ->
-    // +-----------------------------------------+
-    // |                                         |
-    // |              <- tile w  ->              |
-    // |              +-----------+              |
-    // |              |           | \            |
-    // |              |           | |            |
-    // |              |           | | tile h     |
-    // |              |           | |            |
-    // |              |           | /            |
-    // |              +-----------+              |
-    // |                                         |
-    // |                                         |
-    // +-----------------------------------------+
+    for (;;) {
+      Task task;
+      if (Pop(index, &task)) {
+        Run(task);
+        continue;
+      }
 
-    TINY_DNG_DPRINTF("tile = %d, %d\n", image_info.tile_width,
-                     image_info.tile_length);
-    TINY_DNG_DPRINTF("w, h = %d, %d\n", image_info.width, image_info.height);
+      std::unique_lock<std::mutex> lock(wake_mutex);
+      wake.wait(lock, [this]() { return stop || (num_queued > 0); });
+      if (stop && (num_queued == 0)) {
+        return;
+      }
+    }
+  }
+};
 
-    // Currently we only support tile data for tile.length == tiff.height.
-    // assert(image_info.tile_length == image_info.height);
+ThreadPool::ThreadPool(int num_threads) : impl_(new Impl()) {
+  if (num_threads <= 0) {
+    num_threads = (std::max)(1, int(std::thread::hardware_concurrency()));
+  }
 
-    size_t column_step = 0;
-    while (tiff_h < static_cast<unsigned int>(image_info.height)) {
-      TINY_DNG_DPRINTF("sr tell = %d\n", int(sr.tell()));
-
-      if ((image_info.width <= image_info.tile_width) &&
-          (image_info.height <= image_info.tile_length)) {
-        // Only 1 tile in the image and tile size is larger than image size.
-        // Use image_info.tile_offset
-        // FIXME(syoyo): Record tag len in somewhere and lookup it to count the
-        // number of tiles in the image.
-        offset = int(image_info.tile_offset);
-      } else {
-        // Read offset to data location.
-        if (!sr.read4(&offset)) {
-          if (err) {
-            (*err) +=
-                "Failed to read offset to image data location in "
-                "DecompressZip.\n";
-          }
-          return false;
-        }
-        TINY_DNG_DPRINTF("offt = %d\n", offset);
-      }
+  impl_->num_queued = 0;
+  impl_->next_queue = 0;
+  impl_->stop = false;
+
+  // The calling thread of `parallel_for` is also used, so spawn
+  // `num_threads - 1` workers.
+  const size_t num_workers = size_t(num_threads - 1);
+  for (size_t i = 0; i < num_workers; i++) {
+    impl_->queues.emplace_back(new Impl::Queue());
+  }
+  for (size_t i = 0; i < num_workers; i++) {
+    impl_->workers.emplace_back(&Impl::WorkerLoop, impl_, int(i));
+  }
+}
 
-      size_t input_len = sr.size() - static_cast<size_t>(offset);
-      unsigned long uncompressed_size =
-          static_cast<unsigned long>(
-              image_info.samples_per_pixel * image_info.tile_width *
-              image_info.tile_length * image_info.bits_per_sample) /
-          static_cast<unsigned long>(8);
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(impl_->wake_mutex);
+    impl_->stop = true;
+  }
+  impl_->wake.notify_all();
+  for (size_t i = 0; i < impl_->workers.size(); i++) {
+    impl_->workers[i].join();
+  }
+  delete impl_;
+}
 
-      std::vector<uint8_t> tmp_buf;
-      tmp_buf.resize(uncompressed_size);
+int ThreadPool::num_threads() const { return int(impl_->workers.size()) + 1; }
 
-      if (!DecompressZIP(tmp_buf.data(), &uncompressed_size, sr.data() + offset,
-                         static_cast<unsigned long>(input_len), err)) {
-        if (err) {
-          (*err) += "Failed to decode ZIP data.\n";
-        }
-        return false;
-      }
+void ThreadPool::parallel_for(
+    size_t n, const std::function<void(size_t begin, size_t end)>& func) {
+  if (n == 0) {
+    return;
+  }
 
-      if (!UnpredictImageU8(tmp_buf, image_info.predictor,
-                            size_t(image_info.tile_width),
-                            size_t(image_info.tile_length),
-                            size_t(image_info.samples_per_pixel))) {
-        if (err) {
-          (*err) += "Failed to unpredict ZIP-ed tile image.\n";
-        }
-        return false;
-      }
+  const size_t num_workers = impl_->workers.size();
+  if ((num_workers == 0) || (n == 1)) {
+    func(0, n);
+    return;
+  }
 
-      // Copy to dest buffer.
-      // NOTE: For some DNG file, tiled image may exceed the extent of target
-      // image resolution.
-      const size_t spp = size_t(image_info.samples_per_pixel);
+  // Split into several tasks per thread so that idle workers can steal the
+  // remaining work of busy workers.
+  const size_t num_tasks = (std::min)(n, 4 * (num_workers + 1));
 
-      for (unsigned int y = 0;
-           y < static_cast<unsigned int>(image_info.tile_length); y++) {
-        unsigned int y_offset = y + tiff_h;
-        if (y_offset >= static_cast<unsigned int>(image_info.height)) {
-          continue;
-        }
+  Impl::Job job;
+  job.func = &func;
+  job.pending = num_tasks;
 
-        size_t dst_offset =
-            tiff_w + static_cast<unsigned int>(dst_width) * y_offset;
+  const int self = impl_->CurrentWorker();
+  for (size_t t = 0; t < num_tasks; t++) {
+    Impl::Task task;
+    task.job = &job;
+    task.begin = (n * t) / num_tasks;
+    task.end = (n * (t + 1)) / num_tasks;
 
-        size_t x_len = static_cast<size_t>(image_info.tile_width);
-        if ((tiff_w + static_cast<unsigned int>(image_info.tile_width)) >=
-            static_cast<unsigned int>(dst_width)) {
-          x_len = static_cast<size_t>(dst_width) - tiff_w;
-        }
+    // Nested call from a worker keeps tasks in its own queue. Otherwise
+    // distribute tasks to all workers.
+    const size_t q = (self >= 0) ? size_t(self) : (t % num_workers);
+    impl_->Push(q, task);
+  }
 
-        for (size_t x = 0; x < x_len; x++) {
-          for (size_t c = 0; c < spp; c++) {
-            dst_data[spp * (dst_offset + x) + c] =
-                tmp_buf[spp * (y * static_cast<size_t>(image_info.tile_width) +
-                               x) +
-                        c];
-          }
-        }
-      }
+  {
+    std::lock_guard<std::mutex> lock(impl_->wake_mutex);
+  }
+  impl_->wake.notify_all();
 
-      tiff_w += static_cast<unsigned int>(image_info.tile_width);
-      column_step++;
-      // TINY_DNG_DPRINTF("col = %d, tiff_w = %d / %d\n", column_step, tiff_w,
-      // image_info.width);
-      if (tiff_w >= static_cast<unsigned int>(image_info.width)) {
-        // tiff_h += static_cast<unsigned int>(image_info.tile_length);
-        tiff_h += static_cast<unsigned int>(image_info.tile_length);
-        // TINY_DNG_DPRINTF("tiff_h = %d\n", tiff_h);
-        tiff_w = 0;
-        column_step = 0;
-      }
+  // Help executing tasks until all tasks of this job are finished.
+  while (job.pending > 0) {
+    Impl::Task task;
+    if (impl_->Pop(self, &task)) {
+      Impl::Run(task);
+      continue;
     }
-  } else {
-    // Assume ZIP data is not stored in tiled format.
 
-    TINY_DNG_DPRINTF("width = %d", int(image_info.width));
-    TINY_DNG_DPRINTF("height = %d", int(image_info.height));
+    std::unique_lock<std::mutex> lock(job.mutex);
+    job.done.wait(lock, [&job]() { return job.pending == 0; });
+  }
 
-    TINY_DNG_ASSERT(image_info.offset > 0, "Invalid ZIPed data offset.");
-    offset = static_cast<int>(image_info.offset);
+  // Wait for the last task to release `job.mutex`.
+  std::lock_guard<std::mutex> lock(job.mutex);
 
-    size_t input_len = sr.size() - static_cast<size_t>(offset);
-    unsigned long uncompressed_size =
-        static_cast<unsigned long>(image_info.samples_per_pixel *
-                                   image_info.width * image_info.height *
-                                   image_info.bits_per_sample) /
-        static_cast<unsigned long>(8);
+#if !defined(TINY_DNG_NO_EXCEPTION)
+  if (job.exception) {
+    std::rethrow_exception(job.exception);
+  }
+#endif
+}
 
-    std::vector<uint8_t> tmp_buf;
-    tmp_buf.resize(uncompressed_size);
+#else
 
-    if (!DecompressZIP(tmp_buf.data(), &uncompressed_size, sr.data() + offset,
-                       static_cast<unsigned long>(input_len), err)) {
-      if (err) {
-        (*err) += "Failed to decode non-tiled ZIP data.\n";
-      }
-      return false;
-    }
+struct ThreadPool::Impl {};
 
-    if (!UnpredictImageU8(tmp_buf, image_info.predictor,
-                          size_t(image_info.tile_width),
-                          size_t(image_info.tile_length),
-                          size_t(image_info.samples_per_pixel))) {
-      if (err) {
-        (*err) += "Failed to unpredict ZIP-ed tile image.\n";
-      }
-      return false;
-    }
+ThreadPool::ThreadPool(int num_threads) : impl_(NULL) { (void)num_threads; }
 
-    memcpy(dst_data, tmp_buf.data(), tmp_buf.size());
-  }
+ThreadPool::~ThreadPool() {}
 
-#ifdef TINY_DNG_LOADER_PROFILING
-  auto end_t = std::chrono::system_clock::now();
-  auto ms =
-      std::chrono::duration_cast<std::chrono::milliseconds>(end_t - start_t);
+int ThreadPool::num_threads() const { return 1; }
+
+void ThreadPool::parallel_for(
+    size_t n, const std::function<void(size_t begin, size_t end)>& func) {
+  if (n > 0) {
+    func(0, n);
+  }
+}
 
-  std::cout << "DecompressZIP : " << ms.count() << " [ms]" << std::endl;
 #endif
 
-  return true;
+ThreadPool* ThreadPool::GetDefault() {
+  static ThreadPool pool;
+  return &pool;
 }
-#endif
 
-// Decompress LosslesJPEG adta.
-static bool DecompressLosslessJPEG(const StreamReader& sr,
-                                   unsigned short* dst_data, int dst_width,
-                                   const DNGImage& image_info, int* ljbits_out,
-                                   std::string* err) {
-  unsigned int tiff_h = 0, tiff_w = 0;
-  int offset = 0;
+// Scratch memory for a decoding task.
+struct DecoderScratch {
+  AllocVector<uint8_t> u8;
+  AllocVector<uint16_t> u16;
+  lj92_storage lj92;
+
+  // Statistics of heap allocations made for `u8` and `u16`.
+  uint64_t num_allocations;
+  uint64_t allocated_bytes;
+
+  explicit DecoderScratch(Allocator* allocator)
+      : u8(allocator),
+        u16(allocator),
+        lj92(allocator),
+        num_allocations(0),
+        allocated_bytes(0) {}
+};
 
-#ifdef TINY_DNG_LOADER_PROFILING
-  auto start_t = std::chrono::system_clock::now();
-#endif
+// Returns a buffer of `n` elements. Memory is reused when the capacity is
+// enough.
+template <typename T>
+static T* ScratchBuffer(DecoderScratch* scratch, AllocVector<T>* buf,
+                        size_t n) {
+  if (buf->capacity() < n) {
+    buf->clear();
+    buf->shrink_to_fit();
+    buf->reserve(n);
+    scratch->num_allocations++;
+    scratch->allocated_bytes += n * sizeof(T);
+  }
+  buf->resize(n);
+  return buf->data();
+}
 
-  TINY_DNG_DPRINTF("tile_width %d, tile_length %d\n", image_info.tile_width,
-                   image_info.tile_length);
+struct DecoderContext::Impl {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::mutex mutex;
+#endif
+  Allocator* allocator;
+  uint64_t generation;  // `Allocator::generation` of the cached memory.
+  AllocVector<DecoderScratch*> scratches;  // All scratches.
+  AllocVector<DecoderScratch*> available;  // Scratches not checked out.
+
+  uint64_t num_allocations;  // For `DecoderScratch` objects.
+  uint64_t allocated_bytes;
+  uint64_t num_acquires;
+
+  explicit Impl(Allocator* a)
+      : allocator(a),
+        generation(a ? a->generation() : 0),
+        scratches(a),
+        available(a),
+        num_allocations(0),
+        allocated_bytes(0),
+        num_acquires(0) {}
+};
 
-  if ((image_info.tile_width > 0) && (image_info.tile_length > 0)) {
-    // Assume Lossless JPEG data is stored in tiled format.
-    if (image_info.tile_width <= 0) {
-      if (err) {
-        (*err) += "Invalid tile width.\n";
-      }
-      return false;
-    }
-    if (image_info.tile_length <= 0) {
-      if (err) {
-        (*err) += "Invalid tile length.\n";
-      }
-      return false;
-    }
-    //TINY_DNG_ASSERT(image_info.tile_width > 0, "Invalid tile width.");
-    //TINY_DNG_ASSERT(image_info.tile_length > 0, "Invalid tile length.");
+struct DecoderContextAccess {
+  // Forget cached scratches when the allocator reclaimed their memory. The
+  // scratches and the lists are not destructed, since their memory may
+  // already be reused.
+  static void DropReclaimed(DecoderContext::Impl* impl) {
+    const uint64_t generation =
+        impl->allocator ? impl->allocator->generation() : 0;
+    if (generation == impl->generation) {
+      return;
+    }
+    new (&impl->scratches) AllocVector<DecoderScratch*>(
+        StlAllocator<DecoderScratch*>(impl->allocator));
+    new (&impl->available) AllocVector<DecoderScratch*>(
+        StlAllocator<DecoderScratch*>(impl->allocator));
+    impl->generation = generation;
+  }
+
+  static DecoderScratch* Acquire(DecoderContext* ctx) {
+    DecoderContext::Impl* impl = ctx->impl_;
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+    std::lock_guard<std::mutex> lock(impl->mutex);
+#endif
+    DropReclaimed(impl);
+    impl->num_acquires++;
+    if (!impl->available.empty()) {
+      DecoderScratch* scratch = impl->available.back();
+      impl->available.pop_back();
+      return scratch;
+    }
+
+    DecoderScratch* scratch = new (
+        StlAllocator<DecoderScratch>(impl->allocator).allocate(1))
+        DecoderScratch(impl->allocator);
+    impl->num_allocations++;
+    impl->allocated_bytes += sizeof(DecoderScratch);
+    impl->scratches.push_back(scratch);
+    // Reserve so that `Release` does not allocate.
+    impl->available.reserve(impl->scratches.size());
+    return scratch;
+  }
+
+  static void Release(DecoderContext* ctx, DecoderScratch* scratch) {
+    DecoderContext::Impl* impl = ctx->impl_;
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+    std::lock_guard<std::mutex> lock(impl->mutex);
+#endif
+    impl->available.push_back(scratch);
+  }
+};
 
-    // <-       image width(skip len)           ->
-    // +-----------------------------------------+
-    // |                                         |
-    // |              <- tile w  ->              |
-    // |              +-----------+              |
-    // |              |           | \            |
-    // |              |           | |            |
-    // |              |           | | tile h     |
-    // |              |           | |            |
-    // |              |           | /            |
-    // |              +-----------+              |
-    // |                                         |
-    // |                                         |
-    // +-----------------------------------------+
+// Checks out a scratch from `ctx` during its lifetime.
+class ScratchLease {
+ public:
+  explicit ScratchLease(DecoderContext* ctx)
+      : ctx_(ctx), scratch_(DecoderContextAccess::Acquire(ctx)) {}
+  ~ScratchLease() { DecoderContextAccess::Release(ctx_, scratch_); }
 
-    // TINY_DNG_DPRINTF("tile = %d, %d\n", image_info.tile_width,
-    // image_info.tile_length);
+  DecoderScratch* get() const { return scratch_; }
+  DecoderScratch* operator->() const { return scratch_; }
 
-    // Currently we only support tile data for tile.length == tiff.height.
-    // assert(image_info.tile_length == image_info.height);
+ private:
+  ScratchLease(const ScratchLease&);
+  ScratchLease& operator=(const ScratchLease&);
 
-    size_t column_step = 0;
-    while (tiff_h < static_cast<unsigned int>(image_info.height)) {
-      // Read offset to JPEG data location.
-      if (!sr.read4(&offset)) {
-        if (err) {
-          (*err) +=
-              "Failed to read offset to JPEG data location in "
-              "DecompressLosslessJPEG.\n";
-        }
-        return false;
-      }
-      TINY_DNG_DPRINTF("tile offt = %d\n", offset);
+  DecoderContext* ctx_;
+  DecoderScratch* scratch_;
+};
 
-      int lj_width = 0;
-      int lj_height = 0;
-      int lj_bits = 0;
+DecoderContext::DecoderContext() : impl_(new Impl(NULL)) {}
 
-      lj92 ljp;
-
-      size_t input_len = sr.size() - static_cast<size_t>(offset);
-
-      // @fixme { Parse LJPEG header first and set exact compressed LJPEG data
-      // length to `data_len` arg. }
-      int ret =
-          lj92_open(&ljp, reinterpret_cast<const uint8_t*>(sr.data() + offset),
-                    /* data_len */ static_cast<int>(input_len), &lj_width,
-                    &lj_height, &lj_bits);
-      TINY_DNG_DPRINTF("ret = %d\n", ret);
-      TINY_DNG_ASSERT(ret == LJ92_ERROR_NONE, "Error opening JPEG stream.");
-
-      TINY_DNG_DPRINTF("lj %d, %d, %d\n", lj_width, lj_height, lj_bits);
-      TINY_DNG_DPRINTF("ljp x %d, y %d, c %d\n", ljp->x, ljp->y,
-      ljp->components);
-      TINY_DNG_DPRINTF("tile width = %d\n", image_info.tile_width);
-      TINY_DNG_DPRINTF("tile height = %d\n", image_info.tile_length);
-      TINY_DNG_DPRINTF("col = %d, tiff_w = %d / %d\n", int(column_step), tiff_w,
-      image_info.width);
-
-      TINY_DNG_ASSERT(lj_width <= image_info.tile_width, "Unexpected JPEG tile width size.");
-      TINY_DNG_ASSERT(lj_height <= image_info.tile_length, "Unexpected JPEG tile length size.");
-
-      //TINY_DNG_ASSERT((lj_width * lj_height) ==
-      //                    image_info.tile_width * image_info.tile_length,
-      //                "Unexpected JPEG tile size.");
-
-      TINY_DNG_DPRINTF("lj.components %d, samples_per_pixel %d\n", ljp->components, image_info.samples_per_pixel);
-      //TINY_DNG_ASSERT(ljp->components == image_info.samples_per_pixel,
-      //                "# of color channels does not match.");
-
-      // int write_length = image_info.tile_width;
-      // int skip_length = dst_width - image_info.tile_width;
-      // TINY_DNG_DPRINTF("write_len = %d, skip_len = %d\n", write_length,
-      // skip_length);
-
-      // size_t dst_offset =
-      //    column_step * static_cast<size_t>(image_info.tile_width) +
-      //    static_cast<unsigned int>(dst_width) * tiff_h;
-
-      // Decode into temporary buffer.
-
-      std::vector<uint16_t> tmpbuf;
-      tmpbuf.resize(
-          static_cast<size_t>(lj_width * lj_height * ljp->components));
-
-      // TODO: ljp->components > image_info.samples_per_pixel
-      ret = lj92_decode(ljp, tmpbuf.data(), image_info.tile_width, 0, NULL, 0);
-      // ret = lj92_decode(ljp, tmpbuf.data(), write_length, skip_length, NULL,
-      // 0);
-      TINY_DNG_ASSERT(ret == LJ92_ERROR_NONE, "Error decoding JPEG stream.");
-      // ret = lj92_decode(ljp, dst_data + dst_offset, write_length,
-      // skip_length,
-      //                  NULL, 0);
-
-      // Copy to dest buffer.
-      // NOTE: For some DNG file, tiled image may exceed the extent of target
-      // image resolution.
-
-#if 0  // TODO: remove
-      for (unsigned int y = 0;
-           y < static_cast<unsigned int>(image_info.tile_length); y++) {
-        unsigned int y_offset = y + tiff_h;
-        if (y_offset >= static_cast<unsigned int>(image_info.height)) {
-          continue;
-        }
+DecoderContext::DecoderContext(Allocator* allocator)
+    : impl_(new Impl(allocator)) {}
 
-        size_t dst_offset =
-            tiff_w + static_cast<unsigned int>(dst_width) * y_offset;
+DecoderContext::~DecoderContext() {
+  release();
+  delete impl_;
+}
 
-        size_t x_len = static_cast<size_t>(image_info.tile_width);
-        if ((tiff_w + static_cast<unsigned int>(image_info.tile_width)) >=
-            static_cast<unsigned int>(dst_width)) {
-          x_len = static_cast<size_t>(dst_width) - tiff_w;
-        }
-        for (size_t x = 0; x < x_len; x++) {
-          dst_data[dst_offset + x] =
-              tmpbuf[y * static_cast<size_t>(image_info.tile_width) + x];
-        }
-      }
-#endif
+DecoderContext::Stats DecoderContext::stats() const {
+  DecoderContextAccess::DropReclaimed(impl_);
+  Stats st;
+  st.num_allocations = impl_->num_allocations;
+  st.allocated_bytes = impl_->allocated_bytes;
+  st.num_acquires = impl_->num_acquires;
+  for (size_t i = 0; i < impl_->scratches.size(); i++) {
+    const DecoderScratch* scratch = impl_->scratches[i];
+    st.num_allocations += scratch->num_allocations;
+    st.allocated_bytes += scratch->allocated_bytes;
+    st.num_allocations += scratch->lj92.num_allocations;
+    st.allocated_bytes += scratch->lj92.allocated_bytes;
+  }
+  return st;
+}
 
-      const size_t spp = size_t(image_info.samples_per_pixel);
+void DecoderContext::reset_stats() {
+  DecoderContextAccess::DropReclaimed(impl_);
+  impl_->num_allocations = 0;
+  impl_->allocated_bytes = 0;
+  impl_->num_acquires = 0;
+  for (size_t i = 0; i < impl_->scratches.size(); i++) {
+    DecoderScratch* scratch = impl_->scratches[i];
+    scratch->num_allocations = 0;
+    scratch->allocated_bytes = 0;
+    scratch->lj92.num_allocations = 0;
+    scratch->lj92.allocated_bytes = 0;
+  }
+}
 
-      // const size_t tile_size =
-      //    size_t(image_info.tile_width) * size_t(image_info.tile_length);
-      for (unsigned int y = 0;
-           y < static_cast<unsigned int>(image_info.tile_length); y++) {
-        unsigned int y_offset = y + tiff_h;
-        if (y_offset >= static_cast<unsigned int>(image_info.height)) {
-          continue;
-        }
+void DecoderContext::release() {
+  DecoderContextAccess::DropReclaimed(impl_);
+  for (size_t i = 0; i < impl_->scratches.size(); i++) {
+    impl_->scratches[i]->~DecoderScratch();
+    StlAllocator<DecoderScratch>(impl_->allocator)
+        .deallocate(impl_->scratches[i], 1);
+  }
+  impl_->scratches.clear();
+  impl_->available.clear();
+}
 
-        size_t dst_offset =
-            tiff_w + static_cast<unsigned int>(dst_width) * y_offset;
+struct ArenaAllocator::Impl {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::mutex mutex;
+#endif
+  struct Block {
+    unsigned char* data;
+    size_t size;
+  };
+  std::vector<Block> blocks;
+  size_t block_size;
+  size_t current;  // Index of the block to allocate from.
+  size_t offset;   // Used bytes of `blocks[current]`.
+  size_t used_bytes;
+  uint64_t generation;  // Incremented by `reset`.
+
+  explicit Impl(size_t bs)
+      : block_size(bs),
+        current(0),
+        offset(0),
+        used_bytes(0),
+        generation(0) {}
+};
 
-        size_t x_len = static_cast<size_t>(image_info.tile_width);
-        if ((tiff_w + static_cast<unsigned int>(image_info.tile_width)) >=
-            static_cast<unsigned int>(dst_width)) {
-          x_len = static_cast<size_t>(dst_width) - tiff_w;
-        }
+// Alignment of memory returned by `ArenaAllocator`.
+static const size_t kArenaAlignment = 16;
 
-        // Decoded ljpeg data is already channel first(RGBRGBRGB...)
-        for (size_t x = 0; x < x_len; x++) {
-          for (size_t c = 0; c < spp; c++) {
-            dst_data[spp * (dst_offset + x) + c] =
-                tmpbuf[spp * (y * static_cast<size_t>(image_info.tile_width) +
-                              x) +
-                       c];
-          }
-        }
-      }
+static inline size_t ArenaAlignedSize(const size_t size) {
+  return (std::max)(kArenaAlignment,
+                    (size + kArenaAlignment - 1) & ~(kArenaAlignment - 1));
+}
 
-      TINY_DNG_ASSERT(ret == LJ92_ERROR_NONE,
-                      "Error opening JPEG stream.");  // @fixme: redundant?
+ArenaAllocator::ArenaAllocator(size_t block_size)
+    : impl_(new Impl((std::max)(block_size, kArenaAlignment))) {}
 
-      if (ljbits_out && (lj_bits > 0)) {
-        // Assume all tiles have same lj_bits value.
-        (*ljbits_out) = lj_bits;
-      }
+ArenaAllocator::~ArenaAllocator() {
+  release();
+  delete impl_;
+}
 
-      lj92_close(ljp);
+void* ArenaAllocator::allocate(size_t size) {
+  if (size > (std::numeric_limits<size_t>::max)() - kArenaAlignment) {
+    return NULL;
+  }
+  const size_t n = ArenaAlignedSize(size);
 
-      tiff_w += static_cast<unsigned int>(image_info.tile_width);
-      column_step++;
-      // TINY_DNG_DPRINTF("col = %d, tiff_w = %d / %d\n", column_step, tiff_w,
-      // image_info.width);
-      if (tiff_w >= static_cast<unsigned int>(image_info.width)) {
-        // tiff_h += static_cast<unsigned int>(image_info.tile_length);
-        tiff_h += static_cast<unsigned int>(image_info.tile_length);
-        // TINY_DNG_DPRINTF("tiff_h = %d\n", tiff_h);
-        tiff_w = 0;
-        column_step = 0;
-      }
-    }
-  } else {
-    // Assume LJPEG data is not stored in tiled format.
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+#endif
+  while (impl_->current < impl_->blocks.size()) {
+    const Impl::Block& block = impl_->blocks[impl_->current];
+    if (block.size - impl_->offset >= n) {
+      void* p = block.data + impl_->offset;
+      impl_->offset += n;
+      impl_->used_bytes += n;
+      return p;
+    }
+    impl_->current++;
+    impl_->offset = 0;
+  }
+
+  Impl::Block block;
+  block.size = (std::max)(impl_->block_size, n);
+  block.data = static_cast<unsigned char*>(malloc(block.size));
+  if (!block.data) {
+    return NULL;
+  }
+  impl_->blocks.push_back(block);
+  impl_->current = impl_->blocks.size() - 1;
+  impl_->offset = n;
+  impl_->used_bytes += n;
+  return block.data;
+}
 
-    // Read offset to JPEG data location.
-    // offset = static_cast<int>(Read4(fp, swap_endian));
+void ArenaAllocator::deallocate(void* ptr, size_t size) {
+  if (!ptr) {
+    return;
+  }
+  const size_t n = ArenaAlignedSize(size);
 
-    TINY_DNG_ASSERT(image_info.offset > 0, "Invalid JPEG data offset.");
-    offset = static_cast<int>(image_info.offset);
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+#endif
+  // Only the last allocation is given back(e.g. a buffer replaced by a larger
+  // one right after). Other memory is reused after `reset`.
+  if (impl_->current < impl_->blocks.size()) {
+    const Impl::Block& block = impl_->blocks[impl_->current];
+    if ((impl_->offset >= n) &&
+        (static_cast<unsigned char*>(ptr) == block.data + impl_->offset - n)) {
+      impl_->offset -= n;
+      impl_->used_bytes -= n;
+    }
+  }
+}
 
-    TINY_DNG_DPRINTF("LJPEG offset %d\n", offset);
+uint64_t ArenaAllocator::generation() const {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+#endif
+  return impl_->generation;
+}
 
-    int lj_width = 0;
-    int lj_height = 0;
-    int lj_bits = 0;
-    lj92 ljp;
+void ArenaAllocator::reset() {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+#endif
+  impl_->current = 0;
+  impl_->offset = 0;
+  impl_->used_bytes = 0;
+  impl_->generation++;
+}
 
-    size_t input_len = sr.size() - static_cast<size_t>(offset);
+void ArenaAllocator::release() {
+  for (size_t i = 0; i < impl_->blocks.size(); i++) {
+    free(impl_->blocks[i].data);
+  }
+  impl_->blocks.clear();
+  reset();
+}
 
-    // @fixme { Parse LJPEG header first and set exact compressed LJPEG data
-    // length to `data_len` arg. }
-    int ret =
-        lj92_open(&ljp, reinterpret_cast<const uint8_t*>(sr.data() + offset),
-                  /* data_len */ static_cast<int>(input_len), &lj_width,
-                  &lj_height, &lj_bits);
+ArenaAllocator::Stats ArenaAllocator::stats() const {
+  Stats st;
+  st.used_bytes = impl_->used_bytes;
+  st.reserved_bytes = 0;
+  for (size_t i = 0; i < impl_->blocks.size(); i++) {
+    st.reserved_bytes += impl_->blocks[i].size;
+  }
+  st.num_blocks = impl_->blocks.size();
+  return st;
+}
 
-    // TINY_DNG_DPRINTF("ret = %d\n", ret);
-    TINY_DNG_ASSERT(ret == LJ92_ERROR_NONE, "Error opening JPEG stream.");
+// Shared resources for decoding an image.
+struct DecodeResources {
+  ThreadPool* pool;
+  DecoderContext* context;
+  Allocator* allocator;  // For bookkeeping of decoding tasks.
+  ImageBufferCallback image_buffer_callback;
+  void* image_buffer_user_data;
+  SampleUnpacking unpack_samples;
+  BitOrder packed_bit_order;
+  bool host_byte_order;
+
+  DecodeResources()
+      : pool(NULL),
+        context(NULL),
+        allocator(NULL),
+        image_buffer_callback(NULL),
+        image_buffer_user_data(NULL),
+        unpack_samples(SAMPLE_UNPACKING_NONE),
+        packed_bit_order(BIT_ORDER_MSB_FIRST),
+        host_byte_order(false) {}
+};
 
-    // TINY_DNG_DPRINTF("lj %d, %d, %d\n", lj_width, lj_height, lj_bits);
+// True when samples of `bps` bits are converted to host byte order while they
+// are decoded(`LoadOptions::host_byte_order`).
+static inline bool ToHostByteOrder(const DecodeResources& res,
+                                   const bool swap_endian, const int bps) {
+  return res.host_byte_order && swap_endian &&
+         ((bps == 16) || (bps == 32) || (bps == 64));
+}
 
-    int write_length = image_info.width;
-    int skip_length = 0;
+static inline uint64_t LoadU64BE(const uint8_t* p) {
+  return (uint64_t(p[0]) << 56) | (uint64_t(p[1]) << 48) |
+         (uint64_t(p[2]) << 40) | (uint64_t(p[3]) << 32) |
+         (uint64_t(p[4]) << 24) | (uint64_t(p[5]) << 16) |
+         (uint64_t(p[6]) << 8) | uint64_t(p[7]);
+}
 
-    ret = lj92_decode(ljp, dst_data, write_length, skip_length, NULL, 0);
-    // TINY_DNG_DPRINTF("ret = %d\n", ret);
+static inline uint64_t LoadU64LE(const uint8_t* p) {
+  return (uint64_t(p[7]) << 56) | (uint64_t(p[6]) << 48) |
+         (uint64_t(p[5]) << 40) | (uint64_t(p[4]) << 32) |
+         (uint64_t(p[3]) << 24) | (uint64_t(p[2]) << 16) |
+         (uint64_t(p[1]) << 8) | uint64_t(p[0]);
+}
 
-    TINY_DNG_ASSERT(ret == LJ92_ERROR_NONE, "Error decoding JPEG stream.");
+// Horizontal differencing(Predictor = 2) of `T` samples. Samples are stored in
+// file byte order, which is the reverse of host byte order when `swap` is true.
+// Decoded samples are written in file byte order when `swap_out` is true, and
+// in host byte order otherwise(`swap_out` implies `swap`).
 
-    lj92_close(ljp);
+static inline uint8_t SwapSample(const uint8_t v) { return v; }
 
-    if (ljbits_out && (lj_bits > 0)) {
-      (*ljbits_out) = lj_bits;
-    }
-  }
+static inline uint16_t SwapSample(const uint16_t v) {
+  return uint16_t((v >> 8) | (v << 8));
+}
 
-#ifdef TINY_DNG_LOADER_PROFILING
-  auto end_t = std::chrono::system_clock::now();
-  auto ms =
-      std::chrono::duration_cast<std::chrono::milliseconds>(end_t - start_t);
+static inline uint32_t SwapSample(const uint32_t v) {
+  return ((v >> 24) & 0xff) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) |
+         (v << 24);
+}
 
-  std::cout << "DecompressLosslessJPEG : " << ms.count() << " [ms]"
-            << std::endl;
-#endif
+static inline uint64_t SwapSample(const uint64_t v) {
+  return (uint64_t(SwapSample(uint32_t(v))) << 32) |
+         uint64_t(SwapSample(uint32_t(v >> 32)));
+}
 
-  return true;
+// Undo differencing of samples [begin, end) of a row whose first `spp`
+// samples are stored as is.
+template <typename T>
+static void UnpredictSamples(uint8_t* row, size_t begin, const size_t end,
+                             const size_t spp, const bool swap,
+                             const bool swap_out) {
+  if (swap != swap_out) {
+    for (size_t i = begin; i < (std::min)(spp, end); i++) {
+      T v;
+      memcpy(&v, row + sizeof(T) * i, sizeof(T));
+      v = SwapSample(v);
+      memcpy(row + sizeof(T) * i, &v, sizeof(T));
+    }
+  }
+  begin = (std::max)(begin, spp);
+  for (size_t i = begin; i < end; i++) {
+    T a, b;
+    memcpy(&a, row + sizeof(T) * i, sizeof(T));
+    memcpy(&b, row + sizeof(T) * (i - spp), sizeof(T));
+    // value may overflow(wrap over), but its expected behavior.
+    const T v = T((swap ? SwapSample(a) : a) + (swap_out ? SwapSample(b) : b));
+    const T w = swap_out ? SwapSample(v) : v;
+    memcpy(row + sizeof(T) * i, &w, sizeof(T));
+  }
 }
 
-// Currently we only support parsing GainMap
-static bool ParseOpcodeList(unsigned short tag, const uint8_t *data, size_t dataSize,
-  std::vector<GainMap> *gainmaps_out)
-{
-  const size_t kMaxSize = 1024*1024*512;
+// Same as `UnpredictSamples` for a whole row of `SPP` samples per pixel.
+// Running sums are kept in registers instead of being reloaded from the row.
+template <typename T, int SPP, bool SWAP, bool SWAP_OUT>
+static void UnpredictPixels(uint8_t* row, const size_t width) {
+  T acc[SPP];
+  for (int c = 0; c < SPP; c++) {
+    acc[c] = 0;
+  }
+  for (size_t x = 0; x < width; x++) {
+    uint8_t* p = row + sizeof(T) * SPP * x;
+    for (int c = 0; c < SPP; c++) {
+      T v;
+      memcpy(&v, p + sizeof(T) * size_t(c), sizeof(T));
+      acc[c] = T(acc[c] + (SWAP ? SwapSample(v) : v));
+      v = SWAP_OUT ? SwapSample(acc[c]) : acc[c];
+      memcpy(p + sizeof(T) * size_t(c), &v, sizeof(T));
+    }
+  }
+}
 
-  // OpCode data is always store in big-endian byte order.
-  // First 32bit uint: The number of opcodes.
-  // For each opcode:
-  //   32bit uint for OpCodeID
-  //   32bit uint for DNG version
-  //   32bit uint for various flag bits.
-  //   32bit uint for the number of bytes of opcode data.
-  //
-  // Value range of processed Image data after OpCode processing(not implemented in TinyDNG)
-  //   Opcode1 : 0 to 2^32 - 1
-  //   Opcode2 : 0 to 2^16 - 1
-  //   Opcode3 : 0.0 to 1.0
+#if defined(TINY_DNG_LOADER_SSE2)
 
-  // TODO: Clip image data range according with `tag`
-  (void)tag;
+static inline __m128i AddSamples(const __m128i a, const __m128i b, uint8_t) {
+  return _mm_add_epi8(a, b);
+}
 
-  if (dataSize <= (4 * 5)) {
-    // Too small
-    return false;
-  }
+static inline __m128i AddSamples(const __m128i a, const __m128i b, uint16_t) {
+  return _mm_add_epi16(a, b);
+}
 
-  bool swap_endian = !IsBigEndian();
-  StreamReader sr(data, dataSize, swap_endian);
+static inline __m128i AddSamples(const __m128i a, const __m128i b, uint32_t) {
+  return _mm_add_epi32(a, b);
+}
 
-  uint32_t num_opcodes = 0;
+// Reverse the bytes of each sample. SSSE3 does it with one `pshufb`, SSE2
+// swaps 16-bit words with shuffles and then bytes with shifts.
+static inline __m128i SwapSamples(const __m128i v, uint8_t) { return v; }
 
-  if (!sr.read4(&num_opcodes)) {
-    return false;
-  }
+static inline __m128i SwapSamples(const __m128i v, uint16_t) {
+#if defined(TINY_DNG_LOADER_SSSE3)
+  return _mm_shuffle_epi8(
+      v, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+#else
+  return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+#endif
+}
 
-  const size_t kMaxNumOpcodes = 16;
-  if (num_opcodes > kMaxNumOpcodes) {
-    // too many opcodes.
-    return false;
-  }
+static inline __m128i SwapSamples(const __m128i v, uint32_t) {
+#if defined(TINY_DNG_LOADER_SSSE3)
+  return _mm_shuffle_epi8(
+      v, _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+#else
+  const __m128i w = _mm_shufflehi_epi16(
+      _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+  return _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+#endif
+}
 
-  //TINY_DNG_DPRINTF("# of opcodes = %d\n", num_opcodes);
+static inline __m128i SwapSamples(const __m128i v, uint64_t) {
+#if defined(TINY_DNG_LOADER_SSSE3)
+  return _mm_shuffle_epi8(
+      v, _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8));
+#else
+  const __m128i w = _mm_shufflehi_epi16(
+      _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+  return _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+#endif
+}
 
-  for (size_t i = 0; i < num_opcodes; i++) {
-    uint32_t opcode_id = 0;
-    uint32_t dng_version = 0;
-    uint32_t flags = 0;
-    uint32_t num_bytes = 0;
+// Shift amounts are clamped to keep them valid immediates. Steps whose shift
+// is not less than 16 bytes are skipped.
+#define TINY_DNG_SHIFT_BYTES(n) (((n) < 16) ? (n) : 0)
 
-    if (!sr.read4(&opcode_id)) {
-      return false;
+// Undo differencing of a row of `P` byte pixels(`P` <= 16). Each 16 bytes are
+// prefix-summed per sample(adds shifted by P, 2P, 4P, ... bytes), then the
+// last `P` bytes of the previous 16 bytes, repeated with a period of `P`, are
+// added. When `P` does not divide 16(e.g. RGB), that repetition still lines
+// up each lane with the previous sample of the same channel.
+template <typename T, int P>
+static void UnpredictRowSSE2(uint8_t* row, const size_t row_bytes,
+                             const bool swap, const bool swap_out) {
+  __m128i carry = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= row_bytes; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+    if (swap) {
+      v = SwapSamples(v, T());
     }
-    if (!sr.read4(&dng_version)) {
-      return false;
+    if (P < 16) {
+      v = AddSamples(v, _mm_slli_si128(v, TINY_DNG_SHIFT_BYTES(P)), T());
     }
-    if (!sr.read4(&flags)) {
-      return false;
+    if (2 * P < 16) {
+      v = AddSamples(v, _mm_slli_si128(v, TINY_DNG_SHIFT_BYTES(2 * P)), T());
     }
-    if (!sr.read4(&num_bytes)) {
-      return false;
+    if (4 * P < 16) {
+      v = AddSamples(v, _mm_slli_si128(v, TINY_DNG_SHIFT_BYTES(4 * P)), T());
+    }
+    if (8 * P < 16) {
+      v = AddSamples(v, _mm_slli_si128(v, TINY_DNG_SHIFT_BYTES(8 * P)), T());
     }
+    v = AddSamples(v, carry, T());
 
-    TINY_DNG_DPRINTF("opcode %d, dng ver %d, flags %d, num_bytes %d\n", opcode_id, dng_version, flags, num_bytes);
+    // Repeat the last `P` bytes.
+    carry = _mm_srli_si128(v, TINY_DNG_SHIFT_BYTES(16 - P));
+    if (P < 16) {
+      carry = _mm_or_si128(carry,
+                           _mm_slli_si128(carry, TINY_DNG_SHIFT_BYTES(P)));
+    }
+    if (2 * P < 16) {
+      carry = _mm_or_si128(
+          carry, _mm_slli_si128(carry, TINY_DNG_SHIFT_BYTES(2 * P)));
+    }
+    if (4 * P < 16) {
+      carry = _mm_or_si128(
+          carry, _mm_slli_si128(carry, TINY_DNG_SHIFT_BYTES(4 * P)));
+    }
+    if (8 * P < 16) {
+      carry = _mm_or_si128(
+          carry, _mm_slli_si128(carry, TINY_DNG_SHIFT_BYTES(8 * P)));
+    }
 
-    if (num_bytes < 4) {
-      return false;
+    if (swap_out) {
+      v = SwapSamples(v, T());
     }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), v);
+  }
 
-    if (opcode_id == OPCODE_LIST_GAIN_MAP) {
-      const size_t kMaxItems = 1024*1024;
+  UnpredictSamples<T>(row, i / sizeof(T), row_bytes / sizeof(T),
+                      size_t(P) / sizeof(T), swap, swap_out);
+}
 
-      uint32_t saved_loc = uint32_t(sr.tell());
+#undef TINY_DNG_SHIFT_BYTES
 
-      // Top, Left, Bottom, Right, Plane, Planes, RowPitch, ColPitch, MapPointsV, MapPointsH (LONG)
-      // MapSpacingV, MapSpacingH, MapOriginV, MapOriginH (DOUBLE)
-      // MapPlanes (LONG)
-      // For each MapPointsV
-      //   For each MapPointsH
-      //     For each MapPlanes
-      //       MapGain (FLOAT)
+#endif
 
-      uint32_t top, left, bottom, right, plane, planes, row_pitch, col_pitch, map_points_v, map_points_h;
-      double map_spacing_v, map_spacing_h, map_origin_v, map_origin_h;
-      uint32_t map_planes;
+template <typename T>
+static void UnpredictRow(uint8_t* row, const size_t width, const size_t spp,
+                         const bool swap, const bool swap_out) {
+  const size_t n = width * spp;
+#if defined(TINY_DNG_LOADER_SSE2)
+  switch (spp * sizeof(T)) {
+    case 1:
+      UnpredictRowSSE2<T, 1>(row, n * sizeof(T), swap, swap_out);
+      return;
+    case 2:
+      UnpredictRowSSE2<T, 2>(row, n * sizeof(T), swap, swap_out);
+      return;
+    case 3:
+      UnpredictRowSSE2<T, 3>(row, n * sizeof(T), swap, swap_out);
+      return;
+    case 6:
+      UnpredictRowSSE2<T, 6>(row, n * sizeof(T), swap, swap_out);
+      return;
+    case 12:
+      UnpredictRowSSE2<T, 12>(row, n * sizeof(T), swap, swap_out);
+      return;
+    case 4:
+      UnpredictRowSSE2<T, 4>(row, n * sizeof(T), swap, swap_out);
+      return;
+    case 8:
+      UnpredictRowSSE2<T, 8>(row, n * sizeof(T), swap, swap_out);
+      return;
+    case 16:
+      UnpredictRowSSE2<T, 16>(row, n * sizeof(T), swap, swap_out);
+      return;
+    default:
+      break;
+  }
+#endif
+  if (spp == 3) {
+    if (swap_out) {
+      UnpredictPixels<T, 3, true, true>(row, width);
+    } else if (swap) {
+      UnpredictPixels<T, 3, true, false>(row, width);
+    } else {
+      UnpredictPixels<T, 3, false, false>(row, width);
+    }
+    return;
+  }
+  UnpredictSamples<T>(row, 0, n, spp, swap, swap_out);
+}
 
-      if (!sr.read4(&top)) {
-        return false;
-      }
+// Copy `len` bytes of `T` samples from `src` to `dst` reversing the byte order
+// of each sample. `dst` may be `src`. A trailing partial sample is copied as
+// is.
+template <typename T>
+static void CopySwappedSamples(uint8_t* dst, const uint8_t* src,
+                               const size_t len) {
+  size_t i = 0;
+#if defined(TINY_DNG_LOADER_SSE2)
+  for (; i + 32 <= len; i += 32) {
+    const __m128i v0 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    const __m128i v1 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                     SwapSamples(v0, T()));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 16),
+                     SwapSamples(v1, T()));
+  }
+#endif
+  for (; i + sizeof(T) <= len; i += sizeof(T)) {
+    T v;
+    memcpy(&v, src + i, sizeof(T));
+    v = SwapSample(v);
+    memcpy(dst + i, &v, sizeof(T));
+  }
+  if ((dst != src) && (i < len)) {
+    memcpy(dst + i, src + i, len - i);
+  }
+}
 
-      if (!sr.read4(&left)) {
-        return false;
-      }
+// Same as `CopySwappedSamples` for samples of `sample_bytes` bytes. Samples of
+// other than 2, 4 and 8 bytes are copied as is.
+static void CopySwapped(uint8_t* dst, const uint8_t* src, const size_t len,
+                        const size_t sample_bytes) {
+  if (sample_bytes == 2) {
+    CopySwappedSamples<uint16_t>(dst, src, len);
+  } else if (sample_bytes == 4) {
+    CopySwappedSamples<uint32_t>(dst, src, len);
+  } else if (sample_bytes == 8) {
+    CopySwappedSamples<uint64_t>(dst, src, len);
+  } else if (dst != src) {
+    memcpy(dst, src, len);
+  }
+}
 
-      if (!sr.read4(&bottom)) {
-        return false;
-      }
+// Floating point predictor(Predictor = 3, TIFF Technical Note 3). A row of
+// `n` samples of `bytes` bytes is stored as `bytes` byte planes(most
+// significant byte first), and the bytes of the row are differenced with a
+// stride of `spp`.
+
+// Interleave byte planes to samples: byte `j` of sample `i` is `planes[j][i]`.
+static void InterleaveBytePlanes(uint8_t* dst, const uint8_t* const* planes,
+                                 const size_t n, const size_t bytes) {
+  size_t i = 0;
+#if defined(TINY_DNG_LOADER_SSE2)
+  if (bytes == 2) {
+    for (; i + 16 <= n; i += 16) {
+      const __m128i q0 =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[0] + i));
+      const __m128i q1 =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[1] + i));
+      __m128i* d = reinterpret_cast<__m128i*>(dst + 2 * i);
+      _mm_storeu_si128(d, _mm_unpacklo_epi8(q0, q1));
+      _mm_storeu_si128(d + 1, _mm_unpackhi_epi8(q0, q1));
+    }
+  } else if (bytes == 4) {
+    for (; i + 16 <= n; i += 16) {
+      const __m128i q0 =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[0] + i));
+      const __m128i q1 =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[1] + i));
+      const __m128i q2 =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[2] + i));
+      const __m128i q3 =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[3] + i));
+      const __m128i lo01 = _mm_unpacklo_epi8(q0, q1);
+      const __m128i lo23 = _mm_unpacklo_epi8(q2, q3);
+      const __m128i hi01 = _mm_unpackhi_epi8(q0, q1);
+      const __m128i hi23 = _mm_unpackhi_epi8(q2, q3);
+      __m128i* d = reinterpret_cast<__m128i*>(dst + 4 * i);
+      _mm_storeu_si128(d, _mm_unpacklo_epi16(lo01, lo23));
+      _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(lo01, lo23));
+      _mm_storeu_si128(d + 2, _mm_unpacklo_epi16(hi01, hi23));
+      _mm_storeu_si128(d + 3, _mm_unpackhi_epi16(hi01, hi23));
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    for (size_t j = 0; j < bytes; j++) {
+      dst[bytes * i + j] = planes[j][i];
+    }
+  }
+}
+
+// Undo the floating point predictor of a row. `tmp` holds a row. Samples are
+// written in big endian when `big_endian` is true, little endian otherwise.
+static void UnpredictFloatRow(uint8_t* row, uint8_t* tmp, const size_t width,
+                              const size_t spp, const size_t bytes,
+                              const bool big_endian) {
+  const size_t n = width * spp;
+
+  // Byte differencing with a stride of `spp` over the whole row.
+  UnpredictRow<uint8_t>(row, width * bytes, spp, false, false);
+
+  memcpy(tmp, row, n * bytes);
+
+  const uint8_t* planes[8];
+  for (size_t j = 0; j < bytes; j++) {
+    planes[j] = tmp + n * (big_endian ? j : (bytes - 1 - j));
+  }
+  InterleaveBytePlanes(row, planes, n, bytes);
+}
+
+// Undo the predictor of `rows` rows of `width` x `spp` samples in place.
+// `swap_endian` is true when samples are not in host byte order. Samples are
+// left in file byte order, or converted to host byte order when `to_host` is
+// true. `allocator` is used for the row buffer of the floating point
+// predictor.
+static bool UnpredictImage(uint8_t* dst,  // inout
+                           const int predictor, const int bps,
+                           const size_t width, const size_t rows,
+                           const size_t spp, const bool swap_endian,
+                           const bool to_host, Allocator* allocator,
+                           std::string* err) {
+  const bool swap_out = swap_endian && !to_host;
+  if (predictor == 1) {
+    // no prediction shceme
+    if (swap_endian && to_host) {
+      CopySwapped(dst, dst, width * spp * size_t(bps / 8) * rows,
+                  size_t(bps / 8));
+    }
+    return true;
+  } else if (predictor == 2) {
+    // horizontal diff
+    if ((bps != 8) && (bps != 16) && (bps != 32)) {
+      if (err) {
+        (*err) += "Horizontal differencing predictor for " +
+                  std::to_string(bps) + " bits per sample is not supported.\n";
+      }
+      return false;
+    }
+    const size_t stride = width * spp * size_t(bps / 8);
+    for (size_t row = 0; row < rows; row++) {
+      uint8_t* line = dst + row * stride;
+      if (bps == 8) {
+        UnpredictRow<uint8_t>(line, width, spp, swap_endian, swap_out);
+      } else if (bps == 16) {
+        UnpredictRow<uint16_t>(line, width, spp, swap_endian, swap_out);
+      } else {
+        UnpredictRow<uint32_t>(line, width, spp, swap_endian, swap_out);
+      }
+    }
+    return true;
+  } else if (predictor == 3) {
+    // fp horizontal diff(fp16, fp24, fp32 and fp64).
+    if ((bps != 16) && (bps != 24) && (bps != 32) && (bps != 64)) {
+      if (err) {
+        (*err) += "Floating point predictor for " + std::to_string(bps) +
+                  " bits per sample is not supported.\n";
+      }
+      return false;
+    }
+    const size_t bytes = size_t(bps / 8);
+    const size_t stride = width * spp * bytes;
+    const bool big_endian = (swap_out != IsBigEndian());
+    AllocVector<uint8_t> tmp((StlAllocator<uint8_t>(allocator)));
+    tmp.resize(stride);
+    for (size_t row = 0; row < rows; row++) {
+      UnpredictFloatRow(dst + row * stride, tmp.data(), width, spp, bytes,
+                        big_endian);
+    }
+    return true;
+  } else {
+    if (err) {
+      (*err) += "Invalid predictor value " + std::to_string(predictor) +
+                ".\n";
+    }
+    return false;
+  }
+}
+
+// Bit-packed samples. Sample `i` of a stream of `bps` bit samples occupies
+// bits [i * bps, (i + 1) * bps). 3 bytes hold a sample of up to 16 bits at any
+// bit offset.
+
+// Read a sample at bit `bit`. Bytes beyond `src_len` are read as zero.
+static inline uint32_t LoadPackedSample(const uint8_t* src,
+                                        const size_t src_len,
+                                        const uint64_t bit, const int bps,
+                                        const bool msb_first) {
+  const size_t a = size_t(bit >> 3);
+  const int off = int(bit & 7);
+  const uint32_t mask = (1u << bps) - 1u;
+  if (a + 8 <= src_len) {
+    if (msb_first) {
+      return uint32_t(LoadU64BE(src + a) >> (64 - off - bps)) & mask;
+    }
+    return uint32_t(LoadU64LE(src + a) >> off) & mask;
+  }
+
+  uint32_t w = 0;
+  for (size_t k = 0; k < 3; k++) {
+    const uint32_t v = (a + k < src_len) ? uint32_t(src[a + k]) : 0u;
+    w |= msb_first ? (v << (16 - 8 * k)) : (v << (8 * k));
+  }
+  return (msb_first ? (w >> (24 - off - bps)) : (w >> off)) & mask;
+}
+
+#if defined(TINY_DNG_LOADER_SSSE3)
+
+static inline void StoreUnpacked(uint16_t* dst, const __m128i v) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), v);
+}
+
+static inline void StoreUnpacked(float* dst, const __m128i v) {
+  const __m128i zero = _mm_setzero_si128();
+  _mm_storeu_ps(dst, _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+  _mm_storeu_ps(dst + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+}
+
+// Unpack `num_blocks` blocks of 8 samples(`bps` bytes each) of 1 to 15 bits.
+// Each 16-bit lane gathers the 3 bytes holding its sample with `pshufb`, and
+// per-lane shifts are done with multiplies. Reads 16 bytes per block.
+template <typename OutT>
+static void UnpackBlocksSSSE3(const uint8_t* src, const size_t num_blocks,
+                              const int bps, const bool msb_first,
+                              OutT* dst) {
+  uint8_t shuf_w[16], shuf_b[16];
+  uint16_t mul_lo[8], mul_hi[8], keep[8];
+  for (int j = 0; j < 8; j++) {
+    const int a = (j * bps) >> 3;
+    const int off = (j * bps) & 7;
+    if (msb_first) {
+      // w = src[a] << 8 | src[a + 1], b = src[a + 2] << 8
+      shuf_w[2 * j] = uint8_t(a + 1);
+      shuf_w[2 * j + 1] = uint8_t(a);
+      shuf_b[2 * j] = 0x80;
+      shuf_b[2 * j + 1] = uint8_t(a + 2);
+      mul_lo[j] = uint16_t(1 << off);  // (w << off)
+      mul_hi[j] = uint16_t(1 << off);  // (b << off) >> 16
+      keep[j] = 0;
+    } else {
+      // w = src[a + 1] << 8 | src[a], b = src[a + 2]
+      shuf_w[2 * j] = uint8_t(a);
+      shuf_w[2 * j + 1] = uint8_t(a + 1);
+      shuf_b[2 * j] = uint8_t(a + 2);
+      shuf_b[2 * j + 1] = 0x80;
+      mul_lo[j] = uint16_t((1 << (16 - off)) & 0xffff);  // b << (16 - off)
+      mul_hi[j] = uint16_t((1 << (16 - off)) & 0xffff);  // w >> off(off > 0)
+      keep[j] = (off == 0) ? 0xffff : 0;                  // w(off = 0)
+    }
+  }
+
+  const __m128i sw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(shuf_w));
+  const __m128i sb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(shuf_b));
+  const __m128i ml = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mul_lo));
+  const __m128i mh = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mul_hi));
+  const __m128i kp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keep));
+  const __m128i mask = _mm_set1_epi16(short((1 << bps) - 1));
+  const __m128i shift = _mm_cvtsi32_si128(16 - bps);
+
+  for (size_t k = 0; k < num_blocks; k++) {
+    const __m128i in = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(src + size_t(bps) * k));
+    const __m128i w = _mm_shuffle_epi8(in, sw);
+    const __m128i b = _mm_shuffle_epi8(in, sb);
+    __m128i v;
+    if (msb_first) {
+      v = _mm_or_si128(_mm_mullo_epi16(w, ml), _mm_mulhi_epu16(b, mh));
+      v = _mm_srl_epi16(v, shift);
+    } else {
+      v = _mm_or_si128(_mm_mullo_epi16(b, ml),
+                       _mm_or_si128(_mm_mulhi_epu16(w, mh),
+                                    _mm_and_si128(w, kp)));
+      v = _mm_and_si128(v, mask);
+    }
+    StoreUnpacked(dst + 8 * k, v);
+  }
+}
+
+#endif
+
+// Unpack samples [first, first + n) of `bps` bits(1 to 15) to `dst`.
+template <typename OutT>
+static void UnpackSamples(const uint8_t* src, const size_t src_len,
+                          const uint64_t first, const size_t n, const int bps,
+                          const bool msb_first, OutT* dst) {
+  size_t i = 0;
+#if defined(TINY_DNG_LOADER_SSSE3)
+  // Blocks of 8 samples start at a byte boundary.
+  while ((i < n) && (((first + i) & 7) != 0)) {
+    dst[i] = OutT(LoadPackedSample(src, src_len, (first + i) * uint64_t(bps),
+                                   bps, msb_first));
+    i++;
+  }
+  const size_t a = size_t((first + i) * uint64_t(bps) / 8);
+  if (a + 16 <= src_len) {
+    const size_t num_blocks = (std::min)((n - i) / 8,
+                                         (src_len - a - 16) / size_t(bps) + 1);
+    UnpackBlocksSSSE3(src + a, num_blocks, bps, msb_first, dst + i);
+    i += 8 * num_blocks;
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = OutT(LoadPackedSample(src, src_len, (first + i) * uint64_t(bps),
+                                   bps, msb_first));
+  }
+}
+
+// Rows per strip of a strip image. Missing or larger than image height means
+// the whole image is a single strip.
+static inline size_t RowsPerStrip(const DNGImage& image) {
+  if ((image.rows_per_strip > 0) && (image.rows_per_strip < image.height)) {
+    return size_t(image.rows_per_strip);
+  }
+  return size_t((std::max)(image.height, 0));
+}
+
+// Rectangle [x, x + width) x [y, y + height) of an image. Tile decoders write
+// pixels inside of the window to a destination buffer whose row stride is
+// `row_stride` bytes(0 = `width` pixels).
+struct ImageWindow {
+  int x;
+  int y;
+  int width;
+  int height;
+  size_t row_stride;
+};
+
+static inline ImageWindow MakeImageWindow(int x, int y, int width, int height,
+                                          size_t row_stride = 0) {
+  ImageWindow window;
+  window.x = x;
+  window.y = y;
+  window.width = width;
+  window.height = height;
+  window.row_stride = row_stride;
+  return window;
+}
+
+// Row stride in bytes of the destination buffer of `window`.
+static inline size_t WindowRowStride(const ImageWindow& window,
+                                     const size_t pixel_bytes) {
+  return (window.row_stride > 0) ? window.row_stride
+                                 : pixel_bytes * size_t(window.width);
+}
+
+// Intersect the tile at (`tiff_w`, `tiff_h`) with the image extent and
+// `window`. Returns false when they do not overlap.
+static inline bool IntersectTile(const DNGImage& image_info,
+                                 const unsigned int tiff_w,
+                                 const unsigned int tiff_h,
+                                 const ImageWindow& window, int* x0, int* y0,
+                                 int* x1, int* y1) {
+  (*x0) = (std::max)(int(tiff_w), window.x);
+  (*y0) = (std::max)(int(tiff_h), window.y);
+  (*x1) = (std::min)((std::min)(int(tiff_w) + image_info.tile_width,
+                                image_info.width),
+                     window.x + window.width);
+  (*y1) = (std::min)((std::min)(int(tiff_h) + image_info.tile_length,
+                                image_info.height),
+                     window.y + window.height);
+  return ((*x0) < (*x1)) && ((*y0) < (*y1));
+}
+
+// Clamp byte length to `int` range for decoders taking `int` length.
+static inline int ClampToInt(const size_t len) {
+  return static_cast<int>(
+      (std::min)(len, size_t((std::numeric_limits<int>::max)())));
+}
+
+// Bytes of image data inspected to read the header(e.g. resolution of JPEG
+// data).
+static const size_t kDataHeaderLength = 64 * 1024;
+
+// Length of the data of `image` at `offset` whose byte count is not known
+// exactly. For a memory all the rest of the data is used. For a `ByteSource`
+// the length is limited to `DNGImage::data_byte_count` so that only the image
+// is fetched.
+static size_t ImageDataLength(const StreamReader& sr,
+                              const tinydng::DNGImage& image,
+                              const size_t offset) {
+  const size_t len = sr.size() - offset;
+  if (sr.source() && (image.data_byte_count > 0)) {
+    return size_t((std::min)(uint64_t(len), image.data_byte_count));
+  }
+  return len;
+}
+
+// Decoder of `k`'th tile located at (`tiff_w`, `tiff_h`) in the image.
+typedef std::function<bool(size_t k, unsigned int tiff_w, unsigned int tiff_h,
+                           DecoderScratch* scratch, std::string* err)>
+    TileDecodeFunc;
+
+// Decode the tiles of `image_info` which intersect `window` with
+// `decode_tile`. Tiles are decoded concurrently. Each task reuses a scratch
+// for its tiles.
+static bool DecodeTiles(const DNGImage& image_info, const ImageWindow& window,
+                        const DecodeResources& res,
+                        const TileDecodeFunc& decode_tile, std::string* err) {
+  if ((image_info.tile_width <= 0) || (image_info.tile_length <= 0)) {
+    if (err) {
+      (*err) += "Invalid tile size.\n";
+    }
+    return false;
+  }
+
+  const unsigned int tiles_across =
+      (static_cast<unsigned int>(image_info.width) +
+       static_cast<unsigned int>(image_info.tile_width) - 1) /
+      static_cast<unsigned int>(image_info.tile_width);
+  const unsigned int tiles_down =
+      (static_cast<unsigned int>(image_info.height) +
+       static_cast<unsigned int>(image_info.tile_length) - 1) /
+      static_cast<unsigned int>(image_info.tile_length);
+  const size_t num_tiles = size_t(tiles_across) * size_t(tiles_down);
+
+  // Tile table is validated at IFD parse time, so tiles can be decoded in
+  // any order.
+  if (image_info.tile_offsets.size() < num_tiles) {
+    if (err) {
+      (*err) += "Tile offsets not found.\n";
+    }
+    return false;
+  }
+
+  // Only tiles intersecting `window` are decoded.
+  const unsigned int tx0 = static_cast<unsigned int>(window.x) /
+                           static_cast<unsigned int>(image_info.tile_width);
+  const unsigned int ty0 = static_cast<unsigned int>(window.y) /
+                           static_cast<unsigned int>(image_info.tile_length);
+  const unsigned int tx1 =
+      (std::min)(tiles_across,
+                 (static_cast<unsigned int>(window.x + window.width) +
+                  static_cast<unsigned int>(image_info.tile_width) - 1) /
+                     static_cast<unsigned int>(image_info.tile_width));
+  const unsigned int ty1 =
+      (std::min)(tiles_down,
+                 (static_cast<unsigned int>(window.y + window.height) +
+                  static_cast<unsigned int>(image_info.tile_length) - 1) /
+                     static_cast<unsigned int>(image_info.tile_length));
+
+  AllocVector<size_t> tiles(res.allocator);
+  for (unsigned int ty = ty0; ty < ty1; ty++) {
+    for (unsigned int tx = tx0; tx < tx1; tx++) {
+      tiles.push_back(size_t(ty) * size_t(tiles_across) + size_t(tx));
+    }
+  }
+
+  AllocVector<std::string> tile_errs(tiles.size(), std::string(),
+                                     res.allocator);
+  AllocVector<char> tile_ok(tiles.size(), char(0), res.allocator);
+
+  res.pool->parallel_for(tiles.size(), [&](size_t begin, size_t end) {
+    ScratchLease scratch(res.context);
+    for (size_t t = begin; t < end; t++) {
+      const size_t k = tiles[t];
+      const unsigned int tiff_w =
+          static_cast<unsigned int>(k % tiles_across) *
+          static_cast<unsigned int>(image_info.tile_width);
+      const unsigned int tiff_h =
+          static_cast<unsigned int>(k / tiles_across) *
+          static_cast<unsigned int>(image_info.tile_length);
+
+      tile_ok[t] =
+          decode_tile(k, tiff_w, tiff_h, scratch.get(), &tile_errs[t]) ? 1
+                                                                       : 0;
+    }
+  });
+
+  for (size_t t = 0; t < tiles.size(); t++) {
+    if (!tile_ok[t]) {
+      if (err) {
+        (*err) += tile_errs[t];
+      }
+      return false;
+    }
+  }
+
+  return true;
+}
+
+#ifdef TINY_DNG_LOADER_ENABLE_ZIP
+
+// Inflate `src` directly into `dst`.
+static bool DecompressZIP(unsigned char* dst,
+                          unsigned long* uncompressed_size /* inout */,
+                          const unsigned char* src, unsigned long src_size,
+                          std::string* err) {
+#ifdef TINY_DNG_LOADER_USE_SYSTEM_ZLIB
+  int ret = uncompress(dst, uncompressed_size, src, src_size);
+  if (Z_OK != ret) {
+    if (err) {
+      std::stringstream ss;
+      ss << "zlib uncompress failed. code = " << ret << "\n";
+      (*err) += ss.str();
+    }
+    return false;
+  }
+#else
+  int ret = mz_uncompress(dst, uncompressed_size, src, src_size);
+  if (MZ_OK != ret) {
+    if (err) {
+      std::stringstream ss;
+      ss << "mz_uncompress failed. code = " << ret << "\n";
+      (*err) += ss.str();
+    }
+    return false;
+  }
+#endif
+
+  return true;
+}
+
+// Inflate a ZIP-ed tile of `input_len` bytes located at `offset` and store its
+// pixels inside of `dst` to `dst_data`. (`tiff_w`, `tiff_h`) is the position
+// of the tile in the image. `scratch` can be reused among tiles.
+// NOTE: This function does not modify the read position of `sr`, thus it can
+// be called from multiple threads.
+static bool DecompressZIPTile(const StreamReader& sr, const size_t offset,
+                              const size_t input_len,
+                              const DNGImage& image_info,
+                              const unsigned int tiff_w,
+                              const unsigned int tiff_h,
+                              unsigned char* dst_data, const ImageWindow& dst,
+                              const bool to_host, DecoderScratch* scratch,
+                              std::string* err) {
+  if ((offset == 0) || (offset >= sr.size()) ||
+      (input_len > sr.size() - offset)) {
+    if (err) {
+      (*err) += "Invalid offset to ZIP-ed tile data.\n";
+    }
+    return false;
+  }
+
+  int x0, y0, x1, y1;
+  if (!IntersectTile(image_info, tiff_w, tiff_h, dst, &x0, &y0, &x1, &y1)) {
+    return true;
+  }
+
+  const size_t tile_size = size_t(image_info.samples_per_pixel) *
+                           size_t(image_info.tile_width) *
+                           size_t(image_info.tile_length) *
+                           size_t(image_info.bits_per_sample) / size_t(8);
+
+  const uint8_t* src = sr.map_abs_addr(offset, input_len);
+  if (!src) {
+    if (err) {
+      (*err) += "Failed to read ZIP-ed tile data.\n";
+    }
+    return false;
+  }
+
+  uint8_t* tile_buf = ScratchBuffer(scratch, &scratch->u8, tile_size);
+
+  unsigned long uncompressed_size = static_cast<unsigned long>(tile_size);
+  if (!DecompressZIP(tile_buf, &uncompressed_size, src,
+                     static_cast<unsigned long>(input_len), err)) {
+    if (err) {
+      (*err) += "Failed to decode ZIP data.\n";
+    }
+    return false;
+  }
+
+  if (!UnpredictImage(tile_buf, image_info.predictor,
+                      image_info.bits_per_sample,
+                      size_t(image_info.tile_width),
+                      size_t(image_info.tile_length),
+                      size_t(image_info.samples_per_pixel), sr.swap_endian(),
+                      to_host, scratch->u8.get_allocator().allocator, err)) {
+    if (err) {
+      (*err) += "Failed to unpredict ZIP-ed tile image.\n";
+    }
+    return false;
+  }
+
+  // Copy to dest buffer.
+  // NOTE: For some DNG file, tiled image may exceed the extent of target
+  // image resolution. Such a tile is clipped to the image and `dst`.
+  const size_t pixel_bytes = size_t(image_info.samples_per_pixel) *
+                             size_t(image_info.bits_per_sample) / size_t(8);
+  const size_t src_stride = pixel_bytes * size_t(image_info.tile_width);
+  const size_t dst_stride = WindowRowStride(dst, pixel_bytes);
+  const size_t x_len = pixel_bytes * size_t(x1 - x0);
+
+  for (int y = y0; y < y1; y++) {
+    memcpy(dst_data + dst_stride * size_t(y - dst.y) +
+               pixel_bytes * size_t(x0 - dst.x),
+           tile_buf + src_stride * size_t(y - int(tiff_h)) +
+               pixel_bytes * size_t(x0 - int(tiff_w)),
+           x_len);
+  }
+
+  return true;
+}
+
+static bool DecompressZIPedTile(const StreamReader& sr, unsigned char* dst_data,
+                                const ImageWindow& dst,
+                                const DNGImage& image_info,
+                                const DecodeResources& res, std::string* err) {
+  size_t offset = 0;
+  const bool to_host =
+      ToHostByteOrder(res, sr.swap_endian(), image_info.bits_per_sample);
+
+#ifdef TINY_DNG_LOADER_PROFILING
+  auto start_t = std::chrono::system_clock::now();
+#endif
+
+  TINY_DNG_DPRINTF("tile_offset = %d\n", int(image_info.tile_offset));
+
+  if ((image_info.tile_width > 0) && (image_info.tile_length > 0)) {
+    // Assume ZIP is stored in tiled format.
+    TINY_DNG_ASSERT(image_info.tile_width > 0, "Invalid tile width.");
+    TINY_DNG_ASSERT(image_info.tile_length > 0, "Invalid tile length.");
+
+    // <-       image width(skip len)           ->
+    // +-----------------------------------------+
+    // |                                         |
+    // |              <- tile w  ->              |
+    // |              +-----------+              |
+    // |              |           | \            |
+    // |              |           | |            |
+    // |              |           | | tile h     |
+    // |              |           | |            |
+    // |              |           | /            |
+    // |              +-----------+              |
+    // |                                         |
+    // |                                         |
+    // +-----------------------------------------+
+
+    TINY_DNG_DPRINTF("tile = %d, %d\n", image_info.tile_width,
+                     image_info.tile_length);
+    TINY_DNG_DPRINTF("w, h = %d, %d\n", image_info.width, image_info.height);
+
+    if (!DecodeTiles(image_info, dst, res,
+                     [&](size_t k, unsigned int tiff_w, unsigned int tiff_h,
+                         DecoderScratch* scratch, std::string* tile_err) {
+                       return DecompressZIPTile(
+                           sr, size_t(image_info.tile_offsets[k]),
+                           size_t(image_info.tile_byte_counts[k]), image_info,
+                           tiff_w, tiff_h, dst_data, dst, to_host, scratch,
+                           tile_err);
+                     },
+                     err)) {
+      return false;
+    }
+  } else {
+    // Assume ZIP data is not stored in tiled format.
+
+    TINY_DNG_DPRINTF("width = %d", int(image_info.width));
+    TINY_DNG_DPRINTF("height = %d", int(image_info.height));
+
+    TINY_DNG_ASSERT(image_info.offset > 0, "Invalid ZIPed data offset.");
+    offset = size_t(image_info.offset);
+
+    size_t input_len = ImageDataLength(sr, image_info, offset);
+    const uint8_t* src = sr.map_abs_addr(offset, input_len);
+    if (!src) {
+      if (err) {
+        (*err) += "Failed to read ZIP-ed data.\n";
+      }
+      return false;
+    }
+
+    const size_t row_bytes = size_t(image_info.samples_per_pixel) *
+                             size_t(image_info.width) *
+                             size_t(image_info.bits_per_sample) / size_t(8);
+    const size_t dst_stride =
+        (dst.row_stride > 0) ? dst.row_stride : row_bytes;
+
+    // Inflate directly into the destination when its rows are packed.
+    // Otherwise inflate to a scratch buffer and copy rows.
+    ScratchLease scratch(res.context);
+    uint8_t* buf =
+        (dst_stride == row_bytes)
+            ? dst_data
+            : ScratchBuffer(scratch.get(), &scratch->u8,
+                            row_bytes * size_t(image_info.height));
+
+    unsigned long uncompressed_size =
+        static_cast<unsigned long>(row_bytes * size_t(image_info.height));
+
+    if (!DecompressZIP(buf, &uncompressed_size, src,
+                       static_cast<unsigned long>(input_len), err)) {
+      if (err) {
+        (*err) += "Failed to decode non-tiled ZIP data.\n";
+      }
+      return false;
+    }
+
+    // Rows are independent. Unpredict them in parallel.
+    const size_t height = size_t(image_info.height);
+    const size_t kRowsPerTask = 64;
+    const size_t num_tasks = (height + kRowsPerTask - 1) / kRowsPerTask;
+    AllocVector<std::string> task_errs(num_tasks, std::string(),
+                                       res.allocator);
+    AllocVector<char> task_ok(num_tasks, char(0), res.allocator);
+    res.pool->parallel_for(num_tasks, [&](size_t begin, size_t end) {
+      for (size_t t = begin; t < end; t++) {
+        const size_t y0 = t * kRowsPerTask;
+        const size_t rows = (std::min)(kRowsPerTask, height - y0);
+        task_ok[t] = UnpredictImage(buf + row_bytes * y0,
+                                    image_info.predictor,
+                                    image_info.bits_per_sample,
+                                    size_t(image_info.width), rows,
+                                    size_t(image_info.samples_per_pixel),
+                                    sr.swap_endian(), to_host, res.allocator,
+                                    &task_errs[t])
+                         ? 1
+                         : 0;
+      }
+    });
+
+    for (size_t t = 0; t < num_tasks; t++) {
+      if (!task_ok[t]) {
+        if (err) {
+          (*err) += task_errs[t];
+          (*err) += "Failed to unpredict ZIP-ed image.\n";
+        }
+        return false;
+      }
+    }
+
+    if (buf != dst_data) {
+      for (size_t y = 0; y < size_t(image_info.height); y++) {
+        memcpy(dst_data + dst_stride * y, buf + row_bytes * y, row_bytes);
+      }
+    }
+  }
+
+#ifdef TINY_DNG_LOADER_PROFILING
+  auto end_t = std::chrono::system_clock::now();
+  auto ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end_t - start_t);
+
+  std::cout << "DecompressZIP : " << ms.count() << " [ms]" << std::endl;
+#endif
+
+  return true;
+}
+#endif
+
+// Decompress a LosslesJPEG tile located at `offset` and store it to
+// (`tiff_w`, `tiff_h`) of `dst_data`. `scratch` can be reused among tiles.
+// NOTE: This function does not modify the read position of `sr`, thus it can
+// be called from multiple threads.
+static bool DecompressLosslessJPEGTile(const StreamReader& sr,
+                                       const size_t offset,
+                                       const size_t input_len,
+                                       const DNGImage& image_info,
+                                       const unsigned int tiff_w,
+                                       const unsigned int tiff_h,
+                                       unsigned short* dst_data,
+                                       const ImageWindow& dst,
+                                       DecoderScratch* scratch,
+                                       int* ljbits_out, std::string* err) {
+  int lj_width = 0;
+  int lj_height = 0;
+  int lj_bits = 0;
+
+  lj92 ljp;
+
+  if ((offset == 0) || (offset >= sr.size()) ||
+      (input_len > sr.size() - offset)) {
+    if (err) {
+      (*err) += "Invalid offset to JPEG tile data.\n";
+    }
+    return false;
+  }
+
+  int x0, y0, x1, y1;
+  if (!IntersectTile(image_info, tiff_w, tiff_h, dst, &x0, &y0, &x1, &y1)) {
+    return true;
+  }
+
+  const uint8_t* src = sr.map_abs_addr(offset, input_len);
+  if (!src) {
+    if (err) {
+      (*err) += "Failed to read JPEG tile data.\n";
+    }
+    return false;
+  }
+
+  int ret = lj92_open_with_storage(
+      &ljp, &scratch->lj92, src,
+      /* data_len */ ClampToInt(input_len), &lj_width, &lj_height, &lj_bits);
+  TINY_DNG_DPRINTF("ret = %d\n", ret);
+  if (ret != LJ92_ERROR_NONE) {
+    if (err) {
+      (*err) += "Error opening JPEG stream.\n";
+    }
+    return false;
+  }
+
+  TINY_DNG_DPRINTF("lj %d, %d, %d\n", lj_width, lj_height, lj_bits);
+  TINY_DNG_DPRINTF("tile width = %d\n", image_info.tile_width);
+  TINY_DNG_DPRINTF("tile height = %d\n", image_info.tile_length);
+
+  TINY_DNG_ASSERT(lj_width <= image_info.tile_width,
+                  "Unexpected JPEG tile width size.");
+  TINY_DNG_ASSERT(lj_height <= image_info.tile_length,
+                  "Unexpected JPEG tile length size.");
+
+  TINY_DNG_DPRINTF("lj.components %d, samples_per_pixel %d\n",
+                   ljp->components, image_info.samples_per_pixel);
+
+  // Decoded ljpeg data is already channel first(RGBRGBRGB...).
+  // NOTE: For some DNG file, tiled image may exceed the extent of target
+  // image resolution. Such a tile is clipped: samples right of the image or
+  // `dst` are not written, and decoding stops at the last row needed.
+  const size_t spp = size_t(image_info.samples_per_pixel);
+  const size_t tile_stride = spp * size_t(image_info.tile_width);
+  const size_t lj_row = size_t(lj_width) * size_t(ljp->components);
+  const size_t dst_stride =
+      WindowRowStride(dst, spp * sizeof(uint16_t)) / sizeof(uint16_t);
+  const int write_length = static_cast<int>(spp * size_t(x1 - x0));
+
+  // A JPEG row may not be a tile row(e.g. 2 components of half the tile
+  // width). Then samples are decoded contiguously and read as tile rows.
+  if ((lj_row == 0) || (lj_row * size_t(lj_height) >
+                        tile_stride * size_t(image_info.tile_length))) {
+    lj92_close(ljp);
+    if (err) {
+      (*err) += "JPEG tile does not fit the tile size.\n";
+    }
+    return false;
+  }
+
+  const int rows =
+      std::min(static_cast<int>(lj_row * size_t(lj_height) / tile_stride),
+               y1 - int(tiff_h));
+
+  if (rows <= y0 - int(tiff_h)) {
+    // No decoded rows inside of `dst`.
+    ret = LJ92_ERROR_NONE;
+  } else if ((lj_row == tile_stride) && (x0 == int(tiff_w)) &&
+             (y0 == int(tiff_h))) {
+    // Decode directly into the destination.
+    const int skip_length = static_cast<int>(dst_stride) - write_length;
+
+    // TODO: ljp->components > image_info.samples_per_pixel
+    ret = lj92_decode(ljp,
+                      dst_data + dst_stride * size_t(y0 - dst.y) +
+                          spp * size_t(x0 - dst.x),
+                      write_length, skip_length, NULL, 0, rows);
+  } else {
+    // `dst` starts inside of the tile, or JPEG rows are not tile rows. Decode
+    // the rows up to the bottom of `dst` to a scratch buffer, then copy the
+    // overlapping part.
+    const int lj_rows = static_cast<int>(
+        (std::min)(size_t(lj_height),
+                   (tile_stride * size_t(rows) + lj_row - 1) / lj_row));
+    uint16_t* tile_buf =
+        ScratchBuffer(scratch, &scratch->u16, lj_row * size_t(lj_rows));
+
+    ret = lj92_decode(ljp, tile_buf, static_cast<int>(lj_row), 0, NULL, 0,
+                      lj_rows);
+    if (ret == LJ92_ERROR_NONE) {
+      for (int y = y0; y < int(tiff_h) + rows; y++) {
+        memcpy(dst_data + dst_stride * size_t(y - dst.y) +
+                   spp * size_t(x0 - dst.x),
+               tile_buf + tile_stride * size_t(y - int(tiff_h)) +
+                   spp * size_t(x0 - int(tiff_w)),
+               sizeof(uint16_t) * size_t(write_length));
+      }
+    }
+  }
+  lj92_close(ljp);
+
+  if (ret != LJ92_ERROR_NONE) {
+    if (err) {
+      (*err) += "Error decoding JPEG stream.\n";
+    }
+    return false;
+  }
+
+  if (ljbits_out) {
+    (*ljbits_out) = lj_bits;
+  }
+
+  return true;
+}
+
+// Decompress LosslesJPEG adta.
+static bool DecompressLosslessJPEG(const StreamReader& sr,
+                                   unsigned short* dst_data,
+                                   const ImageWindow& dst,
+                                   const DNGImage& image_info, int* ljbits_out,
+                                   const DecodeResources& res,
+                                   std::string* err) {
+  size_t offset = 0;
+
+#ifdef TINY_DNG_LOADER_PROFILING
+  auto start_t = std::chrono::system_clock::now();
+#endif
+
+  TINY_DNG_DPRINTF("tile_width %d, tile_length %d\n", image_info.tile_width,
+                   image_info.tile_length);
+
+  if ((image_info.tile_width > 0) && (image_info.tile_length > 0)) {
+    // Assume Lossless JPEG data is stored in tiled format.
+    if (image_info.tile_width <= 0) {
+      if (err) {
+        (*err) += "Invalid tile width.\n";
+      }
+      return false;
+    }
+    if (image_info.tile_length <= 0) {
+      if (err) {
+        (*err) += "Invalid tile length.\n";
+      }
+      return false;
+    }
+    //TINY_DNG_ASSERT(image_info.tile_width > 0, "Invalid tile width.");
+    //TINY_DNG_ASSERT(image_info.tile_length > 0, "Invalid tile length.");
+
+    // <-       image width(skip len)           ->
+    // +-----------------------------------------+
+    // |                                         |
+    // |              <- tile w  ->              |
+    // |              +-----------+              |
+    // |              |           | \            |
+    // |              |           | |            |
+    // |              |           | | tile h     |
+    // |              |           | |            |
+    // |              |           | /            |
+    // |              +-----------+              |
+    // |                                         |
+    // |                                         |
+    // +-----------------------------------------+
+
+    // TINY_DNG_DPRINTF("tile = %d, %d\n", image_info.tile_width,
+    // image_info.tile_length);
+
+    // Currently we only support tile data for tile.length == tiff.height.
+    // assert(image_info.tile_length == image_info.height);
+
+    AllocVector<int> tile_lj_bits(image_info.tile_offsets.size(), 0,
+                                  res.allocator);
+
+    if (!DecodeTiles(image_info, dst, res,
+                     [&](size_t k, unsigned int tiff_w, unsigned int tiff_h,
+                         DecoderScratch* scratch, std::string* tile_err) {
+                       return DecompressLosslessJPEGTile(
+                           sr, size_t(image_info.tile_offsets[k]),
+                           size_t(image_info.tile_byte_counts[k]), image_info,
+                           tiff_w, tiff_h, dst_data, dst, scratch,
+                           &tile_lj_bits[k], tile_err);
+                     },
+                     err)) {
+      return false;
+    }
+
+    for (size_t k = 0; k < tile_lj_bits.size(); k++) {
+      if (ljbits_out && (tile_lj_bits[k] > 0)) {
+        // Assume all tiles have same lj_bits value.
+        (*ljbits_out) = tile_lj_bits[k];
+      }
+    }
+  } else {
+    // Assume LJPEG data is not stored in tiled format.
+
+    // Read offset to JPEG data location.
+    // offset = static_cast<int>(Read4(fp, swap_endian));
+
+    TINY_DNG_ASSERT(image_info.offset > 0, "Invalid JPEG data offset.");
+    offset = size_t(image_info.offset);
+
+    TINY_DNG_DPRINTF("LJPEG offset %d\n", int(offset));
+
+    int lj_width = 0;
+    int lj_height = 0;
+    int lj_bits = 0;
+    lj92 ljp;
+
+    size_t input_len = ImageDataLength(sr, image_info, offset);
+    const uint8_t* src = sr.map_abs_addr(offset, input_len);
+    if (!src) {
+      if (err) {
+        (*err) += "Failed to read JPEG data.\n";
+      }
+      return false;
+    }
+
+    ScratchLease scratch(res.context);
+
+    // @fixme { Parse LJPEG header first and set exact compressed LJPEG data
+    // length to `data_len` arg. }
+    int ret = lj92_open_with_storage(
+        &ljp, &scratch->lj92, src,
+        /* data_len */ static_cast<int>(input_len), &lj_width, &lj_height,
+        &lj_bits);
+
+    // TINY_DNG_DPRINTF("ret = %d\n", ret);
+    if (ret != LJ92_ERROR_NONE) {
+      if (err) {
+        (*err) += "Error opening JPEG stream.\n";
+      }
+      return false;
+    }
+
+    // TINY_DNG_DPRINTF("lj %d, %d, %d\n", lj_width, lj_height, lj_bits);
+
+    // The JPEG frame is decoded to the top of `dst`, which is sized from the
+    // IFD(and may be user memory). A JPEG row may not be an image row(e.g.
+    // tiny_dng_writer stores two image rows in one JPEG row), so only the
+    // number of samples must fit.
+    const size_t spp = size_t(image_info.samples_per_pixel);
+    const size_t image_row = size_t((std::max)(dst.width, 0)) * spp;
+    const size_t lj_row = size_t(lj_width) * size_t(ljp->components);
+    const size_t lj_len = lj_row * size_t(lj_height);
+    if ((dst.x != 0) || (dst.y != 0) || (dst.width <= 0) ||
+        (dst.height <= 0) || (lj_len == 0) ||
+        (lj_len > image_row * size_t(dst.height))) {
+      lj92_close(ljp);
+      if (err) {
+        (*err) += "JPEG frame does not fit the image size.\n";
+      }
+      return false;
+    }
+
+    const size_t dst_stride =
+        WindowRowStride(dst, spp * sizeof(uint16_t)) / sizeof(uint16_t);
+    if (dst_stride < image_row) {
+      lj92_close(ljp);
+      if (err) {
+        (*err) += "Row stride is smaller than the image row.\n";
+      }
+      return false;
+    }
+
+    if ((lj_row == image_row) || (dst_stride == image_row)) {
+      // JPEG rows are image rows, or `dst` is contiguous. Decode directly.
+      const int write_length = static_cast<int>(lj_row);
+      const int skip_length =
+          (lj_row == image_row) ? static_cast<int>(dst_stride - image_row) : 0;
+      ret = lj92_decode(ljp, dst_data, write_length, skip_length, NULL, 0);
+    } else {
+      // Decode contiguously to scratch memory, then copy image rows to the
+      // padded rows of `dst`.
+      uint16_t* buf = ScratchBuffer(scratch.get(), &scratch->u16, lj_len);
+      ret = lj92_decode(ljp, buf, static_cast<int>(lj_row), 0, NULL, 0);
+      if (ret == LJ92_ERROR_NONE) {
+        for (size_t y = 0; (y < size_t(dst.height)) && (y * image_row < lj_len);
+             y++) {
+          memcpy(dst_data + dst_stride * y, buf + image_row * y,
+                 sizeof(uint16_t) *
+                     (std::min)(image_row, lj_len - image_row * y));
+        }
+      }
+    }
+
+    lj92_close(ljp);
+
+    if (ret != LJ92_ERROR_NONE) {
+      if (err) {
+        (*err) += "Error decoding JPEG stream.\n";
+      }
+      return false;
+    }
+
+    if (ljbits_out && (lj_bits > 0)) {
+      (*ljbits_out) = lj_bits;
+    }
+  }
+
+#ifdef TINY_DNG_LOADER_PROFILING
+  auto end_t = std::chrono::system_clock::now();
+  auto ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end_t - start_t);
+
+  std::cout << "DecompressLosslessJPEG : " << ms.count() << " [ms]"
+            << std::endl;
+#endif
+
+  return true;
+}
+
+// Currently we only support parsing GainMap
+static bool ParseOpcodeList(unsigned short tag, const uint8_t *data, size_t dataSize,
+  std::vector<GainMap> *gainmaps_out)
+{
+  const size_t kMaxSize = 1024*1024*512;
+
+  // OpCode data is always store in big-endian byte order.
+  // First 32bit uint: The number of opcodes.
+  // For each opcode:
+  //   32bit uint for OpCodeID
+  //   32bit uint for DNG version
+  //   32bit uint for various flag bits.
+  //   32bit uint for the number of bytes of opcode data.
+  //
+  // Value range of processed Image data after OpCode processing(not implemented in TinyDNG)
+  //   Opcode1 : 0 to 2^32 - 1
+  //   Opcode2 : 0 to 2^16 - 1
+  //   Opcode3 : 0.0 to 1.0
+
+  // TODO: Clip image data range according with `tag`
+  (void)tag;
+
+  if (dataSize <= (4 * 5)) {
+    // Too small
+    return false;
+  }
+
+  bool swap_endian = !IsBigEndian();
+  StreamReader sr(data, dataSize, swap_endian);
+
+  uint32_t num_opcodes = 0;
+
+  if (!sr.read4(&num_opcodes)) {
+    return false;
+  }
+
+  const size_t kMaxNumOpcodes = 16;
+  if (num_opcodes > kMaxNumOpcodes) {
+    // too many opcodes.
+    return false;
+  }
+
+  //TINY_DNG_DPRINTF("# of opcodes = %d\n", num_opcodes);
+
+  for (size_t i = 0; i < num_opcodes; i++) {
+    uint32_t opcode_id = 0;
+    uint32_t dng_version = 0;
+    uint32_t flags = 0;
+    uint32_t num_bytes = 0;
+
+    if (!sr.read4(&opcode_id)) {
+      return false;
+    }
+    if (!sr.read4(&dng_version)) {
+      return false;
+    }
+    if (!sr.read4(&flags)) {
+      return false;
+    }
+    if (!sr.read4(&num_bytes)) {
+      return false;
+    }
+
+    TINY_DNG_DPRINTF("opcode %d, dng ver %d, flags %d, num_bytes %d\n", opcode_id, dng_version, flags, num_bytes);
+
+    if (num_bytes < 4) {
+      return false;
+    }
+
+    if (opcode_id == OPCODE_LIST_GAIN_MAP) {
+      const size_t kMaxItems = 1024*1024;
+
+      uint32_t saved_loc = uint32_t(sr.tell());
+
+      // Top, Left, Bottom, Right, Plane, Planes, RowPitch, ColPitch, MapPointsV, MapPointsH (LONG)
+      // MapSpacingV, MapSpacingH, MapOriginV, MapOriginH (DOUBLE)
+      // MapPlanes (LONG)
+      // For each MapPointsV
+      //   For each MapPointsH
+      //     For each MapPlanes
+      //       MapGain (FLOAT)
+
+      uint32_t top, left, bottom, right, plane, planes, row_pitch, col_pitch, map_points_v, map_points_h;
+      double map_spacing_v, map_spacing_h, map_origin_v, map_origin_h;
+      uint32_t map_planes;
+
+      if (!sr.read4(&top)) {
+        return false;
+      }
+
+      if (!sr.read4(&left)) {
+        return false;
+      }
+
+      if (!sr.read4(&bottom)) {
+        return false;
+      }
 
       if (!sr.read4(&right)) {
         return false;
       }
 
-      if (!sr.read4(&plane)) {
-        return false;
+      if (!sr.read4(&plane)) {
+        return false;
+      }
+
+      if (!sr.read4(&planes)) {
+        return false;
+      }
+
+      if (!sr.read4(&row_pitch)) {
+        return false;
+      }
+
+      if (!sr.read4(&col_pitch)) {
+        return false;
+      }
+
+      if (!sr.read4(&map_points_v)) {
+        return false;
+      }
+
+      if (!sr.read4(&map_points_h)) {
+        return false;
+      }
+
+      if (!sr.read_double(&map_spacing_v)) {
+        return false;
+      }
+
+      if (!sr.read_double(&map_spacing_h)) {
+        return false;
+      }
+
+      if (!sr.read_double(&map_origin_v)) {
+        return false;
+      }
+
+      if (!sr.read_double(&map_origin_h)) {
+        return false;
+      }
+
+      if (!sr.read4(&map_planes)) {
+        return false;
+      }
+
+      size_t num_items = map_points_v * map_points_h * map_planes;
+
+      //TINY_DNG_DPRINTF("top %d, left %d, bottom %d, right %d\n", top, left, bottom, right);
+      //TINY_DNG_DPRINTF("plane %d, planes %d\n", plane, planes);
+      //TINY_DNG_DPRINTF("row_pitch %d, col_pitch %d\n", row_pitch, col_pitch);
+      //TINY_DNG_DPRINTF("map_points_v %d, map_points_h %d\n", map_points_v, map_points_h);
+      //TINY_DNG_DPRINTF("map_spacing_v %f, map_spacing_h %f\n", map_spacing_v, map_spacing_h);
+      //TINY_DNG_DPRINTF("map_origin_v %f, map_origin_h %f\n", map_origin_v, map_origin_h);
+      //TINY_DNG_DPRINTF("map_planes %d\n", map_planes);
+      //TINY_DNG_DPRINTF("num_items %d\n", int(num_items));
+
+      // Read gain values.
+
+      if (num_items > kMaxItems) {
+        return false;
+      }
+
+      std::vector<float> gainmap_pixels(num_items);
+      for (size_t k = 0; k < num_items; k++) {
+
+        if (!sr.read_float(&gainmap_pixels[k])) {
+          return false;
+        }
+
+        //TINY_DNG_DPRINTF("values = %f\n", double(gainmap_pixels[k]));
+      }
+
+      GainMap gmap;
+      gmap.idx = (tag - TAG_OPCODE_LIST1) + 1;
+      //TINY_DNG_DPRINTF("idx = %d\n", gmap.idx);
+      gmap.top = top;
+      gmap.left = left;
+      gmap.bottom = bottom;
+      gmap.right = right;
+      gmap.plane = plane;
+      gmap.planes = planes;
+      gmap.row_pitch = row_pitch;
+      gmap.col_pitch = col_pitch;
+      gmap.map_points_v = map_points_v;
+      gmap.map_points_h = map_points_h;
+      gmap.map_origin_v = map_origin_v;
+      gmap.map_origin_h = map_origin_h;
+      gmap.map_spacing_v = map_spacing_v;
+      gmap.map_spacing_h = map_spacing_h;
+      gmap.map_planes = map_planes;
+      gmap.pixels = gainmap_pixels;
+
+      gainmaps_out->push_back(gmap);
+
+      // Go to next OpCode data
+      // TODO: Ensure read bytes == num_bytes
+      if (!sr.seek_set(saved_loc + num_bytes)) {
+        return false;
+      }
+
+    } else {
+
+      if (num_bytes > kMaxSize) {
+        // Too large bytes. Guess invalid OpCode data.
+        return false;
+      }
+
+      // Unimplemented
+      std::vector<uint8_t> op_data(num_bytes);
+      if (!sr.read(num_bytes, num_bytes, reinterpret_cast<unsigned char *>(op_data.data()))) {
+        return false;
+      }
+
+    }
+
+  }
+
+  return true;
+}
+
+// Parse custom TIFF field
+// returns -1 when error.
+// returns 0 when not found.
+// returns 1 when success.
+static int ParseCustomField(const StreamReader& sr,
+                            const std::vector<FieldInfo>& field_lists,
+                            const unsigned short tag, const unsigned short type,
+                            const unsigned int len, FieldData* data,
+                            std::string* err) {
+  bool found = false;
+
+  (void)len;
+
+  // Simple linear search.
+  // TODO(syoyo): Use binary search for faster procesing.
+  for (size_t i = 0; i < field_lists.size(); i++) {
+    if ((field_lists[i].tag > TAG_NEW_SUBFILE_TYPE) &&
+        (field_lists[i].tag == tag) && (field_lists[i].type == type)) {
+      if ((type == TYPE_BYTE) || (type == TYPE_SBYTE)) {
+        data->name = field_lists[i].name;
+        data->type = static_cast<DataType>(type);
+        unsigned char val;
+        if (!sr.read1(&val)) {
+          if (err) {
+            (*err) += "Failed tp parse custom field.\n";
+          }
+          return -1;
+        }
+
+        data->data.resize(1);
+        data->data[0] = val;
+        found = true;
+      } else if ((type == TYPE_SHORT) || (type == TYPE_SSHORT)) {
+        data->name = field_lists[i].name;
+        data->type = static_cast<DataType>(type);
+        unsigned short val;
+        if (!sr.read2(&val)) {
+          if (err) {
+            (*err) += "Failed tp parse custom field.\n";
+          }
+          return -1;
+        }
+        data->data.resize(sizeof(short));
+        memcpy(data->data.data(), &val, sizeof(short));
+        found = true;
+      } else if ((type == TYPE_LONG) || (type == TYPE_SLONG) ||
+                 (type == TYPE_FLOAT)) {
+        data->name = field_lists[i].name;
+        data->type = static_cast<DataType>(type);
+        unsigned int val;
+        if (!sr.read4(&val)) {
+          if (err) {
+            (*err) += "Failed tp parse custom field.\n";
+          }
+          return -1;
+        }
+        data->data.resize(sizeof(int));
+        memcpy(data->data.data(), &val, sizeof(int));
+        found = true;
+      } else if ((type == TYPE_RATIONAL) || (type == TYPE_SRATIONAL)) {
+        data->name = field_lists[i].name;
+        data->type = static_cast<DataType>(type);
+        unsigned int num, denom;
+
+        if (!sr.read4(&num)) {
+          if (err) {
+            (*err) += "Failed tp parse custom field.\n";
+          }
+          return -1;
+        }
+
+        if (!sr.read4(&denom)) {
+          if (err) {
+            (*err) += "Failed tp parse custom field.\n";
+          }
+          return -1;
+        }
+
+        data->data.resize(sizeof(int) * 2);
+
+        // Store rational value as is.
+        memcpy(&data->data[0], &num, 4);
+        memcpy(&data->data[4], &denom, 4);
+        found = true;
+      } else {
+        // TODO(syoyo): Support more data types.
+      }
+    }
+  }
+
+  return found ? 1 : 0;
+}
+
+// Parse TIFF IFD.
+// Returns true upon success, false if failed to parse.
+static bool ParseTIFFIFD(const StreamReader& sr, const bool big_tiff,
+                         const std::vector<FieldInfo>& custom_field_lists,
+                         std::vector<tinydng::DNGImage>* images,
+                         std::string* warn, std::string* err, uint32_t call_depth = 0) {
+  if (!images) {
+    if (err) {
+      (*err) += "`images` argument is null.\n";
+    }
+    return false;
+  }
+
+  tinydng::DNGImage image;
+  InitializeDNGImage(&image);
+
+  // TINY_DNG_DPRINTF("id = %d\n", idx);
+  uint64_t num_entries = 0;
+  bool num_entries_ok = false;
+  if (big_tiff) {
+    num_entries_ok = sr.read8(&num_entries);
+  } else {
+    unsigned short num_entries16 = 0;
+    num_entries_ok = sr.read2(&num_entries16);
+    num_entries = num_entries16;
+  }
+  if (!num_entries_ok) {
+    if (err) {
+      (*err) += "Faild to read the number of entries in TIFF IFD.\n";
+    }
+    return false;
+  }
+
+  if (num_entries == 0) {
+    if (err) {
+      (*err) += "TIFF IFD cannot have 0 entries.\n";
+    }
+    return false;
+  }
+
+  TINY_DNG_DPRINTF("----------\n");
+  TINY_DNG_DPRINTF("num entries %d\n", int(num_entries));
+
+  // For delayed reading of strip offsets and strip byte counts.
+  size_t offt_strip_offset = 0;
+  size_t offt_strip_byte_counts = 0;
+  unsigned short type_strip_offset = TYPE_LONG;
+  unsigned short type_strip_byte_counts = TYPE_LONG;
+
+  // For delayed reading of tile offsets and tile byte counts.
+  size_t offt_tile_offsets = 0;
+  size_t offt_tile_byte_counts = 0;
+  unsigned short type_tile_offsets = 0;
+  unsigned short type_tile_byte_counts = 0;
+  unsigned int num_tile_offsets = 0;
+  unsigned int num_tile_byte_counts = 0;
+
+  while (num_entries--) {
+    unsigned short tag, type;
+    unsigned int len;
+    size_t saved_offt;
+    if (!GetTIFFTag(sr, big_tiff, &tag, &type, &len, &saved_offt)) {
+      if (err) {
+        (*err) += "Failed to read TIFF Tag.\n";
+      }
+      return false;
+    }
+
+    TINY_DNG_DPRINTF("tag %d\n", tag);
+    TINY_DNG_DPRINTF("saved_offt %d\n", int(saved_offt));
+    if (tag < TAG_NEW_SUBFILE_TYPE) {
+      if (err) {
+        (*err) += "Invalid tag ID.\n";
+      }
+      return false;
+    }
+
+    // TINY_DNG_DPRINTF("tag = %d\n", tag);
+
+    switch (tag) {
+      case TAG_NEW_SUBFILE_TYPE:
+        if (!sr.read_uint(type, &image.new_subfile_type)) {
+          if (err) {
+            (*err) += "Failed to read NewSubFileType Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case 2:
+      case TAG_IMAGE_WIDTH:
+      case 61441:  // ImageWidth
+        if (!sr.read_uint(type,
+                          reinterpret_cast<unsigned int*>(&(image.width)))) {
+          if (err) {
+            (*err) += "Failed to read ImageWidth Tag.\n";
+          }
+          return false;
+        }
+        // TINY_DNG_DPRINTF("[%d] width = %d\n", idx, info.width);
+        break;
+
+      case 3:
+      case TAG_IMAGE_HEIGHT:
+      case 61442:  // ImageHeight
+        if (!sr.read_uint(type,
+                          reinterpret_cast<unsigned int*>(&(image.height)))) {
+          if (err) {
+            (*err) += "Failed to read ImageHeight Tag.\n";
+          }
+          return false;
+        }
+        // TINY_DNG_DPRINTF("height = %d\n", image.height);
+        break;
+
+      case TAG_BITS_PER_SAMPLE:
+      case 61443:  // BitsPerSample
+        // image->samples = len & 7;
+        if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
+                                    &(image.bits_per_sample_original)))) {
+          if (err) {
+            (*err) += "Failed to read BitsPerSample Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_SAMPLES_PER_PIXEL: {
+        short spp = 0;
+        if (!sr.read2(&spp)) {
+          if (err) {
+            (*err) += "Failed to read SamplesPerPixel Tag.\n";
+          }
+          return false;
+        }
+
+        if (spp < 1) {
+          if (err) {
+            (*err) += "SamplesPerPixel must be 1 ~ 4, but got " + std::to_string(spp) + ".\n";
+          }
+          return false;
+        }
+
+        if (spp > 4) {
+          if (err) {
+            (*err) += "SamplesPerPixel must be less than or equal to 4.\n";
+          }
+          return false;
+        }
+
+        image.samples_per_pixel = static_cast<int>(spp);
+
+        // TINY_DNG_DPRINTF("spp = %d\n", image.samples_per_pixel);
+      } break;
+
+      case TAG_ROWS_PER_STRIP: {
+        // SHORT or LONG. 2^32 - 1(= -1) means a single strip.
+        if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
+                                    &image.rows_per_strip))) {
+          if (err) {
+            (*err) += "Failed to parse RowsPerStrip Tag.\n";
+          }
+          return false;
+        }
+        // NOTE: Compute strip_per_image in later since image.height is required
+        // to compute strips_per_image.
+      } break;
+
+      case TAG_COMPRESSION:
+        if (!sr.read_uint(
+                type, reinterpret_cast<unsigned int*>(&image.compression))) {
+          if (err) {
+            (*err) += "Failed to parse Compression Tag.\n";
+          }
+          return false;
+        }
+
+        // TINY_DNG_DPRINTF("tag-compression = %d\n", image.compression);
+        break;
+
+      case TAG_STRIP_OFFSET:
+      case TAG_JPEG_IF_OFFSET:
+        offt_strip_offset = sr.tell();
+        type_strip_offset = type;
+        if (!ReadTIFFOffset(sr, type, &image.offset)) {
+          if (err) {
+            (*err) += "Failed to parse Compression Tag.\n";
+          }
+          return false;
+        }
+        // TINY_DNG_DPRINTF("strip_offset = %d\n", image.offset);
+        break;
+
+      case TAG_JPEG_IF_BYTE_COUNT:
+        if (!sr.read4(&image.jpeg_byte_count)) {
+          if (err) {
+            (*err) = "Failed to parse JpegIfByteCount Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_ORIENTATION:
+        if (!sr.read2(&image.orientation)) {
+          if (err) {
+            (*err) = "Failed to parse Orientation Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_STRIP_BYTE_COUNTS: {
+        offt_strip_byte_counts = sr.tell();
+        type_strip_byte_counts = type;
+        uint64_t strip_byte_count = 0;
+        if (!ReadTIFFOffset(sr, type, &strip_byte_count)) {
+          if (err) {
+            (*err) = "Failed to parse StripByteCount Tag.\n";
+          }
+          return false;
+        }
+        image.strip_byte_count = static_cast<int>((std::min)(
+            strip_byte_count, uint64_t((std::numeric_limits<int>::max)())));
+        TINY_DNG_DPRINTF("strip_byte_count = %d\n", image.strip_byte_count);
+      } break;
+
+      case TAG_PLANAR_CONFIGURATION:
+        if (!sr.read2(&image.planar_configuration)) {
+          if (err) {
+            (*err) = "Failed to parse PlanarConfiguration Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_PREDICTOR:
+        if (!sr.read2(&image.predictor)) {
+          if (err) {
+            (*err) = "Failed to parse Predictor Tag.\n";
+          }
+          return false;
+        }
+
+        if ((image.predictor < 1) || (image.predictor > 3)) {
+          if (err) {
+            (*err) = "Predictor value must be 1, 2 or 3.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_SAMPLE_FORMAT: {
+        short format;
+        if (!sr.read2(&format)) {
+          if (err) {
+            (*err) = "Failed to parse SampleFormat.\n";
+          }
+          return false;
+        }
+
+        if ((format == SAMPLEFORMAT_INT) || (format == SAMPLEFORMAT_UINT) ||
+            (format == SAMPLEFORMAT_IEEEFP)) {
+          image.sample_format = static_cast<SampleFormat>(format);
+        }
+      } break;
+
+      case TAG_SUB_IFDS:
+
+      {
+        // TINY_DNG_DPRINTF("sub_ifds = %d\n", len);
+        // LONG or IFD in classic TIFF. LONG8 or IFD8 in BigTIFF.
+        const bool is_ifd8 = (type == TYPE_LONG8) || (type == TYPE_IFD8);
+        const unsigned short elem_type =
+            is_ifd8 ? type : static_cast<unsigned short>(TYPE_LONG);
+        const size_t elem_size = is_ifd8 ? 8 : 4;
+        for (size_t k = 0; k < len; k++) {
+          size_t i = sr.tell();
+          uint64_t offt;
+          if (!ReadTIFFOffset(sr, elem_type, &offt)) {
+            if (err) {
+              (*err) += "Failed to parse SubIFDs Tag.\n";
+            }
+            return false;
+          }
+
+          uint64_t base = 0;  // @fixme
+          if (!sr.seek_set(offt + base)) {
+            if (err) {
+              (*err) += "Failed to seek to SubIFD Tag.\n";
+            }
+            return false;
+          }
+
+          // recursive call
+          if (call_depth > kMaxRecursiveIFDParse) {
+            if (err) {
+              (*err) += "Too many nested SUB_IFDS. Input DNG seems invalid or malcious.\n";
+            }
+            return false;
+          }
+
+          if (!ParseTIFFIFD(sr, big_tiff, custom_field_lists, images, warn, err, call_depth+1)) {
+            if (err) {
+              (*err) += "Failed to Parse SubIFD Tag.\n";
+            }
+            return false;
+          }
+
+          if (!sr.seek_set(i + elem_size)) {
+            if (err) {
+              (*err) += "Failed to rewind to SubIFD Tag position.\n";
+            }
+            return false;
+          }
+        }
+        // TINY_DNG_DPRINTF("sub_ifds DONE\n");
+      }
+
+      break;
+
+      case TAG_TILE_WIDTH:
+        if (!sr.read_uint(type,
+                          reinterpret_cast<unsigned int*>(&image.tile_width))) {
+          if (err) {
+            (*err) += "Failed to parse TileWidth Tag.\n";
+          }
+        }
+        // TINY_DNG_DPRINTF("tile_width = %d\n", image.tile_width);
+        break;
+
+      case TAG_TILE_LENGTH:
+        // TINY_DNG_DPRINTF("tile_length = %d\n", image.tile_length);
+        if (!sr.read_uint(
+                type, reinterpret_cast<unsigned int*>(&image.tile_length))) {
+          if (err) {
+            (*err) += "Failed to parse TileLength Tag.\n";
+          }
+        }
+        break;
+
+      case TAG_TILE_OFFSETS:
+        // Read after all tags are parsed.
+        offt_tile_offsets = sr.tell();
+        type_tile_offsets = type;
+        num_tile_offsets = len;
+        break;
+
+      case TAG_TILE_BYTE_COUNTS:
+        // Read after all tags are parsed.
+        offt_tile_byte_counts = sr.tell();
+        type_tile_byte_counts = type;
+        num_tile_byte_counts = len;
+        break;
+
+      case TAG_CFA_PATTERN_DIM:
+        if (!sr.read2(&image.cfa_pattern_dim)) {
+          if (err) {
+            (*err) = "Failed to parse CFA PatternDim Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_CFA_PATTERN: {
+        char buf[16];
+        size_t readLen = len;
+        if (readLen > 16) readLen = 16;
+
+        if (!sr.read(readLen, 16, reinterpret_cast<unsigned char*>(buf))) {
+          if (err) {
+            (*err) = "Failed to parse CFA Pattern Tag.\n";
+          }
+          return false;
+        }
+
+        // Only 2x2 CFAPattern is supported at the moment.
+        if (readLen == 4) {
+          image.cfa_pattern[0][0] = buf[0];
+          image.cfa_pattern[0][1] = buf[1];
+          image.cfa_pattern[1][0] = buf[2];
+          image.cfa_pattern[1][1] = buf[3];
+        } else {
+          if (err) {
+            (*err) =
+                "Length of CFA pattern other than 4(2x2) is not supported "
+                "yet.\n";
+          }
+          return false;
+        }
+      } break;
+
+      case TAG_DNG_VERSION: {
+        char data[4];
+        {
+          for (int i = 0; i < 4; i++) {
+            if (!sr.read1(&data[i])) {
+              if (err) {
+                (*err) += "Failed to parse DNGVersion Tag.\n";
+              }
+              return false;
+            }
+          }
+        }
+
+        image.version =
+            (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
+      } break;
+
+      case TAG_CFA_PLANE_COLOR: {
+        char buf[4];
+        size_t readLen = len;
+        if (readLen > 4) readLen = 4;
+
+        if (!sr.read(readLen, readLen, reinterpret_cast<unsigned char*>(buf))) {
+          if (err) {
+            (*err) += "Failed to parse CFALayout Tag.\n";
+          }
+          return false;
+        }
+
+        for (size_t i = 0; i < readLen; i++) {
+          image.cfa_plane_color[i] = buf[i];
+        }
+      } break;
+
+      case TAG_CFA_LAYOUT: {
+        if (!sr.read4(&image.cfa_layout)) {
+          if (err) {
+            (*err) += "Failed to parse CFALayout Tag.\n";
+          }
+          return false;
+        }
+      } break;
+
+      case TAG_ACTIVE_AREA:
+
+        for (size_t c = 0; c < 4; c++) {
+          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
+                                      &image.active_area[c]))) {
+            if (err) {
+              (*err) += "Failed to parse ActiveArea Tag.\n";
+            }
+            return false;
+          }
+        }
+
+        image.has_active_area = true;
+
+        break;
+
+      case TAG_BLACK_LEVEL: {
+        // Assume TAG_SAMPLES_PER_PIXEL is read before
+        // FIXME(syoyo): scan TAG_SAMPLES_PER_PIXEL in IFD table in advance.
+        for (int s = 0; s < image.samples_per_pixel; s++) {
+          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
+                                      &image.black_level[s]))) {
+            if (err) {
+              (*err) += "Failed to parse BlackLevel Tag.\n";
+            }
+            return false;
+          }
+        }
+      } break;
+
+      case TAG_WHITE_LEVEL: {
+        // Assume TAG_SAMPLES_PER_PIXEL is read before
+        // FIXME(syoyo): scan TAG_SAMPLES_PER_PIXEL in IFD table in advance.
+        for (int s = 0; s < image.samples_per_pixel; s++) {
+          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
+                                      &image.white_level[s]))) {
+            if (err) {
+              (*err) += "Failed to parse WhiteLevel Tag.\n";
+            }
+            return false;
+          }
+        }
+      } break;
+
+      case TAG_ANALOG_BALANCE:
+        // Assume RGB
+        if (!sr.read_real(type, &image.analog_balance[0])) {
+          if (err) {
+            (*err) += "Failed to parse analog balance.\n";
+          }
+          return false;
+        }
+        if (!sr.read_real(type, &image.analog_balance[1])) {
+          if (err) {
+            (*err) += "Failed to parse analog balance.\n";
+          }
+          return false;
+        }
+        if (!sr.read_real(type, &image.analog_balance[2])) {
+          if (err) {
+            (*err) += "Failed to parse analog balance.\n";
+          }
+          return false;
+        }
+
+        image.has_analog_balance = true;
+        break;
+
+      case TAG_AS_SHOT_NEUTRAL:
+        // Assume RGB
+        // TINY_DNG_DPRINTF("ty = %d\n", type);
+        for (size_t c = 0; c < 3; c++) {
+          if (!sr.read_real(type, &image.as_shot_neutral[c])) {
+            if (err) {
+              (*err) += "Failed to parse AsShotNeutral Tag.\n";
+            }
+            return false;
+          }
+        }
+
+        image.has_as_shot_neutral = true;
+        break;
+
+      case TAG_CALIBRATION_ILLUMINANT1: {
+        unsigned short val;
+        if (!sr.read2(&val)) {
+          if (err) {
+            (*err) += "Failed to parse CalibrartionIlluminant1 Tag.\n";
+          }
+          return false;
+        }
+
+        image.calibration_illuminant1 = static_cast<LightSource>(val);
+      } break;
+
+      case TAG_CALIBRATION_ILLUMINANT2: {
+        unsigned short val;
+        if (!sr.read2(&val)) {
+          if (err) {
+            (*err) += "Failed to parse CalibrartionIlluminant2 Tag.\n";
+          }
+          return false;
+        }
+        image.calibration_illuminant2 = static_cast<LightSource>(val);
+      } break;
+
+      case TAG_COLOR_MATRIX1: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse ColorMatrix1 Tag.\n";
+              }
+              return false;
+            }
+
+            image.color_matrix1[c][k] = val;
+          }
+        }
+      } break;
+
+      case TAG_COLOR_MATRIX2: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse ColorMatrix2 Tag.\n";
+              }
+              return false;
+            }
+            image.color_matrix2[c][k] = val;
+          }
+        }
+      } break;
+
+      case TAG_FORWARD_MATRIX1: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse ForwardMatrix1 Tag.\n";
+              }
+              return false;
+            }
+            image.forward_matrix1[c][k] = val;
+          }
+        }
+      } break;
+
+      case TAG_FORWARD_MATRIX2: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse ForwardMatrix2 Tag.\n";
+              }
+              return false;
+            }
+            image.forward_matrix2[c][k] = val;
+          }
+        }
+      } break;
+
+      case TAG_CAMERA_CALIBRATION1: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse CameraCalibration1 Tag.\n";
+              }
+              return false;
+            }
+            image.camera_calibration1[c][k] = val;
+          }
+        }
+      } break;
+
+      case TAG_CAMERA_CALIBRATION2: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse CameraCalibration2 Tag.\n";
+              }
+              return false;
+            }
+            image.camera_calibration2[c][k] = val;
+          }
+        }
+      } break;
+
+      case TAG_CR2_SLICES: {
+        // Assume 3 ushorts;
+        for (size_t c = 0; c < 3; c++) {
+          if (!sr.read2(&image.cr2_slices[c])) {
+            if (err) {
+              (*err) += "Failed to parse CR2Slices Tag.\n";
+            }
+            return false;
+          }
+        }
+        // TINY_DNG_DPRINTF("cr2_slices = %d, %d, %d\n",
+        //  image.cr2_slices[0],
+        //  image.cr2_slices[1],
+        //  image.cr2_slices[2]);
+      } break;
+
+      case TAG_SEMANTIC_NAME: {
+        size_t readLen = len;
+        if (readLen < 1) {
+          if (err) {
+            (*err) += "Null string for SemanticName Tag.\n";
+          }
+
+          return false;
+        }
+
+        const size_t kMaxNameSize = 1024 * 1024;
+
+        if (readLen > kMaxNameSize) {
+          if (err) {
+            (*err) += "The length of SemanticName string too large.\n";
+          }
+          return false;
+        }
+
+        std::vector<uint8_t> buf(readLen);  // readLen includes null char
+        if (!sr.read(readLen, readLen,
+                     reinterpret_cast<unsigned char*>(buf.data()))) {
+          if (err) {
+            (*err) += "Failed to parse SemanticName Tag.\n";
+          }
+          return false;
+        }
+
+        image.semantic_name = std::string(buf.begin(), buf.end());
+
+        TINY_DNG_DPRINTF("semantic_name = %s\n", image.semantic_name.c_str());
+      } break;
+
+      case TAG_OPCODE_LIST1:
+      case TAG_OPCODE_LIST2:
+      case TAG_OPCODE_LIST3: {
+        const size_t kMaxOpcodeDataSize = 1024*1024*256;
+
+        TINY_DNG_DPRINTF("opcodelist %d\n", tag);
+        size_t readLen = len;
+        if (readLen < 1) {
+          if (err) {
+            (*err) += "Empty data for OpCodeList Tag.\n";
+          }
+
+          return false;
+        }
+
+        if (readLen > kMaxOpcodeDataSize) {
+          if (err) {
+            (*err) += "OpCodeList data too large.\n";
+          }
+
+          return false;
+        }
+        std::vector<uint8_t> buf(readLen);
+        if (!sr.read(readLen, readLen,
+                     reinterpret_cast<unsigned char*>(buf.data()))) {
+          if (err) {
+            (*err) += "Failed to read OpCodeList data.\n";
+          }
+          return false;
+        }
+
+        std::vector<GainMap> *gainmaps = NULL;
+        if (tag == TAG_OPCODE_LIST1) {
+          gainmaps = &image.opcodelist1_gainmap;
+        } else if (tag == TAG_OPCODE_LIST2) {
+          gainmaps = &image.opcodelist2_gainmap;
+        } else if (tag == TAG_OPCODE_LIST3) {
+          gainmaps = &image.opcodelist3_gainmap;
+        }
+
+        if (!ParseOpcodeList(tag, buf.data(), buf.size(), gainmaps)) {
+          if (err) {
+            (*err) += "Failed to parse OpCodeList Tag.\n";
+          }
+          return false;
+        }
+
+        TINY_DNG_DPRINTF("opcodelist %d, dataLen = %d\n", tag, int(readLen));
+
+      } break;
+
+      default: {
+        FieldData data;
+        int ret = ParseCustomField(sr, custom_field_lists, tag, type, len,
+                                   &data, err);
+        if (ret == -1) {
+          return false;
+        }
+
+        if (ret > 0) {
+          image.custom_fields.push_back(data);
+        }
+        // TINY_DNG_DPRINTF("unknown or unsupported tag = %d\n", tag);
+      }
+    }
+
+    sr.seek_set(saved_offt);
+  }
+
+  if (image.rows_per_strip > 0) {
+    if (image.height == -1) {
+      if (err) {
+        (*err) = "image height tag is required to compute StripsPerImage.\n";
+      }
+      return false;
+    }
+
+    // http://www.awaresystems.be/imaging/tiff/tifftags/rowsperstrip.html
+    image.strips_per_image =
+        static_cast<int>(floor(double(image.height + image.rows_per_strip - 1) /
+                               double(image.rows_per_strip)));
+    TINY_DNG_DPRINTF("rows_per_strip = %d\n", image.samples_per_pixel);
+    TINY_DNG_DPRINTF("strips_per_image = %d\n", image.strips_per_image);
+  }
+
+  // Delayed read of strip offsets and strip byte counts
+  if (image.strips_per_image > 0) {
+    image.strip_byte_counts.clear();
+    image.strip_offsets.clear();
+
+    std::vector<uint64_t> values;
+
+    if (offt_strip_byte_counts > 0) {
+      if (!ReadTIFFUIntArray(sr, offt_strip_byte_counts,
+                             ArrayTypeOf(type_strip_byte_counts),
+                             static_cast<unsigned int>(image.strips_per_image),
+                             &values)) {
+        if (err) {
+          (*err) += "Failed to read StripByteCount value.";
+        }
+        return false;
+      }
+      image.strip_byte_counts.swap(values);
+    }
+
+    if (offt_strip_offset > 0) {
+      if (!ReadTIFFUIntArray(sr, offt_strip_offset,
+                             ArrayTypeOf(type_strip_offset),
+                             static_cast<unsigned int>(image.strips_per_image),
+                             &values)) {
+        if (err) {
+          (*err) += "Failed to read StripOffset value.";
+        }
+        return false;
+      }
+      image.strip_offsets.swap(values);
+    }
+  }
+
+  // Delayed read of tile offsets and tile byte counts
+  if ((offt_tile_offsets > 0) || (offt_tile_byte_counts > 0)) {
+    if (!ReadTIFFUIntArray(sr, offt_tile_offsets, type_tile_offsets,
+                           num_tile_offsets, &image.tile_offsets) ||
+        !ReadTIFFUIntArray(sr, offt_tile_byte_counts,
+                           type_tile_byte_counts, num_tile_byte_counts,
+                           &image.tile_byte_counts)) {
+      if (err) {
+        (*err) += "Failed to read TileOffsets or TileByteCounts.\n";
+      }
+      return false;
+    }
+
+    if (!ValidateTileTable(sr, image, err)) {
+      return false;
+    }
+
+    if (!image.tile_offsets.empty()) {
+      image.tile_offset = image.tile_offsets[0];
+      image.tile_byte_count = image.tile_byte_counts[0];
+    }
+  }
+  //
+
+  // Add to images.
+  if (images->size() < kMaxImages) {
+    images->push_back(image);
+  } else {
+    if (warn) {
+      (*warn) = "Too many images in one DNG file. Skipped some images\n";
+    }
+  }
+
+  // TINY_DNG_DPRINTF("DONE ---------\n");
+
+  return true;
+}
+
+static bool ParseDNGFromMemory(const StreamReader& sr,
+                               const std::vector<FieldInfo>& custom_fields,
+                               std::vector<tinydng::DNGImage>* images,
+                               std::string* warn, std::string* err) {
+  if (!images) {
+    if (err) {
+      (*err) += "Invalid `images` argument.\n";
+    }
+    return false;
+  }
+
+  // Classic TIFF: byte order(2), 42(2), first IFD offset(4)
+  // BigTIFF: byte order(2), 43(2), bytesize(2) = 8, reserved(2) = 0,
+  //          first IFD offset(8)
+  unsigned short magic = 0;
+  if (!sr.read_at(2, &magic)) {
+    if (err) {
+      (*err) += "Failed to read TIFF magic number.\n";
+    }
+    return false;
+  }
+
+  const bool big_tiff = (magic == 43);
+
+  uint64_t offt = 0;
+  if (big_tiff) {
+    unsigned short bytesize = 0;
+    if (!sr.read_at(4, &bytesize) || (bytesize != 8) || !sr.read_at(8, &offt)) {
+      if (err) {
+        (*err) += "Invalid BigTIFF header.\n";
       }
-
-      if (!sr.read4(&planes)) {
-        return false;
+      return false;
+    }
+  } else {
+    unsigned int offt32;
+    if (!sr.read4(&offt32)) {
+      if (err) {
+        (*err) += "Failed to read offset.\n";
       }
+      return false;
+    }
+    offt = offt32;
+  }
 
-      if (!sr.read4(&row_pitch)) {
-        return false;
-      }
+  TINY_DNG_DPRINTF("First IFD offt: %d\n", int(offt));
 
-      if (!sr.read4(&col_pitch)) {
-        return false;
-      }
+  size_t count = 0;
 
-      if (!sr.read4(&map_points_v)) {
-        return false;
+  while (offt) {
+    if (!sr.seek_set(offt)) {
+      if (err) {
+        (*err) += "Failed to seek to TIFF IFD.\n";
       }
+      return false;
+    }
 
-      if (!sr.read4(&map_points_h)) {
-        return false;
+    // TINY_DNG_DPRINTF("Parse TIFF IFD\n");
+    if (!ParseTIFFIFD(sr, big_tiff, custom_fields, images, warn, err)) {
+      break;
+    }
+    // Get next IFD offset(0 = end of file).
+    if (!ReadTIFFOffset(sr, big_tiff ? TYPE_IFD8 : TYPE_IFD, &offt)) {
+      if (err) {
+        (*err) += "Failed to read next IDF offset.\n";
       }
+      return false;
+    }
 
-      if (!sr.read_double(&map_spacing_v)) {
-        return false;
-      }
+    TINY_DNG_DPRINTF("Next IFD offset = %d\n", int(offt));
 
-      if (!sr.read_double(&map_spacing_h)) {
-        return false;
+    // Avoid infinite loop
+    count++;
+    if (count > kMaxImages) {
+      if (warn) {
+        (*warn) += "Too many IFDs. IFD offset seems invalid.\n";
       }
+      break;
+    }
+  }
 
-      if (!sr.read_double(&map_origin_v)) {
-        return false;
-      }
+  return true;
+}
 
-      if (!sr.read_double(&map_origin_h)) {
+static bool IsBigEndian() {
+  uint32_t i = 0x01020304;
+  char c[4];
+  memcpy(c, &i, 4);
+  return (c[0] == 1);
+}
+
+// TIFF LZW decoder.
+// =============================================================================
+//
+// Codes are read from a 64bit bit buffer which is refilled a word at a time.
+// Instead of prefix chains, each dictionary entry stores the offset and length
+// of an earlier occurrence of its string in the output(the string of the
+// previous code followed by the first byte of the current one), so a code is
+// emitted with a single forward copy.
+//
+namespace lzw {
+
+// TIFF specific values
+static const int kClearCode = 256;
+static const int kEndOfInformation = 257;
+static const int kFirstCode = 258;
+static const int kStartBits = 9;
+static const int kMaxBits = 12;
+static const int kMaxCodes = 1 << kMaxBits;
+
+// Reads variable width codes. With `msb_first` codes are packed from the most
+// significant bit of each byte, otherwise from the least significant bit.
+class CodeReader {
+ public:
+  CodeReader(const uint8_t* src, size_t len, bool msb_first)
+      : src_(src), len_(len), pos_(0), bits_(0), count_(0),
+        msb_first_(msb_first) {}
+
+  // Returns false when less than `width` bits are left.
+  bool Read(const int width, int* code) {
+    if (count_ < width) {
+      Refill();
+      if (count_ < width) {
         return false;
       }
+    }
 
-      if (!sr.read4(&map_planes)) {
-        return false;
+    if (msb_first_) {
+      // Valid bits are kept at the top of `bits_`.
+      (*code) = int(bits_ >> (64 - width));
+      bits_ <<= width;
+    } else {
+      (*code) = int(bits_ & ((uint64_t(1) << width) - 1));
+      bits_ >>= width;
+    }
+    count_ -= width;
+    return true;
+  }
+
+ private:
+  // Fills `bits_` up to at least 56 bits. Bits past `count_` may already hold
+  // the next(not yet consumed) stream bits, which OR in unchanged.
+  void Refill() {
+    if (pos_ + 8 <= len_) {
+      if (msb_first_) {
+        bits_ |= LoadU64BE(src_ + pos_) >> count_;
+      } else {
+        bits_ |= LoadU64LE(src_ + pos_) << count_;
       }
+      pos_ += size_t((63 - count_) >> 3);
+      count_ |= 56;
+      return;
+    }
 
-      size_t num_items = map_points_v * map_points_h * map_planes;
+    while ((count_ <= 56) && (pos_ < len_)) {
+      if (msb_first_) {
+        bits_ |= uint64_t(src_[pos_]) << (56 - count_);
+      } else {
+        bits_ |= uint64_t(src_[pos_]) << count_;
+      }
+      pos_++;
+      count_ += 8;
+    }
+  }
 
-      //TINY_DNG_DPRINTF("top %d, left %d, bottom %d, right %d\n", top, left, bottom, right);
-      //TINY_DNG_DPRINTF("plane %d, planes %d\n", plane, planes);
-      //TINY_DNG_DPRINTF("row_pitch %d, col_pitch %d\n", row_pitch, col_pitch);
-      //TINY_DNG_DPRINTF("map_points_v %d, map_points_h %d\n", map_points_v, map_points_h);
-      //TINY_DNG_DPRINTF("map_spacing_v %f, map_spacing_h %f\n", map_spacing_v, map_spacing_h);
-      //TINY_DNG_DPRINTF("map_origin_v %f, map_origin_h %f\n", map_origin_v, map_origin_h);
-      //TINY_DNG_DPRINTF("map_planes %d\n", map_planes);
-      //TINY_DNG_DPRINTF("num_items %d\n", int(num_items));
+  const uint8_t* src_;
+  size_t len_;
+  size_t pos_;
+  uint64_t bits_;
+  int count_;  // The number of valid bits in `bits_`.
+  bool msb_first_;
+};
 
-      // Read gain values.
+// Copies `len` bytes from an earlier part of the output. `src + len <= dst`.
+// Uses 8 byte copies when there are at least 7 spare bytes after `len`
+// (`avail` bytes are writable from `dst`). Bytes written past `len` are
+// overwritten by the following strings.
+static inline void CopyString(uint8_t* dst, const uint8_t* src,
+                              const size_t len, const size_t avail) {
+  if (len + 7 <= avail) {
+    for (size_t i = 0; i < len; i += 8) {
+      uint64_t v;
+      memcpy(&v, src + i, 8);
+      memcpy(dst + i, &v, 8);
+    }
+  } else {
+    memmove(dst, src, len);
+  }
+}
 
-      if (num_items > kMaxItems) {
-        return false;
-      }
+// Decodes TIFF LZW stream `src` into `dst`. Returns the number of decoded
+// bytes. Decoding stops at EndOfInformation, at the end of the stream or when
+// `dst` is full(the string which does not fit is truncated).
+static size_t Decode(const uint8_t* src, const size_t src_len, uint8_t* dst,
+                     const size_t dst_len, const bool msb_first) {
+  if ((src == NULL) || (dst == NULL) || (src_len == 0) || (dst_len == 0)) {
+    TINY_DNG_DPRINTF("lzw::Decode(): Invalid arguments!\n");
+    return 0;
+  }
 
-      std::vector<float> gainmap_pixels(num_items);
-      for (size_t k = 0; k < num_items; k++) {
+  // Location of the string of code `kFirstCode` or larger in `dst`.
+  size_t offsets[kMaxCodes];
+  uint32_t lengths[kMaxCodes];
 
-        if (!sr.read_float(&gainmap_pixels[k])) {
-          return false;
-        }
+  CodeReader reader(src, src_len, msb_first);
 
-        //TINY_DNG_DPRINTF("values = %f\n", double(gainmap_pixels[k]));
-      }
+  int width = kStartBits;
+  int next_code = kFirstCode;
+  bool has_prev = false;
+  size_t prev_start = 0;
+  size_t prev_len = 0;
+  size_t pos = 0;
 
-      GainMap gmap;
-      gmap.idx = (tag - TAG_OPCODE_LIST1) + 1;
-      //TINY_DNG_DPRINTF("idx = %d\n", gmap.idx);
-      gmap.top = top;
-      gmap.left = left;
-      gmap.bottom = bottom;
-      gmap.right = right;
-      gmap.plane = plane;
-      gmap.planes = planes;
-      gmap.row_pitch = row_pitch;
-      gmap.col_pitch = col_pitch;
-      gmap.map_points_v = map_points_v;
-      gmap.map_points_h = map_points_h;
-      gmap.map_origin_v = map_origin_v;
-      gmap.map_origin_h = map_origin_h;
-      gmap.map_spacing_v = map_spacing_v;
-      gmap.map_spacing_h = map_spacing_h;
-      gmap.map_planes = map_planes;
-      gmap.pixels = gainmap_pixels;
+  int code;
+  while (reader.Read(width, &code)) {
+    if (code == kEndOfInformation) {
+      break;
+    }
 
-      gainmaps_out->push_back(gmap);
+    if (code == kClearCode) {
+      width = kStartBits;
+      next_code = kFirstCode;
+      has_prev = false;
+      continue;
+    }
 
-      // Go to next OpCode data
-      // TODO: Ensure read bytes == num_bytes
-      if (!sr.seek_set(saved_loc + num_bytes)) {
-        return false;
+    if (!has_prev) {
+      // The first code after a clear must be a literal.
+      if ((code > 255) || (pos >= dst_len)) {
+        break;
       }
+      prev_start = pos;
+      prev_len = 1;
+      dst[pos++] = uint8_t(code);
+      has_prev = true;
+      continue;
+    }
 
-    } else {
+    const size_t avail = dst_len - pos;
+    const size_t start = pos;
+    size_t len;
 
-      if (num_bytes > kMaxSize) {
-        // Too large bytes. Guess invalid OpCode data.
-        return false;
+    if (code < 256) {
+      if (avail < 1) {
+        break;
       }
-
-      // Unimplemented
-      std::vector<uint8_t> op_data(num_bytes);
-      if (!sr.read(num_bytes, num_bytes, reinterpret_cast<unsigned char *>(op_data.data()))) {
-        return false;
+      len = 1;
+      dst[pos++] = uint8_t(code);
+    } else if (code < next_code) {
+      len = lengths[code];
+      if (len > avail) {
+        memmove(dst + pos, dst + offsets[code], avail);
+        pos += avail;
+        break;
+      }
+      CopyString(dst + pos, dst + offsets[code], len, avail);
+      pos += len;
+    } else {
+      // Code not yet in the dictionary: the previous string followed by its
+      // own first byte.
+      len = prev_len + 1;
+      if (len > avail) {
+        memmove(dst + pos, dst + prev_start, avail);
+        pos += avail;
+        break;
+      }
+      CopyString(dst + pos, dst + prev_start, prev_len, avail);
+      dst[pos + prev_len] = dst[prev_start];
+      pos += len;
+    }
+
+    // New entry: the previous string and the first byte of this one, which
+    // are contiguous in `dst`.
+    offsets[next_code] = prev_start;
+    lengths[next_code] = uint32_t(prev_len + 1);
+    next_code++;
+
+    // Code width grows one code early(TIFF "early change").
+    if (next_code == ((1 << width) - 1)) {
+      width++;
+      if (width > kMaxBits) {
+        width = kStartBits;
+        next_code = kFirstCode;
+        has_prev = false;
+        continue;
       }
-
     }
 
+    prev_start = start;
+    prev_len = len;
   }
 
-  return true;
+  return pos;
 }
 
-// Parse custom TIFF field
-// returns -1 when error.
-// returns 0 when not found.
-// returns 1 when success.
-static int ParseCustomField(const StreamReader& sr,
-                            const std::vector<FieldInfo>& field_lists,
-                            const unsigned short tag, const unsigned short type,
-                            const unsigned int len, FieldData* data,
-                            std::string* err) {
-  bool found = false;
-
-  (void)len;
+}  // namespace lzw
 
-  // Simple linear search.
-  // TODO(syoyo): Use binary search for faster procesing.
-  for (size_t i = 0; i < field_lists.size(); i++) {
-    if ((field_lists[i].tag > TAG_NEW_SUBFILE_TYPE) &&
-        (field_lists[i].tag == tag) && (field_lists[i].type == type)) {
-      if ((type == TYPE_BYTE) || (type == TYPE_SBYTE)) {
-        data->name = field_lists[i].name;
-        data->type = static_cast<DataType>(type);
-        unsigned char val;
-        if (!sr.read1(&val)) {
-          if (err) {
-            (*err) += "Failed tp parse custom field.\n";
-          }
-          return -1;
-        }
+// Bytes of a row of strip or tile data. Rows are padded to a byte boundary.
+static inline size_t StripRowBytes(const DNGImage& image) {
+  return size_t((uint64_t(image.samples_per_pixel) * uint64_t(image.width) *
+                     uint64_t(image.bits_per_sample) +
+                 7) /
+                8);
+}
 
-        data->data.resize(1);
-        data->data[0] = val;
-        found = true;
-      } else if ((type == TYPE_SHORT) || (type == TYPE_SSHORT)) {
-        data->name = field_lists[i].name;
-        data->type = static_cast<DataType>(type);
-        unsigned short val;
-        if (!sr.read2(&val)) {
-          if (err) {
-            (*err) += "Failed tp parse custom field.\n";
-          }
-          return -1;
-        }
-        data->data.resize(sizeof(short));
-        memcpy(data->data.data(), &val, sizeof(short));
-        found = true;
-      } else if ((type == TYPE_LONG) || (type == TYPE_SLONG) ||
-                 (type == TYPE_FLOAT)) {
-        data->name = field_lists[i].name;
-        data->type = static_cast<DataType>(type);
-        unsigned int val;
-        if (!sr.read4(&val)) {
-          if (err) {
-            (*err) += "Failed tp parse custom field.\n";
-          }
-          return -1;
-        }
-        data->data.resize(sizeof(int));
-        memcpy(data->data.data(), &val, sizeof(int));
-        found = true;
-      } else if ((type == TYPE_RATIONAL) || (type == TYPE_SRATIONAL)) {
-        data->name = field_lists[i].name;
-        data->type = static_cast<DataType>(type);
-        unsigned int num, denom;
+// Decode `k`'th LZW compressed strip into `dst`. `dst_len` must hold the rows
+// of the strip(the last strip may be shorter than RowsPerStrip). Samples are
+// converted to host byte order when `to_host` is true.
+// NOTE: This function does not modify the read position of `sr`, thus it can
+// be called from multiple threads.
+static bool DecodeLZWStrip(const StreamReader& sr, const bool swap_endian,
+                           const bool to_host, const tinydng::DNGImage& image,
+                           const size_t k, unsigned char* dst,
+                           const size_t dst_len, Allocator* allocator,
+                           std::string* err) {
+  const size_t strip_offset = image.strip_offsets[k];
+  const size_t strip_bytesize = image.strip_byte_counts[k];
+
+  const size_t rows_per_strip = RowsPerStrip(image);
+  const size_t y0 = k * rows_per_strip;
+  if (y0 >= size_t(image.height)) {
+    return true;
+  }
+  const size_t rows = (std::min)(rows_per_strip, size_t(image.height) - y0);
+  const size_t len = rows * StripRowBytes(image);
+  TINY_DNG_ASSERT(len <= dst_len, "Too small LZW strip buffer.");
+  (void)dst_len;
 
-        if (!sr.read4(&num)) {
-          if (err) {
-            (*err) += "Failed tp parse custom field.\n";
-          }
-          return -1;
-        }
+  const uint8_t* src_addr = sr.map_abs_addr(strip_offset, strip_bytesize);
+  if (!src_addr) {
+    if (err) {
+      (*err) += "Cannot read strip_byte_counts bytes from a memory.\n";
+    }
+    return false;
+  }
 
-        if (!sr.read4(&denom)) {
-          if (err) {
-            (*err) += "Failed tp parse custom field.\n";
-          }
-          return -1;
-        }
+  // LZW codes are MSB-first regardless of the byte order of the file.
+  const size_t decoded_bytes =
+      lzw::Decode(src_addr, strip_bytesize, dst, len, /* msb_first */ true);
+  if (decoded_bytes == 0) {
+    if (err) {
+      (*err) += "Failed to decode LZW strip.\n";
+    }
+    return false;
+  }
 
-        data->data.resize(sizeof(int) * 2);
+  // Missing data of a truncated strip is filled with zero.
+  if (decoded_bytes < len) {
+    memset(dst + decoded_bytes, 0, len - decoded_bytes);
+  }
 
-        // Store rational value as is.
-        memcpy(&data->data[0], &num, 4);
-        memcpy(&data->data[4], &denom, 4);
-        found = true;
-      } else {
-        // TODO(syoyo): Support more data types.
-      }
-    }
+  if (!UnpredictImage(dst, image.predictor, image.bits_per_sample,
+                      size_t(image.width), rows,
+                      size_t(image.samples_per_pixel), swap_endian, to_host,
+                      allocator, err)) {
+    return false;
   }
 
-  return found ? 1 : 0;
+  return true;
 }
 
-// Parse TIFF IFD.
-// Returns true upon success, false if failed to parse.
-static bool ParseTIFFIFD(const StreamReader& sr,
-                         const std::vector<FieldInfo>& custom_field_lists,
-                         std::vector<tinydng::DNGImage>* images,
-                         std::string* warn, std::string* err, uint32_t call_depth = 0) {
-  if (!images) {
-    if (err) {
-      (*err) += "`images` argument is null.\n";
+// Fill `DNGImage::data_offset` and `DNGImage::data_byte_count`.
+static void ResolveDataLocation(tinydng::DNGImage* image) {
+  image->data_offset = 0;
+  image->data_byte_count = 0;
+
+  if (!image->tile_offsets.empty()) {
+    image->data_offset = image->tile_offsets[0];
+    for (size_t k = 0; k < image->tile_byte_counts.size(); k++) {
+      image->data_byte_count += image->tile_byte_counts[k];
+    }
+  } else if (!image->strip_offsets.empty()) {
+    image->data_offset = image->strip_offsets[0];
+    for (size_t k = 0; k < image->strip_byte_counts.size(); k++) {
+      image->data_byte_count += image->strip_byte_counts[k];
+    }
+  } else {
+    image->data_offset = (image->offset > 0) ? image->offset : image->tile_offset;
+    if (image->strip_byte_count > 0) {
+      image->data_byte_count = uint64_t(image->strip_byte_count);
+    } else if (image->jpeg_byte_count > 0) {
+      image->data_byte_count = uint64_t(image->jpeg_byte_count);
     }
-    return false;
   }
+}
 
-  tinydng::DNGImage image;
-  InitializeDNGImage(&image);
+// Append byte ranges([begin, end)) of the compressed data of `image` to
+// `ranges`. Ranges outside of the data are skipped.
+static void CollectImageDataRanges(
+    const tinydng::DNGImage& image, const uint64_t data_size,
+    std::vector<std::pair<uint64_t, uint64_t> >* ranges) {
+  std::vector<std::pair<uint64_t, uint64_t> > r;
+  if (!image.tile_offsets.empty()) {
+    for (size_t k = 0; k < image.tile_offsets.size(); k++) {
+      if (k < image.tile_byte_counts.size()) {
+        r.push_back(std::make_pair(image.tile_offsets[k],
+                                   image.tile_offsets[k] +
+                                       image.tile_byte_counts[k]));
+      }
+    }
+  } else if (!image.strip_offsets.empty()) {
+    for (size_t k = 0; k < image.strip_offsets.size(); k++) {
+      if (k < image.strip_byte_counts.size()) {
+        r.push_back(std::make_pair(uint64_t(image.strip_offsets[k]),
+                                   uint64_t(image.strip_offsets[k]) +
+                                       image.strip_byte_counts[k]));
+      }
+    }
+  } else if (image.data_byte_count > 0) {
+    r.push_back(std::make_pair(image.data_offset,
+                               image.data_offset + image.data_byte_count));
+  }
 
-  // TINY_DNG_DPRINTF("id = %d\n", idx);
-  unsigned short num_entries = 0;
-  if (!sr.read2(&num_entries)) {
-    if (err) {
-      (*err) += "Faild to read the number of entries in TIFF IFD.\n";
+  for (size_t k = 0; k < r.size(); k++) {
+    if ((r[k].first < r[k].second) && (r[k].second <= data_size)) {
+      ranges->push_back(r[k]);
     }
-    return false;
   }
+}
 
-  if (num_entries == 0) {
+// Fill image information which are only available after looking into image
+// data(e.g. resolution of JPEG image) without decoding pixels.
+static bool ReadImageDataInfo(const StreamReader& sr, const size_t i,
+                              tinydng::DNGImage* image,
+                              DecoderContext* context, std::string* err) {
+  const size_t data_offset = size_t(image->data_offset);
+  if ((data_offset == 0) || (data_offset >= sr.size())) {
     if (err) {
-      (*err) += "TIFF IFD cannot have 0 entries.\n";
+      std::stringstream ss;
+      ss << i << "'th image data offset is zero or invalid.\n";
+      (*err) += ss.str();
     }
     return false;
   }
 
-  TINY_DNG_DPRINTF("----------\n");
-  TINY_DNG_DPRINTF("num entries %d\n", num_entries);
-
-  // For delayed reading of strip offsets and strip byte counts.
-  long offt_strip_offset = 0;
-  long offt_strip_byte_counts = 0;
-
-  while (num_entries--) {
-    unsigned short tag, type;
-    unsigned int len;
-    unsigned int saved_offt;
-    if (!GetTIFFTag(sr, &tag, &type, &len, &saved_offt)) {
+  // Only headers of JPEG data are inspected. Limit the range so that a
+  // `ByteSource` does not fetch whole image data.
+  size_t data_len = 0;
+  const uint8_t* data_addr = NULL;
+  if ((image->compression == COMPRESSION_OLD_JPEG) ||
+      (image->compression == COMPRESSION_NEW_JPEG) ||
+      (image->compression == COMPRESSION_LOSSY)) {
+    data_len = (std::min)(ImageDataLength(sr, *image, data_offset),
+                          kDataHeaderLength);
+    data_addr = sr.map_abs_addr(data_offset, data_len);
+    if (!data_addr) {
       if (err) {
-        (*err) += "Failed to read TIFF Tag.\n";
+        std::stringstream ss;
+        ss << "Failed to read " << i << "'th image data.\n";
+        (*err) += ss.str();
       }
       return false;
     }
+  }
 
-    TINY_DNG_DPRINTF("tag %d\n", tag);
-    TINY_DNG_DPRINTF("saved_offt %d\n", saved_offt);
-    if (tag < TAG_NEW_SUBFILE_TYPE) {
-      if (err) {
-        (*err) += "Invalid tag ID.\n";
+  if (image->compression == COMPRESSION_NONE) {
+    if (image->jpeg_byte_count > 0) {
+      // CR2 thumbnail. See `DecodeImageData`.
+      image->width = 0;
+      image->height = 0;
+      if (image->bits_per_sample_original < 0) {
+        image->bits_per_sample_original = 8;
       }
-      return false;
     }
-
-    // TINY_DNG_DPRINTF("tag = %d\n", tag);
-
-    switch (tag) {
-      case 2:
-      case TAG_IMAGE_WIDTH:
-      case 61441:  // ImageWidth
-        if (!sr.read_uint(type,
-                          reinterpret_cast<unsigned int*>(&(image.width)))) {
-          if (err) {
-            (*err) += "Failed to read ImageWidth Tag.\n";
-          }
-          return false;
-        }
-        // TINY_DNG_DPRINTF("[%d] width = %d\n", idx, info.width);
-        break;
-
-      case 3:
-      case TAG_IMAGE_HEIGHT:
-      case 61442:  // ImageHeight
-        if (!sr.read_uint(type,
-                          reinterpret_cast<unsigned int*>(&(image.height)))) {
-          if (err) {
-            (*err) += "Failed to read ImageHeight Tag.\n";
-          }
-          return false;
-        }
-        // TINY_DNG_DPRINTF("height = %d\n", image.height);
-        break;
-
-      case TAG_BITS_PER_SAMPLE:
-      case 61443:  // BitsPerSample
-        // image->samples = len & 7;
-        if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
-                                    &(image.bits_per_sample_original)))) {
-          if (err) {
-            (*err) += "Failed to read BitsPerSample Tag.\n";
-          }
-          return false;
-        }
-        break;
-
-      case TAG_SAMPLES_PER_PIXEL: {
-        short spp = 0;
-        if (!sr.read2(&spp)) {
-          if (err) {
-            (*err) += "Failed to read SamplesPerPixel Tag.\n";
-          }
-          return false;
-        }
-
-        if (spp < 1) {
-          if (err) {
-            (*err) += "SamplesPerPixel must be 1 ~ 4, but got " + std::to_string(spp) + ".\n";
-          }
-          return false;
+    image->bits_per_sample = image->bits_per_sample_original;
+  } else if ((image->compression == COMPRESSION_LZW) ||
+             (image->compression == COMPRESSION_ZIP)) {
+    image->bits_per_sample = image->bits_per_sample_original;
+  } else if (image->compression == COMPRESSION_OLD_JPEG) {
+    int lj_width = -1, lj_height = -1, lj_bits = -1, lj_components = -1;
+    bool is_lj = false;
+    {
+      ScratchLease scratch(context);
+      is_lj = IsLosslessJPEG(data_addr, ClampToInt(data_len), &lj_width,
+                             &lj_height, &lj_bits, &lj_components,
+                             &scratch->lj92);
+    }
+    if (is_lj) {
+      image->height = lj_height;
+      if (image->cr2_slices[0] != 0) {
+        image->width = image->cr2_slices[0] * image->cr2_slices[1] +
+                       image->cr2_slices[2];
+      } else {
+        image->width = lj_width;
+      }
+      image->bits_per_sample_original = lj_bits;
+      image->bits_per_sample = 16;
+    } else {
+      int w = 0, h = 0, components = 0;
+      size_t jpeg_len = (image->jpeg_byte_count > 0)
+                            ? size_t(image->jpeg_byte_count)
+                            : data_len;
+      jpeg_len = (std::min)(jpeg_len, data_len);
+      if (stbi_info_from_memory(data_addr, ClampToInt(jpeg_len), &w,
+                                &h, &components) != 1) {
+        if (err) {
+          (*err) += "Not a JPEG data.\n";
         }
+        return false;
+      }
+      image->width = w;
+      image->height = h;
+      image->bits_per_sample_original = 8;
+      image->bits_per_sample = 8;
+    }
+  } else if (image->compression == COMPRESSION_NEW_JPEG) {
+    bool is_baseline = false;
+    if (image->bits_per_sample_original == 8) {
+      int w = 0, h = 0, components = 0;
+      size_t jpeg_len = (image->jpeg_byte_count > 0)
+                            ? size_t(image->jpeg_byte_count)
+                            : data_len;
+      jpeg_len = (std::min)(jpeg_len, data_len);
+      if (stbi_info_from_memory(data_addr, ClampToInt(jpeg_len), &w,
+                                &h, &components) == 1) {
+        is_baseline = true;
+        image->width = w;
+        image->height = h;
+        image->samples_per_pixel = components;
+        image->bits_per_sample = 8;
+      }
+    }
 
-        if (spp > 4) {
-          if (err) {
-            (*err) += "SamplesPerPixel must be less than or equal to 4.\n";
-          }
-          return false;
+    if (!is_baseline) {
+      // lj92 decodes data into 16bits.
+      image->bits_per_sample = 16;
+      if (image->bits_per_sample_original <= 0) {
+        int lj_width = -1, lj_height = -1, lj_bits = -1, lj_components = -1;
+        ScratchLease scratch(context);
+        if (IsLosslessJPEG(data_addr, ClampToInt(data_len), &lj_width,
+                           &lj_height, &lj_bits, &lj_components,
+                           &scratch->lj92)) {
+          image->bits_per_sample_original = lj_bits;
         }
+      }
+    }
+  } else if (image->compression == COMPRESSION_LOSSY) {
+    int w = 0, h = 0, components = 0;
+    size_t jpeg_len = (image->jpeg_byte_count > 0)
+                          ? size_t(image->jpeg_byte_count)
+                          : data_len;
+    jpeg_len = (std::min)(jpeg_len, data_len);
+    if (stbi_info_from_memory(data_addr, ClampToInt(jpeg_len), &w, &h,
+                              &components) != 1) {
+      if (err) {
+        (*err) +=
+            "Currently We only supports Standard JPEG data for Lossy "
+            "compression(34892).\n";
+      }
+      return false;
+    }
+    image->width = w;
+    image->height = h;
+    image->samples_per_pixel = components;
+    image->bits_per_sample = 8;
+  } else if (image->compression == COMPRESSION_NEF) {
+    image->bits_per_sample_original = 1;  // FIXME
+    image->bits_per_sample = 1;           // FIXME
+  } else {
+    if (err) {
+      std::stringstream ss;
+      ss << "IFD [" << i << "] "
+         << " Unsupported compression type : " << image->compression
+         << std::endl;
+      (*err) += ss.str();
+    }
+    return false;
+  }
 
-        image.samples_per_pixel = static_cast<int>(spp);
-
-        // TINY_DNG_DPRINTF("spp = %d\n", image.samples_per_pixel);
-      } break;
-
-      case TAG_ROWS_PER_STRIP: {
-        // The TIFF Spec says data type may be SHORT, but assume LONG for a
-        // while.
-        if (!sr.read4(&image.rows_per_strip)) {
-          if (err) {
-            (*err) += "Failed to parse RowsPerStrip Tag.\n";
-          }
-          return false;
-        }
-        // NOTE: Compute strip_per_image in later since image.height is required
-        // to compute strips_per_image.
-      } break;
+  return true;
+}
 
-      case TAG_COMPRESSION:
-        if (!sr.read_uint(
-                type, reinterpret_cast<unsigned int*>(&image.compression))) {
-          if (err) {
-            (*err) += "Failed to parse Compression Tag.\n";
-          }
-          return false;
-        }
+// Destination of decoded pixels of an image.
+struct ImageOutput {
+  unsigned char* data;
+  size_t size;        // Bytes of packed pixels which fit in `data`.
+  size_t row_bytes;   // Bytes of a packed row.
+  size_t row_stride;  // Bytes between the start of rows in `data`.
+  bool packed;        // Rows are contiguous in `data`.
+};
 
-        // TINY_DNG_DPRINTF("tag-compression = %d\n", image.compression);
-        break;
+// Prepare the destination of decoded pixels of `index`'th image. `image` must
+// have the layout of decoded pixels. `len` is the size of `DNGImage::data`,
+// which is used unless the user callback supplies a buffer.
+static bool AcquireImageOutput(tinydng::DNGImage* image, const size_t index,
+                               const size_t len, const DecodeResources& res,
+                               ImageOutput* out, std::string* err) {
+  const uint64_t row_bits = uint64_t(image->samples_per_pixel) *
+                            uint64_t(image->width) *
+                            uint64_t(image->bits_per_sample);
+  const bool row_aligned = ((row_bits % 8) == 0);
+
+  out->row_bytes = size_t(row_bits / 8);
+  out->row_stride = row_aligned ? out->row_bytes : 0;
+  out->packed = true;
+
+  image->external_data = NULL;
+  image->row_stride = out->row_stride;
+
+  if (res.image_buffer_callback) {
+    const size_t byte_size = size_t(row_bits * uint64_t(image->height) / 8);
+
+    ImageBuffer buffer;
+    buffer.data = NULL;
+    buffer.row_stride = 0;
+    if (!res.image_buffer_callback(*image, index, byte_size, &buffer,
+                                   res.image_buffer_user_data)) {
+      if (err) {
+        std::stringstream ss;
+        ss << "Image buffer callback failed for " << index << "'th image.\n";
+        (*err) += ss.str();
+      }
+      return false;
+    }
 
-      case TAG_STRIP_OFFSET:
-      case TAG_JPEG_IF_OFFSET:
-        offt_strip_offset = static_cast<long>(sr.tell());
-        if (!sr.read4(&image.offset)) {
-          if (err) {
-            (*err) += "Failed to parse Compression Tag.\n";
-          }
-          return false;
+    if (buffer.data) {
+      // 16/32/64-bit samples are accessed as words. Other samples(e.g.
+      // 24-bit floats) are accessed bytewise and need no alignment.
+      const int bytes = image->bits_per_sample / 8;
+      const size_t sample_bytes =
+          ((bytes == 2) || (bytes == 4) || (bytes == 8)) ? size_t(bytes) : 1;
+      if ((reinterpret_cast<uintptr_t>(buffer.data) % sample_bytes) != 0) {
+        if (err) {
+          (*err) += "Image buffer is not aligned to the sample size.\n";
         }
-        // TINY_DNG_DPRINTF("strip_offset = %d\n", image.offset);
-        break;
+        return false;
+      }
 
-      case TAG_JPEG_IF_BYTE_COUNT:
-        if (!sr.read4(&image.jpeg_byte_count)) {
+      if ((buffer.row_stride > 0) && (buffer.row_stride != out->row_bytes)) {
+        if (!row_aligned || (buffer.row_stride < out->row_bytes) ||
+            ((buffer.row_stride % sample_bytes) != 0)) {
           if (err) {
-            (*err) = "Failed to parse JpegIfByteCount Tag.\n";
+            std::stringstream ss;
+            ss << "Invalid row stride " << buffer.row_stride << " for "
+               << index << "'th image.\n";
+            (*err) += ss.str();
           }
           return false;
         }
-        break;
+        out->row_stride = buffer.row_stride;
+        out->packed = false;
+      }
 
-      case TAG_ORIENTATION:
-        if (!sr.read2(&image.orientation)) {
-          if (err) {
-            (*err) = "Failed to parse Orientation Tag.\n";
-          }
-          return false;
-        }
-        break;
+      image->data.clear();
+      image->external_data = buffer.data;
+      image->row_stride = out->row_stride;
 
-      case TAG_STRIP_BYTE_COUNTS:
-        offt_strip_byte_counts = static_cast<long>(sr.tell());
-        if (!sr.read4(&image.strip_byte_count)) {
-          if (err) {
-            (*err) = "Failed to parse StripByteCount Tag.\n";
-          }
-          return false;
-        }
-        TINY_DNG_DPRINTF("strip_byte_count = %d\n", image.strip_byte_count);
-        break;
+      out->data = buffer.data;
+      out->size = byte_size;
+      return true;
+    }
+  }
 
-      case TAG_PLANAR_CONFIGURATION:
-        if (!sr.read2(&image.planar_configuration)) {
-          if (err) {
-            (*err) = "Failed to parse PlanarConfiguration Tag.\n";
-          }
-          return false;
-        }
-        break;
+  image->data.resize(len);
+  out->data = image->data.data();
+  out->size = len;
+  return true;
+}
 
-      case TAG_PREDICTOR:
-        if (!sr.read2(&image.predictor)) {
-          if (err) {
-            (*err) = "Failed to parse Predictor Tag.\n";
-          }
-          return false;
-        }
+// Copy `len` bytes of packed pixels to `out`.
+static void WriteImageRows(const ImageOutput& out, const unsigned char* src,
+                           const size_t len) {
+  if (out.packed) {
+    memcpy(out.data, src, (std::min)(len, out.size));
+    return;
+  }
 
-        if ((image.predictor < 1) || (image.predictor > 3)) {
-          if (err) {
-            (*err) = "Predictor value must be 1, 2 or 3.\n";
-          }
-          return false;
-        }
-        break;
+  const size_t rows = (std::min)(len, out.size) / out.row_bytes;
+  for (size_t y = 0; y < rows; y++) {
+    memcpy(out.data + out.row_stride * y, src + out.row_bytes * y,
+           out.row_bytes);
+  }
+}
 
-      case TAG_SAMPLE_FORMAT: {
-        short format;
-        if (!sr.read2(&format)) {
-          if (err) {
-            (*err) = "Failed to parse SampleFormat.\n";
-          }
-          return false;
-        }
+// Decode `i`'th image data.
+static bool DecodeImageData(const StreamReader& sr, const bool swap_endian,
+                            const size_t i, tinydng::DNGImage* image,
+                            const DecodeResources& res, std::string* err) {
+  const size_t data_offset =
+      (image->offset > 0) ? image->offset : image->tile_offset;
+  TINY_DNG_DPRINTF("data_offset = %d\n", int(data_offset));
+  if ((data_offset == 0) || (data_offset > sr.size())) {
+    if (err) {
+      std::stringstream ss;
+      ss << i << "'th image data offset is zero or invalid.\n";
+      (*err) += ss.str();
+    }
+    return false;
+  }
 
-        if ((format == SAMPLEFORMAT_INT) || (format == SAMPLEFORMAT_UINT) ||
-            (format == SAMPLEFORMAT_IEEEFP)) {
-          image.sample_format = static_cast<SampleFormat>(format);
-        }
-      } break;
+  // std::cout << "offt =\n" << image->offset << std::endl;
+  // std::cout << "tile_offt = \n" << image->tile_offset << std::endl;
+  // std::cout << "data_offset = " << data_offset << std::endl;
 
-      case TAG_SUB_IFDS:
+  TINY_DNG_DPRINTF("image[%d].compression = %d\n", int(i),
+                   image->compression);
 
-      {
-        // TINY_DNG_DPRINTF("sub_ifds = %d\n", len);
-        for (size_t k = 0; k < len; k++) {
-          unsigned int i = static_cast<unsigned int>(sr.tell());
-          unsigned int offt;
-          if (!sr.read4(&offt)) {
-            if (err) {
-              (*err) += "Failed to parse SubIFDs Tag.\n";
-            }
-            return false;
-          }
+  if (image->compression == COMPRESSION_NONE) {  // no compression
 
-          unsigned int base = 0;  // @fixme
-          if (!sr.seek_set(offt + base)) {
-            if (err) {
-              (*err) += "Failed to seek to SubIFD Tag.\n";
-            }
-            return false;
-          }
+    if (image->jpeg_byte_count > 0) {
+      // Looks like CR2 IFD#1(thumbnail jpeg image)
+      // Currently skip parsing jpeg data.
+      // TODO(syoyo): Decode jpeg data.
+      image->width = 0;
+      image->height = 0;
 
-          // recursive call
-          if (call_depth > kMaxRecursiveIFDParse) {
-            if (err) {
-              (*err) += "Too many nested SUB_IFDS. Input DNG seems invalid or malcious.\n";
-            }
-            return false;
-          }
+      if (image->bits_per_sample_original < 0) {
+        // Assume 8bit
+        image->bits_per_sample_original = 8;
+      }
 
-          if (!ParseTIFFIFD(sr, custom_field_lists, images, warn, err, call_depth+1)) {
-            if (err) {
-              (*err) += "Failed to Parse SubIFD Tag.\n";
-            }
-            return false;
-          }
+      image->bits_per_sample = image->bits_per_sample_original;
 
-          if (!sr.seek_set(i + 4)) {
-            if (err) {
-              (*err) += "Failed to rewind to SubIFD Tag position.\n";
-            }
-            return false;
-          }
+    } else {
+
+      const size_t kMaxImageSize = size_t(1024)*size_t(1024)*size_t(1024)*size_t(2); // 2GB
+
+      if (image->bits_per_sample_original <= 0) {
+        if (err) {
+          (*err) += "bits_per_sample information not found in the tag.\n";
         }
-        // TINY_DNG_DPRINTF("sub_ifds DONE\n");
+        return false;
       }
 
-      break;
-
-      case TAG_TILE_WIDTH:
-        if (!sr.read_uint(type,
-                          reinterpret_cast<unsigned int*>(&image.tile_width))) {
+      image->bits_per_sample = image->bits_per_sample_original;
+      // std::cout << "sample_per_pixel " << image->samples_per_pixel << "\n";
+      // std::cout << "width " << image->width << "\n";
+      // std::cout << "height " << image->height << "\n";
+      // std::cout << "bps " << image->bits_per_sample << "\n";
+
+      const int packed_bps = image->bits_per_sample;
+      if ((res.unpack_samples != SAMPLE_UNPACKING_NONE) &&
+          ((packed_bps % 8) != 0) && (packed_bps < 16)) {
+        const bool to_float = (res.unpack_samples == SAMPLE_UNPACKING_FLOAT);
+
+        // Each row of the file is padded to a byte boundary.
+        const size_t src_row_bytes = StripRowBytes(*image);
+        const size_t row_samples =
+            size_t(image->samples_per_pixel) * size_t(image->width);
+        const uint64_t out_len = uint64_t(row_samples) *
+                                 uint64_t(image->height) *
+                                 uint64_t(to_float ? 4 : 2);
+        if ((image->width <= 0) || (image->height <= 0) || (out_len == 0)) {
           if (err) {
-            (*err) += "Failed to parse TileWidth Tag.\n";
+            (*err) += "Unexpected length.";
           }
+          return false;
         }
-        // TINY_DNG_DPRINTF("tile_width = %d\n", image.tile_width);
-        break;
-
-      case TAG_TILE_LENGTH:
-        // TINY_DNG_DPRINTF("tile_length = %d\n", image.tile_length);
-        if (!sr.read_uint(
-                type, reinterpret_cast<unsigned int*>(&image.tile_length))) {
+        if (out_len > kMaxImageSize) {
           if (err) {
-            (*err) += "Failed to parse TileLength Tag.\n";
+            std::stringstream ss;
+            ss << "Image byte size too large. " << out_len
+               << "bytes unpacked, but hard-limit is set to " << kMaxImageSize
+               << " bytes.\n";
+            (*err) += ss.str();
           }
+          return false;
         }
-        break;
 
-      case TAG_TILE_OFFSETS:
-        if (len > 1) {
-          image.tile_offset = static_cast<unsigned int>(sr.tell());
-        } else {
-          if (!sr.read4(&image.tile_offset)) {
-            if (err) {
-              (*err) += "Failed to parse TileOffsets Tag.\n";
-            }
-          }
+        image->bits_per_sample = to_float ? 32 : 16;
+        if (to_float) {
+          image->sample_format = SAMPLEFORMAT_IEEEFP;
         }
-        TINY_DNG_DPRINTF("tile_offt = %d\n", int(image.tile_offset));
-        break;
 
-      case TAG_TILE_BYTE_COUNTS:
-        if (len > 1) {
-          image.tile_byte_count = static_cast<unsigned int>(sr.tell());
-        } else {
-          if (!sr.read4(&image.tile_byte_count)) {
-            if (err) {
-              (*err) += "Failed to parse TileByteCounts Tag.\n";
-            }
-          }
+        ImageOutput out;
+        if (!AcquireImageOutput(image, i, size_t(out_len), res, &out, err)) {
+          return false;
         }
-        break;
 
-      case TAG_CFA_PATTERN_DIM:
-        if (!sr.read2(&image.cfa_pattern_dim)) {
+        // Truncated data is read as far as available.
+        const size_t read_len =
+            (std::min)(src_row_bytes * size_t(image->height),
+                       size_t(sr.size() - data_offset));
+        const uint8_t* src =
+            (read_len > 0) ? sr.map_abs_addr(data_offset, read_len) : NULL;
+        if (!src) {
           if (err) {
-            (*err) = "Failed to parse CFA PatternDim Tag.\n";
+            (*err) += "Failed to read image data.\n";
           }
           return false;
         }
-        break;
 
-      case TAG_CFA_PATTERN: {
-        char buf[16];
-        size_t readLen = len;
-        if (readLen > 16) readLen = 16;
+        // Rows are unpacked in parallel, directly into the image. Samples
+        // which are not stored in the file are left unwritten.
+        const bool msb_first = (res.packed_bit_order == BIT_ORDER_MSB_FIRST);
+        res.pool->parallel_for(
+            size_t(image->height), [&](size_t begin, size_t end) {
+              for (size_t y = begin; y < end; y++) {
+                const size_t row_offset = src_row_bytes * y;
+                if (row_offset >= read_len) {
+                  break;
+                }
+                const size_t row_len =
+                    (std::min)(src_row_bytes, read_len - row_offset);
+                const size_t n = (std::min)(
+                    row_samples,
+                    size_t(uint64_t(row_len) * 8 / uint64_t(packed_bps)));
+                unsigned char* row = out.data + out.row_stride * y;
+                if (to_float) {
+                  UnpackSamples(src + row_offset, row_len, 0, n, packed_bps,
+                                msb_first, reinterpret_cast<float*>(row));
+                } else {
+                  UnpackSamples(src + row_offset, row_len, 0, n, packed_bps,
+                                msb_first, reinterpret_cast<uint16_t*>(row));
+                }
+              }
+            });
+        return true;
+      }
 
-        if (!sr.read(readLen, 16, reinterpret_cast<unsigned char*>(buf))) {
-          if (err) {
-            (*err) = "Failed to parse CFA Pattern Tag.\n";
-          }
-          return false;
+      if (((image->width * image->height * image->bits_per_sample) % 8) ==
+          0) {
+        // OK
+      } else {
+        if (err) {
+          (*err) += "Image size must be multiple of 8.";
         }
+        return false;
+      }
 
-        // Only 2x2 CFAPattern is supported at the moment.
-        if (readLen == 4) {
-          image.cfa_pattern[0][0] = buf[0];
-          image.cfa_pattern[0][1] = buf[1];
-          image.cfa_pattern[1][0] = buf[2];
-          image.cfa_pattern[1][1] = buf[3];
-        } else {
-          if (err) {
-            (*err) =
-                "Length of CFA pattern other than 4(2x2) is not supported "
-                "yet.\n";
-          }
-          return false;
+      const size_t len = size_t(image->samples_per_pixel) *
+                         size_t(image->width) * size_t(image->height) *
+                         size_t(image->bits_per_sample) / size_t(8);
+
+      if (len == 0) {
+        if (err) {
+          (*err) += "Unexpected length.";
         }
-      } break;
+        return false;
+      }
 
-      case TAG_DNG_VERSION: {
-        char data[4];
-        {
-          for (int i = 0; i < 4; i++) {
-            if (!sr.read1(&data[i])) {
-              if (err) {
-                (*err) += "Failed to parse DNGVersion Tag.\n";
-              }
-              return false;
-            }
-          }
+      if (len > kMaxImageSize) {
+        if (err) {
+          std::stringstream ss;
+          ss << "Image byte size too large. " << len << "bytes in file, but hard-limit is set to " << kMaxImageSize << " bytes.\n";
+          (*err) += ss.str();
         }
+        return false;
+      }
 
-        image.version =
-            (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
-      } break;
+      // Truncated data is read as far as available.
+      const size_t read_len = (std::min)(len, sr.size() - data_offset);
 
-      case TAG_CFA_PLANE_COLOR: {
-        char buf[4];
-        size_t readLen = len;
-        if (readLen > 4) readLen = 4;
+      ImageOutput out;
+      if (!AcquireImageOutput(image, i, len, res, &out, err)) {
+        return false;
+      }
 
-        if (!sr.read(readLen, readLen, reinterpret_cast<unsigned char*>(buf))) {
+      if (ToHostByteOrder(res, swap_endian, image->bits_per_sample) &&
+          (read_len > 0)) {
+        const uint8_t* src = sr.map_abs_addr(data_offset, read_len);
+        if (!src) {
           if (err) {
-            (*err) += "Failed to parse CFALayout Tag.\n";
+            (*err) += "Failed to read image data.\n";
           }
           return false;
         }
 
-        for (size_t i = 0; i < readLen; i++) {
-          image.cfa_plane_color[i] = buf[i];
-        }
-      } break;
+        // Samples are swapped while rows are copied from the file, in
+        // parallel.
+        const size_t avail =
+            out.packed ? (std::min)(read_len, out.size) : read_len;
+        const size_t sample_bytes = size_t(image->bits_per_sample / 8);
+        res.pool->parallel_for(
+            size_t(image->height), [&](size_t begin, size_t end) {
+              for (size_t y = begin; y < end; y++) {
+                const size_t row_offset = out.row_bytes * y;
+                if (row_offset >= avail) {
+                  break;
+                }
+                CopySwapped(out.data + out.row_stride * y, src + row_offset,
+                            (std::min)(out.row_bytes, avail - row_offset),
+                            sample_bytes);
+              }
+            });
+        return true;
+      }
 
-      case TAG_CFA_LAYOUT: {
-        if (!sr.read4(&image.cfa_layout)) {
-          if (err) {
-            (*err) += "Failed to parse CFALayout Tag.\n";
+      bool ok = (read_len > 0);
+      if (out.packed) {
+        ok = ok && sr.read_at(data_offset, (std::min)(read_len, out.size),
+                              out.data);
+      } else {
+        for (size_t y = 0; ok && (y < size_t(image->height)); y++) {
+          const size_t row_offset = out.row_bytes * y;
+          if (row_offset >= read_len) {
+            break;
           }
-          return false;
+          ok = sr.read_at(data_offset + row_offset,
+                          (std::min)(out.row_bytes, read_len - row_offset),
+                          out.data + out.row_stride * y);
         }
-      } break;
+      }
+      if (!ok) {
+        if (err) {
+          (*err) += "Failed to read image data.\n";
+        }
+        return false;
+      }
+    }
+  } else if (image->compression == COMPRESSION_LZW) {  // lzw compression
 
-      case TAG_ACTIVE_AREA:
+    if (image->bits_per_sample_original <= 0) {
+      if (err) {
+        (*err) += "bits_per_sample information not found in the tag.\n";
+      }
+      return false;
+    }
 
-        for (size_t c = 0; c < 4; c++) {
-          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
-                                      &image.active_area[c]))) {
-            if (err) {
-              (*err) += "Failed to parse ActiveArea Tag.\n";
-            }
-            return false;
-          }
+    image->bits_per_sample = image->bits_per_sample_original;
+    TINY_DNG_DPRINTF("bps = %d\n", image->bits_per_sample);
+    TINY_DNG_DPRINTF("counts = %d\n", int(image->strip_byte_counts.size()));
+    TINY_DNG_DPRINTF("offsets = %d\n", int(image->strip_offsets.size()));
+
+    image->data.clear();
+
+    if ((image->strip_byte_counts.size() > 0) &&
+        (image->strip_byte_counts.size() == image->strip_offsets.size())) {
+      const size_t num_strips = image->strip_byte_counts.size();
+
+      // The last strip may hold less rows than RowsPerStrip.
+      const size_t rows_per_strip = RowsPerStrip(*image);
+      const size_t row_bytes = StripRowBytes(*image);
+      const uint64_t dst_len = uint64_t(row_bytes) * uint64_t(image->height);
+      if ((dst_len == 0) || (rows_per_strip == 0)) {
+        if (err) {
+          (*err) += "Image data size is zero.\n";
+          (*err) += "  samples_per_pixel " + std::to_string(image->samples_per_pixel) + "\n";
+          (*err) += "  width " + std::to_string(image->width) + "\n";
+          (*err) += "  height " + std::to_string(image->height) + "\n";
+          (*err) += "  bits_per_sample " + std::to_string(image->bits_per_sample) + "\n";
         }
+        return false;
+      }
 
-        image.has_active_area = true;
+      if (dst_len > (kMaxImageSizeInMB * 1024ull * 1024ull)) {
+        if (err) {
+          (*err) += "Image data size too large. Exceeds " + std::to_string(kMaxImageSizeInMB) + " MB.\n";
+        }
+        return false;
+      }
 
-        break;
+      ImageOutput out;
+      if (!AcquireImageOutput(image, i, size_t(dst_len), res, &out, err)) {
+        return false;
+      }
 
-      case TAG_BLACK_LEVEL: {
-        // Assume TAG_SAMPLES_PER_PIXEL is read before
-        // FIXME(syoyo): scan TAG_SAMPLES_PER_PIXEL in IFD table in advance.
-        for (int s = 0; s < image.samples_per_pixel; s++) {
-          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
-                                      &image.black_level[s]))) {
-            if (err) {
-              (*err) += "Failed to parse BlackLevel Tag.\n";
-            }
-            return false;
+      // Strips are decoded concurrently, directly into the image. A strip
+      // which does not fit the destination(strided rows, or a user buffer
+      // shorter than the strip) is decoded to scratch and copied.
+      const size_t strip_len = row_bytes * rows_per_strip;
+      const bool to_host =
+          ToHostByteOrder(res, swap_endian, image->bits_per_sample);
+      AllocVector<std::string> strip_errs(num_strips, std::string(),
+                                          res.allocator);
+      AllocVector<char> strip_ok(num_strips, char(0), res.allocator);
+
+      res.pool->parallel_for(num_strips, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+          const size_t y0 = k * rows_per_strip;
+          const size_t dst_offset = y0 * row_bytes;
+          if ((y0 >= size_t(image->height)) ||
+              (out.packed && (dst_offset >= out.size))) {
+            strip_ok[k] = 1;
+            continue;
           }
-        }
-      } break;
 
-      case TAG_WHITE_LEVEL: {
-        // Assume TAG_SAMPLES_PER_PIXEL is read before
-        // FIXME(syoyo): scan TAG_SAMPLES_PER_PIXEL in IFD table in advance.
-        for (int s = 0; s < image.samples_per_pixel; s++) {
-          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
-                                      &image.white_level[s]))) {
-            if (err) {
-              (*err) += "Failed to parse WhiteLevel Tag.\n";
+          const size_t rows =
+              (std::min)(rows_per_strip, size_t(image->height) - y0);
+          const size_t len = rows * row_bytes;
+
+          if (out.packed && (out.size - dst_offset >= len)) {
+            strip_ok[k] =
+                DecodeLZWStrip(sr, swap_endian, to_host, (*image), k,
+                               out.data + dst_offset, len, res.allocator,
+                               &strip_errs[k])
+                    ? 1
+                    : 0;
+            continue;
+          }
+
+          ScratchLease scratch(res.context);
+          uint8_t* buf = ScratchBuffer(scratch.get(), &scratch->u8, strip_len);
+          if (!DecodeLZWStrip(sr, swap_endian, to_host, (*image), k, buf,
+                              len, res.allocator, &strip_errs[k])) {
+            continue;
+          }
+          if (out.packed) {
+            memcpy(out.data + dst_offset, buf, out.size - dst_offset);
+          } else {
+            for (size_t y = 0; y < rows; y++) {
+              memcpy(out.data + out.row_stride * (y0 + y),
+                     buf + out.row_bytes * y, out.row_bytes);
             }
-            return false;
           }
+          strip_ok[k] = 1;
         }
-      } break;
+      });
 
-      case TAG_ANALOG_BALANCE:
-        // Assume RGB
-        if (!sr.read_real(type, &image.analog_balance[0])) {
+      for (size_t k = 0; k < num_strips; k++) {
+        if (!strip_ok[k]) {
           if (err) {
-            (*err) += "Failed to parse analog balance.\n";
+            (*err) += strip_errs[k];
           }
           return false;
         }
-        if (!sr.read_real(type, &image.analog_balance[1])) {
-          if (err) {
-            (*err) += "Failed to parse analog balance.\n";
-          }
-          return false;
+      }
+    } else {
+      TINY_DNG_ABORT("Unsupported image strip configuration.");
+    }
+  } else if (image->compression ==
+             COMPRESSION_OLD_JPEG) {  // old jpeg compression
+
+    // std::cout << "IFD " << i << std::endl;
+
+    // First check if JPEG is lossless JPEG
+    // TODO(syoyo): Compure conservative data_len.
+    if (sr.size() < data_offset) {
+      if (err) {
+        (*err) += "Unexpected data offset.\n";
+      }
+      return false;
+    }
+    size_t data_len = ImageDataLength(sr, *image, data_offset);
+    const uint8_t* data_addr = sr.map_abs_addr(data_offset, data_len);
+    if (!data_addr) {
+      if (err) {
+        (*err) += "Failed to read JPEG data.\n";
+      }
+      return false;
+    }
+    int lj_width = -1, lj_height = -1, lj_bits = -1, lj_components = -1;
+    bool is_lj = false;
+    {
+      ScratchLease scratch(res.context);
+      is_lj = IsLosslessJPEG(data_addr, static_cast<int>(data_len), &lj_width,
+                             &lj_height, &lj_bits, &lj_components,
+                             &scratch->lj92);
+    }
+    if (is_lj) {
+      // std::cout << "IFD " << i << " is LJPEG" << std::endl;
+      TINY_DNG_DPRINTF("IFD[%d] is LJPEG\n", int(i));
+
+      TINY_DNG_ASSERT(
+          lj_width > 0 && lj_height > 0 && lj_bits > 0 && lj_components > 0,
+          "Image dimensions must be > 0.");
+
+      // Assume not in tiled format.
+      TINY_DNG_ASSERT(image->tile_width == -1 && image->tile_length == -1,
+                      "Tiled format not supported tile size.");
+
+      image->height = lj_height;
+
+      // Is Canon CR2?
+      const bool is_cr2 = (image->cr2_slices[0] != 0) ? true : false;
+
+      if (is_cr2) {
+        // For CR2 RAW, slices[0] * slices[1] + slices[2] = image width
+        image->width = image->cr2_slices[0] * image->cr2_slices[1] +
+                       image->cr2_slices[2];
+      } else {
+        image->width = lj_width;
+      }
+
+      image->bits_per_sample_original = lj_bits;
+
+      // lj92 decodes data into 16bits, so modify bps.
+      image->bits_per_sample = 16;
+
+      TINY_DNG_ASSERT(
+          ((image->width * image->height * image->bits_per_sample) % 8) == 0,
+          "Image size must be multiple of 8.");
+      const size_t len =
+          size_t(image->samples_per_pixel) * size_t(image->width) *
+          size_t(image->height) * size_t(image->bits_per_sample) / 8;
+      // std::cout << "spp = " << image->samples_per_pixel;
+      // std::cout << ", w = " << image->width << ", h = " << image->height <<
+      // ", bps = " << image->bits_per_sample << std::endl;
+      TINY_DNG_ASSERT(len > 0, "Invalid length.");
+
+      ImageOutput out;
+      if (!AcquireImageOutput(image, i, len, res, &out, err)) {
+        return false;
+      }
+
+      if (sr.size() < data_offset) {
+        if (err) {
+          (*err) += "Unexpected file size or data offset.\n";
+        }
+        return false;
+      }
+
+      ScratchLease scratch(res.context);
+      uint16_t* buf = ScratchBuffer(
+          scratch.get(), &scratch->u16,
+          static_cast<size_t>(image->width * image->height *
+                              image->samples_per_pixel));
+
+      bool ok = DecompressLosslessJPEG(
+          sr, buf, MakeImageWindow(0, 0, image->width, image->height),
+          (*image), NULL, res, err);
+      if (!ok) {
+        if (err) {
+          std::stringstream ss;
+          ss << "Failed to decompress LJPEG." << std::endl;
+          (*err) += ss.str();
         }
-        if (!sr.read_real(type, &image.analog_balance[2])) {
-          if (err) {
-            (*err) += "Failed to parse analog balance.\n";
+        return false;
+      }
+
+      if (is_cr2) {
+        // CR2 stores image in tiled format(image slices. left to right).
+        // Convert it to scanline format.
+        int nslices = image->cr2_slices[0];
+        int slice_width = image->cr2_slices[1];
+        int slice_remainder_width = image->cr2_slices[2];
+        size_t src_offset = 0;
+
+        for (int slice = 0; slice < nslices; slice++) {
+          int x_offset = slice * slice_width;
+          for (int y = 0; y < image->height; y++) {
+            unsigned short* dst_ptr = reinterpret_cast<unsigned short*>(
+                out.data + out.row_stride * size_t(y));
+            memcpy(&dst_ptr[x_offset], buf + src_offset,
+                   sizeof(unsigned short) * static_cast<size_t>(slice_width));
+            src_offset += static_cast<size_t>(slice_width);
           }
-          return false;
         }
 
-        image.has_analog_balance = true;
-        break;
-
-      case TAG_AS_SHOT_NEUTRAL:
-        // Assume RGB
-        // TINY_DNG_DPRINTF("ty = %d\n", type);
-        for (size_t c = 0; c < 3; c++) {
-          if (!sr.read_real(type, &image.as_shot_neutral[c])) {
-            if (err) {
-              (*err) += "Failed to parse AsShotNeutral Tag.\n";
-            }
-            return false;
+        // remainder(the last slice).
+        {
+          int x_offset = nslices * slice_width;
+          for (int y = 0; y < image->height; y++) {
+            unsigned short* dst_ptr = reinterpret_cast<unsigned short*>(
+                out.data + out.row_stride * size_t(y));
+            memcpy(&dst_ptr[x_offset], buf + src_offset,
+                   sizeof(unsigned short) *
+                       static_cast<size_t>(slice_remainder_width));
+            src_offset += static_cast<size_t>(slice_remainder_width);
           }
         }
 
-        image.has_as_shot_neutral = true;
-        break;
+      } else {
+        WriteImageRows(out, reinterpret_cast<const unsigned char*>(buf), len);
+      }
 
-      case TAG_CALIBRATION_ILLUMINANT1: {
-        unsigned short val;
-        if (!sr.read2(&val)) {
-          if (err) {
-            (*err) += "Failed to parse CalibrartionIlluminant1 Tag.\n";
-          }
-          return false;
-        }
+    } else {
+      // Baseline 8bit JPEG
 
-        image.calibration_illuminant1 = static_cast<LightSource>(val);
-      } break;
+      image->bits_per_sample_original = 8;
+      image->bits_per_sample = 8;
 
-      case TAG_CALIBRATION_ILLUMINANT2: {
-        unsigned short val;
-        if (!sr.read2(&val)) {
+      size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
+      if (image->jpeg_byte_count == -1) {
+        // No jpeg datalen. Set to the size of file - offset.
+        if (sr.size() < data_offset) {
           if (err) {
-            (*err) += "Failed to parse CalibrartionIlluminant2 Tag.\n";
+            (*err) += "Unexpected file size or data offset.\n";
           }
           return false;
         }
-        image.calibration_illuminant2 = static_cast<LightSource>(val);
-      } break;
-
-      case TAG_COLOR_MATRIX1: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
-              if (err) {
-                (*err) += "Failed to parse ColorMatrix1 Tag.\n";
-              }
-              return false;
-            }
+        jpeg_len = ImageDataLength(sr, *image, data_offset);
+      }
+      jpeg_len = (std::min)(jpeg_len, sr.size() - data_offset);
 
-            image.color_matrix1[c][k] = val;
-          }
+      if (jpeg_len == 0) {
+        if (err) {
+          (*err) += "Invalid jpeg data length.\n";
         }
-      } break;
+        return false;
+      }
 
-      case TAG_COLOR_MATRIX2: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
-              if (err) {
-                (*err) += "Failed to parse ColorMatrix2 Tag.\n";
-              }
-              return false;
-            }
-            image.color_matrix2[c][k] = val;
-          }
+      const uint8_t* jpeg_addr = sr.map_abs_addr(data_offset, jpeg_len);
+      if (!jpeg_addr) {
+        if (err) {
+          (*err) += "Failed to read JPEG data.\n";
         }
-      } break;
+        return false;
+      }
 
-      case TAG_FORWARD_MATRIX1: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
-              if (err) {
-                (*err) += "Failed to parse ForwardMatrix1 Tag.\n";
-              }
-              return false;
-            }
-            image.forward_matrix1[c][k] = val;
-          }
+      // Assume RGB jpeg
+      //
+      // First check the header.
+      int w_info = 0, h_info = 0, components_info = 0;
+      int is_jpeg = stbi_info_from_memory(jpeg_addr,
+                                          static_cast<int>(jpeg_len), &w_info,
+                                          &h_info, &components_info);
+      if (is_jpeg != 1) {
+        if (err) {
+          (*err) += "Not a JPEG data.\n";
         }
-      } break;
+        return false;
+      }
 
-      case TAG_FORWARD_MATRIX2: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
-              if (err) {
-                (*err) += "Failed to parse ForwardMatrix2 Tag.\n";
-              }
-              return false;
-            }
-            image.forward_matrix2[c][k] = val;
-          }
+      if ((components_info != 1) && (components_info != 3)) {
+        if (err) {
+          (*err) += "Unsupported channels in JPEG data.\n";
         }
-      } break;
+        return false;
+      }
 
-      case TAG_CAMERA_CALIBRATION1: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
-              if (err) {
-                (*err) += "Failed to parse CameraCalibration1 Tag.\n";
-              }
-              return false;
-            }
-            image.camera_calibration1[c][k] = val;
-          }
+      if ((w_info < 1) || (h_info < 1)) {
+        if (err) {
+          (*err) += "Invalid JPEG image resolution.\n";
         }
-      } break;
+        return false;
+      }
 
-      case TAG_CAMERA_CALIBRATION2: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
-              if (err) {
-                (*err) += "Failed to parse CameraCalibration2 Tag.\n";
-              }
-              return false;
-            }
-            image.camera_calibration2[c][k] = val;
-          }
+      // Check if data is in valid range.
+      if ((sr.tell() + data_offset + static_cast<uint32_t>(jpeg_len)) >= sr.size()) {
+        if (err) {
+          (*err) += "Invalid JPEG image data size.\n";
         }
-      } break;
+        return false;
+      }
 
-      case TAG_CR2_SLICES: {
-        // Assume 3 ushorts;
-        for (size_t c = 0; c < 3; c++) {
-          if (!sr.read2(&image.cr2_slices[c])) {
-            if (err) {
-              (*err) += "Failed to parse CR2Slices Tag.\n";
-            }
-            return false;
-          }
-        }
-        // TINY_DNG_DPRINTF("cr2_slices = %d, %d, %d\n",
-        //  image.cr2_slices[0],
-        //  image.cr2_slices[1],
-        //  image.cr2_slices[2]);
-      } break;
+      // Currently we do not decode JPEG image(since JPEG image would be just a
+      // thumbnail or LDR image of RAW). Only the resolution is read from the
+      // header.
+      // TODO(syoyo): Decode JPEG image.
+      image->width = w_info;
+      image->height = h_info;
+    }
 
-      case TAG_SEMANTIC_NAME: {
-        size_t readLen = len;
-        if (readLen < 1) {
-          if (err) {
-            (*err) += "Null string for SemanticName Tag.\n";
-          }
+  } else if (image->compression ==
+             COMPRESSION_NEW_JPEG) {  //  new JPEG(baseline DCT JPEG or
+                                      //  lossless JPEG)
 
-          return false;
-        }
+    bool decoded = false;
 
-        const size_t kMaxNameSize = 1024 * 1024;
+    if (image->bits_per_sample_original == 8) {
+      // bps TAG exists. probably ordinal JPEG
 
-        if (readLen > kMaxNameSize) {
+      size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
+      if (image->jpeg_byte_count == -1) {
+        // No jpeg datalen. Set to the size of file - offset.
+        if (sr.size() < data_offset) {
           if (err) {
-            (*err) += "The length of SemanticName string too large.\n";
+            (*err) += "Unexpected file size or data offset.\n";
           }
           return false;
         }
+        jpeg_len = ImageDataLength(sr, *image, data_offset);
+      }
+      jpeg_len = (std::min)(jpeg_len, sr.size() - data_offset);
 
-        std::vector<uint8_t> buf(readLen);  // readLen includes null char
-        if (!sr.read(readLen, readLen,
-                     reinterpret_cast<unsigned char*>(buf.data()))) {
-          if (err) {
-            (*err) += "Failed to parse SemanticName Tag.\n";
-          }
-          return false;
+      const uint8_t* jpeg_addr = sr.map_abs_addr(data_offset, jpeg_len);
+      if (!jpeg_addr) {
+        if (err) {
+          (*err) += "Failed to read JPEG data.\n";
         }
+        return false;
+      }
 
-        image.semantic_name = std::string(buf.begin(), buf.end());
-
-        TINY_DNG_DPRINTF("semantic_name = %s\n", image.semantic_name.c_str());
-      } break;
-
-      case TAG_OPCODE_LIST1:
-      case TAG_OPCODE_LIST2:
-      case TAG_OPCODE_LIST3: {
-        const size_t kMaxOpcodeDataSize = 1024*1024*256;
-
-        TINY_DNG_DPRINTF("opcodelist %d\n", tag);
-        size_t readLen = len;
-        if (readLen < 1) {
-          if (err) {
-            (*err) += "Empty data for OpCodeList Tag.\n";
-          }
+      int w_info = 0, h_info = 0, components_info = 0;
+      int is_jpeg = stbi_info_from_memory(jpeg_addr,
+                                          static_cast<int>(jpeg_len), &w_info,
+                                          &h_info, &components_info);
 
-          return false;
-        }
+      if (is_jpeg != 1) {
+        // Try to decode image as lossless JPEG.
+      } else {
+        int w = 0, h = 0, components = 0;
+        unsigned char* decoded_image = stbi_load_from_memory(
+            jpeg_addr, static_cast<int>(jpeg_len), &w, &h,
+            &components, /* desired_channels */ components_info);
 
-        if (readLen > kMaxOpcodeDataSize) {
-          if (err) {
-            (*err) += "OpCodeList data too large.\n";
+        if (!decoded_image) {
+          // Try to decode image as lossless JPEG.
+        } else {
+          decoded = true;
+
+          image->width = w;
+          image->height = h;
+          image->samples_per_pixel = components;
+          image->bits_per_sample = 8;
+
+          const uint64_t len = uint64_t(image->samples_per_pixel) * uint64_t(image->width) * uint64_t(image->height) * uint64_t(image->bits_per_sample / 8);
+          // For 32bit
+          if (sizeof(void *) == 4) {
+            // Use 2GB as a max
+            if (len > (std::numeric_limits<int32_t>::max)()) {
+              if (err) {
+                (*err) += "Decoded image size exceeds 2GB.\n";
+              }
+              return false;
+            }
           }
 
-          return false;
-        }
-        std::vector<uint8_t> buf(readLen);
-        if (!sr.read(readLen, readLen,
-                     reinterpret_cast<unsigned char*>(buf.data()))) {
-          if (err) {
-            (*err) += "Failed to read OpCodeList data.\n";
-          }
-          return false;
-        }
+          ImageOutput out;
+          if (!AcquireImageOutput(image, i, size_t(len), res, &out, err)) {
+            free(decoded_image);
+            return false;
+          }
 
-        std::vector<GainMap> *gainmaps = NULL;
-        if (tag == TAG_OPCODE_LIST1) {
-          gainmaps = &image.opcodelist1_gainmap;
-        } else if (tag == TAG_OPCODE_LIST2) {
-          gainmaps = &image.opcodelist2_gainmap;
-        } else if (tag == TAG_OPCODE_LIST3) {
-          gainmaps = &image.opcodelist3_gainmap;
+          WriteImageRows(out, decoded_image, size_t(len));
+
+          free(decoded_image);
         }
+      }
+    }
 
-        if (!ParseOpcodeList(tag, buf.data(), buf.size(), gainmaps)) {
+    if (!decoded) {
+      // Try to decode as lossless JPEG.
+
+      // lj92 decodes data into 16bits, so modify bps.
+      image->bits_per_sample = 16;
+
+      // std::cout << "w = " << image->width << ", h = " << image->height <<
+      // std::endl;
+
+      TINY_DNG_DPRINTF("image.width = %d\n", image->width);
+      TINY_DNG_DPRINTF("image.height = %d\n", image->height);
+      TINY_DNG_DPRINTF("image.bps = %d\n", image->bits_per_sample);
+      TINY_DNG_DPRINTF("image.spp = %d\n", image->samples_per_pixel);
+
+      TINY_DNG_ASSERT(
+          ((image->width * image->height * image->bits_per_sample) % 8) == 0,
+          "Image must be multiple of 8.");
+      const uint64_t len = uint64_t(image->samples_per_pixel) * uint64_t(image->width) * uint64_t(image->height) * uint64_t(image->bits_per_sample / 8);
+      // For 32bit
+      if (sizeof(void *) == 4) {
+        // Use 2GB as a max
+        if (len > (std::numeric_limits<int32_t>::max)()) {
           if (err) {
-            (*err) += "Failed to parse OpCodeList Tag.\n";
+            (*err) += "Decoded image size exceeds 2GB.\n";
           }
           return false;
         }
+      }
 
-        TINY_DNG_DPRINTF("opcodelist %d, dataLen = %d\n", tag, int(readLen));
+      if (len == 0) {
+        if (err) {
+          (*err) += "Invalid jpeg data length.\n";
+        }
+        return false;
+      }
+      TINY_DNG_DPRINTF("image.data.size = %lld\n", len);
 
-      } break;
+      ImageOutput out;
+      if (!AcquireImageOutput(image, i, size_t(len), res, &out, err)) {
+        return false;
+      }
+      TINY_DNG_DPRINTF("image.data.size = %d\n", int(len));
 
-      default: {
-        FieldData data;
-        int ret = ParseCustomField(sr, custom_field_lists, tag, type, len,
-                                   &data, err);
-        if (ret == -1) {
-          return false;
+      if (sr.size() < data_offset) {
+        if (err) {
+          (*err) += "Unexpected file size or data offset.\n";
         }
+        return false;
+      }
 
-        if (ret > 0) {
-          image.custom_fields.push_back(data);
+      int lj_bits = 0;
+
+      bool ok = DecompressLosslessJPEG(
+          sr, reinterpret_cast<unsigned short*>(out.data),
+          MakeImageWindow(0, 0, image->width, image->height, out.row_stride),
+          (*image), &lj_bits, res, err);
+      if (!ok) {
+        if (err) {
+          std::stringstream ss;
+          ss << "Failed to decompress LJPEG." << std::endl;
+          (*err) += ss.str();
         }
-        // TINY_DNG_DPRINTF("unknown or unsupported tag = %d\n", tag);
+        return false;
+      }
+
+      if (image->bits_per_sample_original <= 0) {
+        image->bits_per_sample_original = lj_bits;
       }
     }
 
-    sr.seek_set(saved_offt);
-  }
+  } else if (image->compression == COMPRESSION_ZIP) {  // ZIP
+#ifdef TINY_DNG_LOADER_ENABLE_ZIP
+    TINY_DNG_ASSERT(image->bits_per_sample_original > 0,
+                    "bits_per_sample information not found in the tag.");
+    image->bits_per_sample = image->bits_per_sample_original;
+    TINY_DNG_DPRINTF("bps = %d\n", image->bits_per_sample);
+    TINY_DNG_DPRINTF("data_offset = %d\n", int(data_offset));
 
-  if (image.rows_per_strip > 0) {
-    if (image.height == -1) {
+    TINY_DNG_DPRINTF("width %d\n", image->width);
+    TINY_DNG_DPRINTF("height %d\n", image->height);
+    TINY_DNG_DPRINTF("samples_per_pixel %d\n", image->samples_per_pixel);
+    TINY_DNG_DPRINTF("bits_per_sample %d\n", image->bits_per_sample);
+
+    if ((image->width <= 0) || (image->height <= 0) ||
+        (image->samples_per_pixel <= 0)) {
       if (err) {
-        (*err) = "image height tag is required to compute StripsPerImage.\n";
+        (*err) += "Invalid image dimensions in ZIP compressed data.\n";
       }
       return false;
     }
 
-    // http://www.awaresystems.be/imaging/tiff/tifftags/rowsperstrip.html
-    image.strips_per_image =
-        static_cast<int>(floor(double(image.height + image.rows_per_strip - 1) /
-                               double(image.rows_per_strip)));
-    TINY_DNG_DPRINTF("rows_per_strip = %d\n", image.samples_per_pixel);
-    TINY_DNG_DPRINTF("strips_per_image = %d\n", image.strips_per_image);
-  }
-
-  // Delayed read of strip offsets and strip byte counts
-  if (image.strips_per_image > 0) {
-    image.strip_byte_counts.clear();
-    image.strip_offsets.clear();
+    const uint64_t len64 =
+        uint64_t(image->samples_per_pixel) * uint64_t(image->width) *
+        uint64_t(image->height) * uint64_t(image->bits_per_sample) / 8;
+    if (len64 == 0) {
+      if (err) {
+        (*err) += "Invalid length. in ZIP compressed data.\n";
+      }
+      return false;
+    }
 
-    long curr_offt = static_cast<long>(sr.tell());
+    if (len64 > (kMaxImageSizeInMB * 1024ull * 1024ull)) {
+      if (err) {
+        (*err) += "Image data size too large. Exceeds " +
+                  std::to_string(kMaxImageSizeInMB) + " MB.\n";
+      }
+      return false;
+    }
+    const size_t len = size_t(len64);
 
-    if (offt_strip_byte_counts > 0) {
-      if (!sr.seek_set(uint64_t(offt_strip_byte_counts))) {
-        if (err) {
-          (*err) = "Failed to seek.\n";
-        }
-        return false;
+    if (sr.size() < data_offset) {
+      if (err) {
+        (*err) +=
+            "Unexpected file size or data offset in ZIP compressed data.\n";
       }
+      return false;
+    }
 
-      for (int k = 0; k < image.strips_per_image; k++) {
-        unsigned int strip_byte_count;
-        if (!sr.read4(&strip_byte_count)) {
-          if (err) {
-            (*err) += "Failed to read StripByteCount value.";
-          }
-          return false;
-        }
-        TINY_DNG_DPRINTF("strip_byte_counts[%d] = %u\n", k, strip_byte_count);
-        image.strip_byte_counts.push_back(strip_byte_count);
+    ImageOutput out;
+    if (!AcquireImageOutput(image, i, len, res, &out, err)) {
+      return false;
+    }
+
+    bool ok = DecompressZIPedTile(
+        sr, out.data,
+        MakeImageWindow(0, 0, image->width, image->height, out.row_stride),
+        (*image), res, err);
+    if (!ok) {
+      if (err) {
+        std::stringstream ss;
+        ss << "Failed to decompress ZIP." << std::endl;
+        (*err) += ss.str();
       }
+      return false;
+    }
+#else
+    if (err) {
+      std::stringstream ss;
+      ss << "ZIP compression is not supported." << std::endl;
+      (*err) = ss.str();
     }
+#endif
+  } else if (image->compression == COMPRESSION_LOSSY) {  // lossy JPEG
 
-    if (offt_strip_offset > 0) {
-      if (!sr.seek_set(uint64_t(offt_strip_offset))) {
+    // TOOD: Check bps and photometric_interpretation.
+
+    size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
+    if (image->jpeg_byte_count == -1) {
+      // No jpeg datalen. Set to the size of file - offset.
+      if (sr.size() < data_offset) {
         if (err) {
-          (*err) = "Failed to seek.\n";
+          (*err) += "Unexpected file size or data offset.\n";
         }
         return false;
       }
+      jpeg_len = ImageDataLength(sr, *image, data_offset);
+    }
+    jpeg_len = (std::min)(jpeg_len, sr.size() - data_offset);
 
-      for (int k = 0; k < image.strips_per_image; k++) {
-        unsigned int strip_offset;
-        if (!sr.read4(&strip_offset)) {
-          if (err) {
-            (*err) += "Failed to read StripOffset value.";
-          }
-          return false;
-        }
+    const uint8_t* jpeg_addr = sr.map_abs_addr(data_offset, jpeg_len);
+    if (!jpeg_addr) {
+      if (err) {
+        (*err) += "Failed to read JPEG data.\n";
+      }
+      return false;
+    }
+
+    int w_info = 0, h_info = 0, components_info = 0;
+    int is_jpeg = stbi_info_from_memory(jpeg_addr,
+                                        static_cast<int>(jpeg_len), &w_info,
+                                        &h_info, &components_info);
 
-        TINY_DNG_DPRINTF("strip_offset[%d] = %u\n", k, strip_offset);
-        image.strip_offsets.push_back(strip_offset);
+    if (is_jpeg != 1) {
+      if (err) {
+        (*err) +=
+            "Currently We only supports Standard JPEG data for Lossy "
+            "compression(34892).\n";
       }
+      return false;
     }
 
-    if (!sr.seek_set(uint64_t(curr_offt))) {
+    if ((components_info != 1) && (components_info != 3)) {
       if (err) {
-        (*err) = "Failed to seek.\n";
+        (*err) += "Unsupported channels in JPEG data.\n";
       }
       return false;
     }
-  }
-  //
 
-  // Add to images.
-  if (images->size() < kMaxImages) {
-    images->push_back(image);
+    if ((w_info < 1) || (h_info < 1)) {
+      if (err) {
+        (*err) += "Invalid JPEG image resolution.\n";
+      }
+      return false;
+    }
+
+    int w = 0, h = 0, components = 0;
+    unsigned char* decoded_image = stbi_load_from_memory(
+        jpeg_addr, static_cast<int>(jpeg_len), &w, &h,
+        &components, /* desired_channels */ components_info);
+
+
+    if (!decoded_image) {
+      // Probably 16bit JPEG?
+      image->bits_per_sample_original = 1;  // FIXME
+      image->bits_per_sample = 1;           // FIXME
+
+      if (err) {
+        std::stringstream ss;
+        ss << "Unsupported lossy JPEG compression(16bit JPEG?)." << std::endl;
+        (*err) = ss.str();
+      }
+
+    } else {
+      image->width = w;
+      image->height = h;
+      image->samples_per_pixel = components;
+      image->bits_per_sample = 8;
+
+      const size_t len =
+          static_cast<size_t>((image->samples_per_pixel * image->width *
+                               image->height * image->bits_per_sample) /
+                              8);
+      ImageOutput out;
+      if (!AcquireImageOutput(image, i, len, res, &out, err)) {
+        free(decoded_image);
+        return false;
+      }
+
+      WriteImageRows(out, decoded_image, len);
+
+#if defined(TINY_DNG_DEBUG_SAVEIMAGE)
+      std::string output_filename = "layer-" + std::to_string(i) + ".png";
+      stbi_write_png(output_filename.c_str(), w, h, components,
+                     reinterpret_cast<const void*>(decoded_image),
+                     /* stride */ 0);
+#endif
+      free(decoded_image);
+    }
+
+  } else if (image->compression == 34713) {  // NEF lossless?
+
+    image->bits_per_sample_original = 1;  // FIXME
+    image->bits_per_sample = 1;           // FIXME
+
+    if (err) {
+      std::stringstream ss;
+      ss << "Seems a NEF RAW. This compression is not supported."
+         << std::endl;
+      (*err) = ss.str();
+    }
   } else {
-    if (warn) {
-      (*warn) = "Too many images in one DNG file. Skipped some images\n";
+    if (err) {
+      std::stringstream ss;
+      ss << "IFD [" << i << "] "
+         << " Unsupported compression type : " << image->compression
+         << std::endl;
+      (*err) = ss.str();
     }
+    return false;
   }
 
-  // TINY_DNG_DPRINTF("DONE ---------\n");
-
   return true;
 }
 
-static bool ParseDNGFromMemory(const StreamReader& sr,
-                               const std::vector<FieldInfo>& custom_fields,
-                               std::vector<tinydng::DNGImage>* images,
-                               std::string* warn, std::string* err) {
-  if (!images) {
+// Decode `window` of `image` to `out`. Only tiles or strips which intersect
+// `window` are decoded.
+static bool DecodeImageRegion(const StreamReader& sr, const bool swap_endian,
+                              const tinydng::DNGImage& image,
+                              const ImageWindow& window,
+                              std::vector<unsigned char>* out,
+                              const DecodeResources& res, std::string* err) {
+  if ((image.width <= 0) || (image.height <= 0) ||
+      (image.samples_per_pixel <= 0) || (image.samples_per_pixel > 4)) {
     if (err) {
-      (*err) += "Invalid `images` argument.\n";
+      (*err) += "Invalid image dimensions.\n";
     }
     return false;
   }
 
-  unsigned int offt;
-  if (!sr.read4(&offt)) {
+  if ((window.x < 0) || (window.y < 0) || (window.width <= 0) ||
+      (window.height <= 0) || (window.width > image.width - window.x) ||
+      (window.height > image.height - window.y)) {
     if (err) {
-      (*err) += "Failed to read offset.\n";
+      std::stringstream ss;
+      ss << "Region (" << window.x << ", " << window.y << ", " << window.width
+         << ", " << window.height << ") is outside of the image("
+         << image.width << "x" << image.height << ").\n";
+      (*err) += ss.str();
     }
     return false;
   }
 
-  TINY_DNG_DPRINTF("First IFD offt: %d\n", offt);
+  const bool is_tiled = (image.tile_width > 0) && (image.tile_length > 0);
 
-  size_t count = 0;
+  // Bits per sample of the decoded pixels. Same as `DecodeImageData`.
+  int bps = image.bits_per_sample_original;
+  bool supported = false;
+  if (image.compression == COMPRESSION_NEW_JPEG) {
+    // lj92 decodes data into 16bits.
+    bps = 16;
+    supported = is_tiled;
+  } else if (image.compression == COMPRESSION_ZIP) {
+#ifdef TINY_DNG_LOADER_ENABLE_ZIP
+    supported = is_tiled;
+#endif
+  } else if (image.compression == COMPRESSION_LZW) {
+    supported = !is_tiled;
+  } else if (image.compression == COMPRESSION_NONE) {
+    supported = (image.jpeg_byte_count <= 0);
+  }
 
-  while (offt) {
-    if (!sr.seek_set(offt)) {
-      if (err) {
-        (*err) += "Failed to seek to TIFF IFD.\n";
-      }
-      return false;
+  if (!supported || (image.planar_configuration == 2)) {
+    if (err) {
+      std::stringstream ss;
+      ss << "Region decoding is not supported for this image(compression "
+         << image.compression << ", "
+         << (is_tiled ? "tiled" : "not tiled") << ").\n";
+      (*err) += ss.str();
     }
+    return false;
+  }
 
-    // TINY_DNG_DPRINTF("Parse TIFF IFD\n");
-    if (!ParseTIFFIFD(sr, custom_fields, images, warn, err)) {
-      break;
-    }
-    // Get next IFD offset(0 = end of file).
-    if (!sr.read4(&offt)) {
-      if (err) {
-        (*err) += "Failed to read next IDF offset.\n";
-      }
-      return false;
+  if ((bps <= 0) || ((bps % 8) != 0)) {
+    if (err) {
+      (*err) += "Region decoding requires byte aligned samples.\n";
     }
+    return false;
+  }
 
-    TINY_DNG_DPRINTF("Next IFD offset = %d\n", offt);
+  const size_t pixel_bytes =
+      size_t(image.samples_per_pixel) * size_t(bps) / size_t(8);
+  const size_t dst_stride = pixel_bytes * size_t(window.width);
+  const size_t row_bytes = pixel_bytes * size_t(image.width);
 
-    // Avoid infinite loop
-    count++;
-    if (count > kMaxImages) {
-      if (warn) {
-        (*warn) += "Too many IFDs. IFD offset seems invalid.\n";
-      }
-      break;
-    }
-  }
+  // Uncompressed samples are byte swapped while copied(1 = plain copy).
+  const bool to_host = ToHostByteOrder(res, swap_endian, bps);
+  const size_t sample_bytes = to_host ? size_t(bps / 8) : size_t(1);
 
-  return true;
-}
+  out->resize(dst_stride * size_t(window.height));
 
-static bool IsBigEndian() {
-  uint32_t i = 0x01020304;
-  char c[4];
-  memcpy(c, &i, 4);
-  return (c[0] == 1);
-}
+  if (image.compression == COMPRESSION_NEW_JPEG) {
+    return DecompressLosslessJPEG(
+        sr, reinterpret_cast<unsigned short*>(out->data()), window, image,
+        NULL, res, err);
+  }
 
-// C++03 and tiff lzw port of https://github.com/glampert/compression-algorithms
-// =============================================================================
-//
-// File: lzw.hpp
-// Author: Guilherme R. Lampert
-// Created on: 17/02/16
-// Brief: LZW encoder/decoder in C++11 with varying length dictionary codes.
-//
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wpadded"
+#ifdef TINY_DNG_LOADER_ENABLE_ZIP
+  if (image.compression == COMPRESSION_ZIP) {
+    return DecompressZIPedTile(sr, out->data(), window, image, res, err);
+  }
 #endif
-namespace lzw {
-
-class Dictionary {
- public:
-  struct Entry {
-    int code;
-    int value;
-  };
 
-  // Dictionary entries 0-255 are always reserved to the byte/ASCII range.
-  int size_;
-  Entry entries_[4096];
+  if (is_tiled) {
+    // Uncompressed tiles. Copy the overlapping rows of each tile.
+    const size_t tile_stride = pixel_bytes * size_t(image.tile_width);
+    return DecodeTiles(
+        image, window, res,
+        [&](size_t k, unsigned int tiff_w, unsigned int tiff_h,
+            DecoderScratch* /* scratch */, std::string* tile_err) {
+          int x0, y0, x1, y1;
+          if (!IntersectTile(image, tiff_w, tiff_h, window, &x0, &y0, &x1,
+                             &y1)) {
+            return true;
+          }
 
-  Dictionary();
-  int findIndex(int code, int value) const;
-  bool add(int code, int value);
-  bool flush(int& codeBitsWidth);
-  void init();
-  int size() { return size_; }
-};
+          const size_t src_offset =
+              size_t(image.tile_offsets[k]) +
+              tile_stride * size_t(y0 - int(tiff_h)) +
+              pixel_bytes * size_t(x0 - int(tiff_w));
+          const size_t src_len =
+              tile_stride * size_t(y1 - y0 - 1) + pixel_bytes * size_t(x1 - x0);
+          if (src_offset + src_len >
+              size_t(image.tile_offsets[k] + image.tile_byte_counts[k])) {
+            if (tile_err) {
+              (*tile_err) += "Uncompressed tile data is too short.\n";
+            }
+            return false;
+          }
 
-// ========================================================
-// class Dictionary:
-// ========================================================
+          const uint8_t* src = sr.map_abs_addr(src_offset, src_len);
+          if (!src) {
+            if (tile_err) {
+              (*tile_err) += "Failed to read uncompressed tile data.\n";
+            }
+            return false;
+          }
 
-Dictionary::Dictionary() { init(); }
+          for (int y = y0; y < y1; y++) {
+            CopySwapped(out->data() + dst_stride * size_t(y - window.y) +
+                            pixel_bytes * size_t(x0 - window.x),
+                        src + tile_stride * size_t(y - y0),
+                        pixel_bytes * size_t(x1 - x0), sample_bytes);
+          }
+          return true;
+        },
+        err);
+  }
 
-void Dictionary::init() {
-  // First 256 dictionary entries are reserved to the byte/ASCII
-  // range. Additional entries follow for the character sequences
-  // found in the input. Up to 4096 - 256 (MaxDictEntries - FirstCode).
-  size_ = 256;
-  for (int i = 0; i < size_; ++i) {
-    entries_[i].code = -1;
-    entries_[i].value = i;
+  // Strips. An image without StripOffsets array is treated as one strip.
+  size_t rows_per_strip = size_t(image.height);
+  if ((image.rows_per_strip > 0) && (image.rows_per_strip < image.height)) {
+    rows_per_strip = size_t(image.rows_per_strip);
   }
 
-  // 256 is reserved for ClearCode, 257 is reserved for end of stream, thus
-  // FistCode starts with 258
-  size_ = 258;  // = 256 + 2
-}
+  std::vector<uint64_t> strip_offsets;
+  std::vector<uint64_t> strip_byte_counts;
+  if (!image.strip_offsets.empty()) {
+    strip_offsets.assign(image.strip_offsets.begin(),
+                         image.strip_offsets.end());
+    strip_byte_counts.assign(image.strip_byte_counts.begin(),
+                             image.strip_byte_counts.end());
+  } else if (image.offset > 0) {
+    rows_per_strip = size_t(image.height);
+    strip_offsets.push_back(image.offset);
+    if (image.strip_byte_count > 0) {
+      strip_byte_counts.push_back(uint64_t(image.strip_byte_count));
+    }
+  }
 
-int Dictionary::findIndex(const int code, const int value) const {
-  if (code == -1) {
-    return value;
+  const size_t s0 = size_t(window.y) / rows_per_strip;
+  const size_t s1 =
+      (size_t(window.y + window.height) + rows_per_strip - 1) / rows_per_strip;
+  if (strip_offsets.size() < s1) {
+    if (err) {
+      (*err) += "Strip offsets not found.\n";
+    }
+    return false;
   }
 
-  // Linear search for now.
-  // TODO: Worth optimizing with a proper hash-table?
-  for (int i = 0; i < size_; ++i) {
-    if (entries_[i].code == code && entries_[i].value == value) {
-      return i;
+  if (image.compression == COMPRESSION_NONE) {
+    // Rows are read from the file as is.
+    for (int y = window.y; y < window.y + window.height; y++) {
+      const size_t s = size_t(y) / rows_per_strip;
+      const size_t strip_row = size_t(y) - s * rows_per_strip;
+      const size_t src_offset = size_t(strip_offsets[s]) +
+                                row_bytes * strip_row +
+                                pixel_bytes * size_t(window.x);
+      const size_t strip_end =
+          (s < strip_byte_counts.size())
+              ? size_t(strip_offsets[s] + strip_byte_counts[s])
+              : sr.size();
+      if ((src_offset + dst_stride > strip_end) ||
+          (src_offset + dst_stride > sr.size())) {
+        if (err) {
+          (*err) += "Uncompressed strip data is too short.\n";
+        }
+        return false;
+      }
+
+      uint8_t* dst = out->data() + dst_stride * size_t(y - window.y);
+      if (!sr.read_at(src_offset, dst_stride, dst)) {
+        if (err) {
+          (*err) += "Failed to read uncompressed strip data.\n";
+        }
+        return false;
+      }
+      // The row is still in cache, so swap it in place.
+      CopySwapped(dst, dst, dst_stride, sample_bytes);
     }
+    return true;
   }
 
-  return -1;
-}
-
-bool Dictionary::add(const int code, const int value) {
-  TINY_DNG_ASSERT(code <= size_,
-                  "`code' must be less than or equal to dictionary size.");
-  if (size_ == 4096) {
-    TINY_DNG_DPRINTF("Dictionary overflowed!");
+  // LZW strips.
+  if (strip_byte_counts.size() != strip_offsets.size()) {
+    if (err) {
+      (*err) += "StripByteCounts not found.\n";
+    }
     return false;
   }
 
-  TINY_DNG_DPRINTF("add[%d].code = %d\n", size_, code);
-  TINY_DNG_DPRINTF("add[%d].value = %d\n", size_, value);
-  entries_[size_].code = code;
-  entries_[size_].value = value;
-  ++size_;
-  return true;
-}
+  // Same strip length as `DecodeImageData`.
+  const size_t strip_len = row_bytes * rows_per_strip;
+  AllocVector<std::string> strip_errs(s1 - s0, std::string(), res.allocator);
+  AllocVector<char> strip_ok(s1 - s0, char(0), res.allocator);
+
+  res.pool->parallel_for(s1 - s0, [&](size_t begin, size_t end) {
+    ScratchLease scratch(res.context);
+    uint8_t* strip_buf =
+        ScratchBuffer(scratch.get(), &scratch->u8, strip_len);
+    for (size_t t = begin; t < end; t++) {
+      const size_t s = s0 + t;
+      if (!DecodeLZWStrip(sr, swap_endian, to_host, image, s,
+                          strip_buf, strip_len, res.allocator,
+                          &strip_errs[t])) {
+        continue;
+      }
 
-bool Dictionary::flush(int& codeBitsWidth) {
-  if (size_ == ((1 << codeBitsWidth) - 1)) {
-    ++codeBitsWidth;
-    TINY_DNG_DPRINTF("expand: bits %d\n", codeBitsWidth);
-    if (codeBitsWidth > 12)  // MaxDictBits
-    {
-      // Clear the dictionary (except the first 256 byte entries).
-      codeBitsWidth = 9;  // StartBits
-      size_ = 256 + 2;    // 256 is reserved for ClearCode, 257 is reserved for
-                          // end of stream, thus FistCode starts with 258
-      return true;
+      const int y0 = (std::max)(window.y, int(s * rows_per_strip));
+      const int y1 = (std::min)(window.y + window.height,
+                                int((s + 1) * rows_per_strip));
+      for (int y = y0; y < y1; y++) {
+        memcpy(out->data() + dst_stride * size_t(y - window.y),
+               strip_buf + row_bytes * (size_t(y) - s * rows_per_strip) +
+                   pixel_bytes * size_t(window.x),
+               dst_stride);
+      }
+      strip_ok[t] = 1;
     }
-  }
-  return false;
-}
-
-class BitStreamReader {
- public:
-  // No copy/assignment.
-  // BitStreamReader(const BitStreamReader &) = delete;
-  // BitStreamReader & operator = (const BitStreamReader &) = delete;
-
-  // BitStreamReader(const BitStreamWriter & bitStreamWriter);
-  BitStreamReader(const uint8_t* bitStream, int byteCount, int bitCount);
-
-  bool isEndOfStream() const;
-  bool readNextBitLE(int& bitOut);       // little endian
-  bool readNextBitBE(int& bitOut);       // big endian
-  uint64_t readBitsU64LE(int bitCount);  // little endian
-  uint64_t readBitsU64BE(int bitCount);  // big endian
-  void reset();
+  });
 
- private:
-  const uint8_t*
-      stream;  // Pointer to the external bit stream. Not owned by the reader.
-  const int
-      sizeInBytes;  // Size of the stream *in bytes*. Might include padding.
-  const int sizeInBits;  // Size of the stream *in bits*, padding *not* include.
-  int currBytePos;       // Current byte being read in the stream.
-  int nextBitPos;   // Bit position within the current byte to access next. 0 to
-                    // 7.
-  int numBitsRead;  // Total bits read from the stream so far. Never includes
-                    // byte-rounding padding.
-};
+  for (size_t t = 0; t < strip_ok.size(); t++) {
+    if (!strip_ok[t]) {
+      if (err) {
+        (*err) += strip_errs[t];
+      }
+      return false;
+    }
+  }
 
-// BitStreamReader::BitStreamReader(const BitStreamWriter & bitStreamWriter)
-//    : stream(bitStreamWriter.getBitStream())
-//    , sizeInBytes(bitStreamWriter.getByteCount())
-//    , sizeInBits(bitStreamWriter.getBitCount())
-//{
-//    reset();
-//}
-
-BitStreamReader::BitStreamReader(const unsigned char* bitStream,
-                                 const int byteCount, const int bitCount)
-    : stream(bitStream), sizeInBytes(byteCount), sizeInBits(bitCount) {
-  (void)sizeInBytes;
-  reset();
+  return true;
 }
 
-bool BitStreamReader::readNextBitLE(int& bitOut) {
-  if (numBitsRead >= sizeInBits) {
-    return false;  // We are done.
-  }
+// Choose images to decode according to `options`.
+// Stores a warning to `warn` when no image matches the selection.
+static bool SelectImages(const std::vector<tinydng::DNGImage>& images,
+                         const tinydng::LoadOptions& options,
+                         std::vector<bool>* selected, std::string* warn,
+                         std::string* err) {
+  const ImageSelection mode = options.image_selection;
 
-  const uint32_t mask = uint32_t(1) << nextBitPos;
-  bitOut = !!(stream[currBytePos] & mask);
-  ++numBitsRead;
+  selected->assign(images.size(), mode == IMAGE_SELECTION_ALL);
 
-  if (++nextBitPos == 8) {
-    nextBitPos = 0;
-    ++currBytePos;
+  if (mode == IMAGE_SELECTION_ALL) {
+    return true;
+  } else if (mode == IMAGE_SELECTION_INDEX) {
+    if (options.select_index < images.size()) {
+      (*selected)[options.select_index] = true;
+    }
+  } else if (mode == IMAGE_SELECTION_NEW_SUBFILE_TYPE) {
+    for (size_t i = 0; i < images.size(); i++) {
+      (*selected)[i] =
+          (images[i].new_subfile_type == options.select_new_subfile_type);
+    }
+  } else if (mode == IMAGE_SELECTION_LARGEST) {
+    uint64_t largest_area = 0;
+    size_t largest_idx = images.size();
+    for (size_t i = 0; i < images.size(); i++) {
+      if ((images[i].width <= 0) || (images[i].height <= 0)) {
+        continue;
+      }
+      const uint64_t area = uint64_t(images[i].width) * uint64_t(images[i].height);
+      if (area > largest_area) {
+        largest_area = area;
+        largest_idx = i;
+      }
+    }
+    if (largest_idx < images.size()) {
+      (*selected)[largest_idx] = true;
+    }
+  } else if (mode == IMAGE_SELECTION_SEMANTIC_NAME) {
+    for (size_t i = 0; i < images.size(); i++) {
+      // `semantic_name` may contain trailing null character.
+      (*selected)[i] = (strcmp(images[i].semantic_name.c_str(),
+                               options.select_semantic_name.c_str()) == 0) &&
+                       !images[i].semantic_name.empty();
+    }
+  } else if (mode == IMAGE_SELECTION_PREDICATE) {
+    if (!options.select_predicate) {
+      if (err) {
+        (*err) += "`select_predicate` is NULL.\n";
+      }
+      return false;
+    }
+    for (size_t i = 0; i < images.size(); i++) {
+      (*selected)[i] = options.select_predicate(
+          images[i], i, options.select_predicate_user_data);
+    }
+  } else {
+    if (err) {
+      (*err) += "Invalid image selection mode.\n";
+    }
+    return false;
   }
-  return true;
-}
 
-bool BitStreamReader::readNextBitBE(int& bitOut) {
-  if (numBitsRead >= sizeInBits) {
-    return false;  // We are done.
+  if (std::find(selected->begin(), selected->end(), true) ==
+      selected->end()) {
+    if (warn) {
+      (*warn) += "No image matched the selection. No image is decoded.\n";
+    }
   }
 
-  const uint32_t mask = uint32_t(1) << (7 - nextBitPos);
-  bitOut = !!(stream[currBytePos] & mask);
-  ++numBitsRead;
-
-  if (++nextBitPos == 8) {
-    nextBitPos = 0;
-    ++currBytePos;
-  }
   return true;
 }
 
-uint64_t BitStreamReader::readBitsU64LE(const int bitCount) {
-  TINY_DNG_ASSERT(bitCount <= 64,
-                  "`bitCount' must be less than or equal to 64.");
-
-  uint64_t num = 0;
-  for (int b = 0; b < bitCount; ++b) {
-    int bit;
-    if (!readNextBitLE(bit)) {
-      TINY_DNG_DPRINTF(
-          "LE: Failed to read bits from stream! Unexpected end.\n");
-      break;
-    }
+#if defined(_WIN32)
+namespace {
 
-    // Based on a "Stanford bit-hack":
-    // http://graphics.stanford.edu/~seander/bithacks.html#ConditionalSetOrClearBitsWithoutBranching
-    const uint64_t mask = uint64_t(1) << b;
-    num = (num & ~mask) | (uint64_t(-bit) & mask);
-  }
+static inline std::wstring UTF8ToWchar(const std::string& str) {
+  int wstr_size =
+      MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), NULL, 0);
+  TINY_DNG_ASSERT(wstr_size >= 0, "wstr_size must be positive");
+  std::wstring wstr(size_t(wstr_size), 0);
+  MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), &wstr[0],
+                      int(wstr.size()));
+  return wstr;
+}
 
-  return num;
+static inline std::string WcharToUTF8(const std::wstring& wstr) {
+  int str_size = WideCharToMultiByte(CP_UTF8, 0, wstr.data(), int(wstr.size()),
+                                     NULL, 0, NULL, NULL);
+  TINY_DNG_ASSERT(str_size >= 0, "str_size must be positive");
+  std::string str(size_t(str_size), 0);
+  WideCharToMultiByte(CP_UTF8, 0, wstr.data(), int(wstr.size()), &str[0],
+                      int(str.size()), NULL, NULL);
+  return str;
 }
 
-uint64_t BitStreamReader::readBitsU64BE(const int bitCount) {
-  TINY_DNG_ASSERT(bitCount <= 64,
-                  "`bitCount' must be less than or equal to 64.");
+}  // namespace
+#endif
 
-  uint64_t num = 0;
-  for (int b = 0; b < bitCount; ++b) {
-    int bit;
-    if (!readNextBitBE(bit)) {
-      TINY_DNG_DPRINTF("BE: Failed to read bits from stream! Unexpected end.");
-      break;
-    }
+namespace {
 
-    TINY_DNG_DPRINTF("bit[%d](count %d) = %d\n", b, bitCount, bit);
+// Open a file in read-only binary mode.
+// Returns NULL and store message into `err` when failed.
+static FILE* OpenFileForRead(const char* filename, std::string* err) {
+  FILE* fp = NULL;
+#if defined(_WIN32)
 
-    // Based on a "Stanford bit-hack":
-    // http://graphics.stanford.edu/~seander/bithacks.html#ConditionalSetOrClearBitsWithoutBranching
-    const uint64_t mask = uint64_t(1) << (bitCount - b - 1);
-    num = (num & ~mask) | (uint64_t(-bit) & mask);
+#if defined(_MSC_VER) || defined(__MINGW32__)  // MSVC, MinGW gcc or clang
+  errno_t errcode = _wfopen_s(&fp, UTF8ToWchar(filename).c_str(), L"rb");
+  if (errcode != 0) {
+    if (err) {
+      (*err) += "Error opening file: " + std::string(filename) + "(errno " +
+                std::to_string(errcode) + ")\n";
+    }
+    return NULL;
   }
+#else
+  // Unknown compiler
+  fp = fopen(filename, "rb");
+#endif
 
-  TINY_DNG_DPRINTF("num = %d\n", int(num));
-  return num;
-}
+#else
+  fp = fopen(filename, "rb");
+#endif
 
-void BitStreamReader::reset() {
-  currBytePos = 0;
-  nextBitPos = 0;
-  numBitsRead = 0;
-}
+  if (!fp) {
+    if (err) {
+      std::stringstream ss;
+      ss << "File not found or cannot open file " << filename << std::endl;
+      (*err) += ss.str();
+    }
+  }
 
-bool BitStreamReader::isEndOfStream() const {
-  return numBitsRead >= sizeInBits;
+  return fp;
 }
 
-// ========================================================
-// easyDecode() and helpers:
-// ========================================================
+}  // namespace
 
-static bool outputByte(int code, unsigned char*& output, int outputSizeBytes,
-                       int& bytesDecodedSoFar) {
-  if (bytesDecodedSoFar >= outputSizeBytes) {
-    // LZW_ERROR("Decoder output buffer too small!");
-    return false;
+///
+/// Read-only view of a whole file.
+///
+/// The file is memory-mapped(mmap or MapViewOfFile) so that only the pages
+/// actually touched by the parser and decoders(IFDs and the strips/tiles of
+/// decoded images) are read from the disk. When mapping is not available or
+/// fails(e.g. special files), falls back to reading the whole file into
+/// memory.
+///
+/// Define TINY_DNG_LOADER_NO_MMAP to always use the read fallback.
+///
+class MappedFile {
+ public:
+  MappedFile() : addr_(NULL), size_(0), mapped_(false) {
+#if !defined(TINY_DNG_LOADER_NO_MMAP)
+#if defined(_WIN32)
+    file_ = INVALID_HANDLE_VALUE;
+    mapping_ = NULL;
+#endif
+#endif
   }
 
-  TINY_DNG_ASSERT(code >= 0 && code < 256, "`code' must be within [0, 255].");
-  *output++ = static_cast<unsigned char>(code);
-  ++bytesDecodedSoFar;
-  return true;
-}
+  ~MappedFile() { close(); }
 
-static bool outputSequence(const Dictionary& dict, int code,
-                           unsigned char*& output, int outputSizeBytes,
-                           int& bytesDecodedSoFar, int& firstByte) {
-  const int MaxDictEntries = 4096;
-  (void)MaxDictEntries;
+  bool open(const char* filename, std::string* err) {
+    close();
 
-  // A sequence is stored backwards, so we have to write
-  // it to a temp then output the buffer in reverse.
-  int i = 0;
-  unsigned char sequence[4096];
-  do {
-    TINY_DNG_ASSERT(i < MaxDictEntries - 1 && code >= 0,
-                    "Invalid value for `i' or `code'.");
-    TINY_DNG_DPRINTF("i = %d, ent[%d].value = %d\n", i, code,
-                     dict.entries_[code].value);
-    sequence[i++] = static_cast<unsigned char>(dict.entries_[code].value);
-    code = dict.entries_[code].code;
-  } while (code >= 0);
-
-  firstByte = sequence[--i];
-  for (; i >= 0; --i) {
-    if (!outputByte(sequence[i], output, outputSizeBytes, bytesDecodedSoFar)) {
+    if (!filename) {
+      if (err) {
+        (*err) += "Invalid filename.\n";
+      }
       return false;
     }
-  }
-  return true;
-}
-
-static int easyDecode(const unsigned char* compressed,
-                      const int compressedSizeBytes,
-                      const int compressedSizeBits, unsigned char* uncompressed,
-                      const int uncompressedSizeBytes, const bool swap_endian) {
-  const int Nil = -1;
-  const int MaxDictBits = 12;
-  const int StartBits = 9;
 
-  // TIFF specific values
-  const int ClearCode = 256;
-  const int EndOfInformation = 257;
+#if !defined(TINY_DNG_LOADER_NO_MMAP)
+    if (map(filename)) {
+      return true;
+    }
+#endif
 
-  if (compressed == NULL || uncompressed == NULL) {
-    TINY_DNG_DPRINTF("lzw::easyDecode(): Null data pointer(s)!\n");
-    return 0;
+    return read_whole(filename, err);
   }
 
-  if (compressedSizeBytes <= 0 || compressedSizeBits <= 0 ||
-      uncompressedSizeBytes <= 0) {
-    TINY_DNG_DPRINTF("lzw::easyDecode(): Bad in/out sizes!n");
-    return 0;
+  void close() {
+#if !defined(TINY_DNG_LOADER_NO_MMAP)
+    if (mapped_) {
+#if defined(_WIN32)
+      UnmapViewOfFile(addr_);
+      CloseHandle(mapping_);
+      CloseHandle(file_);
+      mapping_ = NULL;
+      file_ = INVALID_HANDLE_VALUE;
+#else
+      munmap(const_cast<uint8_t*>(addr_), size_);
+#endif
+    }
+#endif
+    std::vector<uint8_t>().swap(buffer_);
+    addr_ = NULL;
+    size_ = 0;
+    mapped_ = false;
   }
 
-  int code = Nil;
-  int prevCode = Nil;
-  int firstByte = 0;
-  int bytesDecoded = 0;
-  int codeBitsWidth = StartBits;
-
-  // We'll reconstruct the dictionary based on the
-  // bit stream codes. Unlike Huffman encoding, we
-  // don't store the dictionary as a prefix to the data.
-  Dictionary dictionary;
-  BitStreamReader bitStream(compressed, compressedSizeBytes,
-                            compressedSizeBits);
-
-  // We check to avoid an overflow of the user buffer.
-  // If the buffer is smaller than the decompressed size,
-  // TINY_DNG_DPRINTF() is called. If that doesn't throw or
-  // terminate we break the loop and return the current
-  // decompression count.
-  while (!bitStream.isEndOfStream()) {
-    TINY_DNG_ASSERT(
-        codeBitsWidth <= MaxDictBits,
-        "`codeBitsWidth must be less than or equal to `MaxDictBits'.");
-    (void)MaxDictBits;
-
-    if (!swap_endian) {  // TODO(syoyo): Detect BE or LE depending on endianness
-                         // in stored format and host endian
-      code = static_cast<int>(bitStream.readBitsU64BE(codeBitsWidth));
-    } else {
-      code = static_cast<int>(bitStream.readBitsU64LE(codeBitsWidth));
-    }
+  const uint8_t* data() const { return addr_; }
+  size_t size() const { return size_; }
+  bool mapped() const { return mapped_; }
 
-    TINY_DNG_DPRINTF("code = %d(swap_endian = %d)\n", code, swap_endian);
+ private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+#if !defined(TINY_DNG_LOADER_NO_MMAP)
+  bool map(const char* filename) {
+#if defined(_WIN32)
+    HANDLE file = CreateFileW(UTF8ToWchar(filename).c_str(), GENERIC_READ,
+                              FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+      return false;
+    }
 
-    // if (code >= dictionary.size()) {
-    //  std::cerr << "code = " << code << "dict.size = " << dictionary.size() <<
-    //  std::endl;
-    //}
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || (file_size.QuadPart <= 0) ||
+        (uint64_t(file_size.QuadPart) > uint64_t((std::numeric_limits<size_t>::max)()))) {
+      CloseHandle(file);
+      return false;
+    }
 
-    // TINY_DNG_ASSERT(code <= dictionary.size(),
-    //                "`code' must be less than or equal to dictionary size.");
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+      CloseHandle(file);
+      return false;
+    }
 
-    if (code == EndOfInformation) {
-      TINY_DNG_DPRINTF("EoI\n");
-      break;
+    void* addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (addr == NULL) {
+      CloseHandle(mapping);
+      CloseHandle(file);
+      return false;
     }
 
-    if (code == ClearCode) {
-      // Initialize dict.
-      dictionary.init();
-      codeBitsWidth = StartBits;
+    file_ = file;
+    mapping_ = mapping;
+    addr_ = reinterpret_cast<const uint8_t*>(addr);
+    size_ = size_t(file_size.QuadPart);
+    mapped_ = true;
+    return true;
+#else
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
 
-      if (!swap_endian) {
-        code = static_cast<int>(bitStream.readBitsU64BE(codeBitsWidth));
-      } else {
-        code = static_cast<int>(bitStream.readBitsU64LE(codeBitsWidth));
-      }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size <= 0)) {
+      ::close(fd);
+      return false;
+    }
 
-      if (code == EndOfInformation) {
-        TINY_DNG_DPRINTF("EoI\n");
-        break;
-      }
+    void* addr =
+        mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after closing the file descriptor.
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      return false;
+    }
 
-      if (!outputByte(code, uncompressed, uncompressedSizeBytes,
-                      bytesDecoded)) {
-        break;
-      }
+    addr_ = reinterpret_cast<const uint8_t*>(addr);
+    size_ = size_t(st.st_size);
+    mapped_ = true;
+    return true;
+#endif
+  }
+#endif
 
-      prevCode = code;
-      continue;
+  bool read_whole(const char* filename, std::string* err) {
+    FILE* fp = OpenFileForRead(filename, err);
+    if (!fp) {
+      return false;
     }
 
-    if (prevCode == Nil) {
-      if (!outputByte(code, uncompressed, uncompressedSizeBytes,
-                      bytesDecoded)) {
-        break;
+    if (0 != fseek(fp, 0, SEEK_END)) {
+      if (err) {
+        (*err) += "Error seeking.\n";
       }
-      firstByte = code;
-      prevCode = code;
-      continue;
+      fclose(fp);
+      return false;
     }
 
-    if (code >= dictionary.size()) {
-      if (!outputSequence(dictionary, prevCode, uncompressed,
-                          uncompressedSizeBytes, bytesDecoded, firstByte)) {
-        break;
-      }
-      if (!outputByte(firstByte, uncompressed, uncompressedSizeBytes,
-                      bytesDecoded)) {
-        break;
-      }
-    } else {
-      if (!outputSequence(dictionary, code, uncompressed, uncompressedSizeBytes,
-                          bytesDecoded, firstByte)) {
-        break;
+    long file_size = ftell(fp);
+    if (file_size <= 0) {
+      if (err) {
+        (*err) += "Unexpected file size.\n";
       }
+      fclose(fp);
+      return false;
     }
 
-    dictionary.add(prevCode, firstByte);
-    if (dictionary.flush(codeBitsWidth)) {
-      TINY_DNG_DPRINTF("flush\n");
-      prevCode = Nil;
-    } else {
-      prevCode = code;
+    buffer_.resize(size_t(file_size));
+    fseek(fp, 0, SEEK_SET);
+    size_t read_len = fread(buffer_.data(), 1, buffer_.size(), fp);
+    fclose(fp);
+
+    if (read_len != buffer_.size()) {
+      if (err) {
+        (*err) += "Unexpected file size.\n";
+      }
+      std::vector<uint8_t>().swap(buffer_);
+      return false;
     }
-  }
 
-  return bytesDecoded;
-}
+    addr_ = buffer_.data();
+    size_ = buffer_.size();
+    return true;
+  }
 
-// =============================================================================
-#ifdef __clang__
-#pragma clang diagnostic pop
+  const uint8_t* addr_;
+  size_t size_;
+  bool mapped_;
+  std::vector<uint8_t> buffer_;  // Used when the file is not mapped.
+#if !defined(TINY_DNG_LOADER_NO_MMAP)
+#if defined(_WIN32)
+  HANDLE file_;
+  HANDLE mapping_;
+#endif
 #endif
+};
 
-}  // namespace lzw
+MemoryByteSource::MemoryByteSource(const void* mem, size_t size)
+    : mem_(reinterpret_cast<const unsigned char*>(mem)), size_(size) {}
 
-#if defined(_WIN32)
-namespace {
+uint64_t MemoryByteSource::size() const { return uint64_t(size_); }
 
-static inline std::wstring UTF8ToWchar(const std::string& str) {
-  int wstr_size =
-      MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), NULL, 0);
-  TINY_DNG_ASSERT(wstr_size >= 0, "wstr_size must be positive");
-  std::wstring wstr(size_t(wstr_size), 0);
-  MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), &wstr[0],
-                      int(wstr.size()));
-  return wstr;
+bool MemoryByteSource::read_at(uint64_t offset, size_t len,
+                               unsigned char* dst) {
+  if ((mem_ == NULL) || (offset > size_) || (len > size_ - offset)) {
+    return false;
+  }
+
+  memcpy(dst, mem_ + offset, len);
+  return true;
 }
 
-}  // namespace
+struct FileByteSource::Impl {
+#if defined(_WIN32)
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::mutex mutex;  // Guards the file position.
+#endif
+  FILE* fp;
+#else
+  int fd;
 #endif
+  uint64_t size;
+};
 
-bool LoadDNG(const char* filename, std::vector<FieldInfo>& custom_fields,
-             std::vector<DNGImage>* images, std::string* warn,
-             std::string* err) {
-  (void)warn;
-  std::stringstream ss;
+FileByteSource::FileByteSource() : impl_(new Impl()) {
+#if defined(_WIN32)
+  impl_->fp = NULL;
+#else
+  impl_->fd = -1;
+#endif
+  impl_->size = 0;
+}
 
-  if (!images) {
+FileByteSource::~FileByteSource() {
+  close();
+  delete impl_;
+}
+
+bool FileByteSource::open(const char* filename, std::string* err) {
+  close();
+
+  if (!filename) {
     if (err) {
-      (*err) += "Invalid `images` pointer.\n";
+      (*err) += "Invalid filename.\n";
     }
     return false;
   }
 
-  FILE* fp;
 #if defined(_WIN32)
+  FILE* fp = OpenFileForRead(filename, err);
+  if (!fp) {
+    return false;
+  }
 
-#if defined(_MSC_VER) || defined(__MINGW32__)  // MSVC, MinGW gcc or clang
-  errno_t errcode = _wfopen_s(&fp, UTF8ToWchar(filename).c_str(), L"rb");
-  if (errcode != 0) {
+  if (0 != _fseeki64(fp, 0, SEEK_END)) {
     if (err) {
-      (*err) += "Error opening file: " + std::string(filename) + "(errno " +
-                std::to_string(errcode) + ")\n";
+      (*err) += "Error seeking.\n";
+    }
+    fclose(fp);
+    return false;
+  }
+
+  const __int64 file_size = _ftelli64(fp);
+  if (file_size <= 0) {
+    if (err) {
+      (*err) += "Unexpected file size.\n";
     }
+    fclose(fp);
     return false;
   }
+
+  impl_->fp = fp;
+  impl_->size = uint64_t(file_size);
 #else
-  // Unknown compiler
-  fp = fopen(filename, "rb");
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) {
+    if (err) {
+      std::stringstream ss;
+      ss << "File not found or cannot open file " << filename << std::endl;
+      (*err) += ss.str();
+    }
+    return false;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+    if (err) {
+      (*err) += "Unexpected file size.\n";
+    }
+    ::close(fd);
+    return false;
+  }
+
+  impl_->fd = fd;
+  impl_->size = uint64_t(st.st_size);
 #endif
 
+  return true;
+}
+
+void FileByteSource::close() {
+#if defined(_WIN32)
+  if (impl_->fp) {
+    fclose(impl_->fp);
+    impl_->fp = NULL;
+  }
 #else
-  fp = fopen(filename, "rb");
+  if (impl_->fd >= 0) {
+    ::close(impl_->fd);
+    impl_->fd = -1;
+  }
 #endif
+  impl_->size = 0;
+}
 
-  if (!fp) {
-    ss << "File not found or cannot open file " << filename << std::endl;
-    if (err) {
-      (*err) = ss.str();
-    }
+uint64_t FileByteSource::size() const { return impl_->size; }
+
+bool FileByteSource::read_at(uint64_t offset, size_t len, unsigned char* dst) {
+  if ((offset > impl_->size) || (len > impl_->size - offset)) {
     return false;
   }
 
-  if (0 != fseek(fp, 0, SEEK_END)) {
-    if (err) {
-      (*err) = "Error seeking.\n";
-    }
+#if defined(_WIN32)
+  if (!impl_->fp) {
     return false;
   }
 
-  size_t file_size = static_cast<size_t>(ftell(fp));
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+#endif
+  if (0 != _fseeki64(impl_->fp, __int64(offset), SEEK_SET)) {
+    return false;
+  }
+  return fread(dst, 1, len, impl_->fp) == len;
+#else
+  if (impl_->fd < 0) {
+    return false;
+  }
 
-  std::vector<unsigned char> whole_data;
-  {
-    whole_data.resize(file_size);
-    fseek(fp, 0, SEEK_SET);
-    size_t read_len = fread(whole_data.data(), 1, file_size, fp);
-    if (read_len != file_size) {
-      if (err) {
-        (*err) += "Unexpected file size.\n";
+  // pread does not use the file position, thus no lock is required.
+  while (len > 0) {
+    const ssize_t n = pread(impl_->fd, dst, len, off_t(offset));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
       }
       return false;
     }
-
-    fseek(fp, 0, SEEK_SET);
+    if (n == 0) {
+      return false;
+    }
+    dst += n;
+    len -= size_t(n);
+    offset += uint64_t(n);
   }
-  fclose(fp);
+  return true;
+#endif
+}
 
-  return LoadDNGFromMemory(reinterpret_cast<const char*>(whole_data.data()),
-                           static_cast<unsigned int>(whole_data.size()),
-                           custom_fields, images, warn, err);
+bool LoadDNG(const char* filename, std::vector<FieldInfo>& custom_fields,
+             std::vector<DNGImage>* images, std::string* warn,
+             std::string* err) {
+  return LoadDNG(filename, LoadOptions(), custom_fields, images, warn, err);
 }
 
-bool LoadDNGFromMemory(const char* mem, unsigned int size,
-                       std::vector<FieldInfo>& custom_fields,
-                       std::vector<DNGImage>* images, std::string* warn,
-                       std::string* err) {
-  (void)warn;
+bool LoadDNGInfo(const char* filename, std::vector<FieldInfo>& custom_fields,
+                 std::vector<DNGImage>* images, std::string* warn,
+                 std::string* err) {
+  LoadOptions options;
+  options.metadata_only = true;
+  return LoadDNG(filename, options, custom_fields, images, warn, err);
+}
 
-  if ((mem == NULL) || (size < 32) || (!images)) {
+bool LoadDNG(const char* filename, const LoadOptions& options,
+             std::vector<FieldInfo>& custom_fields,
+             std::vector<DNGImage>* images, std::string* warn,
+             std::string* err) {
+  if (!images) {
     if (err) {
-      (*err) = "Invalid argument. argument is null or invalid.\n";
+      (*err) += "Invalid `images` pointer.\n";
     }
     return false;
   }
 
-  bool is_dng_big_endian = false;
-
-  const unsigned short magic = *(reinterpret_cast<const unsigned short*>(mem));
-
-  if (magic == 0x4949) {
-    // might be TIFF(DNG).
-  } else if (magic == 0x4d4d) {
-    // might be TIFF(DNG, bigendian).
-    is_dng_big_endian = true;
-    TINY_DNG_DPRINTF("DNG is big endian\n");
-  } else {
-    std::stringstream ss;
-    ss << "Seems the data is not a DNG format." << std::endl;
-    if (err) {
-      (*err) = ss.str();
-    }
-
+  // Decoders read pixel data directly from the mapped region, so no copy of
+  // the whole file is made here.
+  MappedFile file;
+  if (!file.open(filename, err)) {
     return false;
   }
 
-  const bool swap_endian = (is_dng_big_endian && (!IsBigEndian()));
-  StreamReader sr(reinterpret_cast<const uint8_t*>(mem), size, swap_endian);
+  return LoadDNGFromMemory(reinterpret_cast<const char*>(file.data()),
+                           file.size(), options, custom_fields, images, warn,
+                           err);
+}
+
+// Body of `LoadDNGFromMemory` and `LoadDNGFromSource`.
+static bool LoadDNGFromReader(const StreamReader& sr,
+                              const LoadOptions& options,
+                              std::vector<FieldInfo>& custom_fields,
+                              std::vector<DNGImage>* images, std::string* warn,
+                              std::string* err) {
+  const bool swap_endian = sr.swap_endian();
 
   char header[32];
 
@@ -5004,942 +9565,1274 @@ bool LoadDNGFromMemory(const char* mem, unsigned int size,
   //
   // Decode image data.
   //
+  // Image selection needs metadata of all images(e.g. resolution of JPEG
+  // image) before decoding.
+  const bool need_info =
+      options.metadata_only ||
+      (options.image_selection != IMAGE_SELECTION_ALL);
+
+  DecoderContext local_context(options.allocator);
+  DecoderContext* context =
+      options.decoder_context ? options.decoder_context : &local_context;
+
   for (size_t i = 0; i < images->size(); i++) {
     tinydng::DNGImage* image = &((*images)[i]);
 
-    const size_t data_offset =
-        (image->offset > 0) ? image->offset : image->tile_offset;
-    TINY_DNG_DPRINTF("data_offset = %d\n", int(data_offset));
-    if ((data_offset == 0) || (data_offset > sr.size())) {
-      if (err) {
-        std::stringstream ss;
-        ss << i << "'th image data offset is zero or invalid.\n";
-        (*err) += ss.str();
+    ResolveDataLocation(image);
+
+    if (need_info) {
+      if (!ReadImageDataInfo(sr, i, image, context, err)) {
+        return false;
       }
-      return false;
     }
+  }
 
-    // std::cout << "offt =\n" << image->offset << std::endl;
-    // std::cout << "tile_offt = \n" << image->tile_offset << std::endl;
-    // std::cout << "data_offset = " << data_offset << std::endl;
-
-    TINY_DNG_DPRINTF("image[%d].compression = %d\n", int(i),
-                     image->compression);
+  if (!options.metadata_only) {
+    std::vector<bool> selected;
+    if (!SelectImages(*images, options, &selected, warn, err)) {
+      return false;
+    }
 
-    if (image->compression == COMPRESSION_NONE) {  // no compression
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < images->size(); i++) {
+      if (selected[i]) {
+        indices.push_back(i);
+      }
+    }
 
-      if (image->jpeg_byte_count > 0) {
-        // Looks like CR2 IFD#1(thumbnail jpeg image)
-        // Currently skip parsing jpeg data.
-        // TODO(syoyo): Decode jpeg data.
-        image->width = 0;
-        image->height = 0;
+    if (sr.source()) {
+      // Fetch compressed data of the selected images ahead. Strips/tiles close
+      // to each other are fetched with one read.
+      std::vector<std::pair<uint64_t, uint64_t> > ranges;
+      for (size_t k = 0; k < indices.size(); k++) {
+        CollectImageDataRanges((*images)[indices[k]], sr.size(), &ranges);
+      }
 
-        if (image->bits_per_sample_original < 0) {
-          // Assume 8bit
-          image->bits_per_sample_original = 8;
+      if (!sr.source()->prefetch(ranges)) {
+        if (err) {
+          (*err) += "Failed to read image data from the source.\n";
         }
+        return false;
+      }
+    }
 
-        image->bits_per_sample = image->bits_per_sample_original;
+    DecodeResources res;
+    res.pool =
+        options.thread_pool ? options.thread_pool : ThreadPool::GetDefault();
+    res.context = context;
+    res.allocator = options.allocator;
+    res.image_buffer_callback = options.image_buffer_callback;
+    res.image_buffer_user_data = options.image_buffer_user_data;
+    res.unpack_samples = options.unpack_samples;
+    res.packed_bit_order = options.packed_bit_order;
+    res.host_byte_order = options.host_byte_order;
+
+    // Images are decoded concurrently. Decoders only use positional reads,
+    // so all images share one reader.
+    AllocVector<std::string> image_errs(indices.size(), std::string(),
+                                        options.allocator);
+    AllocVector<char> image_ok(indices.size(), char(0), options.allocator);
+
+    res.pool->parallel_for(indices.size(), [&](size_t begin, size_t end) {
+      for (size_t k = begin; k < end; k++) {
+        image_ok[k] = DecodeImageData(sr, swap_endian, indices[k],
+                                      &((*images)[indices[k]]), res,
+                                      &image_errs[k])
+                          ? 1
+                          : 0;
+      }
+    });
 
-      } else {
+    for (size_t k = 0; k < indices.size(); k++) {
+      if (!image_ok[k]) {
+        if (err) {
+          (*err) += image_errs[k];
+        }
+        return false;
+      }
+    }
+  }
 
-        const size_t kMaxImageSize = size_t(1024)*size_t(1024)*size_t(1024)*size_t(2); // 2GB
+  //
+  // Postprocessing. Calculate while_level.
+  //
+  for (size_t i = 0; i < images->size(); i++) {
+    tinydng::DNGImage* image = &((*images)[i]);
 
-        if (image->bits_per_sample_original <= 0) {
+    if (image->samples_per_pixel > 4) {
+      if (err) {
+        (*err) += "Cannot handle > 4 samples per pixel.\n";
+      }
+      return false;
+    }
+    for (int s = 0; s < image->samples_per_pixel; s++) {
+      if (image->white_level[s] == -1) {
+        // Set white level with (2 ** BitsPerSample) according to the DNG spec.
+        if (image->bits_per_sample_original == 0) {
           if (err) {
-            (*err) += "bits_per_sample information not found in the tag.\n";
+            (*err) += "Bits per sample of image has to be > 0.\n";
           }
           return false;
         }
 
-        image->bits_per_sample = image->bits_per_sample_original;
-        // std::cout << "sample_per_pixel " << image->samples_per_pixel << "\n";
-        // std::cout << "width " << image->width << "\n";
-        // std::cout << "height " << image->height << "\n";
-        // std::cout << "bps " << image->bits_per_sample << "\n";
-
-        if (((image->width * image->height * image->bits_per_sample) % 8) ==
-            0) {
-          // OK
+        if (image->bits_per_sample_original >=
+            32) {  // workaround for 32bit floating point TIFF.
+          image->white_level[s] = -1;
         } else {
-          if (err) {
-            (*err) += "Image size must be multiple of 8.";
+          if (image->bits_per_sample_original >= 32) {
+            if (err) {
+              (*err) += "Cannot handle >= 32 bits per sample.\n";
+            }
+            return false;
           }
-          return false;
-        }
-
-        const size_t len = size_t(image->samples_per_pixel) *
-                           size_t(image->width) * size_t(image->height) *
-                           size_t(image->bits_per_sample) / size_t(8);
 
-        if (len == 0) {
-          if (err) {
-            (*err) += "Unexpected length.";
-          }
-          return false;
+          image->white_level[s] = (1 << image->bits_per_sample_original) - 1;
         }
+      }
 
-        if (len > kMaxImageSize) {
-          if (err) {
-            std::stringstream ss;
-            ss << "Image byte size too large. " << len << "bytes in file, but hard-limit is set to " << kMaxImageSize << " bytes.\n";
-            (*err) += ss.str();
-          }
-          return false;
+      // Shrink value when TIFF tag white level is larger than (2**bps)
+      // e.g. Set to 4096 if TIFF white_balance tag has 65535 but bps == 12
+      // FIXME: Is this ok according to DNG spec?
+      if ((image->bits_per_sample_original > 0) &&
+          (image->bits_per_sample_original < 30)) {
+        if (image->white_level[s] >= (1 << image->bits_per_sample_original)) {
+          image->white_level[s] = (1 << image->bits_per_sample_original) - 1;
         }
+      }
+    }
+  }
 
-        image->data.resize(len);
-        if (!sr.seek_set(data_offset)) {
-          if (err) {
-            (*err) += "Failed to seek to uncompressed image data position.\n";
-          }
-          return false;
-        }
+  return ret ? true : false;
+}
 
-        if (!sr.read(len, len, image->data.data())) {
-          if (err) {
-            (*err) += "Failed to read image data.\n";
-          }
-          return false;
-        }
-      }
-    } else if (image->compression == COMPRESSION_LZW) {  // lzw compression
+bool LoadDNGFromMemory(const char* mem, size_t size,
+                       std::vector<FieldInfo>& custom_fields,
+                       std::vector<DNGImage>* images, std::string* warn,
+                       std::string* err) {
+  return LoadDNGFromMemory(mem, size, LoadOptions(), custom_fields, images,
+                           warn, err);
+}
 
-      if (image->bits_per_sample_original <= 0) {
-        if (err) {
-          (*err) += "bits_per_sample information not found in the tag.\n";
-        }
-        return false;
-      }
+bool LoadDNGInfoFromMemory(const char* mem, size_t size,
+                           std::vector<FieldInfo>& custom_fields,
+                           std::vector<DNGImage>* images, std::string* warn,
+                           std::string* err) {
+  LoadOptions options;
+  options.metadata_only = true;
+  return LoadDNGFromMemory(mem, size, options, custom_fields, images, warn,
+                           err);
+}
 
-      image->bits_per_sample = image->bits_per_sample_original;
-      TINY_DNG_DPRINTF("bps = %d\n", image->bits_per_sample);
-      TINY_DNG_DPRINTF("counts = %d\n", int(image->strip_byte_counts.size()));
-      TINY_DNG_DPRINTF("offsets = %d\n", int(image->strip_offsets.size()));
+bool LoadDNGFromMemory(const char* mem, size_t size,
+                       const LoadOptions& options,
+                       std::vector<FieldInfo>& custom_fields,
+                       std::vector<DNGImage>* images, std::string* warn,
+                       std::string* err) {
+  if ((mem == NULL) || (size < 32) || (!images)) {
+    if (err) {
+      (*err) = "Invalid argument. argument is null or invalid.\n";
+    }
+    return false;
+  }
 
-      image->data.clear();
+  bool is_dng_big_endian = false;
 
-      if ((image->strip_byte_counts.size() > 0) &&
-          (image->strip_byte_counts.size() == image->strip_offsets.size())) {
-#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  const unsigned short magic = *(reinterpret_cast<const unsigned short*>(mem));
 
-        const int num_strips = int(image->strip_byte_counts.size());
+  if (magic == 0x4949) {
+    // might be TIFF(DNG).
+  } else if (magic == 0x4d4d) {
+    // might be TIFF(DNG, bigendian).
+    is_dng_big_endian = true;
+    TINY_DNG_DPRINTF("DNG is big endian\n");
+  } else {
+    std::stringstream ss;
+    ss << "Seems the data is not a DNG format." << std::endl;
+    if (err) {
+      (*err) = ss.str();
+    }
 
-        std::vector<std::thread> workers;
-        std::atomic<size_t> strip_count(0);
+    return false;
+  }
 
-        int num_threads = (std::max)(1, int(std::thread::hardware_concurrency()));
-        if (num_threads > num_strips) {
-          num_threads = num_strips;
-        }
+  const bool swap_endian = (is_dng_big_endian && (!IsBigEndian()));
+  StreamReader sr(reinterpret_cast<const uint8_t*>(mem), size, swap_endian);
 
-        bool failed = false;
+  return LoadDNGFromReader(sr, options, custom_fields, images, warn, err);
+}
 
-        const size_t dst_strip_len = static_cast<size_t>(
-            (image->samples_per_pixel * image->width * image->rows_per_strip *
-             image->bits_per_sample) /
-            8);
+bool LoadDNGFromSource(ByteSource* source, const LoadOptions& options,
+                       std::vector<FieldInfo>& custom_fields,
+                       std::vector<DNGImage>* images, std::string* warn,
+                       std::string* err) {
+  if ((source == NULL) || (source->size() < 32) || (!images)) {
+    if (err) {
+      (*err) = "Invalid argument. argument is null or invalid.\n";
+    }
+    return false;
+  }
 
-        image->data.resize(dst_strip_len * size_t(num_strips));
+  if (source->size() > uint64_t((std::numeric_limits<size_t>::max)())) {
+    if (err) {
+      (*err) = "Data size too large.\n";
+    }
+    return false;
+  }
 
-        for (int t = 0; t < num_threads; t++) {
-          workers.emplace_back(std::thread([&]() {
-            size_t k = 0;
-            while ((k = strip_count++) < size_t(num_strips)) {
-              std::vector<unsigned char> src(image->strip_byte_counts[k]);
-              size_t strip_offset = image->strip_offsets[k];
-              size_t strip_bytesize = image->strip_byte_counts[k];
+  ByteSourceCache cache(source, options.allocator);
 
-              std::vector<unsigned char> dst(dst_strip_len);
+  const uint8_t* magic_addr = cache.map(0, 2);
+  if (!magic_addr) {
+    if (err) {
+      (*err) = "Error reading header.\n";
+    }
+    return false;
+  }
 
-              const uint8_t* src_addr =
-                  sr.map_abs_addr(strip_offset, strip_bytesize);
+  if (((magic_addr[0] != 0x49) || (magic_addr[1] != 0x49)) &&
+      ((magic_addr[0] != 0x4d) || (magic_addr[1] != 0x4d))) {
+    if (err) {
+      (*err) = "Seems the data is not a DNG format.\n";
+    }
+    return false;
+  }
 
-              if (!src_addr) {
-                // TODO(syoyo): Atomic update
-                if (err) {
-                  (*err) +=
-                      "Cannot read strip_byte_counts bytes from a memory.\n";
-                }
-                failed = true;
-                break;
-              }
+  const bool swap_endian = ((magic_addr[0] == 0x4d) && (!IsBigEndian()));
+  StreamReader sr(&cache, swap_endian);
 
-              TINY_DNG_DPRINTF("easyDecode begin\n");
-              int decoded_bytes = lzw::easyDecode(
-                  src_addr, int(strip_bytesize),
-                  int(strip_bytesize) *
-                      image
-                          ->bits_per_sample /* FIXME(syoyo): Is this correct? */
-                  ,
-                  dst.data(), int(dst_strip_len), swap_endian);
-              TINY_DNG_DPRINTF("easyDecode done\n");
-              TINY_DNG_ASSERT(decoded_bytes > 0,
-                              "decoded_ bytes must be non-zero positive.");
-
-              if (image->predictor == 1) {
-                // no prediction shceme
-              } else if (image->predictor == 2) {
-                // horizontal diff
-
-                const size_t stride =
-                    size_t(image->width * image->samples_per_pixel);
-                const size_t spp = size_t(image->samples_per_pixel);
-                for (size_t row = 0; row < size_t(image->rows_per_strip);
-                     row++) {
-                  for (size_t c = 0; c < size_t(image->samples_per_pixel);
-                       c++) {
-                    unsigned int b = dst[row * stride + c];
-                    for (size_t col = 1; col < size_t(image->width); col++) {
-                      // value may overflow(wrap over), but its expected
-                      // behavior.
-                      b += dst[stride * row + spp * col + c];
-                      dst[stride * row + spp * col + c] =
-                          static_cast<unsigned char>(b & 0xFF);
-                    }
-                  }
-                }
+  return LoadDNGFromReader(sr, options, custom_fields, images, warn, err);
+}
 
-              } else if (image->predictor == 3) {
-                // fp horizontal diff.
-                TINY_DNG_ABORT("[TODO] FP horizontal differencing predictor.");
-              } else {
-                TINY_DNG_ABORT("Invalid predictor value.");
-              }
+// Loads a file of `LoadDNGBatch`. Input data is `data` when read ahead,
+// otherwise the file is mapped. Errors thrown by decoders are reported in
+// `result` so that other files are not affected.
+static void LoadBatchFile(const std::vector<uint8_t>& data, bool read_ahead,
+                          const LoadOptions& options,
+                          std::vector<FieldInfo>& custom_fields,
+                          DNGBatchResult* result) {
+#if !defined(TINY_DNG_NO_EXCEPTION)
+  try {
+#endif
+    if (read_ahead) {
+      result->ok = LoadDNGFromMemory(
+          reinterpret_cast<const char*>(data.data()), data.size(), options,
+          custom_fields, &result->images, &result->warn, &result->err);
+    } else {
+      result->ok = LoadDNG(result->filename.c_str(), options, custom_fields,
+                           &result->images, &result->warn, &result->err);
+    }
+#if !defined(TINY_DNG_NO_EXCEPTION)
+  } catch (const std::exception& e) {
+    result->ok = false;
+    result->images.clear();
+    result->err += e.what();
+    result->err += "\n";
+  }
+#endif
+}
 
-              memcpy(&image->data[k * dst_strip_len], dst.data(),
-                     dst_strip_len);
-            }
-          }));
-        }
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
 
-        for (auto& t : workers) {
-          t.join();
-        }
-#else
-        for (size_t k = 0; k < image->strip_byte_counts.size(); k++) {
-          std::vector<unsigned char> src(image->strip_byte_counts[k]);
-          if (!sr.seek_set(image->strip_offsets[k])) {
-            if (err) {
-              (*err) += "Failed to seek to strip offset.\n";
-            }
-            return false;
-          }
+static size_t DecodedBytes(const std::vector<DNGImage>& images) {
+  size_t n = 0;
+  for (size_t i = 0; i < images.size(); i++) {
+    n += images[i].data.size();
+  }
+  return n;
+}
 
-          const uint_64_ dst_len = size_t(image->samples_per_pixel) * size_t(image->width) * size_t(image->rows_per_strip) *
-               size_t(image->bits_per_sample) / 8ull;
-          if (dst_len == 0) {
-            if (err) {
-              (*err) += "Image data size is zero.\n";
-              (*err) += "  samples_per_pixel " + std::to_string(image->samples_per_pixel) + "\n";
-              (*err) += "  width " + std::to_string(image->width) + "\n";
-              (*err) += "  rows_per_strip " + std::to_string(image->rows_per_strip) + "\n";
-              (*err) += "  bits_per_sample " + std::to_string(image->bits_per_sample) + "\n";
-            }
-            return false;
-          }
+// Shared state of `LoadDNGBatch`.
+struct BatchState {
+  struct File {
+    std::vector<uint8_t> data;
+    bool read_ahead;
+    std::string err;  // Error of reading the file.
+    size_t charge;    // Bytes counted in `in_flight_bytes`.
+  };
 
-          if (dst_len > (kMaxImageSizeInMB * 1024ull * 1024ull)) {
-            if (err) {
-              (*err) += "Image data size too large. Exceeds " + std::to_string(kMaxImageSizeInMB) + " MB.\n";
-            }
-            return false;
-          }
-          std::vector<unsigned char> dst(dst_len);
+  std::vector<File> files;
+  std::deque<size_t> ready;  // Files ready to decode.
+  size_t in_flight_bytes;
+  size_t max_in_flight_bytes;
+  bool reader_done;
+  bool stopped;
+
+  std::mutex mutex;
+  std::condition_variable cond;
+
+  std::mutex callback_mutex;  // Serializes user callbacks.
+
+  BatchState()
+      : in_flight_bytes(0),
+        max_in_flight_bytes(0),
+        reader_done(false),
+        stopped(false) {}
+
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+    cond.notify_all();
+  }
+
+  bool Stopped() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stopped;
+  }
 
-          if (!sr.read(image->strip_byte_counts[k], image->strip_byte_counts[k],
-                       src.data())) {
-            if (err) {
-              (*err) += "Cannot read strip_byte_counts bytes from stream.\n";
-            }
-            return false;
-          }
-          TINY_DNG_DPRINTF("easyDecode begin\n");
-          int decoded_bytes = lzw::easyDecode(
-              src.data(), int(image->strip_byte_counts[k]),
-              int(image->strip_byte_counts[k]) *
-                  image->bits_per_sample /* FIXME(syoyo): Is this correct? */,
-              dst.data(), int(dst_len), swap_endian);
-          TINY_DNG_DPRINTF("easyDecode done\n");
-          TINY_DNG_ASSERT(decoded_bytes > 0,
-                          "decoded_ bytes must be non-zero positive.");
-
-          if (image->predictor == 1) {
-            // no prediction shceme
-          } else if (image->predictor == 2) {
-            // horizontal diff
-
-            const size_t stride =
-                size_t(image->width * image->samples_per_pixel);
-            const size_t spp = size_t(image->samples_per_pixel);
-            for (size_t row = 0; row < size_t(image->rows_per_strip); row++) {
-              for (size_t c = 0; c < size_t(image->samples_per_pixel); c++) {
-                unsigned int b = dst[row * stride + c];
-                for (size_t col = 1; col < size_t(image->width); col++) {
-                  // value may overflow(wrap over), but its expected behavior.
-                  b += dst[stride * row + spp * col + c];
-                  dst[stride * row + spp * col + c] =
-                      static_cast<unsigned char>(b & 0xFF);
-                }
-              }
-            }
+  // Adds `n` bytes to the in-flight memory.
+  void Charge(File* file, const size_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    in_flight_bytes += n;
+    file->charge += n;
+  }
 
-          } else if (image->predictor == 3) {
-            // fp horizontal diff.
-            TINY_DNG_ABORT("[TODO] FP horizontal differencing predictor.");
-          } else {
-            TINY_DNG_ABORT("Invalid predictor value.");
-          }
+  // Removes the in-flight memory of `file`.
+  void Discharge(File* file) {
+    std::lock_guard<std::mutex> lock(mutex);
+    in_flight_bytes -= file->charge;
+    file->charge = 0;
+    cond.notify_all();
+  }
+};
 
-          std::copy(dst.begin(), dst.end(), std::back_inserter(image->data));
-        }
+// Reads files ahead in order, waiting while the in-flight memory exceeds the
+// limit.
+static void BatchReaderLoop(const std::vector<std::string>& filenames,
+                            BatchState* state) {
+  for (size_t i = 0; i < filenames.size(); i++) {
+    BatchState::File& file = state->files[i];
 
-#endif
-      } else {
-        TINY_DNG_ABORT("Unsupported image strip configuration.");
-      }
-    } else if (image->compression ==
-               COMPRESSION_OLD_JPEG) {  // old jpeg compression
+    FileByteSource source;
+    const bool opened = source.open(filenames[i].c_str(), &file.err);
+    const uint64_t size = opened ? source.size() : 0;
 
-      // std::cout << "IFD " << i << std::endl;
+    // A file larger than the limit is mapped, and takes all of the limit so
+    // that it is decoded alone.
+    const uint64_t limit = state->max_in_flight_bytes;
+    file.read_ahead = opened && ((limit == 0) || (size <= limit));
+    const size_t charge =
+        size_t((limit > 0) ? (std::min)(size, limit) : size);
 
-      // First check if JPEG is lossless JPEG
-      // TODO(syoyo): Compure conservative data_len.
-      if (sr.size() < data_offset) {
-        if (err) {
-          (*err) += "Unexpected data offset.\n";
-        }
-        return false;
+    {
+      std::unique_lock<std::mutex> lock(state->mutex);
+      state->cond.wait(lock, [&]() {
+        return state->stopped || (state->in_flight_bytes == 0) ||
+               (limit == 0) ||
+               (state->in_flight_bytes + charge <= size_t(limit));
+      });
+      if (state->stopped) {
+        break;
       }
-      size_t data_len = sr.size() - data_offset;
-      int lj_width = -1, lj_height = -1, lj_bits = -1, lj_components = -1;
-      if (IsLosslessJPEG(sr.data() + data_offset, static_cast<int>(data_len),
-                         &lj_width, &lj_height, &lj_bits, &lj_components)) {
-        // std::cout << "IFD " << i << " is LJPEG" << std::endl;
-        TINY_DNG_DPRINTF("IFD[%d] is LJPEG\n", int(i));
+      state->in_flight_bytes += charge;
+      file.charge = charge;
+    }
 
-        TINY_DNG_ASSERT(
-            lj_width > 0 && lj_height > 0 && lj_bits > 0 && lj_components > 0,
-            "Image dimensions must be > 0.");
+    if (file.read_ahead) {
+      file.data.resize(size_t(size));
+      if ((size > 0) && !source.read_at(0, size_t(size), file.data.data())) {
+        file.err += "Failed to read file.\n";
+        std::vector<uint8_t>().swap(file.data);
+      }
+    }
 
-        // Assume not in tiled format.
-        TINY_DNG_ASSERT(image->tile_width == -1 && image->tile_length == -1,
-                        "Tiled format not supported tile size.");
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->ready.push_back(i);
+    state->cond.notify_all();
+  }
 
-        image->height = lj_height;
+  std::lock_guard<std::mutex> lock(state->mutex);
+  state->reader_done = true;
+  state->cond.notify_all();
+}
 
-        // Is Canon CR2?
-        const bool is_cr2 = (image->cr2_slices[0] != 0) ? true : false;
+#endif
 
-        if (is_cr2) {
-          // For CR2 RAW, slices[0] * slices[1] + slices[2] = image width
-          image->width = image->cr2_slices[0] * image->cr2_slices[1] +
-                         image->cr2_slices[2];
-        } else {
-          image->width = lj_width;
-        }
+bool LoadDNGBatch(const std::vector<std::string>& filenames,
+                  const LoadOptions& options,
+                  std::vector<FieldInfo>& custom_fields,
+                  size_t max_in_flight_bytes, DNGBatchCallback callback,
+                  void* user_data, std::string* err) {
+  if (!callback) {
+    if (err) {
+      (*err) += "Invalid argument. callback is null.\n";
+    }
+    return false;
+  }
 
-        image->bits_per_sample_original = lj_bits;
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  ThreadPool* pool =
+      options.thread_pool ? options.thread_pool : ThreadPool::GetDefault();
+
+  BatchState state;
+  state.files.resize(filenames.size());
+  state.max_in_flight_bytes = max_in_flight_bytes;
+
+  std::thread reader(BatchReaderLoop, std::cref(filenames), &state);
+
+  // Decoder threads take files until no file is left. They are not pool
+  // tasks: a pool thread waiting for a nested `parallel_for` may run any
+  // queued task, and a decoder waiting for the reader there could block the
+  // file which holds the in-flight memory.
+  const int num_threads = (std::max)(1, pool->num_threads());
+  const size_t num_decoders =
+      (std::max)(size_t(1), (std::min)(filenames.size(), size_t(num_threads)));
+
+  // Strips/tiles and images of a file are decoded in parallel as in `LoadDNG`
+  // with the threads left to the decoders: a decoder runs `parallel_for` as
+  // the calling thread, so `num_decoders` plus the workers of the pool must
+  // not exceed `num_threads`.
+  std::unique_ptr<ThreadPool> decode_pool;
+  LoadOptions decode_options = options;
+  if (num_decoders > 1) {
+    decode_pool.reset(new ThreadPool(num_threads - int(num_decoders) + 1));
+    decode_options.thread_pool = decode_pool.get();
+  } else {
+    decode_options.thread_pool = pool;
+  }
 
-        // lj92 decodes data into 16bits, so modify bps.
-        image->bits_per_sample = 16;
-
-        TINY_DNG_ASSERT(
-            ((image->width * image->height * image->bits_per_sample) % 8) == 0,
-            "Image size must be multiple of 8.");
-        const size_t len =
-            static_cast<size_t>((image->samples_per_pixel * image->width *
-                                 image->height * image->bits_per_sample) /
-                                8);
-        // std::cout << "spp = " << image->samples_per_pixel;
-        // std::cout << ", w = " << image->width << ", h = " << image->height <<
-        // ", bps = " << image->bits_per_sample << std::endl;
-        TINY_DNG_ASSERT(len > 0, "Invalid length.");
-        image->data.resize(len);
+  std::exception_ptr exception;
 
-        if (sr.size() < data_offset) {
-          if (err) {
-            (*err) += "Unexpected file size or data offset.\n";
+  auto decode_files = [&]() {
+#if !defined(TINY_DNG_NO_EXCEPTION)
+    try {
+#endif
+      for (;;) {
+        size_t i = 0;
+        {
+          std::unique_lock<std::mutex> lock(state.mutex);
+          state.cond.wait(lock, [&]() {
+            return state.stopped || !state.ready.empty() || state.reader_done;
+          });
+          if (state.stopped || state.ready.empty()) {
+            break;
           }
-          return false;
+          i = state.ready.front();
+          state.ready.pop_front();
         }
 
-        std::vector<unsigned short> buf;
-        buf.resize(static_cast<size_t>(image->width * image->height *
-                                       image->samples_per_pixel));
+        BatchState::File& file = state.files[i];
 
-        bool ok = DecompressLosslessJPEG(sr, &buf.at(0), image->width, (*image),
-                                         NULL, err);
-        if (!ok) {
-          if (err) {
-            std::stringstream ss;
-            ss << "Failed to decompress LJPEG." << std::endl;
-            (*err) = ss.str();
-          }
-          return false;
+        DNGBatchResult result;
+        result.index = i;
+        result.filename = filenames[i];
+        if (!file.err.empty()) {
+          result.err = file.err;
+        } else {
+          LoadBatchFile(file.data, file.read_ahead, decode_options,
+                        custom_fields, &result);
         }
 
-        if (is_cr2) {
-          // CR2 stores image in tiled format(image slices. left to right).
-          // Convert it to scanline format.
-          int nslices = image->cr2_slices[0];
-          int slice_width = image->cr2_slices[1];
-          int slice_remainder_width = image->cr2_slices[2];
-          size_t src_offset = 0;
-
-          unsigned short* dst_ptr =
-              reinterpret_cast<unsigned short*>(image->data.data());
-
-          for (int slice = 0; slice < nslices; slice++) {
-            int x_offset = slice * slice_width;
-            for (int y = 0; y < image->height; y++) {
-              size_t dst_offset =
-                  static_cast<size_t>(y * image->width + x_offset);
-              memcpy(&dst_ptr[dst_offset], &buf[src_offset],
-                     sizeof(unsigned short) * static_cast<size_t>(slice_width));
-              src_offset += static_cast<size_t>(slice_width);
-            }
-          }
+        // Input data is no longer needed. Decoded pixels count until the
+        // callback returns.
+        std::vector<uint8_t>().swap(file.data);
+        state.Discharge(&file);
+        state.Charge(&file, DecodedBytes(result.images));
 
-          // remainder(the last slice).
-          {
-            int x_offset = nslices * slice_width;
-            for (int y = 0; y < image->height; y++) {
-              size_t dst_offset =
-                  static_cast<size_t>(y * image->width + x_offset);
-              // std::cout << "y = " << y << ", dst = " << dst_offset << ", src
-              // = " << src_offset << ", len = " << buf.size() << std::endl;
-              memcpy(&dst_ptr[dst_offset], &buf[src_offset],
-                     sizeof(unsigned short) *
-                         static_cast<size_t>(slice_remainder_width));
-              src_offset += static_cast<size_t>(slice_remainder_width);
-            }
+        // Files finished after the batch was stopped are not delivered.
+        bool keep_going = false;
+        {
+          std::lock_guard<std::mutex> lock(state.callback_mutex);
+          if (!state.Stopped()) {
+            keep_going = callback(&result, user_data);
           }
+        }
 
-        } else {
-          memcpy(image->data.data(), static_cast<void*>(&(buf.at(0))), len);
+        state.Discharge(&file);
+        if (!keep_going) {
+          state.Stop();
         }
+      }
+#if !defined(TINY_DNG_NO_EXCEPTION)
+    } catch (...) {
+      // e.g. exception thrown by the callback.
+      {
+        std::lock_guard<std::mutex> lock(state.callback_mutex);
+        if (!exception) {
+          exception = std::current_exception();
+        }
+      }
+      state.Stop();
+    }
+#endif
+  };
 
-      } else {
-        // Baseline 8bit JPEG
+  std::vector<std::thread> decoders;
+  for (size_t t = 1; t < num_decoders; t++) {
+    decoders.emplace_back(decode_files);
+  }
+  decode_files();
 
-        image->bits_per_sample_original = 8;
-        image->bits_per_sample = 8;
+  for (size_t t = 0; t < decoders.size(); t++) {
+    decoders[t].join();
+  }
+  reader.join();
 
-        size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
-        if (image->jpeg_byte_count == -1) {
-          // No jpeg datalen. Set to the size of file - offset.
-          if (sr.size() < data_offset) {
-            if (err) {
-              (*err) += "Unexpected file size or data offset.\n";
-            }
-            return false;
-          }
-          jpeg_len = sr.size() - data_offset;
-        }
+#if !defined(TINY_DNG_NO_EXCEPTION)
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
+#endif
 
-        if (jpeg_len == 0) {
-          if (err) {
-            (*err) += "Invalid jpeg data length.\n";
-          }
-          return false;
-        }
+  if (state.stopped) {
+    if (err) {
+      (*err) += "Batch loading was stopped by the callback.\n";
+    }
+    return false;
+  }
+  return true;
+#else
+  (void)max_in_flight_bytes;
+
+  // Files are loaded one by one from a memory mapping.
+  for (size_t i = 0; i < filenames.size(); i++) {
+    DNGBatchResult result;
+    result.index = i;
+    result.filename = filenames[i];
+    LoadBatchFile(std::vector<uint8_t>(), /* read_ahead */ false, options,
+                  custom_fields, &result);
+    if (!callback(&result, user_data)) {
+      if (err) {
+        (*err) += "Batch loading was stopped by the callback.\n";
+      }
+      return false;
+    }
+  }
+  return true;
+#endif
+}
 
-        // Assume RGB jpeg
-        //
-        // First check the header.
-        int w_info = 0, h_info = 0, components_info = 0;
-        int is_jpeg = stbi_info_from_memory(sr.data() + data_offset,
-                                            static_cast<int>(jpeg_len), &w_info,
-                                            &h_info, &components_info);
-        if (is_jpeg != 1) {
-          if (err) {
-            (*err) += "Not a JPEG data.\n";
-          }
-          return false;
-        }
+bool DecodeRegion(const char* filename, const DNGImage& image, int x, int y,
+                  int w, int h, std::vector<unsigned char>* out,
+                  std::string* err) {
+  return DecodeRegion(filename, LoadOptions(), image, x, y, w, h, out, err);
+}
 
-        if ((components_info != 1) && (components_info != 3)) {
-          if (err) {
-            (*err) += "Unsupported channels in JPEG data.\n";
-          }
-          return false;
-        }
+bool DecodeRegion(const char* filename, const LoadOptions& options,
+                  const DNGImage& image, int x, int y, int w, int h,
+                  std::vector<unsigned char>* out, std::string* err) {
+  MappedFile file;
+  if (!file.open(filename, err)) {
+    return false;
+  }
 
-        if ((w_info < 1) || (h_info < 1)) {
-          if (err) {
-            (*err) += "Invalid JPEG image resolution.\n";
-          }
-          return false;
-        }
+  return DecodeRegionFromMemory(reinterpret_cast<const char*>(file.data()),
+                                file.size(), options, image, x, y, w, h, out,
+                                err);
+}
 
-        int w = 0, h = 0, components = 0;
+bool DecodeRegionFromMemory(const char* mem, size_t size,
+                            const DNGImage& image, int x, int y, int w, int h,
+                            std::vector<unsigned char>* out, std::string* err) {
+  return DecodeRegionFromMemory(mem, size, LoadOptions(), image, x, y, w, h,
+                                out, err);
+}
 
-        // Check if data is in valid range.
-        if ((sr.tell() + data_offset + static_cast<uint32_t>(jpeg_len)) >= sr.size()) {
-          if (err) {
-            (*err) += "Invalid JPEG image data size.\n";
-          }
-          return false;
-        }
+bool DecodeRegionFromMemory(const char* mem, size_t size,
+                            const LoadOptions& options, const DNGImage& image,
+                            int x, int y, int w, int h,
+                            std::vector<unsigned char>* out, std::string* err) {
+  if ((mem == NULL) || (size < 32) || (!out)) {
+    if (err) {
+      (*err) += "Invalid argument. argument is null or invalid.\n";
+    }
+    return false;
+  }
 
-        unsigned char* decoded_image = stbi_load_from_memory(
-            sr.data() + data_offset, static_cast<uint32_t>(jpeg_len), &w, &h,
-            &components, /* desired_channels */ components_info);
-        TINY_DNG_ASSERT(decoded_image, "Could not decode JPEG image.");
+  const unsigned short magic = *(reinterpret_cast<const unsigned short*>(mem));
+  if ((magic != 0x4949) && (magic != 0x4d4d)) {
+    if (err) {
+      (*err) += "Seems the data is not a DNG format.\n";
+    }
+    return false;
+  }
 
-        // Currently we just discard JPEG image(since JPEG image would be just a
-        // thumbnail or LDR image of RAW).
-        // TODO(syoyo): Do not discard JPEG image.
-        free(decoded_image);
+  const bool swap_endian = ((magic == 0x4d4d) && (!IsBigEndian()));
+  StreamReader sr(reinterpret_cast<const uint8_t*>(mem), size, swap_endian);
 
-        // std::cout << "w = " << w << std::endl;
-        // std::cout << "h = " << w << std::endl;
-        // std::cout << "c = " << components << std::endl;
+  DecodeResources res;
+  res.pool =
+      options.thread_pool ? options.thread_pool : ThreadPool::GetDefault();
 
-        TINY_DNG_ASSERT(w > 0 && h > 0, "Image dimensions must be > 0.");
+  DecoderContext local_context(options.allocator);
+  res.context =
+      options.decoder_context ? options.decoder_context : &local_context;
+  res.allocator = options.allocator;
+  res.host_byte_order = options.host_byte_order;
 
-        image->width = w;
-        image->height = h;
-      }
+  return DecodeImageRegion(sr, swap_endian, image,
+                           MakeImageWindow(x, y, w, h), out, res, err);
+}
 
-    } else if (image->compression ==
-               COMPRESSION_NEW_JPEG) {  //  new JPEG(baseline DCT JPEG or
-                                        //  lossless JPEG)
+bool DecodeRegionFromSource(ByteSource* source, const LoadOptions& options,
+                            const DNGImage& image, int x, int y, int w, int h,
+                            std::vector<unsigned char>* out, std::string* err) {
+  if ((source == NULL) || (source->size() < 32) || (!out)) {
+    if (err) {
+      (*err) += "Invalid argument. argument is null or invalid.\n";
+    }
+    return false;
+  }
 
-      bool decoded = false;
+  if (source->size() > uint64_t((std::numeric_limits<size_t>::max)())) {
+    if (err) {
+      (*err) += "Data size too large.\n";
+    }
+    return false;
+  }
 
-      if (image->bits_per_sample_original == 8) {
-        // bps TAG exists. probably ordinal JPEG
+  ByteSourceCache cache(source, options.allocator);
 
-        size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
-        if (image->jpeg_byte_count == -1) {
-          // No jpeg datalen. Set to the size of file - offset.
-          if (sr.size() < data_offset) {
-            if (err) {
-              (*err) += "Unexpected file size or data offset.\n";
-            }
-            return false;
-          }
-          jpeg_len = sr.size() - data_offset;
-        }
+  const uint8_t* magic_addr = cache.map(0, 2);
+  if (!magic_addr) {
+    if (err) {
+      (*err) += "Error reading header.\n";
+    }
+    return false;
+  }
 
-        int w_info = 0, h_info = 0, components_info = 0;
-        int is_jpeg = stbi_info_from_memory(sr.data() + data_offset,
-                                            static_cast<int>(jpeg_len), &w_info,
-                                            &h_info, &components_info);
+  if (((magic_addr[0] != 0x49) || (magic_addr[1] != 0x49)) &&
+      ((magic_addr[0] != 0x4d) || (magic_addr[1] != 0x4d))) {
+    if (err) {
+      (*err) += "Seems the data is not a DNG format.\n";
+    }
+    return false;
+  }
 
-        if (is_jpeg != 1) {
-          // Try to decode image as lossless JPEG.
-        } else {
-          int w = 0, h = 0, components = 0;
-          unsigned char* decoded_image = stbi_load_from_memory(
-              sr.data() + data_offset, static_cast<int>(jpeg_len), &w, &h,
-              &components, /* desired_channels */ components_info);
+  const bool swap_endian = ((magic_addr[0] == 0x4d) && (!IsBigEndian()));
+  StreamReader sr(&cache, swap_endian);
 
-          if (!decoded_image) {
-            // Try to decode image as lossless JPEG.
-          } else {
-            decoded = true;
-
-            image->width = w;
-            image->height = h;
-            image->samples_per_pixel = components;
-
-            const uint64_t len = uint64_t(image->samples_per_pixel) * uint64_t(image->width) * uint64_t(image->height) * uint64_t(image->bits_per_sample / 8);
-            // For 32bit
-            if (sizeof(void *) == 4) {
-              // Use 2GB as a max
-              if (len > (std::numeric_limits<int32_t>::max)()) {
-                if (err) {
-                  (*err) += "Decoded image size exceeds 2GB.\n";
-                }
-                return false;
-              }
-            }
+  DecodeResources res;
+  res.pool =
+      options.thread_pool ? options.thread_pool : ThreadPool::GetDefault();
 
-            image->data.resize(len);
+  DecoderContext local_context(options.allocator);
+  res.context =
+      options.decoder_context ? options.decoder_context : &local_context;
+  res.allocator = options.allocator;
+  res.host_byte_order = options.host_byte_order;
 
-            memcpy(image->data.data(), decoded_image, len);
+  return DecodeImageRegion(sr, swap_endian, image,
+                           MakeImageWindow(x, y, w, h), out, res, err);
+}
 
-            free(decoded_image);
-          }
-        }
-      }
+struct TiledImageReader::Impl {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  mutable std::mutex mutex;  // Guards the cache.
+#endif
+  MappedFile file;
+  bool swap_endian;
+  Options options;
+  DecoderContext context;
+  std::vector<DNGImage> images;
+
+  // LRU cache. `lru` is ordered from the most recently used tile. A key is
+  // (image index, tile index).
+  typedef std::pair<size_t, size_t> Key;
+  typedef std::list<Key> LRUList;
+  struct Entry {
+    std::shared_ptr<const Tile> tile;
+    LRUList::iterator lru_it;
+  };
+  std::map<Key, Entry> cache;
+  LRUList lru;
+  size_t cached_bytes;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+
+  Impl()
+      : swap_endian(false),
+        cached_bytes(0),
+        hits(0),
+        misses(0),
+        evictions(0) {}
+
+  // Evict least recently used tiles until the cache fits into the budget.
+  // Requires the lock.
+  void evict() {
+    while ((cached_bytes > options.cache_budget) && !lru.empty()) {
+      std::map<Key, Entry>::iterator it = cache.find(lru.back());
+      cached_bytes -= it->second.tile->data.size();
+      cache.erase(it);
+      lru.pop_back();
+      evictions++;
+    }
+  }
+};
 
-      if (!decoded) {
-        // Try to decode as lossless JPEG.
+TiledImageReader::TiledImageReader() : impl_(new Impl()) {}
 
-        // lj92 decodes data into 16bits, so modify bps.
-        image->bits_per_sample = 16;
+TiledImageReader::~TiledImageReader() { delete impl_; }
 
-        // std::cout << "w = " << image->width << ", h = " << image->height <<
-        // std::endl;
+bool TiledImageReader::open(const char* filename, const Options& options,
+                            std::string* warn, std::string* err) {
+  close();
 
-        TINY_DNG_DPRINTF("image.width = %d\n", image->width);
-        TINY_DNG_DPRINTF("image.height = %d\n", image->height);
-        TINY_DNG_DPRINTF("image.bps = %d\n", image->bits_per_sample);
-        TINY_DNG_DPRINTF("image.spp = %d\n", image->samples_per_pixel);
+  if (!impl_->file.open(filename, err)) {
+    return false;
+  }
 
-        TINY_DNG_ASSERT(
-            ((image->width * image->height * image->bits_per_sample) % 8) == 0,
-            "Image must be multiple of 8.");
-        const uint64_t len = uint64_t(image->samples_per_pixel) * uint64_t(image->width) * uint64_t(image->height) * uint64_t(image->bits_per_sample / 8);
-        // For 32bit
-        if (sizeof(void *) == 4) {
-          // Use 2GB as a max
-          if (len > (std::numeric_limits<int32_t>::max)()) {
-            if (err) {
-              (*err) += "Decoded image size exceeds 2GB.\n";
-            }
-            return false;
-          }
-        }
+  const char* mem = reinterpret_cast<const char*>(impl_->file.data());
+  std::vector<FieldInfo> custom_fields;
+  if (!LoadDNGInfoFromMemory(mem, impl_->file.size(), custom_fields,
+                             &impl_->images, warn, err)) {
+    close();
+    return false;
+  }
 
-        if (len == 0) {
-          if (err) {
-            (*err) += "Invalid jpeg data length.\n";
-          }
-          return false;
-        }
-        TINY_DNG_DPRINTF("image.data.size = %lld\n", len);
+  impl_->swap_endian =
+      (*(reinterpret_cast<const unsigned short*>(mem)) == 0x4d4d) &&
+      (!IsBigEndian());
+  impl_->options = options;
+  if (impl_->options.virtual_tile_size <= 0) {
+    impl_->options.virtual_tile_size = Options().virtual_tile_size;
+  }
 
-        image->data.resize(len);
-        TINY_DNG_DPRINTF("image.data.size = %d\n", int(len));
+  return true;
+}
 
-        if (sr.size() < data_offset) {
-          if (err) {
-            (*err) += "Unexpected file size or data offset.\n";
-          }
-          return false;
-        }
+void TiledImageReader::close() {
+  impl_->cache.clear();
+  impl_->lru.clear();
+  impl_->cached_bytes = 0;
+  impl_->images.clear();
+  impl_->file.close();
+}
 
-        if (!sr.seek_set(data_offset)) {
-          if (err) {
-            (*err) += "Failed to seek to data offset(NewJpeg).\n";
-          }
-          return false;
-        }
+const std::vector<DNGImage>& TiledImageReader::images() const {
+  return impl_->images;
+}
 
-        int lj_bits = 0;
+bool TiledImageReader::tile_layout(size_t image_index, int* tile_width,
+                                   int* tile_height, int* tiles_across,
+                                   int* tiles_down) const {
+  if (image_index >= impl_->images.size()) {
+    return false;
+  }
 
-        bool ok = DecompressLosslessJPEG(
-            sr, reinterpret_cast<unsigned short*>(&(image->data.at(0))),
-            image->width, (*image), &lj_bits, err);
-        if (!ok) {
-          if (err) {
-            std::stringstream ss;
-            ss << "Failed to decompress LJPEG." << std::endl;
-            (*err) = ss.str();
-          }
-          return false;
-        }
+  const DNGImage& image = impl_->images[image_index];
+  if ((image.width <= 0) || (image.height <= 0)) {
+    return false;
+  }
 
-        if (image->bits_per_sample_original <= 0) {
-          image->bits_per_sample_original = lj_bits;
-        }
-      }
+  int tw = image.width;
+  int th = (std::min)(impl_->options.virtual_tile_size, image.height);
+  if ((image.tile_width > 0) && (image.tile_length > 0)) {
+    tw = image.tile_width;
+    th = image.tile_length;
+  } else if (image.compression == COMPRESSION_LZW) {
+    // A LZW strip is decoded as a whole, so a virtual tile covers whole
+    // strips to decode each strip once.
+    const int rows_per_strip =
+        ((image.rows_per_strip > 0) && (image.rows_per_strip < image.height))
+            ? image.rows_per_strip
+            : image.height;
+    th = ((th + rows_per_strip - 1) / rows_per_strip) * rows_per_strip;
+  }
 
-    } else if (image->compression == COMPRESSION_ZIP) {  // ZIP
-#ifdef TINY_DNG_LOADER_ENABLE_ZIP
-      TINY_DNG_ASSERT(image->bits_per_sample_original > 0,
-                      "bits_per_sample information not found in the tag.");
-      image->bits_per_sample = image->bits_per_sample_original;
-      TINY_DNG_DPRINTF("bps = %d\n", image->bits_per_sample);
-      TINY_DNG_DPRINTF("data_offset = %d\n", int(data_offset));
+  if (tile_width) (*tile_width) = tw;
+  if (tile_height) (*tile_height) = th;
+  if (tiles_across) (*tiles_across) = (image.width + tw - 1) / tw;
+  if (tiles_down) (*tiles_down) = (image.height + th - 1) / th;
 
-      TINY_DNG_DPRINTF("width %d\n", image->width);
-      TINY_DNG_DPRINTF("height %d\n", image->height);
-      TINY_DNG_DPRINTF("samples_per_pixel %d\n", image->samples_per_pixel);
-      TINY_DNG_DPRINTF("bits_per_sample %d\n", image->bits_per_sample);
+  return true;
+}
 
-      const size_t len =
-          static_cast<size_t>((image->samples_per_pixel * image->width *
-                               image->height * image->bits_per_sample) /
-                              8);
-      if (len == 0) {
-        if (err) {
-          (*err) += "Invalid length. in ZIP compressed data.\n";
-        }
-        return false;
-      }
+std::shared_ptr<const TiledImageReader::Tile> TiledImageReader::tile(
+    size_t image_index, int tx, int ty, std::string* err) {
+  int tw = 0, th = 0, across = 0, down = 0;
+  if (!tile_layout(image_index, &tw, &th, &across, &down)) {
+    if (err) {
+      (*err) += "Invalid image index or image dimensions.\n";
+    }
+    return std::shared_ptr<const Tile>();
+  }
+
+  if ((tx < 0) || (ty < 0) || (tx >= across) || (ty >= down)) {
+    if (err) {
+      (*err) += "Tile index out of range.\n";
+    }
+    return std::shared_ptr<const Tile>();
+  }
+
+  const Impl::Key key(image_index, size_t(ty) * size_t(across) + size_t(tx));
+
+  {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+#endif
+    std::map<Impl::Key, Impl::Entry>::iterator it = impl_->cache.find(key);
+    if (it != impl_->cache.end()) {
+      impl_->lru.splice(impl_->lru.begin(), impl_->lru, it->second.lru_it);
+      impl_->hits++;
+      return it->second.tile;
+    }
+    impl_->misses++;
+  }
+
+  // Decode without holding the lock so that other tiles can be fetched in
+  // the meantime. Concurrent misses of the same tile may decode it twice;
+  // the first decoded tile is kept.
+  const DNGImage& image = impl_->images[image_index];
+  std::shared_ptr<Tile> decoded(new Tile());
+  decoded->x = tx * tw;
+  decoded->y = ty * th;
+  decoded->width = (std::min)(tw, image.width - decoded->x);
+  decoded->height = (std::min)(th, image.height - decoded->y);
+  decoded->samples_per_pixel = image.samples_per_pixel;
+  decoded->bits_per_sample = (image.compression == COMPRESSION_NEW_JPEG)
+                                 ? 16
+                                 : image.bits_per_sample_original;
+
+  StreamReader sr(impl_->file.data(), impl_->file.size(), impl_->swap_endian);
+
+  DecodeResources res;
+  res.pool = impl_->options.thread_pool ? impl_->options.thread_pool
+                                        : ThreadPool::GetDefault();
+  res.context = impl_->options.decoder_context
+                    ? impl_->options.decoder_context
+                    : &impl_->context;
+  res.host_byte_order = impl_->options.host_byte_order;
+
+  if (!DecodeImageRegion(sr, impl_->swap_endian, image,
+                         MakeImageWindow(decoded->x, decoded->y,
+                                         decoded->width, decoded->height),
+                         &decoded->data, res, err)) {
+    return std::shared_ptr<const Tile>();
+  }
 
-      image->data.resize(len);
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+#endif
+  std::map<Impl::Key, Impl::Entry>::iterator it = impl_->cache.find(key);
+  if (it != impl_->cache.end()) {
+    return it->second.tile;
+  }
+
+  Impl::Entry& entry = impl_->cache[key];
+  entry.tile = decoded;
+  impl_->lru.push_front(key);
+  entry.lru_it = impl_->lru.begin();
+  impl_->cached_bytes += decoded->data.size();
+  impl_->evict();
+
+  return decoded;
+}
+
+bool TiledImageReader::read_region(size_t image_index, int x, int y, int w,
+                                   int h, std::vector<unsigned char>* out,
+                                   std::string* err) {
+  int tw = 0, th = 0;
+  if (!out || !tile_layout(image_index, &tw, &th, NULL, NULL)) {
+    if (err) {
+      (*err) += "Invalid argument.\n";
+    }
+    return false;
+  }
+
+  const DNGImage& image = impl_->images[image_index];
+  if ((x < 0) || (y < 0) || (w <= 0) || (h <= 0) || (w > image.width - x) ||
+      (h > image.height - y)) {
+    if (err) {
+      (*err) += "Region is outside of the image.\n";
+    }
+    return false;
+  }
 
-      if (sr.size() < data_offset) {
-        if (err) {
-          (*err) +=
-              "Unexpected file size or data offset in ZIP compressed data.\n";
-        }
+  size_t pixel_bytes = 0;
+  for (int ty = y / th; ty <= (y + h - 1) / th; ty++) {
+    for (int tx = x / tw; tx <= (x + w - 1) / tw; tx++) {
+      std::shared_ptr<const Tile> t = tile(image_index, tx, ty, err);
+      if (!t) {
         return false;
       }
 
-      if (!sr.seek_set(data_offset)) {
-        if (err) {
-          (*err) += "Failed to seek to data offset(ZIP).\n";
-        }
-        return false;
+      if (pixel_bytes == 0) {
+        pixel_bytes =
+            t->data.size() / (size_t(t->width) * size_t(t->height));
+        out->resize(pixel_bytes * size_t(w) * size_t(h));
       }
 
-      bool ok = DecompressZIPedTile(sr, &(image->data.at(0)), image->width,
-                                    (*image), err);
-      if (!ok) {
-        if (err) {
-          std::stringstream ss;
-          ss << "Failed to decompress ZIP." << std::endl;
-          (*err) += ss.str();
-        }
-        return false;
-      }
-#else
-      if (err) {
-        std::stringstream ss;
-        ss << "ZIP compression is not supported." << std::endl;
-        (*err) = ss.str();
+      const int x0 = (std::max)(x, t->x);
+      const int y0 = (std::max)(y, t->y);
+      const int x1 = (std::min)(x + w, t->x + t->width);
+      const int y1 = (std::min)(y + h, t->y + t->height);
+      for (int yy = y0; yy < y1; yy++) {
+        memcpy(out->data() + pixel_bytes * (size_t(yy - y) * size_t(w) +
+                                            size_t(x0 - x)),
+               t->data.data() + pixel_bytes * (size_t(yy - t->y) *
+                                                   size_t(t->width) +
+                                               size_t(x0 - t->x)),
+               pixel_bytes * size_t(x1 - x0));
       }
+    }
+  }
+
+  return true;
+}
+
+void TiledImageReader::set_cache_budget(size_t bytes) {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::lock_guard<std::mutex> lock(impl_->mutex);
 #endif
-    } else if (image->compression == COMPRESSION_LOSSY) {  // lossy JPEG
+  impl_->options.cache_budget = bytes;
+  impl_->evict();
+}
 
-      // TOOD: Check bps and photometric_interpretation.
+TiledImageReader::Stats TiledImageReader::stats() const {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+#endif
+  Stats st;
+  st.hits = impl_->hits;
+  st.misses = impl_->misses;
+  st.evictions = impl_->evictions;
+  st.cached_tiles = impl_->cache.size();
+  st.cached_bytes = impl_->cached_bytes;
+  return st;
+}
 
-      size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
-      if (image->jpeg_byte_count == -1) {
-        // No jpeg datalen. Set to the size of file - offset.
-        if (sr.size() < data_offset) {
-          if (err) {
-            (*err) += "Unexpected file size or data offset.\n";
-          }
-          return false;
-        }
-        jpeg_len = sr.size() - data_offset;
-      }
+namespace {
 
-      int w_info = 0, h_info = 0, components_info = 0;
-      int is_jpeg = stbi_info_from_memory(sr.data() + data_offset,
-                                          static_cast<int>(jpeg_len), &w_info,
-                                          &h_info, &components_info);
+// Max bytes read from the beginning of a file when sniffing its type.
+// Large enough to contain the header and IFD0 of usual DNG files.
+const size_t kSniffPrefixSize = 4096;
 
-      if (is_jpeg != 1) {
-        if (err) {
-          (*err) +=
-              "Currently We only supports Standard JPEG data for Lossy "
-              "compression(34892).\n";
-        }
-        return false;
-      }
+// Max number of IFD0 entries examined when sniffing.
+const uint64_t kSniffMaxIFDEntries = 4096;
 
-      if ((components_info != 1) && (components_info != 3)) {
-        if (err) {
-          (*err) += "Unsupported channels in JPEG data.\n";
-        }
-        return false;
-      }
+static inline uint16_t SniffRead2(const uint8_t* p, bool swap_endian) {
+  unsigned short val;
+  cpy2(&val, reinterpret_cast<const unsigned short*>(p));
+  if (swap_endian) swap2(&val);
+  return val;
+}
 
-      if ((w_info < 1) || (h_info < 1)) {
-        if (err) {
-          (*err) += "Invalid JPEG image resolution.\n";
-        }
-        return false;
-      }
+static inline uint32_t SniffRead4(const uint8_t* p, bool swap_endian) {
+  unsigned int val;
+  cpy4(&val, reinterpret_cast<const unsigned int*>(p));
+  if (swap_endian) swap4(&val);
+  return val;
+}
 
-      int w = 0, h = 0, components = 0;
-      unsigned char* decoded_image = stbi_load_from_memory(
-          sr.data() + data_offset, static_cast<int>(jpeg_len), &w, &h,
-          &components, /* desired_channels */ components_info);
+static inline uint64_t SniffRead8(const uint8_t* p, bool swap_endian) {
+  uint64_t val;
+  cpy8(&val, reinterpret_cast<const uint64_t*>(p));
+  if (swap_endian) swap8(&val);
+  return val;
+}
 
+//
+// Sniff TIFF header and IFD0.
+//
+// `Reader` must provide `size_t read_at(uint64_t offset, size_t len, uint8_t*
+// dst)` which returns the number of bytes read.
+//
+template <class Reader>
+static void SniffTIFF(Reader& reader, DNGFileInfo* info, std::string* msg) {
+  uint8_t header[16];
+  const size_t header_len = reader.read_at(0, sizeof(header), header);
+  if (header_len < 8) {
+    if (msg) {
+      (*msg) += "Data too short.\n";
+    }
+    return;
+  }
 
-      if (!decoded_image) {
-        // Probably 16bit JPEG?
-        image->bits_per_sample_original = 1;  // FIXME
-        image->bits_per_sample = 1;           // FIXME
+  if ((header[0] == 'I') && (header[1] == 'I')) {
+    info->big_endian = false;
+  } else if ((header[0] == 'M') && (header[1] == 'M')) {
+    info->big_endian = true;
+  } else {
+    if (msg) {
+      (*msg) += "Not a TIFF byte order mark.\n";
+    }
+    return;
+  }
 
-        if (err) {
-          std::stringstream ss;
-          ss << "Unsupported lossy JPEG compression(16bit JPEG?)." << std::endl;
-          (*err) = ss.str();
-        }
+  const bool swap_endian = (info->big_endian != IsBigEndian());
 
-      } else {
-        image->width = w;
-        image->height = h;
-        image->samples_per_pixel = components;
-        image->bits_per_sample = 8;
+  const uint16_t magic = SniffRead2(header + 2, swap_endian);
+  uint64_t ifd_offset = 0;
+  if (magic == 42) {
+    ifd_offset = SniffRead4(header + 4, swap_endian);
+  } else if (magic == 43) {
+    // BigTIFF: bytesize(2) = 8, reserved(2) = 0, first IFD offset(8)
+    if ((header_len < 16) || (SniffRead2(header + 4, swap_endian) != 8)) {
+      if (msg) {
+        (*msg) += "Invalid BigTIFF header.\n";
+      }
+      return;
+    }
+    info->is_bigtiff = true;
+    ifd_offset = SniffRead8(header + 8, swap_endian);
+  } else {
+    if (msg) {
+      (*msg) += "Invalid TIFF magic number.\n";
+    }
+    return;
+  }
 
-        const size_t len =
-            static_cast<size_t>((image->samples_per_pixel * image->width *
-                                 image->height * image->bits_per_sample) /
-                                8);
-        image->data.resize(len);
+  info->is_tiff = true;
 
-        memcpy(image->data.data(), decoded_image, len);
+  if (info->big_endian && msg) {
+    (*msg) += "DNG is big endian\n";
+  }
 
-#if defined(TINY_DNG_DEBUG_SAVEIMAGE)
-        std::string output_filename = "layer-" + std::to_string(i) + ".png";
-        stbi_write_png(output_filename.c_str(), w, h, components,
-                       reinterpret_cast<const void*>(decoded_image),
-                       /* stride */ 0);
-#endif
-        free(decoded_image);
-      }
+  // Look up DNGVersion in IFD0.
+  const size_t count_size = info->is_bigtiff ? 8 : 2;
+  const size_t entry_size = info->is_bigtiff ? 20 : 12;
 
-    } else if (image->compression == 34713) {  // NEF lossless?
+  uint8_t count_buf[8];
+  if (reader.read_at(ifd_offset, count_size, count_buf) != count_size) {
+    return;
+  }
 
-      image->bits_per_sample_original = 1;  // FIXME
-      image->bits_per_sample = 1;           // FIXME
+  uint64_t num_entries = info->is_bigtiff
+                             ? SniffRead8(count_buf, swap_endian)
+                             : uint64_t(SniffRead2(count_buf, swap_endian));
+  if (num_entries > kSniffMaxIFDEntries) {
+    num_entries = kSniffMaxIFDEntries;
+  }
 
-      if (err) {
-        std::stringstream ss;
-        ss << "Seems a NEF RAW. This compression is not supported."
-           << std::endl;
-        (*err) = ss.str();
-      }
-    } else {
-      if (err) {
-        std::stringstream ss;
-        ss << "IFD [" << i << "] "
-           << " Unsupported compression type : " << image->compression
-           << std::endl;
-        (*err) = ss.str();
+  std::vector<uint8_t> entries(size_t(num_entries) * entry_size);
+  const size_t entries_len =
+      entries.empty()
+          ? 0
+          : reader.read_at(ifd_offset + count_size, entries.size(),
+                           entries.data());
+
+  for (size_t i = 0; (i + 1) * entry_size <= entries_len; i++) {
+    const uint8_t* entry = &entries[i * entry_size];
+    if (SniffRead2(entry, swap_endian) == TAG_DNG_VERSION) {
+      // 4 BYTEs, always stored inline in the value field.
+      const uint8_t* value = entry + (info->is_bigtiff ? 12 : 8);
+      info->has_dng_version = true;
+      for (size_t k = 0; k < 4; k++) {
+        info->dng_version[k] = value[k];
       }
-      return false;
+      break;
     }
   }
+}
 
-  //
-  // Postprocessing. Calculate while_level.
-  //
-  for (size_t i = 0; i < images->size(); i++) {
-    tinydng::DNGImage* image = &((*images)[i]);
+class MemorySniffReader {
+ public:
+  MemorySniffReader(const uint8_t* mem, size_t size) : mem_(mem), size_(size) {}
 
-    if (image->samples_per_pixel > 4) {
-      if (err) {
-        (*err) += "Cannot handle > 4 samples per pixel.\n";
-      }
-      return false;
+  size_t read_at(uint64_t offset, size_t len, uint8_t* dst) {
+    if (offset >= size_) {
+      return 0;
     }
-    for (int s = 0; s < image->samples_per_pixel; s++) {
-      if (image->white_level[s] == -1) {
-        // Set white level with (2 ** BitsPerSample) according to the DNG spec.
-        if (image->bits_per_sample_original == 0) {
-          if (err) {
-            (*err) += "Bits per sample of image has to be > 0.\n";
-          }
-          return false;
-        }
+    size_t n = (std::min)(len, size_t(size_ - offset));
+    memcpy(dst, mem_ + offset, n);
+    return n;
+  }
 
-        if (image->bits_per_sample_original >=
-            32) {  // workaround for 32bit floating point TIFF.
-          image->white_level[s] = -1;
-        } else {
-          if (image->bits_per_sample_original >= 32) {
-            if (err) {
-              (*err) += "Cannot handle >= 32 bits per sample.\n";
-            }
-            return false;
-          }
+ private:
+  const uint8_t* mem_;
+  size_t size_;
+};
 
-          image->white_level[s] = (1 << image->bits_per_sample_original) - 1;
-        }
-      }
+// Reads through a prefix buffer so that the header and IFD0 of usual files
+// are obtained with single read.
+class FileSniffReader {
+ public:
+  explicit FileSniffReader(FILE* fp) : fp_(fp), prefix_len_(0) {
+    prefix_len_ = fread(prefix_, 1, sizeof(prefix_), fp_);
+  }
 
-      // Shrink value when TIFF tag white level is larger than (2**bps)
-      // e.g. Set to 4096 if TIFF white_balance tag has 65535 but bps == 12
-      // FIXME: Is this ok according to DNG spec?
-      if ((image->bits_per_sample_original > 0) &&
-          (image->bits_per_sample_original < 30)) {
-        if (image->white_level[s] >= (1 << image->bits_per_sample_original)) {
-          image->white_level[s] = (1 << image->bits_per_sample_original) - 1;
-        }
+  size_t read_at(uint64_t offset, size_t len, uint8_t* dst) {
+    if ((offset + len) <= prefix_len_) {
+      memcpy(dst, prefix_ + offset, len);
+      return len;
+    }
+
+    if (prefix_len_ < sizeof(prefix_)) {
+      // EOF reached while reading the prefix.
+      if (offset >= prefix_len_) {
+        return 0;
       }
+      size_t n = prefix_len_ - size_t(offset);
+      memcpy(dst, prefix_ + offset, n);
+      return n;
+    }
+
+    if (offset > uint64_t((std::numeric_limits<long>::max)())) {
+      return 0;
     }
+
+    if (0 != fseek(fp_, long(offset), SEEK_SET)) {
+      return 0;
+    }
+    return fread(dst, 1, len, fp_);
   }
 
-  return ret ? true : false;
-}
+ private:
+  FILE* fp_;
+  uint8_t prefix_[kSniffPrefixSize];
+  size_t prefix_len_;
+};
+
+}  // namespace
 
-bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg) {
-  if ((mem == NULL) || (size < 32)) {
+bool SniffDNGFromMemory(const char* mem, size_t size, DNGFileInfo* info,
+                        std::string* msg) {
+  if ((mem == NULL) || (info == NULL)) {
     if (msg) {
-      (*msg) = "Invalid argument. argument is null or invalid.\n";
+      (*msg) += "Invalid argument. argument is null.\n";
     }
     return false;
   }
 
-  const unsigned short magic = *(reinterpret_cast<const unsigned short*>(mem));
+  (*info) = DNGFileInfo();
 
-  if (magic == 0x4949) {
-    // might be TIFF(DNG).
-  } else if (magic == 0x4d4d) {
-    // might be TIFF(DNG, bigendian).
+  MemorySniffReader reader(reinterpret_cast<const uint8_t*>(mem), size);
+  SniffTIFF(reader, info, msg);
+
+  return true;
+}
+
+bool SniffDNG(const char* filename, DNGFileInfo* info, std::string* msg) {
+  if ((filename == NULL) || (info == NULL)) {
     if (msg) {
-      (*msg) = "DNG is big endian";
+      (*msg) += "Invalid argument. argument is null.\n";
     }
-  } else {
     return false;
   }
 
+  (*info) = DNGFileInfo();
+  info->filename = filename;
+
+  FILE* fp = OpenFileForRead(filename, msg);
+  if (!fp) {
+    return false;
+  }
+
+  {
+    FileSniffReader reader(fp);
+    SniffTIFF(reader, info, msg);
+  }
+
+  fclose(fp);
+
   return true;
 }
 
-bool IsDNG(const char* filename, std::string* msg) {
-  std::stringstream ss;
+void SniffDNGFiles(const std::vector<std::string>& filenames,
+                   std::vector<DNGFileInfo>* infos) {
+  if (!infos) {
+    return;
+  }
 
-  FILE* fp = NULL;
-#if defined(_WIN32)
+  infos->resize(filenames.size());
+  for (size_t i = 0; i < filenames.size(); i++) {
+    if (!SniffDNG(filenames[i].c_str(), &(*infos)[i], NULL)) {
+      (*infos)[i] = DNGFileInfo();
+      (*infos)[i].filename = filenames[i];
+    }
+  }
+}
 
-#if defined(_MSC_VER) || defined(__MINGW32__)  // MSVC, MinGW gcc or clang
-  errno_t errcode = _wfopen_s(&fp, UTF8ToWchar(filename).c_str(), L"rb");
-  if (errcode != 0) {
-    if (msg) {
-      (*msg) += "Error opening file: " + std::string(filename) + "(errno " +
-                std::to_string(errcode) + ")\n";
+bool ScanDNGDirectory(const char* dirname, bool dng_only,
+                      std::vector<DNGFileInfo>* infos, std::string* err) {
+  if ((dirname == NULL) || (infos == NULL)) {
+    if (err) {
+      (*err) += "Invalid argument. argument is null.\n";
     }
     return false;
   }
-#else
-  // Unknown compiler
-  fp = fopen(filename, "rb");
+
+  std::string dir(dirname);
+  if (!dir.empty() && (dir[dir.size() - 1] != '/')
+#if defined(_WIN32)
+      && (dir[dir.size() - 1] != '\\')
 #endif
+  ) {
+    dir += "/";
+  }
+
+  std::vector<std::string> filenames;
 
+#if defined(_WIN32)
+  WIN32_FIND_DATAW fd;
+  HANDLE h = FindFirstFileW(UTF8ToWchar(dir + "*").c_str(), &fd);
+  if (h == INVALID_HANDLE_VALUE) {
+    if (err) {
+      (*err) += "Failed to open directory: " + std::string(dirname) + "\n";
+    }
+    return false;
+  }
+  do {
+    if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      continue;
+    }
+    filenames.push_back(dir + WcharToUTF8(fd.cFileName));
+  } while (FindNextFileW(h, &fd));
+  FindClose(h);
 #else
-  fp = fopen(filename, "rb");
-#endif
-  if (!fp) {
-    ss << "File not found or cannot open file " << filename << std::endl;
-    if (msg) {
-      (*msg) = ss.str();
+  DIR* d = opendir(dirname);
+  if (!d) {
+    if (err) {
+      (*err) += "Failed to open directory: " + std::string(dirname) + "\n";
     }
     return false;
   }
+  struct dirent* ent;
+  while ((ent = readdir(d)) != NULL) {
+    const std::string name(ent->d_name);
+    if ((name == ".") || (name == "..")) {
+      continue;
+    }
+#if defined(DT_DIR)
+    if (ent->d_type == DT_DIR) {
+      continue;
+    }
+#endif
+    filenames.push_back(dir + name);
+  }
+  closedir(d);
+#endif
+
+  std::sort(filenames.begin(), filenames.end());
+
+  std::vector<DNGFileInfo> classified;
+  SniffDNGFiles(filenames, &classified);
+
+  infos->clear();
+  for (size_t i = 0; i < classified.size(); i++) {
+    if (dng_only ? classified[i].has_dng_version : classified[i].is_tiff) {
+      infos->push_back(classified[i]);
+    }
+  }
+
+  return true;
+}
 
-  if (0 != fseek(fp, 0, SEEK_END)) {
+bool IsDNGFromMemory(const char* mem, size_t size, std::string* msg) {
+  if ((mem == NULL) || (size < 8)) {
     if (msg) {
-      (*msg) = "Error seeking.\n";
+      (*msg) = "Invalid argument. argument is null or invalid.\n";
     }
     return false;
   }
 
-  size_t file_size = static_cast<size_t>(ftell(fp));
+  DNGFileInfo info;
+  if (!SniffDNGFromMemory(mem, size, &info, msg)) {
+    return false;
+  }
 
-  std::vector<unsigned char> whole_data;
-  {
-    whole_data.resize(file_size);
-    fseek(fp, 0, SEEK_SET);
-    size_t read_len = fread(whole_data.data(), 1, file_size, fp);
-    if (read_len != file_size) {
-      if (msg) {
-        (*msg) += "Unexpected file size.\n";
-      }
-      return false;
-    }
+  return info.is_tiff;
+}
 
-    fseek(fp, 0, SEEK_SET);
+bool IsDNG(const char* filename, std::string* msg) {
+  DNGFileInfo info;
+  if (!SniffDNG(filename, &info, msg)) {
+    return false;
   }
-  fclose(fp);
 
-  return IsDNGFromMemory(reinterpret_cast<const char*>(whole_data.data()),
-                         static_cast<unsigned int>(whole_data.size()), msg);
+  return info.is_tiff;
 }
 
 #ifdef __clang__